@@ -0,0 +1,506 @@
+// An AugmentedOrderStatisticMap is an OrderStatisticMap in which every subtree
+// also keeps a summary of its elements under one or more user-supplied monoids.
+// It can then compute the aggregate of any range of elements, by rank or by
+// key, in O(log n) time.
+//
+// A PrefixSumMap is the special case of one monoid, addition of the mapped
+// values.  Here the monoids can be anything: the min or max of the mapped
+// values, the number of entries that have some flag set, the sums of several
+// fields of a struct, and so on.  Several monoids share one node, so one tree
+// can replace several parallel trees.
+//
+// A monoid is a type with static members like these:
+//
+//   struct CountFlagged {
+//     // The type of the summary.
+//     using type = size_t;
+//     // The identity element: Combine(Identity(), x) == x.
+//     static size_t Identity() { return 0; }
+//     // An associative operation.  (It need not be commutative: `a` always
+//     // summarizes elements with smaller keys than `b` does.)
+//     static size_t Combine(size_t a, size_t b) { return a + b; }
+//     // The summary of a single element.
+//     static size_t Lift(const std::pair<const int64_t, Entry> &value) {
+//       return value.second.flagged ? 1 : 0;
+//     }
+//   };
+//
+// A monoid may also have a member
+//
+//     static type Shift(const type &s, const T &delta, size_t count);
+//
+// which returns the summary of `count` (at least one) elements that `s`
+// summarizes after `delta` is added to each of their mapped values.
+// `AddToRange()` needs it for every monoid.  (CountFlagged can't have one,
+// since adding to a value doesn't say what happens to its flag.)
+//
+// SumMonoid, MinMonoid, and MaxMonoid, which aggregate the mapped values, are
+// provided below, with `Shift()`.
+//
+// Example:
+//
+//   AugmentedOrderStatisticMap<int64_t, int64_t, std::less<>,
+//                              SumMonoid<int64_t>, MaxMonoid<int64_t>>
+//       map;
+//   ...
+//   auto [sum, max] = map.Aggregate(10, 20);  // Ranks 10 through 19.
+//   int64_t max_in_window = map.AggregateKeys<1>(start, end);
+//
+// The iterators refer to const values, since modifying a mapped value through
+// an iterator wouldn't update the summaries.  Use `update()` or
+// `insert_or_assign()` instead.
+
+#ifndef NET_BANDAID_BDN_CACHELIB_AUGMENTED_ORDER_STATISTIC_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_AUGMENTED_ORDER_STATISTIC_MAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "glog/logging.h"
+#include "raw_order_statistic_map.h"  // IWYU pragma: export
+
+namespace cachelib {
+
+// Adds up the mapped values.
+template <class T>
+struct SumMonoid {
+  using type = T;
+  static T Identity() { return T{}; }
+  static T Combine(const T &a, const T &b) { return a + b; }
+  template <class Value>
+  static T Lift(const Value &value) {
+    return value.second;
+  }
+  static T Shift(const T &s, const T &delta, size_t count) {
+    return s + delta * static_cast<T>(count);
+  }
+};
+
+// The smallest mapped value (or the largest `T` if the range is empty).
+template <class T>
+struct MinMonoid {
+  using type = T;
+  static T Identity() { return std::numeric_limits<T>::max(); }
+  static T Combine(const T &a, const T &b) { return std::min(a, b); }
+  template <class Value>
+  static T Lift(const Value &value) {
+    return value.second;
+  }
+  static T Shift(const T &s, const T &delta, size_t) { return s + delta; }
+};
+
+// The largest mapped value (or the smallest `T` if the range is empty).
+template <class T>
+struct MaxMonoid {
+  using type = T;
+  static T Identity() { return std::numeric_limits<T>::lowest(); }
+  static T Combine(const T &a, const T &b) { return std::max(a, b); }
+  template <class Value>
+  static T Lift(const Value &value) {
+    return value.second;
+  }
+  static T Shift(const T &s, const T &delta, size_t) { return s + delta; }
+};
+
+namespace cachelib_internal {
+
+// Whether `Monoid` has `Shift()` for mapped type `T`.
+template <class Monoid, class T, class = void>
+struct HasShift : std::false_type {};
+template <class Monoid, class T>
+struct HasShift<Monoid, T,
+                std::void_t<decltype(Monoid::Shift(
+                    std::declval<const typename Monoid::type &>(),
+                    std::declval<const T &>(), size_t{0}))>>
+    : std::true_type {};
+
+template <class Key, class T, class Compare, class... Monoids>
+class AugmentedMapNode
+    : public RawMapNode<Key, T, Compare,
+                        AugmentedMapNode<Key, T, Compare, Monoids...>> {
+  using Base = typename AugmentedMapNode::RawMapNode;
+  using key_compare = typename AugmentedMapNode::key_compare;
+
+ public:
+  using value_type = typename Base::value_type;
+  using summary_type = std::tuple<typename Monoids::type...>;
+
+  static constexpr bool kMutableValues = false;
+
+  // Whether the map supports `AddToRange()`.  If not, the nodes have no room
+  // for a pending add.
+  static constexpr bool kCanAddToRange = (HasShift<Monoids, T>::value && ...);
+
+  explicit AugmentedMapNode(value_type v)
+      : Base(std::move(v)), summary_(Lift(this->value_)) {}
+
+  // Checks that the summary is the combination of the children's summaries
+  // and the value's.
+  void Check(bool recursive, const key_compare &lessthan) {
+    PushDown();
+    CHECK(summary_ == ComputeSummary())  // Crash OK
+        << " node=" << this;
+    if (recursive) {
+      if (this->left_) this->left_->Check(recursive, lessthan);
+      if (this->right_) this->right_->Check(recursive, lessthan);
+    }
+    Base::Check(false, lessthan);
+  }
+
+  // Applies the pending range add (see `AddToKeys()`) to the children.
+  void PushDown() {
+    if constexpr (kCanAddToRange) {
+      if (!pending_add_.has_value()) return;
+      if (this->left_) this->left_->AddToAll(*pending_add_);
+      if (this->right_) this->right_->AddToAll(*pending_add_);
+      pending_add_.reset();
+    }
+  }
+
+  // There must be no pending range add, which is the case whenever the
+  // children have changed.
+  void RecomputeSummary() {
+    summary_ = ComputeSummary();
+    Base::RecomputeSummary();
+  }
+
+  static summary_type Identity() {
+    return summary_type(Monoids::Identity()...);
+  }
+
+  // Returns the aggregate of the elements with ranks in `[lo, hi)` within the
+  // subtree.
+  //
+  // Once the range covers a whole subtree we use its summary, so the recursion
+  // follows at most two root-to-leaf paths (the ones to `lo` and to `hi`),
+  // which split at the lowest node in the range.
+  static summary_type AggregateRanks(const std::unique_ptr<AugmentedMapNode> &n,
+                                     size_t lo, size_t hi) {
+    if (!n || lo >= hi) return Identity();
+    if (lo == 0 && hi >= Base::Size(n)) return n->summary_;
+    n->PushDown();
+    size_t left_size = Base::Size(n->left_);
+    summary_type result = Identity();
+    if (lo < left_size) {
+      result = AggregateRanks(n->left_, lo, std::min(hi, left_size));
+    }
+    if (lo <= left_size && left_size < hi) {
+      result = Combine(result, Lift(n->value_));
+    }
+    if (hi > left_size + 1) {
+      size_t right_lo = lo > left_size ? lo - left_size - 1 : 0;
+      result = Combine(
+          result, AggregateRanks(n->right_, right_lo, hi - left_size - 1));
+    }
+    return result;
+  }
+
+  // Returns the aggregate of the elements with keys in `[lo, hi)` within the
+  // subtree.  `lo_bounded` and `hi_bounded` say whether `lo` and `hi` still
+  // constrain this subtree (i.e., whether we have not yet passed to the right
+  // of `lo` or to the left of `hi` on the way down).
+  template <class Karg>
+  static summary_type AggregateKeys(const std::unique_ptr<AugmentedMapNode> &n,
+                                    const Karg &lo, bool lo_bounded,
+                                    const Karg &hi, bool hi_bounded,
+                                    const key_compare &lessthan) {
+    if (!n) return Identity();
+    if (!lo_bounded && !hi_bounded) return n->summary_;
+    n->PushDown();
+    const Key &k = Base::key(n->value_);
+    if (lo_bounded && lessthan(k, lo)) {
+      return AggregateKeys(n->right_, lo, lo_bounded, hi, hi_bounded,
+                           lessthan);
+    }
+    if (hi_bounded && !lessthan(k, hi)) {
+      return AggregateKeys(n->left_, lo, lo_bounded, hi, hi_bounded, lessthan);
+    }
+    // `k` is in the range, so everything to the left is below `hi` and
+    // everything to the right is at least `lo`.
+    summary_type result =
+        AggregateKeys(n->left_, lo, lo_bounded, hi, false, lessthan);
+    result = Combine(result, Lift(n->value_));
+    return Combine(result, AggregateKeys(n->right_, lo, false, hi, hi_bounded,
+                                         lessthan));
+  }
+
+  // Returns the rank and the node of the first element `v` in the subtree for
+  // which `pred(prefix, v)` is true, where `prefix` is `*prefix` combined with
+  // the aggregate of the elements before `v`, and leaves that combination in
+  // `*prefix`.  If there is no such element, returns the size of the subtree
+  // and nullptr, and leaves the aggregate of the whole subtree in `*prefix`.
+  //
+  // `pred` is monotone, so one root-to-leaf path decides: if a node satisfies
+  // it, the answer is that node or is to its left.
+  template <class Pred>
+  static std::pair<size_t, AugmentedMapNode *> SelectByPrefixAggregate(
+      const std::unique_ptr<AugmentedMapNode> &root, Pred &pred,
+      summary_type *prefix) {
+    size_t idx = 0;
+    std::pair<size_t, AugmentedMapNode *> result = {Base::Size(root), nullptr};
+    summary_type result_prefix = *prefix;
+    if (root) result_prefix = Combine(result_prefix, root->summary_);
+    AugmentedMapNode *n = root.get();
+    while (n != nullptr) {
+      n->PushDown();
+      summary_type before = *prefix;
+      if (n->left_) before = Combine(before, n->left_->summary_);
+      size_t rank = idx + Base::Size(n->left_);
+      if (pred(std::as_const(before), std::as_const(n->value_))) {
+        result = {rank, n};
+        result_prefix = std::move(before);
+        n = n->left_.get();
+      } else {
+        *prefix = Combine(before, Lift(n->value_));
+        idx = rank + 1;
+        n = n->right_.get();
+      }
+    }
+    *prefix = std::move(result_prefix);
+    return result;
+  }
+
+  // Adds `delta` to the mapped values with keys in `[lo, hi)`, like
+  // `PrefixMapNode::AddToKeys()`: a subtree that lies inside the range gets
+  // the add at its root, pending for the rest, so this visits O(log n) nodes.
+  template <class Karg>
+  static void AddToKeys(AugmentedMapNode *n, const Karg &lo, bool lo_bounded,
+                        const Karg &hi, bool hi_bounded, const T &delta,
+                        const key_compare &lessthan) {
+    if (n == nullptr) return;
+    if (!lo_bounded && !hi_bounded) {
+      n->AddToAll(delta);
+      return;
+    }
+    n->PushDown();
+    const Key &k = Base::key(n->value_);
+    if (lo_bounded && lessthan(k, lo)) {
+      AddToKeys(n->right_.get(), lo, lo_bounded, hi, hi_bounded, delta,
+                lessthan);
+    } else if (hi_bounded && !lessthan(k, hi)) {
+      AddToKeys(n->left_.get(), lo, lo_bounded, hi, hi_bounded, delta,
+                lessthan);
+    } else {
+      AddToKeys(n->left_.get(), lo, lo_bounded, hi, false, delta, lessthan);
+      n->value_.second = n->value_.second + delta;
+      AddToKeys(n->right_.get(), lo, false, hi, hi_bounded, delta, lessthan);
+    }
+    n->RecomputeSummary();
+  }
+
+ private:
+  static summary_type Lift(const value_type &value) {
+    return summary_type(Monoids::Lift(value)...);
+  }
+
+  static summary_type Combine(const summary_type &a, const summary_type &b) {
+    return Combine(a, b, std::index_sequence_for<Monoids...>{});
+  }
+  template <size_t... I>
+  static summary_type Combine(const summary_type &a, const summary_type &b,
+                              std::index_sequence<I...>) {
+    return summary_type(Monoids::Combine(std::get<I>(a), std::get<I>(b))...);
+  }
+
+  // Adds `delta` to every value in the subtree: to this node's value and
+  // summary now, and to the descendants when they are reached.
+  void AddToAll(const T &delta) {
+    this->value_.second = this->value_.second + delta;
+    summary_ = Shift(summary_, delta, this->subtree_size_,
+                     std::index_sequence_for<Monoids...>{});
+    pending_add_ = pending_add_.has_value() ? *pending_add_ + delta : delta;
+  }
+  template <size_t... I>
+  static summary_type Shift(const summary_type &s, const T &delta,
+                            size_t count, std::index_sequence<I...>) {
+    return summary_type(Monoids::Shift(std::get<I>(s), delta, count)...);
+  }
+
+  summary_type ComputeSummary() const {
+    summary_type result = Lift(this->value_);
+    if (this->left_) result = Combine(this->left_->summary_, result);
+    if (this->right_) result = Combine(result, this->right_->summary_);
+    return result;
+  }
+
+  summary_type summary_;
+  // An add that applies to every value in the children's subtrees but hasn't
+  // been applied to them yet.  It is already included in `summary_`.
+  struct NoPendingAdd {};
+  std::conditional_t<kCanAddToRange, std::optional<T>, NoPendingAdd>
+      pending_add_;
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class T, class Compare, class... Monoids>
+class AugmentedOrderStatisticMap
+    : public cachelib_internal::RawOrderStatisticMap<
+          Key, T, Compare,
+          cachelib_internal::AugmentedMapNode<Key, T, Compare, Monoids...>> {
+  static_assert(sizeof...(Monoids) > 0, "Need at least one monoid");
+  using Base = typename AugmentedOrderStatisticMap::RawOrderStatisticMap;
+  using Node = typename Base::Node;
+
+ public:
+  using key_type = typename Base::key_type;
+  using mapped_type = typename Base::mapped_type;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using difference_type = typename Base::difference_type;
+  using key_compare = typename Base::key_compare;
+  using value_compare = typename Base::value_compare;
+  // TODO(bradleybear): Add allocator_type
+  using reference = value_type &;
+  using const_reference = const value_type &;
+  // TODO(bradleybear): Add pointer and const_pointer
+  using iterator = typename Base::iterator;
+  using const_iterator = typename Base::const_iterator;
+  using reverse_iterator = typename Base::reverse_iterator;
+  using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+  // One summary per monoid.
+  using summary_type = typename Node::summary_type;
+
+  // The new methods supported by AugmentedOrderStatisticMap:
+
+  // Returns the aggregates of the elements with ranks in `[rank_lo, rank_hi)`
+  // (which is clipped to the size of the map), one per monoid.  The second
+  // form returns just the one for the `I`th monoid.
+  summary_type Aggregate(size_t rank_lo, size_t rank_hi) const {
+    return Node::AggregateRanks(this->root_, rank_lo, rank_hi);
+  }
+  template <size_t I>
+  auto Aggregate(size_t rank_lo, size_t rank_hi) const {
+    return std::get<I>(Aggregate(rank_lo, rank_hi));
+  }
+
+  // Returns the aggregates of the elements with keys in `[lo, hi)`, one per
+  // monoid.  `K` may be any type that `Compare` can compare with `Key`.
+  template <class K>
+  summary_type AggregateKeys(const K &lo, const K &hi) const {
+    return Node::AggregateKeys(this->root_, lo, true, hi, true,
+                               this->lessthan_);
+  }
+  template <size_t I, class K>
+  auto AggregateKeys(const K &lo, const K &hi) const {
+    return std::get<I>(AggregateKeys(lo, hi));
+  }
+
+  // Returns an iterator to the first element `v` for which `pred(prefix, v)`
+  // is true, where `prefix` is the aggregate of the elements before `v`,
+  // together with that `prefix`.  (If there is none, returns `end()` and the
+  // aggregate of the whole map.)  `pred` must be monotone: once it returns
+  // true for an element, it must return true for every later one.  Takes
+  // O(log n) time, instead of the O(log^2 n) of a binary search over
+  // `Aggregate()`.
+  //
+  // For example, with SumMonoid<int64_t> this finds the first element whose
+  // running sum, including its own value, is at least `x`:
+  //
+  //   map.SelectByPrefixAggregate([x](const auto &prefix, const auto &v) {
+  //     return std::get<0>(prefix) + v.second >= x;
+  //   });
+  template <class Pred>
+  std::pair<iterator, summary_type> SelectByPrefixAggregate(Pred pred) {
+    summary_type prefix = Node::Identity();
+    auto [idx, n] = Node::SelectByPrefixAggregate(this->root_, pred, &prefix);
+    if (n == nullptr) return {this->end(), std::move(prefix)};
+    return {iterator(this, idx, n), std::move(prefix)};
+  }
+  template <class Pred>
+  std::pair<const_iterator, summary_type> SelectByPrefixAggregate(
+      Pred pred) const {
+    summary_type prefix = Node::Identity();
+    auto [idx, n] = Node::SelectByPrefixAggregate(this->root_, pred, &prefix);
+    if (n == nullptr) return {this->end(), std::move(prefix)};
+    return {const_iterator(this, idx, n), std::move(prefix)};
+  }
+
+  // Adds `delta` to every mapped value with a key in `[lo, hi)`, in O(log n)
+  // time no matter how many values that is.  Every monoid must have
+  // `Shift()`.  As with `PrefixSumMap::AddToRange()`, the add reaches most
+  // nodes lazily: the aggregates and the values seen through iterators
+  // obtained afterwards are up to date, but iterators obtained before the
+  // call may still see the old values (look the elements up again), and even
+  // const methods must not be called concurrently after a range add.
+  template <class K>
+  void AddToRange(const K &lo, const K &hi, const T &delta) {
+    static_assert(Node::kCanAddToRange,
+                  "AddToRange() needs Shift() for every monoid");
+    Node::AddToKeys(this->root_.get(), lo, true, hi, true, delta,
+                    this->lessthan_);
+    // Brings the cached first and last values up to date.
+    this->UpdateEnds();
+  }
+
+  // See OrderStatisticSet's documentation for the specification of these
+  // functions.
+
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::begin;
+
+  using Base::cbegin;
+
+  using Base::end;
+
+  using Base::cend;
+
+  using Base::rbegin;
+
+  using Base::crbegin;
+
+  using Base::rend;
+
+  using Base::crend;
+
+  using Base::find;
+
+  using Base::contains;
+
+  using Base::lower_bound;
+
+  using Base::upper_bound;
+
+  using Base::select;
+
+  using Base::sample;
+
+  using Base::sample_n;
+
+  using Base::clear;
+
+  using Base::insert;
+
+  using Base::insert_sorted;
+
+  using Base::erase;
+
+  using Base::key_comp;
+
+  using Base::value_comp;
+
+  // See OrderStatisticMap's documentation for the specification of these
+  // functions.
+  using Base::insert_or_assign;
+
+  using Base::insert_or_assign_sorted;
+
+  using Base::update;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_AUGMENTED_ORDER_STATISTIC_MAP_H_
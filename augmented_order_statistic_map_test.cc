@@ -0,0 +1,210 @@
+#include "augmented_order_statistic_map.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::FieldsAre;
+
+// Make sure it all compiles.
+template class AugmentedOrderStatisticMap<size_t, size_t, std::less<>,
+                                          SumMonoid<size_t>>;
+template class AugmentedOrderStatisticMap<std::string, int64_t, std::less<>,
+                                          SumMonoid<int64_t>,
+                                          MinMonoid<int64_t>,
+                                          MaxMonoid<int64_t>>;
+
+TEST(AugmentedOrderStatisticMapTest, Basic) {
+  AugmentedOrderStatisticMap<int, int, std::less<>, SumMonoid<int>,
+                             MinMonoid<int>, MaxMonoid<int>>
+      map;
+  EXPECT_THAT(map.Aggregate(0, 10),
+              FieldsAre(0, std::numeric_limits<int>::max(),
+                        std::numeric_limits<int>::lowest()));
+  for (int k : {5, 1, 4, 2, 3}) map.insert_or_assign(k, k * 10);
+  map.insert_or_assign(4, -7);
+  // Values by rank: 10 20 30 -7 50
+  EXPECT_THAT(map.Aggregate(0, 5), FieldsAre(103, -7, 50));
+  EXPECT_THAT(map.Aggregate(1, 3), FieldsAre(50, 20, 30));
+  EXPECT_THAT(map.Aggregate(3, 100), FieldsAre(43, -7, 50));
+  EXPECT_EQ(map.Aggregate<0>(2, 2), 0);
+  EXPECT_EQ(map.Aggregate<2>(0, 3), 30);
+  EXPECT_THAT(map.AggregateKeys(2, 5), FieldsAre(43, -7, 30));
+  EXPECT_EQ(map.AggregateKeys<0>(0, 100), 103);
+  EXPECT_EQ(map.AggregateKeys<1>(5, 5), std::numeric_limits<int>::max());
+  map.erase(4);
+  EXPECT_THAT(map.AggregateKeys(2, 6), FieldsAre(100, 20, 50));
+  map.Check();
+}
+
+// Range adds, interleaved with inserts and erases, against a std::map.  The
+// min and max move with the add; the sum moves by the add times the count.
+TEST(AugmentedOrderStatisticMapTest, AddToRange) {
+  absl::BitGen bitgen;
+  AugmentedOrderStatisticMap<int, int64_t, std::less<>, SumMonoid<int64_t>,
+                             MinMonoid<int64_t>, MaxMonoid<int64_t>>
+      map;
+  std::map<int, int64_t> expected;
+  for (size_t i = 0; i < 3000; ++i) {
+    int k = absl::Uniform<int>(bitgen, 0, 500);
+    switch (absl::Uniform<int>(bitgen, 0, 3)) {
+      case 0: {
+        int64_t v = absl::Uniform<int64_t>(bitgen, -100, 100);
+        map.insert_or_assign(k, v);
+        expected.insert_or_assign(k, v);
+        break;
+      }
+      case 1:
+        EXPECT_EQ(map.erase(k), expected.erase(k));
+        break;
+      case 2: {
+        int hi = absl::Uniform<int>(bitgen, k, 501);
+        int64_t delta = absl::Uniform<int64_t>(bitgen, -10, 10);
+        map.AddToRange(k, hi, delta);
+        for (auto it = expected.lower_bound(k);
+             it != expected.end() && it->first < hi; ++it) {
+          it->second += delta;
+        }
+        break;
+      }
+    }
+    if (i % 100 == 0) map.Check();
+    int klo = absl::Uniform<int>(bitgen, 0, 501);
+    int khi = absl::Uniform<int>(bitgen, klo, 501);
+    int64_t sum = 0;
+    int64_t min = std::numeric_limits<int64_t>::max();
+    int64_t max = std::numeric_limits<int64_t>::lowest();
+    for (auto it = expected.lower_bound(klo);
+         it != expected.end() && it->first < khi; ++it) {
+      sum += it->second;
+      min = std::min(min, it->second);
+      max = std::max(max, it->second);
+    }
+    EXPECT_THAT(map.AggregateKeys(klo, khi), FieldsAre(sum, min, max));
+    if (auto it = expected.find(k); it != expected.end()) {
+      EXPECT_EQ(map.find(k)->second, it->second);
+    }
+  }
+  map.Check();
+  // Iterators obtained after the last add see every value.
+  ASSERT_EQ(map.size(), expected.size());
+  auto it = map.begin();
+  for (const auto &[k, v] : expected) {
+    EXPECT_EQ(it->first, k);
+    EXPECT_EQ(it->second, v);
+    ++it;
+  }
+}
+
+// A user-defined monoid that counts the entries with a flag set.
+struct Entry {
+  bool flagged;
+  int64_t bytes;
+};
+struct CountFlagged {
+  using type = size_t;
+  static size_t Identity() { return 0; }
+  static size_t Combine(size_t a, size_t b) { return a + b; }
+  static size_t Lift(const std::pair<const int, Entry> &value) {
+    return value.second.flagged ? 1 : 0;
+  }
+};
+struct FlaggedBytes {
+  using type = int64_t;
+  static int64_t Identity() { return 0; }
+  static int64_t Combine(int64_t a, int64_t b) { return a + b; }
+  static int64_t Lift(const std::pair<const int, Entry> &value) {
+    return value.second.flagged ? value.second.bytes : 0;
+  }
+};
+
+// A monoid that isn't commutative: the first key in the range.
+struct FirstKey {
+  using type = int;
+  static int Identity() { return -1; }
+  static int Combine(int a, int b) { return a == -1 ? b : a; }
+  static int Lift(const std::pair<const int, Entry> &value) {
+    return value.first;
+  }
+};
+
+TEST(AugmentedOrderStatisticMapTest, RandomizedUserMonoids) {
+  absl::BitGen bitgen;
+  AugmentedOrderStatisticMap<int, Entry, std::less<>, CountFlagged,
+                             FlaggedBytes, FirstKey>
+      map;
+  std::map<int, Entry> expected;
+  for (size_t i = 0; i < 3000; ++i) {
+    int k = absl::Uniform<int>(bitgen, 0, 1000);
+    if (absl::Bernoulli(bitgen, 0.7)) {
+      Entry e{absl::Bernoulli(bitgen, 0.3),
+              absl::Uniform<int64_t>(bitgen, 0, 1000)};
+      map.insert_or_assign(k, e);
+      expected.insert_or_assign(k, e);
+    } else {
+      EXPECT_EQ(map.erase(k), expected.erase(k));
+    }
+    if (i % 100 == 0) map.Check();
+    // Check a random rank range and a random key range.
+    size_t lo = absl::Uniform<size_t>(bitgen, 0, expected.size() + 1);
+    size_t hi = absl::Uniform<size_t>(bitgen, 0, expected.size() + 2);
+    int klo = absl::Uniform<int>(bitgen, 0, 1001);
+    int khi = absl::Uniform<int>(bitgen, 0, 1001);
+    size_t count = 0, count_keys = 0;
+    int64_t bytes = 0, bytes_keys = 0;
+    int first = -1, first_keys = -1;
+    size_t rank = 0;
+    for (const auto &[key, e] : expected) {
+      if (lo <= rank && rank < hi) {
+        count += e.flagged;
+        bytes += e.flagged ? e.bytes : 0;
+        if (first == -1) first = key;
+      }
+      if (klo <= key && key < khi) {
+        count_keys += e.flagged;
+        bytes_keys += e.flagged ? e.bytes : 0;
+        if (first_keys == -1) first_keys = key;
+      }
+      ++rank;
+    }
+    EXPECT_THAT(map.Aggregate(lo, hi), FieldsAre(count, bytes, first));
+    EXPECT_THAT(map.AggregateKeys(klo, khi),
+                FieldsAre(count_keys, bytes_keys, first_keys));
+
+    // Find the `target`th flagged entry (counting from 1), if there is one.
+    size_t target = absl::Uniform<size_t>(bitgen, 1, expected.size() + 2);
+    auto [it, prefix] = map.SelectByPrefixAggregate(
+        [target](const auto &prefix, const auto &value) {
+          return std::get<0>(prefix) + value.second.flagged >= target;
+        });
+    size_t seen = 0, expected_rank = 0;
+    int64_t expected_bytes = 0;
+    for (const auto &[key, e] : expected) {
+      if (seen + e.flagged >= target) break;
+      seen += e.flagged;
+      expected_bytes += e.flagged ? e.bytes : 0;
+      ++expected_rank;
+    }
+    EXPECT_EQ(it.rank(), expected_rank);
+    EXPECT_EQ(std::get<0>(prefix), seen);
+    EXPECT_EQ(std::get<1>(prefix), expected_bytes);
+    if (expected_rank < expected.size()) {
+      EXPECT_EQ(it->first, std::next(expected.begin(), expected_rank)->first);
+    }
+  }
+  map.Check();
+}
+
+}  // namespace cachelib
@@ -0,0 +1,1002 @@
+// A BufferedOrderStatisticMap is a write-optimized order-statistic map in the
+// style of a B^epsilon-tree: a B-tree whose internal nodes hold buffers of
+// pending writes ("messages") that flow down toward the leaves in batches.
+//
+// In an OrderStatisticMap (or in a B-tree) every insert walks, and writes to, a
+// whole root-to-leaf path, and during ingest those paths are mostly cold in the
+// cache.  Here a write is appended to a small staging vector and costs O(1).
+// When that fills up (or when a query comes along), the staged writes are
+// sorted, folded into one message per key, and merged into the root's buffer
+// without reading anything below it.  When a buffer overflows, the messages for
+// the child that has the most of them move down into the child's buffer (or, at
+// the bottom, are merged into the leaf) all at once, so each node visited
+// during a flush absorbs many messages for the price of one visit.  Nodes are
+// arrays: leaves hold up to `kLeafCapacity` sorted entries, and internal nodes
+// up to `kFanout` children and `kBufferCapacity` messages.
+//
+// Rank, select, and (for arithmetic mapped types) `SumFirstN()` stay exact.
+// Since a write is blind, its message doesn't know at first how it changes the
+// number of elements (+1, 0, or -1) or their sum.  It finds out for free when
+// it reaches a leaf, or when it lands on an older message for the same key, and
+// the flush carries the change back up to the counts on its path.  Every
+// internal node keeps the number of elements (and their sum) in each child's
+// key range, counting the messages in its own buffer and below as far as they
+// are known.  A counting query first resolves the messages that are still
+// unknown, bottom-up: each node looks up the keys of its unresolved messages in
+// its children with one sorted walk shared by the whole batch.  After that
+// every count is exact, and a query only needs the deltas of the messages above
+// it on its path.  Those it carries down, and only the messages for the child
+// it descends into are read.  `find()` needs no resolving, so an ingest that
+// asks nothing else never reads below the buffers.
+//
+// The queries apply the staged writes first, so even a const query may change
+// the tree's internal structure.  Like the other trees, a
+// BufferedOrderStatisticMap is not thread-safe, and that includes concurrent
+// queries.  `T` must be default-constructible.
+//
+// Example:
+//
+//   BufferedOrderStatisticMap<uint64_t, int64_t> bytes_by_key;
+//   for (const Event &e : stream) {
+//     bytes_by_key.insert_or_assign(e.key, e.bytes);
+//   }
+//   int64_t bytes_below_median =
+//       bytes_by_key.SumFirstN(bytes_by_key.size() / 2);
+
+#ifndef NET_BANDAID_BDN_CACHELIB_BUFFERED_ORDER_STATISTIC_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_BUFFERED_ORDER_STATISTIC_MAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// The sum of the mapped values, for a mapped type that can't be added up.
+struct NoSum {
+  NoSum &operator+=(const NoSum &) { return *this; }
+  NoSum &operator-=(const NoSum &) { return *this; }
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class T, class Compare = std::less<>>
+class BufferedOrderStatisticMap {
+ public:
+  using key_type = Key;
+  using mapped_type = T;
+  using value_type = std::pair<Key, T>;
+  using size_type = size_t;
+  using key_compare = Compare;
+
+  // Whether the map keeps the sums of the mapped values for `SumFirstN()`.
+  static constexpr bool kHasSums = std::is_arithmetic_v<T>;
+  using sum_type = std::conditional_t<kHasSums, T, cachelib_internal::NoSum>;
+
+  // The node sizes.  A flush moves at least `kBufferCapacity / kFanout`
+  // messages one level down.
+  static constexpr size_t kLeafCapacity = 128;
+  static constexpr size_t kFanout = 16;
+  static constexpr size_t kBufferCapacity = 256;
+  // The number of staged writes at which they go to the root.
+  static constexpr size_t kStagingCapacity = 256;
+
+  BufferedOrderStatisticMap() : root_(NewLeaf()) {}
+  BufferedOrderStatisticMap(BufferedOrderStatisticMap &&) = default;
+  BufferedOrderStatisticMap &operator=(BufferedOrderStatisticMap &&) = default;
+
+  //**************** Mutators ****************
+
+  // The writes take O(1) amortized time, and since they are blind they don't
+  // say whether they changed anything.
+
+  // Inserts `{k, v}` unless the map has an element with key `k`.
+  void insert(Key k, T v) {
+    Stage(Outcome::kInsertIfAbsent, std::move(k), std::move(v));
+  }
+
+  // Inserts `{k, v}`, or assigns `v` to the element with key `k`.
+  void insert_or_assign(Key k, T v) {
+    Stage(Outcome::kPresent, std::move(k), std::move(v));
+  }
+
+  // Erases the element with key `k`, if any.
+  void erase(Key k) { Stage(Outcome::kAbsent, std::move(k), T()); }
+
+  // Applies every pending write all the way down to the leaves.
+  void Flush() {
+    Drain();
+    FlushAll(root_.get());
+    FixRoot();
+  }
+
+  void clear() {
+    pending_.clear();
+    root_ = NewLeaf();
+  }
+
+  //**************** Queries ****************
+
+  size_t size() const {
+    Resolve();
+    return Count(*root_);
+  }
+  bool empty() const { return size() == 0; }
+
+  // Returns a copy of the element with key `k`, if any.
+  std::optional<value_type> find(const Key &k) const {
+    Drain();
+    std::optional<value_type> result;
+    if (const T *v = Lookup(root_.get(), k)) result.emplace(k, *v);
+    return result;
+  }
+
+  bool contains(const Key &k) const { return find(k).has_value(); }
+
+  // Returns the number of elements with keys less than `k`.
+  size_t rank(const Key &k) const {
+    Resolve();
+    return Rank(root_.get(), k);
+  }
+
+  // Returns a copy of the element of rank `idx`, if there is one.
+  std::optional<value_type> select(size_t idx) const {
+    std::optional<value_type> result;
+    if (idx < size()) result.emplace(Select(idx));
+    return result;
+  }
+
+  // Returns the sum of the mapped values of the first `n` elements.
+  template <bool has_sums = kHasSums, typename = std::enable_if_t<has_sums>>
+  T SumFirstN(size_t n) const {
+    Resolve();
+    return SumFirst(std::min(n, Count(*root_)));
+  }
+
+  // The number of staged writes not yet sent to the root.
+  size_t pending() const { return pending_.size(); }
+
+  //**************** Debugging and test support ****************
+
+  // Checks the structure, the counts, the sums, and the deltas of every
+  // resolved message.  Leaves the unresolved ones alone.  Runs in O(n log n)
+  // time.
+  void Check() const {
+    Drain();
+    CheckNode(*root_, nullptr, nullptr);
+  }
+
+ private:
+  // What a message leaves behind for its key.  `kInsertIfAbsent` leaves the
+  // element below it, if there is one, and `{key, value}` otherwise.
+  enum class Outcome : uint8_t { kPresent, kAbsent, kInsertIfAbsent };
+
+  // A write, or several folded together.  Its deltas are how much it changes
+  // the number of elements in the subtree below its node, and their sum, as far
+  // as that is known and counted in the node's `counts` and `sums` (and so in
+  // every ancestor's).  Once the message is `resolved` the deltas are exact,
+  // and its outcome isn't `kInsertIfAbsent` anymore.
+  struct Message {
+    value_type entry;
+    Outcome outcome;
+    bool resolved;
+    ptrdiff_t count_delta;
+    sum_type sum_delta;
+  };
+
+  // A change to the deltas of some messages, which the counts and sums of the
+  // nodes above them must make too.
+  struct Change {
+    Change &operator+=(const Change &other) {
+      count += other.count;
+      sum += other.sum;
+      return *this;
+    }
+    ptrdiff_t count = 0;
+    sum_type sum{};
+  };
+
+  struct Node {
+    bool leaf;
+    // For a leaf, the elements, sorted by key.
+    std::vector<value_type> entries;
+    // For an internal node, `children[i]` holds the keys `k` with
+    // `pivots[i - 1] <= k < pivots[i]`, and `counts[i]` and `sums[i]` are
+    // the number and sum of the elements in that range, counting this node's
+    // buffer.
+    std::vector<Key> pivots;
+    std::vector<std::unique_ptr<Node>> children;
+    std::vector<size_t> counts;
+    std::vector<sum_type> sums;
+    // The messages waiting to move to the children, sorted by key (at most one
+    // per key).  Those for `children[i]` are the ones from
+    // `buffer[message_starts[i]]` up to `buffer[message_starts[i + 1]]`, and
+    // `count_deltas[i]` is the sum of the count deltas of the first `i`.
+    std::vector<Message> buffer;
+    std::vector<size_t> message_starts;
+    std::vector<ptrdiff_t> count_deltas;
+    // Whether the subtree may have unresolved messages.
+    bool unresolved;
+  };
+
+  static std::unique_ptr<Node> NewLeaf() {
+    auto n = std::make_unique<Node>();
+    n->leaf = true;
+    n->unresolved = false;
+    return n;
+  }
+  static std::unique_ptr<Node> NewInternal() {
+    auto n = std::make_unique<Node>();
+    n->leaf = false;
+    n->unresolved = false;
+    return n;
+  }
+
+  static sum_type Lift(const T &v) {
+    if constexpr (kHasSums) {
+      return v;
+    } else {
+      return sum_type{};
+    }
+  }
+
+  // The number and sum of the elements in the subtree.
+  static size_t Count(const Node &n) {
+    if (n.leaf) return n.entries.size();
+    size_t count = 0;
+    for (size_t c : n.counts) count += c;
+    return count;
+  }
+  static sum_type Sum(const Node &n) {
+    sum_type sum{};
+    if (n.leaf) {
+      for (const value_type &e : n.entries) sum += Lift(e.second);
+      return sum;
+    }
+    for (const sum_type &s : n.sums) sum += s;
+    return sum;
+  }
+
+  bool Less(const Key &a, const Key &b) const { return lessthan_(a, b); }
+
+  // Returns the index of the child of `n` that holds `k`.
+  size_t ChildIndex(const Node &n, const Key &k) const {
+    return std::upper_bound(
+               n.pivots.begin(), n.pivots.end(), k,
+               [this](const Key &a, const Key &b) { return Less(a, b); }) -
+           n.pivots.begin();
+  }
+
+  // Returns the first message in `n`'s buffer whose key isn't less than `k`.
+  typename std::vector<Message>::const_iterator BufferLowerBound(
+      const Node &n, const Key &k) const {
+    return std::lower_bound(
+        n.buffer.begin(), n.buffer.end(), k,
+        [this](const Message &m, const Key &b) {
+          return Less(m.entry.first, b);
+        });
+  }
+
+  // Returns the index range of the messages in `n`'s buffer for child `c`.
+  static std::pair<size_t, size_t> ChildMessages(const Node &n, size_t c) {
+    return {n.message_starts[c], n.message_starts[c + 1]};
+  }
+
+  // Recomputes `n->message_starts` and `n->count_deltas`, after a change to
+  // the buffer or the children of `n`.
+  void IndexMessages(Node *n) const {
+    n->count_deltas.resize(n->buffer.size() + 1);
+    n->count_deltas[0] = 0;
+    for (size_t i = 0; i < n->buffer.size(); ++i) {
+      n->count_deltas[i + 1] = n->count_deltas[i] + n->buffer[i].count_delta;
+    }
+    n->message_starts.resize(n->children.size() + 1);
+    size_t i = 0;
+    for (size_t c = 0; c < n->children.size(); ++c) {
+      n->message_starts[c] = i;
+      while (i < n->buffer.size() &&
+             (c == n->pivots.size() ||
+              Less(n->buffer[i].entry.first, n->pivots[c]))) {
+        ++i;
+      }
+    }
+    n->message_starts.back() = i;
+  }
+
+  //**************** Resolving ****************
+
+  void Stage(Outcome outcome, Key k, T v) {
+    pending_.push_back(
+        {{std::move(k), std::move(v)}, outcome, false, 0, sum_type{}});
+    if (pending_.size() >= kStagingCapacity) Drain();
+  }
+
+  // Folds `newer` into `older`, an earlier message for the same key, so that
+  // `older` has the outcome of both.  Leaves the deltas alone.
+  static void Fold(Message *older, Message &&newer) {
+    if (newer.outcome != Outcome::kInsertIfAbsent) {
+      older->outcome = newer.outcome;
+      older->entry.second = std::move(newer.entry.second);
+    } else if (older->outcome == Outcome::kAbsent) {
+      older->outcome = Outcome::kPresent;
+      older->entry.second = std::move(newer.entry.second);
+    }
+  }
+
+  // Resolves `m` given `below`, the mapped value of its key in the subtree
+  // below it (or nullptr if the key isn't there), and returns the change in
+  // its deltas.
+  static Change Settle(Message *m, const T *below) {
+    if (m->outcome == Outcome::kInsertIfAbsent) {
+      if (below != nullptr) m->entry.second = *below;
+      m->outcome = Outcome::kPresent;
+    }
+    bool present = m->outcome == Outcome::kPresent;
+    sum_type sum{};
+    if (present) sum += Lift(m->entry.second);
+    if (below != nullptr) sum -= Lift(*below);
+    Change change;
+    change.count =
+        ptrdiff_t{present} - ptrdiff_t{below != nullptr} - m->count_delta;
+    change.sum = sum;
+    change.sum -= m->sum_delta;
+    m->count_delta += change.count;
+    m->sum_delta = sum;
+    m->resolved = true;
+    return change;
+  }
+
+  // Merges `newer`, which arrives from above, into `older`, the message for
+  // the same key already in the buffer.  `newer`'s deltas are relative to
+  // `older`'s outcome, so relative to the children they add up, and whenever
+  // that outcome is known so is `newer`'s effect.  Returns the change in
+  // `newer`'s deltas.
+  static Change Merge(Message *older, Message &&newer) {
+    Change change;
+    if (older->outcome != Outcome::kInsertIfAbsent) {
+      change = Settle(&newer, older->outcome == Outcome::kPresent
+                                  ? &older->entry.second
+                                  : nullptr);
+    } else if (newer.outcome == Outcome::kInsertIfAbsent) {
+      // The older insert goes first, so the newer one does nothing.
+      change.count -= newer.count_delta;
+      change.sum -= newer.sum_delta;
+      newer.count_delta = 0;
+      newer.sum_delta = sum_type{};
+    }
+    older->count_delta += newer.count_delta;
+    older->sum_delta += newer.sum_delta;
+    Fold(older, std::move(newer));
+    return change;
+  }
+
+  // Returns the mapped value of `k` in the subtree, or nullptr if `k` isn't
+  // there.  The first message for `k` on the way down decides, unless it only
+  // inserts if absent: then it's up to the rest of the way down, and if the
+  // key isn't there the lowest (oldest) such message wins.
+  const T *Lookup(const Node *n, const Key &k) const {
+    const T *if_absent = nullptr;
+    while (!n->leaf) {
+      auto it = BufferLowerBound(*n, k);
+      if (it != n->buffer.end() && !Less(k, it->entry.first)) {
+        if (it->outcome == Outcome::kPresent) return &it->entry.second;
+        if (it->outcome == Outcome::kAbsent) return if_absent;
+        if_absent = &it->entry.second;
+      }
+      n = n->children[ChildIndex(*n, k)].get();
+    }
+    auto it = std::lower_bound(
+        n->entries.begin(), n->entries.end(), k,
+        [this](const value_type &e, const Key &b) { return Less(e.first, b); });
+    if (it != n->entries.end() && !Less(k, it->first)) return &it->second;
+    return if_absent;
+  }
+
+  // Looks up the keys of the messages in `[first, last)`, which are sorted by
+  // key, in the subtree `n`, which must have no unresolved messages.  Calls
+  // `found(m, v)` for each message `m`, where `v` is the mapped value of its
+  // key or nullptr.  The lookups share the walk down, so no node is visited
+  // twice.  Overwrites `[first, last)`.
+  template <class Found>
+  void LookupBatch(const Node *n, Message **first, Message **last,
+                   Found &found) const {
+    if (first == last) return;
+    if (n->leaf) {
+      auto e = n->entries.begin();
+      for (; first != last; ++first) {
+        const Key &k = (*first)->entry.first;
+        e = std::lower_bound(e, n->entries.end(), k,
+                             [this](const value_type &a, const Key &b) {
+                               return Less(a.first, b);
+                             });
+        found(*first, e != n->entries.end() && !Less(k, e->first) ? &e->second
+                                                                  : nullptr);
+      }
+      return;
+    }
+    // The keys with messages here are answered, and the rest move to the
+    // front and go down.
+    Message **rest = first;
+    auto b = n->buffer.begin();
+    for (Message **it = first; it != last; ++it) {
+      const Key &k = (*it)->entry.first;
+      b = std::lower_bound(b, n->buffer.end(), k,
+                           [this](const Message &m, const Key &key) {
+                             return Less(m.entry.first, key);
+                           });
+      if (b != n->buffer.end() && !Less(k, b->entry.first)) {
+        DCHECK(b->resolved);
+        found(*it,
+              b->outcome == Outcome::kPresent ? &b->entry.second : nullptr);
+      } else {
+        *rest++ = *it;
+      }
+    }
+    for (size_t c = 0; first != rest; ++c) {
+      Message **end = first;
+      while (end != rest && (c == n->pivots.size() ||
+                             Less((*end)->entry.first, n->pivots[c]))) {
+        ++end;
+      }
+      LookupBatch(n->children[c].get(), first, end, found);
+      first = end;
+    }
+  }
+
+  // Sends the staged writes, folded into one message per key, to the root.
+  void Drain() const {
+    if (pending_.empty()) return;
+    std::stable_sort(pending_.begin(), pending_.end(),
+                     [this](const Message &a, const Message &b) {
+                       return Less(a.entry.first, b.entry.first);
+                     });
+    std::vector<Message> batch;
+    batch.reserve(pending_.size());
+    for (Message &m : pending_) {
+      if (!batch.empty() && !Less(batch.back().entry.first, m.entry.first)) {
+        Fold(&batch.back(), std::move(m));
+      } else {
+        batch.push_back(std::move(m));
+      }
+    }
+    pending_.clear();
+    if (root_->leaf) {
+      ApplyToLeaf(root_.get(), batch.begin(), batch.end());
+    } else {
+      MergeIntoBuffer(root_.get(), batch.begin(), batch.end());
+      while (root_->buffer.size() > kBufferCapacity) FlushBuffer(root_.get());
+    }
+    FixRoot();
+  }
+
+  // Drains the staged writes and resolves every message, which makes the
+  // counts and sums exact.
+  void Resolve() const {
+    Drain();
+    ResolveSubtree(root_.get());
+  }
+
+  // Resolves every message in the subtree, the lower ones first so that the
+  // higher ones can look up their keys below them.  Returns the change to the
+  // subtree's count and sum.
+  Change ResolveSubtree(Node *n) const {
+    Change change;
+    if (!n->unresolved) return change;
+    std::vector<Message *> batch;
+    for (size_t c = 0; c < n->children.size(); ++c) {
+      Change child_change = ResolveSubtree(n->children[c].get());
+      auto settle = [&child_change](Message *m, const T *below) {
+        child_change += Settle(m, below);
+      };
+      batch.clear();
+      auto [begin, end] = ChildMessages(*n, c);
+      for (size_t i = begin; i < end; ++i) {
+        if (!n->buffer[i].resolved) batch.push_back(&n->buffer[i]);
+      }
+      LookupBatch(n->children[c].get(), batch.data(),
+                  batch.data() + batch.size(), settle);
+      n->counts[c] += child_change.count;
+      n->sums[c] += child_change.sum;
+      change += child_change;
+    }
+    n->unresolved = false;
+    IndexMessages(n);
+    return change;
+  }
+
+  //**************** Flushing ****************
+
+  // The functions that move messages down return the change to the count and
+  // sum of the subtree, which the caller adds to its own.
+
+  // Moves the messages in `[first, last)`, which are sorted and whose deltas
+  // are relative to the whole subtree of `n`, into `n`'s buffer.
+  Change MergeIntoBuffer(Node *n, typename std::vector<Message>::iterator first,
+                         typename std::vector<Message>::iterator last) const {
+    Change change;
+    std::vector<Message> merged;
+    merged.reserve(n->buffer.size() + (last - first));
+    auto old = n->buffer.begin();
+    size_t c = 0;
+    for (; first != last; ++first) {
+      while (c < n->pivots.size() && !Less(first->entry.first, n->pivots[c])) {
+        ++c;
+      }
+      while (old != n->buffer.end() &&
+             Less(old->entry.first, first->entry.first)) {
+        merged.push_back(std::move(*old++));
+      }
+      n->counts[c] += first->count_delta;
+      n->sums[c] += first->sum_delta;
+      if (old != n->buffer.end() &&
+          !Less(first->entry.first, old->entry.first)) {
+        Change merge_change = Merge(&*old, std::move(*first));
+        n->counts[c] += merge_change.count;
+        n->sums[c] += merge_change.sum;
+        change += merge_change;
+        merged.push_back(std::move(*old++));
+      } else {
+        merged.push_back(std::move(*first));
+      }
+      if (!merged.back().resolved) n->unresolved = true;
+    }
+    std::move(old, n->buffer.end(), std::back_inserter(merged));
+    n->buffer = std::move(merged);
+    IndexMessages(n);
+    return change;
+  }
+
+  // Applies the messages in `[first, last)` to the leaf `n`, moving from them.
+  // They all resolve here.
+  Change ApplyToLeaf(Node *n, typename std::vector<Message>::iterator first,
+                     typename std::vector<Message>::iterator last) const {
+    Change change;
+    std::vector<value_type> merged;
+    merged.reserve(n->entries.size() + (last - first));
+    auto old = n->entries.begin();
+    for (; first != last; ++first) {
+      while (old != n->entries.end() && Less(old->first, first->entry.first)) {
+        merged.push_back(std::move(*old++));
+      }
+      bool was_present =
+          old != n->entries.end() && !Less(first->entry.first, old->first);
+      change += Settle(&*first, was_present ? &old->second : nullptr);
+      if (was_present) ++old;
+      if (first->outcome == Outcome::kPresent) {
+        merged.push_back(std::move(first->entry));
+      }
+    }
+    std::move(old, n->entries.end(), std::back_inserter(merged));
+    n->entries = std::move(merged);
+    return change;
+  }
+
+  // Moves the messages for the child with the most of them down to it.  The
+  // child's count and sum already include them as far as they are known.
+  Change FlushBuffer(Node *n) const {
+    DCHECK(!n->leaf);
+    const std::vector<size_t> &starts = n->message_starts;
+    size_t c = 0;
+    for (size_t i = 1; i < n->children.size(); ++i) {
+      if (starts[i + 1] - starts[i] > starts[c + 1] - starts[c]) c = i;
+    }
+    auto first = n->buffer.begin() + starts[c];
+    auto last = n->buffer.begin() + starts[c + 1];
+    Node *child = n->children[c].get();
+    Change change;
+    if (child->leaf) {
+      change = ApplyToLeaf(child, first, last);
+    } else {
+      change = MergeIntoBuffer(child, first, last);
+      while (child->buffer.size() > kBufferCapacity) {
+        change += FlushBuffer(child);
+      }
+    }
+    n->counts[c] += change.count;
+    n->sums[c] += change.sum;
+    n->buffer.erase(first, last);
+    IndexMessages(n);
+    FixChild(n, c);
+    return change;
+  }
+
+  // Flushes every buffer in the subtree all the way down, which resolves
+  // every message.
+  Change FlushAll(Node *n) const {
+    Change change;
+    if (n->leaf) return change;
+    while (!n->buffer.empty()) change += FlushBuffer(n);
+    for (size_t i = 0; i < n->children.size();) {
+      Change child_change = FlushAll(n->children[i].get());
+      n->counts[i] += child_change.count;
+      n->sums[i] += child_change.sum;
+      change += child_change;
+      i += FixChild(n, i);
+    }
+    n->unresolved = false;
+    return change;
+  }
+
+  //**************** Restructuring ****************
+
+  // Splits the child `c` of `n` if it is too big, removes it if its subtree is
+  // empty, and merges it into a neighbor if both are small leaves (there is no
+  // other rebalancing).  Returns the number of children, starting at `c`, that
+  // took its place and still need a look.  `n`'s buffer must have no messages
+  // for the child's range.
+  size_t FixChild(Node *n, size_t c) const {
+    Node *child = n->children[c].get();
+    if (child->leaf ? child->entries.size() > kLeafCapacity
+                    : child->children.size() > kFanout) {
+      return SplitChild(n, c);
+    }
+    if (n->children.size() == 1) return 1;
+    // With no unresolved messages below, the count is exact.
+    if (n->counts[c] == 0 && !child->unresolved) {
+      RemoveChild(n, c);
+      return 0;
+    }
+    if (child->leaf && child->entries.size() < kLeafCapacity / 4) {
+      size_t left = c > 0 ? c - 1 : c;
+      Node *a = n->children[left].get();
+      Node *b = n->children[left + 1].get();
+      if (a->leaf && b->leaf &&
+          a->entries.size() + b->entries.size() <= kLeafCapacity / 2) {
+        std::move(b->entries.begin(), b->entries.end(),
+                  std::back_inserter(a->entries));
+        n->counts[left] += n->counts[left + 1];
+        n->sums[left] += n->sums[left + 1];
+        RemoveChild(n, left + 1);
+        return left == c ? 1 : 0;
+      }
+    }
+    return 1;
+  }
+
+  // Removes the child `c` of `n`, giving its key range to a neighbor.
+  void RemoveChild(Node *n, size_t c) const {
+    n->children.erase(n->children.begin() + c);
+    n->counts.erase(n->counts.begin() + c);
+    n->sums.erase(n->sums.begin() + c);
+    n->pivots.erase(n->pivots.begin() + (c > 0 ? c - 1 : 0));
+    IndexMessages(n);
+  }
+
+  // Splits the child `c` of `n` into pieces that are between half full and
+  // full, and returns the number of pieces.
+  size_t SplitChild(Node *n, size_t c) const {
+    std::unique_ptr<Node> child = std::move(n->children[c]);
+    size_t size = child->leaf ? child->entries.size() : child->children.size();
+    size_t capacity = child->leaf ? kLeafCapacity : kFanout;
+    size_t pieces = std::max<size_t>(2, size / (capacity / 2));
+    std::vector<std::unique_ptr<Node>> parts;
+    std::vector<Key> separators;
+    for (size_t p = 0; p < pieces; ++p) {
+      size_t begin = size * p / pieces;
+      size_t end = size * (p + 1) / pieces;
+      std::unique_ptr<Node> part;
+      if (child->leaf) {
+        part = NewLeaf();
+        part->entries.assign(
+            std::make_move_iterator(child->entries.begin() + begin),
+            std::make_move_iterator(child->entries.begin() + end));
+        if (p > 0) separators.push_back(part->entries.front().first);
+      } else {
+        part = NewInternal();
+        part->unresolved = child->unresolved;
+        for (size_t i = begin; i < end; ++i) {
+          part->children.push_back(std::move(child->children[i]));
+          part->counts.push_back(child->counts[i]);
+          part->sums.push_back(child->sums[i]);
+          if (i + 1 < end) part->pivots.push_back(child->pivots[i]);
+        }
+        if (p > 0) separators.push_back(child->pivots[begin - 1]);
+        part->buffer.assign(
+            std::make_move_iterator(child->buffer.begin() +
+                                    child->message_starts[begin]),
+            std::make_move_iterator(child->buffer.begin() +
+                                    child->message_starts[end]));
+        IndexMessages(part.get());
+      }
+      parts.push_back(std::move(part));
+    }
+    std::vector<size_t> counts;
+    std::vector<sum_type> sums;
+    for (const auto &part : parts) {
+      counts.push_back(Count(*part));
+      sums.push_back(Sum(*part));
+    }
+    n->children.erase(n->children.begin() + c);
+    n->children.insert(n->children.begin() + c,
+                       std::make_move_iterator(parts.begin()),
+                       std::make_move_iterator(parts.end()));
+    n->counts.erase(n->counts.begin() + c);
+    n->counts.insert(n->counts.begin() + c, counts.begin(), counts.end());
+    n->sums.erase(n->sums.begin() + c);
+    n->sums.insert(n->sums.begin() + c, sums.begin(), sums.end());
+    n->pivots.insert(n->pivots.begin() + c,
+                     std::make_move_iterator(separators.begin()),
+                     std::make_move_iterator(separators.end()));
+    IndexMessages(n);
+    return pieces;
+  }
+
+  // Grows the tree by a level while the root is too big, and shrinks it while
+  // the root has a single child and nothing buffered.
+  void FixRoot() const {
+    while (root_->leaf ? root_->entries.size() > kLeafCapacity
+                       : root_->children.size() > kFanout) {
+      std::unique_ptr<Node> root = NewInternal();
+      root->counts.push_back(Count(*root_));
+      root->sums.push_back(Sum(*root_));
+      root->unresolved = root_->unresolved;
+      root->children.push_back(std::move(root_));
+      root_ = std::move(root);
+      SplitChild(root_.get(), 0);
+    }
+    while (!root_->leaf && root_->children.size() == 1 &&
+           root_->buffer.empty()) {
+      root_ = std::move(root_->children[0]);
+    }
+  }
+
+  //**************** Queries ****************
+
+  // The queries below need every message resolved.
+
+  // Returns the number of elements in the subtree with keys less than `k`.
+  size_t Rank(const Node *n, const Key &k) const {
+    size_t rank = 0;
+    while (!n->leaf) {
+      size_t c = ChildIndex(*n, k);
+      for (size_t i = 0; i < c; ++i) rank += n->counts[i];
+      // The child's messages for keys less than `k`.
+      size_t end = BufferLowerBound(*n, k) - n->buffer.begin();
+      rank += n->count_deltas[end] - n->count_deltas[n->message_starts[c]];
+      n = n->children[c].get();
+    }
+    return rank + (std::lower_bound(n->entries.begin(), n->entries.end(), k,
+                                    [this](const value_type &e, const Key &b) {
+                                      return Less(e.first, b);
+                                    }) -
+                   n->entries.begin());
+  }
+
+  // A key with messages in the buffers above the current node.  The newest
+  // message (the highest one) decides whether the key is present, and the
+  // deltas add up.
+  struct Overlay {
+    const Message *newest;
+    ptrdiff_t count_delta;
+    sum_type sum_delta;
+  };
+
+  // The leaf below which the element of rank `r` lies, the messages above it
+  // for keys in its range, the rank of the element among the leaf's elements
+  // as changed by those messages, and the sum of the elements to the left of
+  // the leaf.
+  struct Descent {
+    const Node *leaf;
+    std::vector<Overlay> overlay;
+    size_t r;
+    sum_type sum;
+  };
+
+  // Walks down to the element of rank `r`, which must exist.  At each node the
+  // exact number of elements under each child is its count plus the deltas of
+  // the overlay's messages for its range.
+  Descent Descend(size_t r) const {
+    DCHECK_LT(r, Count(*root_));
+    const Node *n = root_.get();
+    std::vector<Overlay> overlay, next;
+    sum_type sum{};
+    while (!n->leaf) {
+      const std::vector<Message> &buffer = n->buffer;
+      size_t o = 0;
+      for (size_t c = 0;; ++c) {
+        DCHECK_LT(c, n->children.size());
+        bool last = c + 1 == n->children.size();
+        size_t count = n->counts[c];
+        sum_type child_sum = n->sums[c];
+        size_t o_end = o;
+        for (; o_end < overlay.size() &&
+               (last || Less(overlay[o_end].newest->entry.first, n->pivots[c]));
+             ++o_end) {
+          count += overlay[o_end].count_delta;
+          child_sum += overlay[o_end].sum_delta;
+        }
+        if (r >= count) {
+          r -= count;
+          sum += child_sum;
+          o = o_end;
+          continue;
+        }
+        // The child's overlay is the merge of the overlay and this node's
+        // messages for its range.
+        auto [b, b_end] = ChildMessages(*n, c);
+        next.clear();
+        while (o < o_end || b < b_end) {
+          if (b == b_end || (o < o_end && Less(overlay[o].newest->entry.first,
+                                               buffer[b].entry.first))) {
+            next.push_back(overlay[o++]);
+          } else if (o == o_end || Less(buffer[b].entry.first,
+                                        overlay[o].newest->entry.first)) {
+            const Message &m = buffer[b++];
+            next.push_back({&m, m.count_delta, m.sum_delta});
+          } else {
+            Overlay v = overlay[o++];
+            v.count_delta += buffer[b].count_delta;
+            v.sum_delta += buffer[b].sum_delta;
+            ++b;
+            next.push_back(v);
+          }
+        }
+        overlay.swap(next);
+        n = n->children[c].get();
+        break;
+      }
+    }
+    return {n, std::move(overlay), r, sum};
+  }
+
+  // Calls `visit` on the elements of `leaf`, as changed by `overlay`, in order,
+  // until it returns false.
+  template <class Visit>
+  void VisitLeaf(const Node *leaf, const std::vector<Overlay> &overlay,
+                 Visit visit) const {
+    const std::vector<value_type> &entries = leaf->entries;
+    size_t i = 0, o = 0;
+    while (i < entries.size() || o < overlay.size()) {
+      const value_type *e;
+      if (o == overlay.size() ||
+          (i < entries.size() &&
+           Less(entries[i].first, overlay[o].newest->entry.first))) {
+        e = &entries[i++];
+      } else {
+        const Message *m = overlay[o++].newest;
+        if (i < entries.size() && !Less(m->entry.first, entries[i].first)) ++i;
+        if (m->outcome != Outcome::kPresent) continue;
+        e = &m->entry;
+      }
+      if (!visit(*e)) return;
+    }
+  }
+
+  // Returns the element of rank `r`, which must exist.
+  const value_type &Select(size_t r) const {
+    Descent d = Descend(r);
+    const value_type *found = nullptr;
+    VisitLeaf(d.leaf, d.overlay, [&](const value_type &e) {
+      if (d.r > 0) {
+        --d.r;
+        return true;
+      }
+      found = &e;
+      return false;
+    });
+    DCHECK(found != nullptr);
+    return *found;
+  }
+
+  // Returns the sum of the first `r` elements, of which there must be at least
+  // `r`.
+  sum_type SumFirst(size_t r) const {
+    if (r == Count(*root_)) return Sum(*root_);
+    Descent d = Descend(r);
+    sum_type sum = d.sum;
+    VisitLeaf(d.leaf, d.overlay, [&](const value_type &e) {
+      if (d.r == 0) return false;
+      --d.r;
+      sum += Lift(e.second);
+      return true;
+    });
+    return sum;
+  }
+
+  //**************** Checking ****************
+
+  // Checks the subtree, whose keys must be in `[lo, hi)` (where nullptr is
+  // unbounded).  Returns whether it has unresolved messages.
+  bool CheckNode(const Node &n, const Key *lo, const Key *hi) const {
+    auto in_range = [&](const Key &k) {
+      return (lo == nullptr || !Less(k, *lo)) &&
+             (hi == nullptr || Less(k, *hi));
+    };
+    if (n.leaf) {
+      CHECK_LE(n.entries.size(), kLeafCapacity);  // Crash OK
+      for (size_t i = 0; i < n.entries.size(); ++i) {
+        CHECK(in_range(n.entries[i].first));  // Crash OK
+        if (i > 0) {
+          CHECK(Less(n.entries[i - 1].first, n.entries[i].first));  // Crash OK
+        }
+      }
+      CHECK(!n.unresolved);  // Crash OK
+      return false;
+    }
+    CHECK_GE(n.children.size(), 1u);                   // Crash OK
+    CHECK_LE(n.children.size(), kFanout);              // Crash OK
+    CHECK_EQ(n.pivots.size() + 1, n.children.size());  // Crash OK
+    CHECK_EQ(n.counts.size(), n.children.size());      // Crash OK
+    CHECK_EQ(n.sums.size(), n.children.size());        // Crash OK
+    CHECK_LE(n.buffer.size(), kBufferCapacity);        // Crash OK
+    CHECK_EQ(n.message_starts.size(), n.children.size() + 1);  // Crash OK
+    CHECK_EQ(n.message_starts.front(), 0u);                     // Crash OK
+    CHECK_EQ(n.message_starts.back(), n.buffer.size());         // Crash OK
+    CHECK_EQ(n.count_deltas.size(), n.buffer.size() + 1);       // Crash OK
+    CHECK_EQ(n.count_deltas.front(), 0);                        // Crash OK
+    for (size_t c = 0; c < n.children.size(); ++c) {
+      auto [begin, end] = ChildMessages(n, c);
+      CHECK_LE(begin, end);  // Crash OK
+      for (size_t i = begin; i < end; ++i) {
+        CHECK_EQ(ChildIndex(n, n.buffer[i].entry.first), c);  // Crash OK
+      }
+    }
+    bool unresolved = false;
+    for (size_t i = 0; i < n.buffer.size(); ++i) {
+      const Message &m = n.buffer[i];
+      CHECK(in_range(m.entry.first));  // Crash OK
+      CHECK_EQ(n.count_deltas[i + 1],  // Crash OK
+               n.count_deltas[i] + m.count_delta);
+      if (i > 0) {
+        CHECK(Less(n.buffer[i - 1].entry.first, m.entry.first));  // Crash OK
+      }
+      if (!m.resolved) {
+        unresolved = true;
+        continue;
+      }
+      CHECK(m.outcome != Outcome::kInsertIfAbsent);  // Crash OK
+      bool present = m.outcome == Outcome::kPresent;
+      const Node *child = n.children[ChildIndex(n, m.entry.first)].get();
+      const T *below = Lookup(child, m.entry.first);
+      CHECK_EQ(m.count_delta,  // Crash OK
+               ptrdiff_t{present} - ptrdiff_t{below != nullptr});
+      if constexpr (std::is_integral_v<T>) {
+        sum_type expected{};
+        if (present) expected += m.entry.second;
+        if (below != nullptr) expected -= *below;
+        CHECK_EQ(m.sum_delta, expected);  // Crash OK
+      }
+    }
+    for (size_t i = 1; i < n.pivots.size(); ++i) {
+      CHECK(Less(n.pivots[i - 1], n.pivots[i]));  // Crash OK
+    }
+    for (size_t i = 0; i < n.children.size(); ++i) {
+      const Key *child_lo = i == 0 ? lo : &n.pivots[i - 1];
+      const Key *child_hi = i == n.pivots.size() ? hi : &n.pivots[i];
+      unresolved |= CheckNode(*n.children[i], child_lo, child_hi);
+      size_t count = Count(*n.children[i]);
+      sum_type sum = Sum(*n.children[i]);
+      auto [begin, end] = ChildMessages(n, i);
+      for (size_t j = begin; j < end; ++j) {
+        count += n.buffer[j].count_delta;
+        sum += n.buffer[j].sum_delta;
+      }
+      CHECK_EQ(n.counts[i], count);  // Crash OK
+      if constexpr (std::is_integral_v<T>) {
+        CHECK_EQ(n.sums[i], sum);  // Crash OK
+      }
+    }
+    CHECK(n.unresolved || !unresolved);  // Crash OK
+    return unresolved;
+  }
+
+  // The tree and the staged writes are mutable because the queries drain the
+  // staged writes and resolve the messages first.
+  mutable std::unique_ptr<Node> root_;
+  mutable std::vector<Message> pending_;
+  Compare lessthan_;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_BUFFERED_ORDER_STATISTIC_MAP_H_
@@ -0,0 +1,146 @@
+#include "buffered_order_statistic_map.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::Optional;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class BufferedOrderStatisticMap<int, std::string>;
+template class BufferedOrderStatisticMap<uint64_t, int64_t>;
+
+TEST(BufferedOrderStatisticMapTest, Basic) {
+  BufferedOrderStatisticMap<int, std::string> map;
+  EXPECT_TRUE(map.empty());
+  map.insert_or_assign(2, "two");
+  map.insert(1, "one");
+  map.insert(2, "deux");
+  EXPECT_EQ(map.pending(), 3);
+  EXPECT_EQ(map.size(), 2);
+  EXPECT_EQ(map.pending(), 0);
+  EXPECT_THAT(map.find(2), Optional(Pair(2, "two")));
+  map.insert_or_assign(2, "zwei");
+  map.erase(1);
+  map.erase(42);
+  EXPECT_FALSE(map.contains(1));
+  EXPECT_THAT(map.select(0), Optional(Pair(2, "zwei")));
+  EXPECT_FALSE(map.select(1).has_value());
+  EXPECT_EQ(map.rank(3), 1);
+  map.Check();
+  map.clear();
+  EXPECT_TRUE(map.empty());
+}
+
+// Checks every query against `reference`.
+void ExpectSame(const BufferedOrderStatisticMap<uint64_t, int64_t> &map,
+                const std::map<uint64_t, int64_t> &reference,
+                absl::BitGen &bitgen) {
+  ASSERT_EQ(map.size(), reference.size());
+  int64_t sum = 0;
+  size_t r = 0;
+  for (const auto &[k, v] : reference) {
+    if (absl::Bernoulli(bitgen, 0.1)) {
+      EXPECT_THAT(map.select(r), Optional(Pair(k, v))) << r;
+      EXPECT_EQ(map.rank(k), r);
+      EXPECT_EQ(map.rank(k + 1), r + 1);
+      EXPECT_EQ(map.SumFirstN(r), sum) << r;
+      EXPECT_THAT(map.find(k), Optional(Pair(k, v)));
+    }
+    sum += v;
+    ++r;
+  }
+  EXPECT_EQ(map.SumFirstN(reference.size() + 1), sum);
+  EXPECT_FALSE(map.select(reference.size()).has_value());
+}
+
+// Writes that land on older messages still in the buffers, with `find()` and
+// `Check()` looking at them before any counting query resolves them.
+TEST(BufferedOrderStatisticMapTest, BlindWrites) {
+  BufferedOrderStatisticMap<uint64_t, int64_t> map;
+  for (uint64_t k = 0; k < 20000; ++k) map.insert_or_assign(k, 1);
+  map.Flush();
+  for (uint64_t k = 0; k < 40000; k += 2) map.insert(k, 2);
+  for (uint64_t k = 0; k < 40000; k += 3) map.erase(k);
+  for (uint64_t k = 0; k < 40000; k += 5) map.insert(k, 4);
+  map.Check();
+  std::map<uint64_t, int64_t> reference;
+  for (uint64_t k = 0; k < 40000; ++k) {
+    if (k < 20000 && k % 3 != 0) {
+      reference[k] = 1;
+    } else if (k % 2 == 0 && k % 3 != 0) {
+      reference[k] = 2;
+    } else if (k % 5 == 0) {
+      reference[k] = 4;
+    }
+  }
+  for (uint64_t k = 0; k < 40000; k += 7) {
+    auto it = reference.find(k);
+    if (it == reference.end()) {
+      EXPECT_FALSE(map.contains(k)) << k;
+    } else {
+      EXPECT_THAT(map.find(k), Optional(Pair(k, it->second))) << k;
+    }
+  }
+  map.Check();
+  absl::BitGen bitgen;
+  ExpectSame(map, reference, bitgen);
+  map.Check();
+}
+
+TEST(BufferedOrderStatisticMapTest, Random) {
+  absl::BitGen bitgen;
+  BufferedOrderStatisticMap<uint64_t, int64_t> map;
+  std::map<uint64_t, int64_t> reference;
+  // Grow the map, then shrink it, with the writes interleaved with queries at
+  // varying rates so that the queries see messages at every level.
+  for (double insert_probability : {0.9, 0.6, 0.2}) {
+    for (size_t i = 0; i < 30000; ++i) {
+      uint64_t k = absl::Uniform<uint64_t>(bitgen, 0, 20000) * 2;
+      int64_t v = absl::Uniform<int64_t>(bitgen, -100, 1000);
+      if (absl::Bernoulli(bitgen, insert_probability)) {
+        if (absl::Bernoulli(bitgen, 0.5)) {
+          map.insert_or_assign(k, v);
+          reference.insert_or_assign(k, v);
+        } else {
+          map.insert(k, v);
+          reference.insert({k, v});
+        }
+      } else {
+        map.erase(k);
+        reference.erase(k);
+      }
+      if (i % 1009 == 0) {
+        uint64_t q = absl::Uniform<uint64_t>(bitgen, 0, 40000);
+        auto expected = reference.lower_bound(q);
+        EXPECT_EQ(map.rank(q), std::distance(reference.begin(), expected));
+        EXPECT_EQ(map.contains(q), reference.count(q) == 1);
+      }
+      if (i % 7919 == 0) {
+        map.Check();
+        ExpectSame(map, reference, bitgen);
+      }
+    }
+    map.Check();
+    ExpectSame(map, reference, bitgen);
+  }
+  map.Flush();
+  map.Check();
+  ExpectSame(map, reference, bitgen);
+  // Erase everything.
+  for (const auto &[k, v] : reference) map.erase(k);
+  EXPECT_TRUE(map.empty());
+  map.Check();
+}
+
+}  // namespace cachelib
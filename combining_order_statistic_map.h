@@ -0,0 +1,329 @@
+// A CombiningOrderStatisticMap is an OrderStatisticMap that many threads can
+// use at once, built with flat combining.
+//
+// Protecting an OrderStatisticMap with a mutex works, but when many threads
+// hammer on it most of the time goes to handing the lock from one thread to
+// the next (and to moving the tree's cache lines along with it).  Here,
+// instead, each thread publishes its operation in its own slot and then tries
+// to become the "combiner".  The combiner scans all the slots and applies
+// every pending operation in one go, while the other threads just wait for
+// their slot to be marked done.  So the lock is acquired once per batch rather
+// than once per operation, and the tree stays in one core's cache.
+//
+// The combiner also gets to reorder the batch.  All of the operations in a
+// batch were pending at the same time, so any order is a valid linearization.
+// The combiner answers the reads first, then sorts the inserts by key and
+// merges them into the tree with a single `insert_or_assign_sorted()` pass,
+// and then does the erases.
+//
+// Usage: Each thread needs its own `Handle`:
+//
+//   CombiningOrderStatisticMap<int64_t, std::string> map;
+//
+//   // In each thread:
+//   CombiningOrderStatisticMap<int64_t, std::string>::Handle handle(&map);
+//   handle.insert_or_assign(now, "event");
+//   size_t rank = handle.rank(now);
+//
+// All Handles must be destroyed before the map.
+
+#ifndef NET_BANDAID_BDN_CACHELIB_COMBINING_ORDER_STATISTIC_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_COMBINING_ORDER_STATISTIC_MAP_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "order_statistic_map.h"
+
+namespace cachelib {
+
+template <class Key, class T, class Compare = std::less<>>
+class CombiningOrderStatisticMap {
+ private:
+  struct Slot;
+
+ public:
+  using key_type = Key;
+  using mapped_type = T;
+  using value_type = std::pair<const Key, T>;
+  using size_type = std::size_t;
+  using key_compare = Compare;
+
+  // `max_threads` bounds the number of Handles that may exist at once.
+  explicit CombiningOrderStatisticMap(size_t max_threads = 128)
+      : slots_(new Slot[max_threads]), num_slots_(max_threads) {}
+
+  CombiningOrderStatisticMap(const CombiningOrderStatisticMap &) = delete;
+  CombiningOrderStatisticMap &operator=(const CombiningOrderStatisticMap &) =
+      delete;
+
+  // A per-thread handle.  Each operation blocks until it has been applied.
+  class Handle {
+   public:
+    explicit Handle(CombiningOrderStatisticMap *map)
+        : map_(map), slot_(map->AcquireSlot()) {}
+    Handle(const Handle &) = delete;
+    Handle &operator=(const Handle &) = delete;
+    ~Handle() { slot_->in_use.store(false); }
+
+    // Inserts `{k, v}`, or assigns `v` to the existing element with key `k`.
+    // Returns true iff the insertion happened.
+    bool insert_or_assign(Key k, T v) {
+      slot_->key.emplace(std::move(k));
+      slot_->mapped.emplace(std::move(v));
+      return map_->Run(slot_, OpKind::kInsertOrAssign) != 0;
+    }
+
+    // Inserts `value` unless an element with an equivalent key is present.
+    // Returns true iff the insertion happened.
+    bool insert(value_type value) {
+      slot_->key.emplace(std::move(value.first));
+      slot_->mapped.emplace(std::move(value.second));
+      return map_->Run(slot_, OpKind::kInsert) != 0;
+    }
+
+    // Erases the element with key equivalent to `k`, if any.  Returns the
+    // number of elements erased (0 or 1).
+    size_t erase(const Key &k) {
+      slot_->key.emplace(k);
+      return map_->Run(slot_, OpKind::kErase);
+    }
+
+    // Returns a copy of the element with key equivalent to `k`, if any.
+    std::optional<value_type> find(const Key &k) {
+      slot_->key.emplace(k);
+      map_->Run(slot_, OpKind::kFind);
+      return TakeFound();
+    }
+
+    bool contains(const Key &k) { return find(k).has_value(); }
+
+    // Returns the number of elements with keys less than `k`.
+    size_t rank(const Key &k) {
+      slot_->key.emplace(k);
+      return map_->Run(slot_, OpKind::kRank);
+    }
+
+    // Returns a copy of the element of rank `idx`, if there is one.
+    std::optional<value_type> select(size_t idx) {
+      slot_->idx = idx;
+      map_->Run(slot_, OpKind::kSelect);
+      return TakeFound();
+    }
+
+    size_t size() { return map_->Run(slot_, OpKind::kSize); }
+
+   private:
+    std::optional<value_type> TakeFound() {
+      std::optional<value_type> result;
+      if (slot_->found) result.emplace(std::move(*slot_->found));
+      slot_->found.reset();
+      return result;
+    }
+
+    CombiningOrderStatisticMap *map_;
+    Slot *slot_;
+  };
+
+  //**************** Debugging and test support ****************
+
+  // Checks the tree.  No operations may be in progress.
+  void Check() const { map_.Check(); }
+
+ private:
+  enum class OpKind {
+    kInsertOrAssign,
+    kInsert,
+    kErase,
+    kFind,
+    kRank,
+    kSelect,
+    kSize
+  };
+
+  // One per Handle, on its own cache line.  The owner fills in the arguments
+  // and then sets `pending`; the combiner fills in the results and then clears
+  // `pending`.  The release/acquire pairs on `pending` order the rest.
+  struct alignas(64) Slot {
+    std::atomic<bool> in_use{false};
+    std::atomic<bool> pending{false};
+    // Arguments
+    OpKind kind;
+    std::optional<Key> key;
+    std::optional<T> mapped;
+    size_t idx;
+    // Results
+    size_t count;
+    std::optional<value_type> found;
+  };
+
+  Slot *AcquireSlot() {
+    for (size_t i = 0; i < num_slots_; ++i) {
+      bool expected = false;
+      if (slots_[i].in_use.compare_exchange_strong(expected, true)) {
+        return &slots_[i];
+      }
+    }
+    LOG(FATAL) << "More than " << num_slots_
+               << " CombiningOrderStatisticMap handles";
+    return nullptr;
+  }
+
+  // Publishes the operation in `slot` and waits for it to be applied, serving
+  // as the combiner if nobody else is.  Returns the slot's `count` result.
+  size_t Run(Slot *slot, OpKind kind) {
+    slot->kind = kind;
+    slot->pending.store(true, std::memory_order_release);
+    while (slot->pending.load(std::memory_order_acquire)) {
+      if (combiner_mu_.try_lock()) {
+        Combine();
+        combiner_mu_.unlock();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    return slot->count;
+  }
+
+  // Applies every pending operation.  Must hold `combiner_mu_`.
+  void Combine() {
+    reads_.clear();
+    upserts_.clear();
+    erases_.clear();
+    for (size_t i = 0; i < num_slots_; ++i) {
+      Slot *slot = &slots_[i];
+      if (!slot->pending.load(std::memory_order_acquire)) continue;
+      switch (slot->kind) {
+        case OpKind::kInsertOrAssign:
+        case OpKind::kInsert:
+          upserts_.push_back(slot);
+          break;
+        case OpKind::kErase:
+          erases_.push_back(slot);
+          break;
+        default:
+          reads_.push_back(slot);
+          break;
+      }
+    }
+    for (Slot *slot : reads_) ApplyRead(slot);
+    ApplyUpserts();
+    for (Slot *slot : erases_) slot->count = map_.erase(*slot->key);
+    for (auto *batch : {&reads_, &upserts_, &erases_}) {
+      for (Slot *slot : *batch) {
+        slot->pending.store(false, std::memory_order_release);
+      }
+    }
+  }
+
+  void ApplyRead(Slot *slot) {
+    switch (slot->kind) {
+      case OpKind::kFind: {
+        auto it = map_.find(*slot->key);
+        if (it != map_.end()) slot->found.emplace(*it);
+        break;
+      }
+      case OpKind::kRank:
+        slot->count = map_.lower_bound(*slot->key).rank();
+        break;
+      case OpKind::kSelect: {
+        auto it = map_.select(slot->idx);
+        if (it != map_.end()) slot->found.emplace(*it);
+        break;
+      }
+      case OpKind::kSize:
+        slot->count = map_.size();
+        break;
+      default:
+        LOG(FATAL) << "Not a read";
+    }
+  }
+
+  // Sorts the inserts by key and merges them into the tree.  When several
+  // operations in the batch have the same key, we order the
+  // `insert_or_assign`s before the `insert`s.  Then the first operation of the
+  // group is the only one that can insert, the last `insert_or_assign` (if
+  // any) determines the value, and the `insert`s after it are no-ops.  The
+  // groups with an `insert_or_assign` are merged with assignment and the
+  // others without.
+  void ApplyUpserts() {
+    if (upserts_.empty()) return;
+    key_compare lessthan = map_.key_comp();
+    std::stable_sort(upserts_.begin(), upserts_.end(),
+                     [&lessthan](const Slot *a, const Slot *b) {
+                       if (lessthan(*a->key, *b->key)) return true;
+                       if (lessthan(*b->key, *a->key)) return false;
+                       return a->kind == OpKind::kInsertOrAssign &&
+                              b->kind == OpKind::kInsert;
+                     });
+    assigns_.clear();
+    assign_owners_.clear();
+    inserts_.clear();
+    insert_owners_.clear();
+    for (size_t i = 0; i < upserts_.size();) {
+      Slot *first = upserts_[i];
+      Slot *last_assign = nullptr;
+      size_t j = i;
+      for (; j < upserts_.size() && !lessthan(*first->key, *upserts_[j]->key);
+           ++j) {
+        upserts_[j]->count = 0;
+        if (upserts_[j]->kind == OpKind::kInsertOrAssign) {
+          last_assign = upserts_[j];
+        }
+      }
+      if (last_assign) {
+        assigns_.emplace_back(std::move(*first->key),
+                              std::move(*last_assign->mapped));
+        assign_owners_.push_back(first);
+      } else {
+        inserts_.emplace_back(std::move(*first->key),
+                              std::move(*first->mapped));
+        insert_owners_.push_back(first);
+      }
+      i = j;
+    }
+    if (did_insert_size_ < upserts_.size()) {
+      did_insert_size_ = upserts_.size();
+      did_insert_.reset(new bool[did_insert_size_]);
+    }
+    map_.insert_or_assign_sorted(assigns_.begin(), assigns_.end(),
+                                 did_insert_.get());
+    for (size_t i = 0; i < assign_owners_.size(); ++i) {
+      assign_owners_[i]->count = did_insert_[i];
+    }
+    map_.insert_sorted(inserts_.begin(), inserts_.end(), did_insert_.get());
+    for (size_t i = 0; i < insert_owners_.size(); ++i) {
+      insert_owners_[i]->count = did_insert_[i];
+    }
+  }
+
+  OrderStatisticMap<Key, T, Compare> map_;
+  std::unique_ptr<Slot[]> slots_;
+  size_t num_slots_;
+  std::mutex combiner_mu_;
+
+  // Scratch space for the combiner, kept around to avoid reallocating it for
+  // every batch.  Guarded by `combiner_mu_`.
+  std::vector<Slot *> reads_;
+  std::vector<Slot *> upserts_;
+  std::vector<Slot *> erases_;
+  std::vector<value_type> assigns_;
+  std::vector<Slot *> assign_owners_;
+  std::vector<value_type> inserts_;
+  std::vector<Slot *> insert_owners_;
+  std::unique_ptr<bool[]> did_insert_;
+  size_t did_insert_size_ = 0;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_COMBINING_ORDER_STATISTIC_MAP_H_
@@ -0,0 +1,110 @@
+#include "combining_order_statistic_map.h"
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::Optional;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class CombiningOrderStatisticMap<size_t, size_t>;
+template class CombiningOrderStatisticMap<std::string, std::string>;
+
+TEST(CombiningOrderStatisticMapTest, Basic) {
+  CombiningOrderStatisticMap<size_t, std::string> map;
+  CombiningOrderStatisticMap<size_t, std::string>::Handle handle(&map);
+  EXPECT_EQ(handle.size(), 0);
+  EXPECT_TRUE(handle.insert_or_assign(2, "b"));
+  EXPECT_TRUE(handle.insert({1, "a"}));
+  EXPECT_FALSE(handle.insert({1, "x"}));
+  EXPECT_FALSE(handle.insert_or_assign(2, "bb"));
+  EXPECT_THAT(handle.find(1), Optional(Pair(1, "a")));
+  EXPECT_THAT(handle.find(2), Optional(Pair(2, "bb")));
+  EXPECT_EQ(handle.find(3), std::nullopt);
+  EXPECT_THAT(handle.select(1), Optional(Pair(2, "bb")));
+  EXPECT_EQ(handle.select(2), std::nullopt);
+  EXPECT_EQ(handle.rank(2), 1);
+  EXPECT_EQ(handle.rank(3), 2);
+  EXPECT_EQ(handle.erase(1), 1);
+  EXPECT_EQ(handle.erase(1), 0);
+  EXPECT_FALSE(handle.contains(1));
+  EXPECT_EQ(handle.size(), 1);
+  map.Check();
+}
+
+// Many threads insert and erase keys while also reading.  Each thread owns the
+// keys congruent to its index, so it can check every result against what it
+// has done.  Some keys are shared by all the threads, which exercises batches
+// that contain several operations on the same key.
+TEST(CombiningOrderStatisticMapTest, Stress) {
+  constexpr size_t kThreads = 32;
+  constexpr size_t kOpsPerThread = 3000;
+  constexpr size_t kKeysPerThread = 200;
+  constexpr size_t kSharedKey = kThreads * kKeysPerThread;
+  using Map = CombiningOrderStatisticMap<size_t, size_t>;
+  Map map;
+  std::vector<std::map<size_t, size_t>> expected(kThreads);
+  std::atomic<size_t> shared_inserts = 0;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&map, &expected, &shared_inserts, kSharedKey, t] {
+      Map::Handle handle(&map);
+      absl::BitGen bitgen;
+      std::map<size_t, size_t> &mine = expected[t];
+      for (size_t i = 0; i < kOpsPerThread; ++i) {
+        size_t k =
+            absl::Uniform<size_t>(bitgen, 0, kKeysPerThread) * kThreads + t;
+        switch (absl::Uniform<int>(bitgen, 0, 6)) {
+          case 0:
+          case 1:
+            EXPECT_EQ(handle.insert_or_assign(k, i),
+                      mine.insert_or_assign(k, i).second);
+            break;
+          case 2:
+            EXPECT_EQ(handle.insert({k, i}), mine.insert({k, i}).second);
+            break;
+          case 3:
+            EXPECT_EQ(handle.erase(k), mine.erase(k));
+            break;
+          case 4:
+            if (auto it = mine.find(k); it == mine.end()) {
+              EXPECT_EQ(handle.find(k), std::nullopt);
+            } else {
+              EXPECT_THAT(handle.find(k), Optional(Pair(k, it->second)));
+            }
+            break;
+          case 5:
+            // Exactly one thread ever manages to insert the shared key.
+            shared_inserts += handle.insert({kSharedKey, t});
+            break;
+        }
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+  map.Check();
+  EXPECT_EQ(shared_inserts.load(), 1);
+  std::map<size_t, size_t> all;
+  for (const auto &mine : expected) all.insert(mine.begin(), mine.end());
+  Map::Handle handle(&map);
+  ASSERT_EQ(handle.size(), all.size() + 1);
+  size_t rank = 0;
+  for (const auto &[k, v] : all) {
+    EXPECT_THAT(handle.select(rank), Optional(Pair(k, v)));
+    EXPECT_EQ(handle.rank(k), rank);
+    ++rank;
+  }
+  EXPECT_TRUE(handle.contains(kSharedKey));
+}
+
+}  // namespace cachelib
@@ -0,0 +1,1115 @@
+// A ConcurrentOrderStatisticMap is an order-statistic map that any number of
+// threads may read and write at the same time.
+//
+// Every operation is linearizable, including `rank` and `select`: each one
+// takes effect at a single instant, as though the operations had run one at a
+// time in some order consistent with real time.
+//
+// How it works: The map is a B+-tree with optimistic lock coupling, in the
+// style of OLC B-trees.  Every node has a version lock.  A writer holds the
+// lock while it changes the node and bumps the version when it lets go.  A
+// reader takes no locks and writes no shared memory: it notes the version of
+// each node as it arrives, and before it moves on to a child it checks that
+// the parent's version hasn't changed (if it has, the reads may be torn, and
+// the reader starts over).  Writers descend the same way and lock only the
+// nodes they change, so writers to different leaves run in parallel.
+//
+// Every inner node also keeps the number of elements under each child, which
+// is what makes `rank` and `select` work.  The counts have a version lock of
+// their own, so keeping them up to date doesn't disturb lookups.  An insert or
+// erase that changes the number of elements locks its leaf, then takes the
+// count locks on its path shared, from the bottom up, adds to the counts
+// atomically, and only then lets go of any of them.  Shared holders don't
+// exclude each other, so writers never wait for each other at the root (or at
+// any inner node): only a split or a removal, which holds a count lock
+// exclusively while it moves counts around, makes them wait.  The counts are
+// validated at read time instead: `rank` and `select` begin reading a node's
+// counts only when no writer holds its count lock, and check every version on
+// their path once more at the end, and each release bumps the version.  So a
+// read that validates overlapped no writer on its path, which (with the
+// writers holding all of their count locks at once) makes it linearizable.
+// The price is that a read needs a moment when no writer holds the root's
+// count lock; under a steady stream of writers the starvation guard below
+// provides one.
+//
+// The counts are still shared memory: every size-changing write makes two
+// atomic adds to the root's count lock and one to a root count, so the root's
+// cache line moves between the writers' cores, but no writer waits for another
+// there.  A write that assigns to an existing key doesn't touch the counts at
+// all.  A writer to a leaf that another writer holds waits for it.  Only a
+// split or a removal on its path makes a writer start over.
+//
+// A reader that has had to start over too many times (because writers keep
+// changing its path) makes new writers wait until it gets through.
+//
+// An element never changes once it is in the tree: an assignment installs a
+// new one.  Replaced and erased elements, and nodes that are unlinked, are
+// freed by an `EpochReclaimer` once no reader can still be looking at them.
+// Full nodes split.  Nodes aren't merged when they shrink, but a leaf that
+// becomes empty is removed, along with the ancestors that only had it, so a
+// map used as a sliding window doesn't accumulate nodes.
+//
+// Usage: Each thread needs its own `Handle`:
+//
+//   ConcurrentOrderStatisticMap<int64_t, std::string> map;
+//
+//   // In each thread:
+//   ConcurrentOrderStatisticMap<int64_t, std::string>::Handle handle(&map);
+//   handle.insert_or_assign(now, "event");
+//   std::optional<std::pair<const int64_t, std::string>> median =
+//       handle.select(handle.size() / 2);
+//
+// `Key` and `T` must be copyable.  All Handles must be destroyed before the
+// map.
+
+#ifndef NET_BANDAID_BDN_CACHELIB_CONCURRENT_ORDER_STATISTIC_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_CONCURRENT_ORDER_STATISTIC_MAP_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "glog/logging.h"
+#include "epoch_reclaimer.h"
+#include "raw_order_statistic_set.h"
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// A lock with a version number, for optimistic lock coupling.  A reader
+// doesn't take the lock: it notes the version, reads, and then validates that
+// the version is the same, which means nobody held the lock in between.  A
+// lock whose node has been unlinked is obsolete: it never validates or locks
+// again.
+class VersionLock {
+ public:
+  // Begins an optimistic read, storing the version in `*version`.  Returns
+  // false if the lock is held or obsolete, in which case the reader must start
+  // over.
+  bool ReadBegin(uint64_t *version) const {
+    *version = word_.load(std::memory_order_acquire);
+    return (*version & (kLocked | kObsolete)) == 0;
+  }
+
+  // Returns whether nothing has changed since `ReadBegin()` returned
+  // `version`, i.e., whether the reads in between were consistent.
+  bool Validate(uint64_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return word_.load(std::memory_order_relaxed) == version;
+  }
+
+  // Takes the lock if the version is still `version`.
+  bool TryLock(uint64_t version) {
+    if (!word_.compare_exchange_strong(version, version | kLocked,
+                                       std::memory_order_acquire)) {
+      return false;
+    }
+    // A reader that sees any of our writes must see the lock too.
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+  }
+
+  // Takes the lock, waiting for whoever holds it.  Returns false if the lock
+  // is (or becomes) obsolete.
+  bool Lock() {
+    while (true) {
+      uint64_t version = word_.load(std::memory_order_relaxed);
+      if (version & kObsolete) return false;
+      if (!(version & kLocked) && TryLock(version)) return true;
+      std::this_thread::yield();
+    }
+  }
+
+  void Unlock() {
+    word_.fetch_add(kVersion - kLocked, std::memory_order_release);
+  }
+
+  // Unlocks for good: the node has been unlinked.
+  void UnlockObsolete() {
+    word_.fetch_add(kVersion + kObsolete - kLocked, std::memory_order_release);
+  }
+
+ private:
+  static constexpr uint64_t kLocked = 1;
+  static constexpr uint64_t kObsolete = 2;
+  static constexpr uint64_t kVersion = 4;
+
+  std::atomic<uint64_t> word_{0};
+};
+
+// A version lock that any number of writers may hold at once, for data that
+// they change only with atomic adds (such as counts), and that a writer which
+// rearranges the data holds alone.  A reader validates as with VersionLock: it
+// begins only when nobody holds the lock, and every release bumps the
+// version, so a read that validates overlapped no holder of either kind.
+class SharedVersionLock {
+ public:
+  bool ReadBegin(uint64_t *version) const {
+    *version = word_.load(std::memory_order_acquire);
+    return (*version & (kExclusive | kSharedMask)) == 0;
+  }
+
+  bool Validate(uint64_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return word_.load(std::memory_order_relaxed) == version;
+  }
+
+  // Takes the lock shared.  Waits only for an exclusive holder, never for
+  // other shared holders.
+  void LockShared() {
+    while (word_.fetch_add(kShared, std::memory_order_acquire) & kExclusive) {
+      word_.fetch_sub(kShared, std::memory_order_relaxed);
+      while (word_.load(std::memory_order_relaxed) & kExclusive) {
+        std::this_thread::yield();
+      }
+    }
+    // A reader that sees any of our writes must see the lock too.
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void UnlockShared() {
+    word_.fetch_add(kVersion - kShared, std::memory_order_release);
+  }
+
+  // Takes the lock exclusively, waiting for the other holders.  New shared
+  // holders wait once this has begun, so it can't be starved.
+  void Lock() {
+    while (true) {
+      uint64_t word = word_.load(std::memory_order_relaxed);
+      if (!(word & kExclusive) &&
+          word_.compare_exchange_weak(word, word | kExclusive,
+                                      std::memory_order_acquire)) {
+        break;
+      }
+      std::this_thread::yield();
+    }
+    while (word_.load(std::memory_order_acquire) & kSharedMask) {
+      std::this_thread::yield();
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void Unlock() {
+    word_.fetch_add(kVersion - kExclusive, std::memory_order_release);
+  }
+
+ private:
+  static constexpr uint64_t kExclusive = 1;
+  // The number of shared holders is in the bits from 1 to 23.
+  static constexpr uint64_t kShared = 2;
+  static constexpr uint64_t kSharedMask = (uint64_t{1} << 24) - kShared;
+  static constexpr uint64_t kVersion = uint64_t{1} << 24;
+
+  std::atomic<uint64_t> word_{0};
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class T, class Compare = std::less<>>
+class ConcurrentOrderStatisticMap {
+  template <class K>
+  using key_arg = typename cachelib_internal::KeyArg<
+      cachelib_internal::IsTransparent<Compare>::value>::template type<K, Key>;
+
+ public:
+  using key_type = Key;
+  using mapped_type = T;
+  using value_type = std::pair<const Key, T>;
+  using size_type = size_t;
+  using key_compare = Compare;
+
+  // The node sizes.  A leaf holds pointers to its elements.
+  static constexpr size_t kLeafCapacity = 32;
+  static constexpr size_t kFanout = 16;
+
+  // `max_threads` bounds the number of Handles that may exist at once.
+  explicit ConcurrentOrderStatisticMap(size_t max_threads = 128)
+      : reclaimer_(max_threads), root_(new Leaf) {}
+
+  // No Handles may exist.
+  ~ConcurrentOrderStatisticMap() { DeleteTree(root_.load()); }
+
+  ConcurrentOrderStatisticMap(const ConcurrentOrderStatisticMap &) = delete;
+  ConcurrentOrderStatisticMap &operator=(const ConcurrentOrderStatisticMap &) =
+      delete;
+
+  // A per-thread handle.  The reads return copies.
+  class Handle {
+   public:
+    explicit Handle(ConcurrentOrderStatisticMap *map)
+        : map_(map), reader_(&map->reclaimer_) {}
+    ~Handle() { map_->Retire(&retired_); }
+
+    Handle(const Handle &) = delete;
+    Handle &operator=(const Handle &) = delete;
+
+    size_t size() {
+      size_t size = 0;
+      Read([&] { return map_->Size(&size); });
+      return size;
+    }
+
+    // Returns the element with key equivalent to `k`, if any.
+    template <class K = Key>
+    std::optional<value_type> find(const key_arg<K> &k) {
+      std::optional<value_type> result;
+      Read([&] {
+        const value_type *found = nullptr;
+        if (!map_->Find(k, &found)) return false;
+        if (found != nullptr) result.emplace(*found);
+        return true;
+      });
+      return result;
+    }
+
+    template <class K = Key>
+    bool contains(const key_arg<K> &k) {
+      bool result = false;
+      Read([&] {
+        const value_type *found = nullptr;
+        if (!map_->Find(k, &found)) return false;
+        result = found != nullptr;
+        return true;
+      });
+      return result;
+    }
+
+    // Returns the number of elements with keys less than `k`.
+    template <class K = Key>
+    size_t rank(const key_arg<K> &k) {
+      size_t rank = 0;
+      Read([&] { return map_->Rank(k, &rank); });
+      return rank;
+    }
+
+    // Returns the element of rank `idx`, if any.
+    std::optional<value_type> select(size_t idx) {
+      std::optional<value_type> result;
+      Read([&] {
+        const value_type *found = nullptr;
+        if (!map_->Select(idx, &found)) return false;
+        if (found != nullptr) result.emplace(*found);
+        return true;
+      });
+      return result;
+    }
+
+    // Inserts `{k, v}`, or assigns `v` to the existing element with key `k`.
+    // Returns true iff the insertion happened.
+    bool insert_or_assign(Key k, T v) {
+      return Insert(new value_type(std::move(k), std::move(v)),
+                    /*assign=*/true);
+    }
+
+    // Inserts `value` unless an element with an equivalent key is present.
+    // Returns true iff the insertion happened.
+    bool insert(value_type value) {
+      return Insert(new value_type(std::move(value)), /*assign=*/false);
+    }
+
+    // Erases the element with key equivalent to `k`, if any.  Returns the
+    // number of elements erased (0 or 1).
+    template <class K = Key>
+    size_t erase(const key_arg<K> &k) {
+      size_t n_erased = 0;
+      bool emptied = false;
+      Write([&] { return map_->Erase(k, &retired_, &n_erased, &emptied); });
+      if (emptied) Write([&] { return map_->Prune(k, &retired_); });
+      return n_erased;
+    }
+
+   private:
+    // Runs `attempt` until it succeeds.  A reader that keeps failing makes
+    // new writers wait.
+    template <class Attempt>
+    void Read(Attempt attempt) {
+      EpochReclaimer::Guard guard = reader_.Pin();
+      size_t tries = 0;
+      while (!attempt()) {
+        if (++tries == kMaxReadTries) map_->starving_readers_.fetch_add(1);
+      }
+      if (tries >= kMaxReadTries) map_->starving_readers_.fetch_sub(1);
+    }
+
+    template <class Attempt>
+    void Write(Attempt attempt) {
+      {
+        EpochReclaimer::Guard guard = reader_.Pin();
+        do {
+          while (map_->starving_readers_.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+          }
+        } while (!attempt());
+      }
+      if (retired_.size() >= kRetireBatch) map_->Retire(&retired_);
+    }
+
+    // Takes ownership of `element`.
+    bool Insert(const value_type *element, bool assign) {
+      bool did_insert = false;
+      Write([&] {
+        return map_->Insert(element, assign, &retired_, &did_insert);
+      });
+      return did_insert;
+    }
+
+    ConcurrentOrderStatisticMap *map_;
+    EpochReclaimer::Reader reader_;
+    EpochReclaimer::Batch retired_;
+  };
+
+  key_compare key_comp() const { return lessthan_; }
+
+  //**************** Debugging and test support ****************
+
+  // Checks the structure and the counts, and that no leaf but a lone one is
+  // empty.  No other thread may be using the map.
+  void Check() const { CheckNode(root_.load(), nullptr, nullptr, true); }
+
+ private:
+  // How many times a read may start over before new writers have to wait.
+  static constexpr size_t kMaxReadTries = 8;
+  // How many objects a Handle collects before handing them to the reclaimer,
+  // and how many are handed over between calls to `EpochReclaimer::Collect()`,
+  // which has to look at every reader's slot.
+  static constexpr size_t kRetireBatch = 64;
+  static constexpr size_t kCollectThreshold = 1024;
+  // Enough for any number of elements that fits in memory: the root only
+  // splits when it has `kFanout` children.
+  static constexpr size_t kMaxHeight = 32;
+  // What the searches return when they notice that their reads were torn.
+  static constexpr size_t kTorn = ~size_t{0};
+
+  struct Node {
+    explicit Node(bool leaf) : leaf(leaf) {}
+    const bool leaf;
+    // Guards everything but the counts.
+    cachelib_internal::VersionLock lock;
+    // The number of elements in a leaf, or of children in an inner node.
+    std::atomic<size_t> size{0};
+  };
+
+  struct Leaf : Node {
+    Leaf() : Node(true) {}
+    // Sorted by key.
+    std::array<std::atomic<const value_type *>, kLeafCapacity> elements{};
+  };
+
+  struct Inner : Node {
+    Inner() : Node(false) {}
+    // Guards the counts.  Inserts and erases hold it shared while they add to
+    // the counts, and a writer that changes the children holds it
+    // exclusively.
+    cachelib_internal::SharedVersionLock count_lock;
+    // `children[i]` holds the keys `k` with `*pivots[i - 1] <= k <
+    // *pivots[i]`, of which there are `counts[i]`.  The pivots are owned by
+    // the node.
+    std::array<std::atomic<const Key *>, kFanout - 1> pivots{};
+    std::array<std::atomic<Node *>, kFanout> children{};
+    std::array<std::atomic<size_t>, kFanout> counts{};
+  };
+
+  // The nodes from the root down to a leaf, with their versions as seen on the
+  // way down, and the index of the child taken at each inner node.
+  struct Path {
+    Inner *inner(size_t d) const { return static_cast<Inner *>(nodes[d]); }
+    Leaf *leaf() const { return static_cast<Leaf *>(nodes[depth]); }
+
+    size_t depth;
+    std::array<Node *, kMaxHeight> nodes;
+    std::array<uint64_t, kMaxHeight> versions;
+    std::array<size_t, kMaxHeight> indexes;
+  };
+
+  // The locks a reader has read through, to validate at the end.
+  class ReadSet {
+   public:
+    void Add(const cachelib_internal::VersionLock *lock, uint64_t version) {
+      DCHECK_LT(n_locks_, locks_.size());
+      locks_[n_locks_++] = {lock, version};
+    }
+    void Add(const cachelib_internal::SharedVersionLock *lock,
+             uint64_t version) {
+      DCHECK_LT(n_count_locks_, count_locks_.size());
+      count_locks_[n_count_locks_++] = {lock, version};
+    }
+    bool Validate() const {
+      for (size_t i = 0; i < n_locks_; ++i) {
+        if (!locks_[i].first->Validate(locks_[i].second)) return false;
+      }
+      for (size_t i = 0; i < n_count_locks_; ++i) {
+        if (!count_locks_[i].first->Validate(count_locks_[i].second)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+   private:
+    size_t n_locks_ = 0;
+    std::array<std::pair<const cachelib_internal::VersionLock *, uint64_t>,
+               kMaxHeight>
+        locks_;
+    size_t n_count_locks_ = 0;
+    std::array<
+        std::pair<const cachelib_internal::SharedVersionLock *, uint64_t>,
+        kMaxHeight>
+        count_locks_;
+  };
+
+  //**************** Searching ****************
+
+  // Returns the index of the child of `n` (which has `size` children) that
+  // holds `k`, or `kTorn`.
+  template <class K>
+  size_t ChildIndex(const Inner *n, size_t size, const K &k) const {
+    size_t lo = 0, hi = size - 1;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      const Key *pivot = n->pivots[mid].load(std::memory_order_acquire);
+      if (pivot == nullptr) return kTorn;
+      if (lessthan_(k, *pivot)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo;
+  }
+
+  // Returns the index of the first of the `size` elements of `leaf` whose key
+  // isn't less than `k`, or `kTorn`.
+  template <class K>
+  size_t LeafLowerBound(const Leaf *leaf, size_t size, const K &k) const {
+    size_t lo = 0, hi = size;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      const value_type *e = leaf->elements[mid].load(std::memory_order_acquire);
+      if (e == nullptr) return kTorn;
+      if (lessthan_(e->first, k)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // Loads the root and begins reading it.  Returns nullptr if the reader must
+  // start over.
+  Node *ReadRoot(uint64_t *version) const {
+    Node *n = root_.load(std::memory_order_acquire);
+    if (!n->lock.ReadBegin(version)) return nullptr;
+    // The root may have split since we loaded it.
+    if (root_.load(std::memory_order_acquire) != n) return nullptr;
+    return n;
+  }
+
+  // Walks down to the leaf for `k`, filling in `path`.  With `split`, splits
+  // the first full node on the way instead and returns false.  Returns false
+  // if the caller must start over.
+  template <class K>
+  bool Descend(const K &k, bool split, Path *path) {
+    uint64_t version;
+    Node *n = ReadRoot(&version);
+    if (n == nullptr) return false;
+    for (size_t d = 0;; ++d) {
+      CHECK_LT(d, kMaxHeight);  // Crash OK
+      path->nodes[d] = n;
+      path->versions[d] = version;
+      size_t size = n->size.load(std::memory_order_relaxed);
+      if (split && size == (n->leaf ? kLeafCapacity : kFanout)) {
+        Split(*path, d);
+        return false;
+      }
+      if (n->leaf) {
+        path->depth = d;
+        return true;
+      }
+      if (size == 0 || size > kFanout) return false;
+      const Inner *inner = static_cast<const Inner *>(n);
+      size_t i = ChildIndex(inner, size, k);
+      if (i == kTorn) return false;
+      Node *child = inner->children[i].load(std::memory_order_acquire);
+      uint64_t child_version;
+      if (child == nullptr || !child->lock.ReadBegin(&child_version) ||
+          !n->lock.Validate(version)) {
+        return false;
+      }
+      path->indexes[d] = i;
+      n = child;
+      version = child_version;
+    }
+  }
+
+  //**************** Reading ****************
+
+  // The reads return false if the caller must start over.
+
+  bool Size(size_t *size) const {
+    uint64_t version;
+    const Node *n = ReadRoot(&version);
+    if (n == nullptr) return false;
+    size_t n_children = n->size.load(std::memory_order_relaxed);
+    if (n->leaf) {
+      *size = n_children;
+      return n->lock.Validate(version);
+    }
+    const Inner *inner = static_cast<const Inner *>(n);
+    uint64_t count_version;
+    if (!inner->count_lock.ReadBegin(&count_version)) return false;
+    if (n_children > kFanout) return false;
+    size_t count = 0;
+    for (size_t i = 0; i < n_children; ++i) {
+      count += inner->counts[i].load(std::memory_order_relaxed);
+    }
+    *size = count;
+    return inner->count_lock.Validate(count_version) &&
+           n->lock.Validate(version);
+  }
+
+  // Stores the element with key `k` (or nullptr) in `*found`.
+  template <class K>
+  bool Find(const K &k, const value_type **found) {
+    Path path;
+    if (!Descend(k, /*split=*/false, &path)) return false;
+    const Leaf *leaf = path.leaf();
+    size_t size = leaf->size.load(std::memory_order_relaxed);
+    if (size > kLeafCapacity) return false;
+    size_t i = LeafLowerBound(leaf, size, k);
+    if (i == kTorn) return false;
+    const value_type *e =
+        i < size ? leaf->elements[i].load(std::memory_order_acquire) : nullptr;
+    *found = e != nullptr && !lessthan_(k, e->first) ? e : nullptr;
+    return leaf->lock.Validate(path.versions[path.depth]);
+  }
+
+  // Stores the number of elements with keys less than `k` in `*rank`.  All
+  // the versions on the path, including those of the counts, are validated
+  // again at the end, so that the counts and the leaf are from one instant.
+  template <class K>
+  bool Rank(const K &k, size_t *rank) const {
+    ReadSet seen;
+    uint64_t version;
+    const Node *n = ReadRoot(&version);
+    if (n == nullptr) return false;
+    seen.Add(&n->lock, version);
+    size_t r = 0;
+    while (!n->leaf) {
+      const Inner *inner = static_cast<const Inner *>(n);
+      uint64_t count_version;
+      if (!inner->count_lock.ReadBegin(&count_version)) return false;
+      seen.Add(&inner->count_lock, count_version);
+      size_t size = n->size.load(std::memory_order_relaxed);
+      if (size == 0 || size > kFanout) return false;
+      size_t i = ChildIndex(inner, size, k);
+      if (i == kTorn) return false;
+      for (size_t j = 0; j < i; ++j) {
+        r += inner->counts[j].load(std::memory_order_relaxed);
+      }
+      const Node *child = inner->children[i].load(std::memory_order_acquire);
+      if (child == nullptr || !child->lock.ReadBegin(&version) ||
+          !seen.Validate()) {
+        return false;
+      }
+      seen.Add(&child->lock, version);
+      n = child;
+    }
+    const Leaf *leaf = static_cast<const Leaf *>(n);
+    size_t size = leaf->size.load(std::memory_order_relaxed);
+    if (size > kLeafCapacity) return false;
+    size_t i = LeafLowerBound(leaf, size, k);
+    if (i == kTorn) return false;
+    *rank = r + i;
+    return seen.Validate();
+  }
+
+  // Stores the element of rank `idx` (or nullptr) in `*found`.  Validates like
+  // `Rank()`.
+  bool Select(size_t idx, const value_type **found) const {
+    ReadSet seen;
+    uint64_t version;
+    const Node *n = ReadRoot(&version);
+    if (n == nullptr) return false;
+    seen.Add(&n->lock, version);
+    bool at_root = true;
+    while (!n->leaf) {
+      const Inner *inner = static_cast<const Inner *>(n);
+      uint64_t count_version;
+      if (!inner->count_lock.ReadBegin(&count_version)) return false;
+      seen.Add(&inner->count_lock, count_version);
+      size_t size = n->size.load(std::memory_order_relaxed);
+      if (size == 0 || size > kFanout) return false;
+      size_t i = 0;
+      for (; i < size; ++i) {
+        size_t count = inner->counts[i].load(std::memory_order_relaxed);
+        if (idx < count) break;
+        idx -= count;
+      }
+      if (i == size) {
+        // Past the end, which is only consistent at the root.
+        *found = nullptr;
+        return at_root && seen.Validate();
+      }
+      const Node *child = inner->children[i].load(std::memory_order_acquire);
+      if (child == nullptr || !child->lock.ReadBegin(&version) ||
+          !seen.Validate()) {
+        return false;
+      }
+      seen.Add(&child->lock, version);
+      n = child;
+      at_root = false;
+    }
+    const Leaf *leaf = static_cast<const Leaf *>(n);
+    size_t size = leaf->size.load(std::memory_order_relaxed);
+    if (size > kLeafCapacity) return false;
+    if (idx >= size) {
+      *found = nullptr;
+      return at_root && seen.Validate();
+    }
+    *found = leaf->elements[idx].load(std::memory_order_acquire);
+    return *found != nullptr && seen.Validate();
+  }
+
+  //**************** Writing ****************
+
+  // The writes return false if the caller must start over, having changed
+  // nothing.
+
+  // Inserts `element` or, with `assign`, replaces the element with its key.
+  // Takes ownership of `element` once it returns true.
+  bool Insert(const value_type *element, bool assign,
+              EpochReclaimer::Batch *retired, bool *did_insert) {
+    const Key &k = element->first;
+    Path path;
+    if (!Descend(k, /*split=*/true, &path)) return false;
+    Leaf *leaf = path.leaf();
+    if (!assign) {
+      // Most inserts of a key that's there need no lock.
+      const value_type *found = nullptr;
+      if (!ReadLeaf(path, k, nullptr, &found)) return false;
+      if (found != nullptr) {
+        delete element;
+        *did_insert = false;
+        return true;
+      }
+    }
+    if (!LockLeaf(path)) return false;
+    size_t size = leaf->size.load(std::memory_order_relaxed);
+    size_t i = 0;
+    const value_type *found = nullptr;
+    ReadLeaf(path, k, &i, &found);
+    if (found != nullptr) {
+      if (assign) {
+        leaf->elements[i].store(element, std::memory_order_release);
+        retired->Add(found);
+      } else {
+        delete element;
+      }
+      leaf->lock.Unlock();
+      *did_insert = false;
+      return true;
+    }
+    if (size == kLeafCapacity || !LockCounts(&path)) {
+      // If the leaf filled up while we waited for it, the next descent splits
+      // it.
+      leaf->lock.Unlock();
+      return false;
+    }
+    for (size_t j = size; j > i; --j) {
+      leaf->elements[j].store(
+          leaf->elements[j - 1].load(std::memory_order_relaxed),
+          std::memory_order_release);
+    }
+    leaf->elements[i].store(element, std::memory_order_release);
+    leaf->size.store(size + 1, std::memory_order_relaxed);
+    AddToCounts(path, 1);
+    UnlockCounts(path, 0);
+    leaf->lock.Unlock();
+    *did_insert = true;
+    return true;
+  }
+
+  // Erases the element with key `k`, if any.  Sets `*emptied` if that leaves
+  // a leaf below the root empty.
+  template <class K>
+  bool Erase(const K &k, EpochReclaimer::Batch *retired, size_t *n_erased,
+             bool *emptied) {
+    Path path;
+    if (!Descend(k, /*split=*/false, &path)) return false;
+    Leaf *leaf = path.leaf();
+    const value_type *found = nullptr;
+    if (!ReadLeaf(path, k, nullptr, &found)) return false;
+    if (found == nullptr) {
+      *n_erased = 0;
+      return true;
+    }
+    if (!LockLeaf(path)) return false;
+    size_t size = leaf->size.load(std::memory_order_relaxed);
+    size_t i = 0;
+    ReadLeaf(path, k, &i, &found);
+    if (found == nullptr) {
+      leaf->lock.Unlock();
+      *n_erased = 0;
+      return true;
+    }
+    if (!LockCounts(&path)) {
+      leaf->lock.Unlock();
+      return false;
+    }
+    for (size_t j = i; j + 1 < size; ++j) {
+      leaf->elements[j].store(
+          leaf->elements[j + 1].load(std::memory_order_relaxed),
+          std::memory_order_release);
+    }
+    leaf->elements[size - 1].store(nullptr, std::memory_order_relaxed);
+    leaf->size.store(size - 1, std::memory_order_relaxed);
+    AddToCounts(path, -1);
+    UnlockCounts(path, 0);
+    leaf->lock.Unlock();
+    retired->Add(found);
+    *n_erased = 1;
+    *emptied = size == 1 && path.depth > 0;
+    return true;
+  }
+
+  // Searches the leaf at the end of `path` for `k`, storing the element (or
+  // nullptr) in `*found` and, if `index` isn't null, its index (or where it
+  // would go) in `*index`.  Returns false if the reads may have been torn,
+  // which the caller ignores if it holds the leaf's lock.
+  template <class K>
+  bool ReadLeaf(const Path &path, const K &k, size_t *index,
+                const value_type **found) const {
+    const Leaf *leaf = path.leaf();
+    size_t size = leaf->size.load(std::memory_order_relaxed);
+    if (size > kLeafCapacity) return false;
+    size_t i = LeafLowerBound(leaf, size, k);
+    if (i == kTorn) return false;
+    const value_type *e =
+        i < size ? leaf->elements[i].load(std::memory_order_acquire) : nullptr;
+    *found = e != nullptr && !lessthan_(k, e->first) ? e : nullptr;
+    if (index != nullptr) *index = i;
+    return leaf->lock.Validate(path.versions[path.depth]);
+  }
+
+  // Locks the leaf at the end of `path`, waiting for any other writer, and
+  // checks that it's still the leaf for the keys that led there.  (It is if
+  // its parent hasn't changed, since splitting or removing it would have
+  // changed the parent.)
+  bool LockLeaf(const Path &path) {
+    Leaf *leaf = path.leaf();
+    if (!leaf->lock.Lock()) return false;
+    bool still_there =
+        path.depth == 0
+            ? root_.load(std::memory_order_acquire) == leaf
+            : path.nodes[path.depth - 1]->lock.Validate(
+                  path.versions[path.depth - 1]);
+    if (!still_there) leaf->lock.Unlock();
+    return still_there;
+  }
+
+  // Takes the count locks of the inner nodes on `path` shared, from the bottom
+  // up, waiting only for writers that change children, and checks that each
+  // still has the next node on the path as a child (updating the indexes if
+  // splits moved it).  Writers that change an inner node's children hold its
+  // count lock exclusively, so the path is then fixed.  Returns false, holding
+  // none of the count locks, if the path has changed.
+  bool LockCounts(Path *path) {
+    for (size_t d = path->depth; d-- > 0;) {
+      Inner *n = path->inner(d);
+      Node *child = path->nodes[d + 1];
+      n->count_lock.LockShared();
+      size_t size = n->size.load(std::memory_order_relaxed);
+      size_t i = path->indexes[d];
+      if (i >= size ||
+          n->children[i].load(std::memory_order_relaxed) != child) {
+        for (i = 0; i < size; ++i) {
+          if (n->children[i].load(std::memory_order_relaxed) == child) break;
+        }
+        if (i == size) {
+          UnlockCounts(*path, d);
+          return false;
+        }
+        path->indexes[d] = i;
+      }
+    }
+    if (root_.load(std::memory_order_acquire) != path->nodes[0]) {
+      UnlockCounts(*path, 0);
+      return false;
+    }
+    return true;
+  }
+
+  // Releases the count locks of the inner nodes on `path` from depth `from`
+  // down.
+  static void UnlockCounts(const Path &path, size_t from) {
+    for (size_t d = from; d < path.depth; ++d) {
+      path.inner(d)->count_lock.UnlockShared();
+    }
+  }
+
+  // Other writers may be adding to the same counts.
+  static void AddToCounts(const Path &path, ptrdiff_t delta) {
+    for (size_t d = 0; d < path.depth; ++d) {
+      path.inner(d)->counts[path.indexes[d]].fetch_add(
+          delta, std::memory_order_relaxed);
+    }
+  }
+
+  //**************** Restructuring ****************
+
+  // The number of elements under `n`, whose count lock (if it has one) the
+  // caller holds.
+  static size_t Count(const Node *n) {
+    size_t size = n->size.load(std::memory_order_relaxed);
+    if (n->leaf) return size;
+    const Inner *inner = static_cast<const Inner *>(n);
+    size_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+      count += inner->counts[i].load(std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+  // Splits the full node at depth `d` of `path`, unless it or its parent has
+  // changed since the descent.  Either way the caller starts over.  The
+  // descent splits full nodes on the way down, so the parent has room.
+  void Split(const Path &path, size_t d) {
+    Node *n = path.nodes[d];
+    Inner *parent = d > 0 ? path.inner(d - 1) : nullptr;
+    if (parent != nullptr && !parent->lock.TryLock(path.versions[d - 1])) {
+      return;
+    }
+    if (!n->lock.TryLock(path.versions[d])) {
+      if (parent != nullptr) parent->lock.Unlock();
+      return;
+    }
+    Inner *inner = n->leaf ? nullptr : static_cast<Inner *>(n);
+    if (inner != nullptr) inner->count_lock.Lock();
+    if (parent == nullptr) {
+      // Grow the tree by a level.  The new root isn't reachable yet.
+      parent = new Inner;
+      parent->lock.TryLock(0);
+      parent->children[0].store(n, std::memory_order_relaxed);
+      parent->counts[0].store(Count(n), std::memory_order_relaxed);
+      parent->size.store(1, std::memory_order_relaxed);
+      SplitChild(parent, 0);
+      root_.store(parent, std::memory_order_release);
+    } else {
+      parent->count_lock.Lock();
+      SplitChild(parent, path.indexes[d - 1]);
+      parent->count_lock.Unlock();
+    }
+    if (inner != nullptr) inner->count_lock.Unlock();
+    n->lock.Unlock();
+    parent->lock.Unlock();
+  }
+
+  // Moves the upper half of the full child `i` of `p` to a new sibling.  The
+  // caller holds the locks and count locks of both.
+  void SplitChild(Inner *p, size_t i) {
+    constexpr auto kRelaxed = std::memory_order_relaxed;
+    constexpr auto kRelease = std::memory_order_release;
+    Node *n = p->children[i].load(kRelaxed);
+    size_t size = n->size.load(kRelaxed);
+    size_t half = size / 2;
+    Node *sibling;
+    const Key *separator;
+    if (n->leaf) {
+      Leaf *leaf = static_cast<Leaf *>(n);
+      Leaf *right = new Leaf;
+      for (size_t j = half; j < size; ++j) {
+        right->elements[j - half].store(leaf->elements[j].load(kRelaxed),
+                                        kRelease);
+        leaf->elements[j].store(nullptr, kRelaxed);
+      }
+      right->size.store(size - half, kRelaxed);
+      separator = new Key(right->elements[0].load(kRelaxed)->first);
+      sibling = right;
+    } else {
+      Inner *inner = static_cast<Inner *>(n);
+      Inner *right = new Inner;
+      for (size_t j = half; j < size; ++j) {
+        right->children[j - half].store(inner->children[j].load(kRelaxed),
+                                        kRelease);
+        right->counts[j - half].store(inner->counts[j].load(kRelaxed),
+                                      kRelaxed);
+        inner->children[j].store(nullptr, kRelaxed);
+        inner->counts[j].store(0, kRelaxed);
+        if (j > half) {
+          right->pivots[j - half - 1].store(
+              inner->pivots[j - 1].load(kRelaxed), kRelease);
+          inner->pivots[j - 1].store(nullptr, kRelaxed);
+        }
+      }
+      right->size.store(size - half, kRelaxed);
+      separator = inner->pivots[half - 1].load(kRelaxed);
+      inner->pivots[half - 1].store(nullptr, kRelaxed);
+      sibling = right;
+    }
+    n->size.store(half, kRelaxed);
+    size_t p_size = p->size.load(kRelaxed);
+    for (size_t j = p_size; j > i + 1; --j) {
+      p->children[j].store(p->children[j - 1].load(kRelaxed), kRelease);
+      p->counts[j].store(p->counts[j - 1].load(kRelaxed), kRelaxed);
+      p->pivots[j - 1].store(p->pivots[j - 2].load(kRelaxed), kRelease);
+    }
+    size_t sibling_count = Count(sibling);
+    p->pivots[i].store(separator, std::memory_order_release);
+    p->counts[i].store(p->counts[i].load(kRelaxed) - sibling_count, kRelaxed);
+    p->counts[i + 1].store(sibling_count, kRelaxed);
+    p->children[i + 1].store(sibling, std::memory_order_release);
+    p->size.store(p_size + 1, kRelaxed);
+  }
+
+  // Removes the empty leaf for `k`, if there is one, along with the ancestors
+  // that have no other child.  The root and its only children stay.
+  template <class K>
+  bool Prune(const K &k, EpochReclaimer::Batch *retired) {
+    constexpr auto kRelaxed = std::memory_order_relaxed;
+    constexpr auto kRelease = std::memory_order_release;
+    Path path;
+    if (!Descend(k, /*split=*/false, &path)) return false;
+    size_t depth = path.depth;
+    if (path.leaf()->size.load(kRelaxed) != 0) return true;
+    // Remove the subtree from `top` down.
+    size_t top = depth;
+    while (top > 1 && path.nodes[top - 1]->size.load(kRelaxed) == 1) --top;
+    if (top == 0 || path.nodes[top - 1]->size.load(kRelaxed) < 2) return true;
+    // Locking with the versions from the descent makes the sizes we just read
+    // consistent.
+    size_t locked = top - 1;
+    for (; locked <= depth; ++locked) {
+      if (!path.nodes[locked]->lock.TryLock(path.versions[locked])) break;
+    }
+    if (locked <= depth) {
+      for (size_t d = top - 1; d < locked; ++d) path.nodes[d]->lock.Unlock();
+      return false;
+    }
+    Inner *parent = path.inner(top - 1);
+    parent->count_lock.Lock();
+    size_t i = path.indexes[top - 1];
+    size_t size = parent->size.load(kRelaxed);
+    DCHECK_EQ(parent->counts[i].load(kRelaxed), 0u);
+    size_t pivot = i > 0 ? i - 1 : 0;
+    retired->Add(parent->pivots[pivot].load(kRelaxed));
+    for (size_t j = pivot; j + 2 < size; ++j) {
+      parent->pivots[j].store(parent->pivots[j + 1].load(kRelaxed), kRelease);
+    }
+    parent->pivots[size - 2].store(nullptr, kRelaxed);
+    for (size_t j = i; j + 1 < size; ++j) {
+      parent->children[j].store(parent->children[j + 1].load(kRelaxed),
+                                kRelease);
+      parent->counts[j].store(parent->counts[j + 1].load(kRelaxed), kRelaxed);
+    }
+    parent->children[size - 1].store(nullptr, kRelaxed);
+    parent->counts[size - 1].store(0, kRelaxed);
+    parent->size.store(size - 1, kRelaxed);
+    parent->count_lock.Unlock();
+    parent->lock.Unlock();
+    for (size_t d = top; d <= depth; ++d) {
+      path.nodes[d]->lock.UnlockObsolete();
+      if (d < depth) {
+        retired->Add(path.inner(d));
+      } else {
+        retired->Add(path.leaf());
+      }
+    }
+    return true;
+  }
+
+  //**************** Memory ****************
+
+  // Hands `batch` to the reclaimer, collecting every so often.
+  void Retire(EpochReclaimer::Batch *batch) {
+    size_t n = batch->size();
+    if (n == 0) return;
+    reclaimer_.Retire(batch);
+    if (retired_since_collect_.fetch_add(n, std::memory_order_relaxed) + n >=
+        kCollectThreshold) {
+      retired_since_collect_.store(0, std::memory_order_relaxed);
+      reclaimer_.Collect();
+    }
+  }
+
+  static void DeleteTree(Node *n) {
+    size_t size = n->size.load();
+    if (n->leaf) {
+      Leaf *leaf = static_cast<Leaf *>(n);
+      for (size_t i = 0; i < size; ++i) delete leaf->elements[i].load();
+      delete leaf;
+      return;
+    }
+    Inner *inner = static_cast<Inner *>(n);
+    for (size_t i = 0; i < size; ++i) {
+      DeleteTree(inner->children[i].load());
+      if (i > 0) delete inner->pivots[i - 1].load();
+    }
+    delete inner;
+  }
+
+  //**************** Checking ****************
+
+  // Checks the subtree, whose keys must be in `[lo, hi)` (where nullptr is
+  // unbounded), and returns the number of elements in it.  `alone` says
+  // whether every ancestor has just the one child.
+  size_t CheckNode(const Node *n, const Key *lo, const Key *hi,
+                   bool alone) const {
+    auto in_range = [&](const Key &k) {
+      return (lo == nullptr || !lessthan_(k, *lo)) &&
+             (hi == nullptr || lessthan_(k, *hi));
+    };
+    uint64_t version;
+    CHECK(n->lock.ReadBegin(&version));  // Crash OK
+    size_t size = n->size.load();
+    if (n->leaf) {
+      const Leaf *leaf = static_cast<const Leaf *>(n);
+      CHECK_LE(size, kLeafCapacity);  // Crash OK
+      CHECK(size > 0 || alone);       // Crash OK
+      for (size_t i = 0; i < size; ++i) {
+        const value_type *e = leaf->elements[i].load();
+        CHECK(e != nullptr);        // Crash OK
+        CHECK(in_range(e->first));  // Crash OK
+        if (i > 0) {
+          CHECK(lessthan_(leaf->elements[i - 1].load()->first,  // Crash OK
+                          e->first));
+        }
+      }
+      return size;
+    }
+    const Inner *inner = static_cast<const Inner *>(n);
+    CHECK(inner->count_lock.ReadBegin(&version));  // Crash OK
+    CHECK_GE(size, 1u);                            // Crash OK
+    CHECK_LE(size, kFanout);                       // Crash OK
+    size_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+      const Key *child_lo = i == 0 ? lo : inner->pivots[i - 1].load();
+      const Key *child_hi = i + 1 == size ? hi : inner->pivots[i].load();
+      CHECK(child_lo == lo || in_range(*child_lo));  // Crash OK
+      if (i > 0 && child_hi != hi) {
+        CHECK(lessthan_(*child_lo, *child_hi));  // Crash OK
+      }
+      size_t child_count = CheckNode(inner->children[i].load(), child_lo,
+                                     child_hi, alone && size == 1);
+      CHECK_EQ(inner->counts[i].load(), child_count);  // Crash OK
+      count += child_count;
+    }
+    return count;
+  }
+
+  EpochReclaimer reclaimer_;
+  std::atomic<Node *> root_;
+  key_compare lessthan_;
+  // The number of readers that have started over too many times.
+  std::atomic<size_t> starving_readers_{0};
+  std::atomic<size_t> retired_since_collect_{0};
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_CONCURRENT_ORDER_STATISTIC_MAP_H_
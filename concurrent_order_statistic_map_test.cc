@@ -0,0 +1,264 @@
+#include "concurrent_order_statistic_map.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::Optional;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class ConcurrentOrderStatisticMap<size_t, size_t>;
+template class ConcurrentOrderStatisticMap<std::string, std::string>;
+
+TEST(ConcurrentOrderStatisticMapTest, Basic) {
+  ConcurrentOrderStatisticMap<size_t, std::string> map;
+  ConcurrentOrderStatisticMap<size_t, std::string>::Handle handle(&map);
+  EXPECT_EQ(handle.size(), 0);
+  EXPECT_TRUE(handle.insert_or_assign(2, "b"));
+  EXPECT_TRUE(handle.insert({1, "a"}));
+  EXPECT_FALSE(handle.insert({1, "x"}));
+  EXPECT_FALSE(handle.insert_or_assign(2, "bb"));
+  EXPECT_THAT(handle.find(1), Optional(Pair(1, "a")));
+  EXPECT_THAT(handle.find(2), Optional(Pair(2, "bb")));
+  EXPECT_THAT(handle.select(1), Optional(Pair(2, "bb")));
+  EXPECT_EQ(handle.rank(2), 1);
+  EXPECT_EQ(handle.erase(1), 1);
+  EXPECT_EQ(handle.erase(1), 0);
+  EXPECT_EQ(handle.size(), 1);
+  map.Check();
+}
+
+// Shared holders don't exclude each other, but any hold makes a read fail
+// validation, and an exclusive holder waits for the shared ones.
+TEST(ConcurrentOrderStatisticMapTest, SharedVersionLock) {
+  cachelib_internal::SharedVersionLock lock;
+  uint64_t version;
+  ASSERT_TRUE(lock.ReadBegin(&version));
+  lock.LockShared();
+  lock.LockShared();
+  uint64_t held;
+  EXPECT_FALSE(lock.ReadBegin(&held));
+  lock.UnlockShared();
+  EXPECT_FALSE(lock.ReadBegin(&held));
+  std::atomic<bool> exclusive = false;
+  std::thread writer([&lock, &exclusive] {
+    lock.Lock();
+    exclusive = true;
+    lock.Unlock();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_FALSE(exclusive);
+  lock.UnlockShared();
+  writer.join();
+  EXPECT_TRUE(exclusive);
+  EXPECT_FALSE(lock.Validate(version));
+  ASSERT_TRUE(lock.ReadBegin(&version));
+  EXPECT_TRUE(lock.Validate(version));
+}
+
+// Many writers insert and erase keys from overlapping (adjacent) ranges while
+// readers look them up.  Each writer owns the keys congruent to its index (and
+// writes values congruent to it too, so that readers can tell whose element
+// they got), so at the end we can compare against what each writer thinks it
+// did.
+TEST(ConcurrentOrderStatisticMapTest, Stress) {
+  constexpr size_t kWriters = 8;
+  constexpr size_t kReaders = 2;
+  constexpr size_t kOpsPerWriter = 5000;
+  constexpr size_t kKeysPerWriter = 300;
+  using Map = ConcurrentOrderStatisticMap<size_t, size_t>;
+  Map map;
+  std::vector<std::map<size_t, size_t>> expected(kWriters);
+  std::atomic<size_t> writers_done = 0;
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < kWriters; ++w) {
+    threads.emplace_back([&map, &expected, &writers_done, w] {
+      Map::Handle handle(&map);
+      absl::BitGen bitgen;
+      std::map<size_t, size_t> &mine = expected[w];
+      for (size_t i = 0; i < kOpsPerWriter; ++i) {
+        size_t k =
+            absl::Uniform<size_t>(bitgen, 0, kKeysPerWriter) * kWriters + w;
+        size_t v = i * kWriters + w;
+        if (absl::Bernoulli(bitgen, 0.6)) {
+          EXPECT_EQ(handle.insert_or_assign(k, v),
+                    mine.insert_or_assign(k, v).second);
+        } else {
+          EXPECT_EQ(handle.erase(k), mine.erase(k));
+        }
+        // Our own writes are visible to us immediately.
+        EXPECT_EQ(handle.contains(k), mine.count(k) == 1);
+      }
+      writers_done.fetch_add(1);
+    });
+  }
+  for (size_t r = 0; r < kReaders; ++r) {
+    threads.emplace_back([&map, &writers_done] {
+      Map::Handle handle(&map);
+      absl::BitGen bitgen;
+      while (writers_done.load() < kWriters) {
+        size_t k = absl::Uniform<size_t>(bitgen, 0, kKeysPerWriter * kWriters);
+        if (auto e = handle.find(k)) {
+          EXPECT_EQ(e->first, k);
+          EXPECT_EQ(e->second % kWriters, k % kWriters);
+        }
+        size_t size = handle.size();
+        EXPECT_LE(size, kKeysPerWriter * kWriters);
+        size_t i = absl::Uniform<size_t>(bitgen, 0, size + 1);
+        if (auto e = handle.select(i)) {
+          EXPECT_EQ(e->second % kWriters, e->first % kWriters);
+        }
+        EXPECT_LE(handle.rank(k), kKeysPerWriter * kWriters);
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+  map.Check();
+  std::map<size_t, size_t> all;
+  for (const auto &mine : expected) all.insert(mine.begin(), mine.end());
+  Map::Handle handle(&map);
+  ASSERT_EQ(handle.size(), all.size());
+  size_t rank = 0;
+  for (const auto &[k, v] : all) {
+    EXPECT_THAT(handle.select(rank), Optional(Pair(k, v)));
+    EXPECT_EQ(handle.rank(k), rank);
+    ++rank;
+  }
+  EXPECT_EQ(handle.select(rank), std::nullopt);
+}
+
+// Writers only insert, so each reader's successive results must move one way:
+// the size and the rank of a fixed key never go down, the key of a fixed rank
+// never goes up, and a key keeps at least the rank it was selected at.  A
+// `rank` or `select` that read counts and leaves from different instants would
+// break these.
+TEST(ConcurrentOrderStatisticMapTest, Linearizable) {
+  constexpr size_t kWriters = 6;
+  constexpr size_t kReaders = 2;
+  constexpr size_t kOpsPerWriter = 4000;
+  constexpr size_t kKeyRange = 1 << 20;
+  constexpr size_t kProbeRank = 100;
+  using Map = ConcurrentOrderStatisticMap<size_t, size_t>;
+  Map map;
+  std::atomic<size_t> inserted = 0;
+  std::atomic<size_t> writers_done = 0;
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < kWriters; ++w) {
+    threads.emplace_back([&map, &inserted, &writers_done, w] {
+      Map::Handle handle(&map);
+      absl::BitGen bitgen;
+      for (size_t i = 0; i < kOpsPerWriter; ++i) {
+        size_t k = absl::Uniform<size_t>(bitgen, 0, kKeyRange) * kWriters + w;
+        if (handle.insert({k, k})) inserted.fetch_add(1);
+        EXPECT_TRUE(handle.contains(k));
+      }
+      writers_done.fetch_add(1);
+    });
+  }
+  for (size_t r = 0; r < kReaders; ++r) {
+    threads.emplace_back([&map, &writers_done, r] {
+      Map::Handle handle(&map);
+      const size_t probe = (r + 1) * kKeyRange * kWriters / (kReaders + 1);
+      size_t last_size = 0;
+      size_t last_rank = 0;
+      std::optional<size_t> last_selected;
+      while (writers_done.load() < kWriters) {
+        size_t size = handle.size();
+        EXPECT_GE(size, last_size);
+        last_size = size;
+        size_t rank = handle.rank(probe);
+        EXPECT_GE(rank, last_rank);
+        last_rank = rank;
+        EXPECT_LE(rank, handle.size());
+        auto e = handle.select(kProbeRank);
+        if (last_selected.has_value()) {
+          ASSERT_TRUE(e.has_value());
+          EXPECT_LE(e->first, *last_selected);
+        }
+        if (e.has_value()) {
+          EXPECT_EQ(e->first, e->second);
+          EXPECT_GE(handle.rank(e->first), size_t{kProbeRank});
+          last_selected = e->first;
+        }
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+  map.Check();
+  Map::Handle handle(&map);
+  EXPECT_EQ(handle.size(), inserted.load());
+}
+
+// Each writer keeps a sliding window of its most recent keys, so leaves keep
+// emptying out behind the writers.  `Check()` verifies that they were removed.
+TEST(ConcurrentOrderStatisticMapTest, SlidingWindow) {
+  constexpr size_t kWriters = 4;
+  constexpr size_t kOpsPerWriter = 5000;
+  constexpr size_t kWindow = 200;
+  using Map = ConcurrentOrderStatisticMap<size_t, size_t>;
+  Map map;
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < kWriters; ++w) {
+    threads.emplace_back([&map, w] {
+      Map::Handle handle(&map);
+      for (size_t i = 0; i < kOpsPerWriter; ++i) {
+        EXPECT_TRUE(handle.insert_or_assign(i * kWriters + w, i));
+        if (i >= kWindow) {
+          EXPECT_EQ(handle.erase((i - kWindow) * kWriters + w), 1);
+        }
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+  map.Check();
+  Map::Handle handle(&map);
+  EXPECT_EQ(handle.size(), kWriters * kWindow);
+  size_t first = (kOpsPerWriter - kWindow) * kWriters;
+  EXPECT_THAT(handle.select(0), Optional(Pair(first, kOpsPerWriter - kWindow)));
+  EXPECT_EQ(handle.rank(first), 0);
+  for (size_t k = first; k < kOpsPerWriter * kWriters; ++k) {
+    EXPECT_EQ(handle.erase(k), 1);
+  }
+  EXPECT_EQ(handle.size(), 0);
+  map.Check();
+}
+
+// All the writers append adjacent keys (like timestamps from a shared clock),
+// which is the case that sharding doesn't help with.
+TEST(ConcurrentOrderStatisticMapTest, AdjacentAppends) {
+  constexpr size_t kWriters = 8;
+  constexpr size_t kOpsPerWriter = 2000;
+  using Map = ConcurrentOrderStatisticMap<size_t, size_t>;
+  Map map;
+  std::atomic<size_t> clock = 0;
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < kWriters; ++w) {
+    threads.emplace_back([&map, &clock] {
+      Map::Handle handle(&map);
+      for (size_t i = 0; i < kOpsPerWriter; ++i) {
+        size_t now = clock.fetch_add(1);
+        EXPECT_TRUE(handle.insert_or_assign(now, now));
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+  map.Check();
+  Map::Handle handle(&map);
+  EXPECT_EQ(handle.size(), kWriters * kOpsPerWriter);
+  EXPECT_THAT(handle.select(1234), Optional(Pair(1234, 1234)));
+  EXPECT_EQ(handle.rank(1234), 1234);
+}
+
+}  // namespace cachelib
@@ -0,0 +1,362 @@
+// A DensePrefixSumMap is a PrefixSumMap specialized for keys that are small
+// unsigned integers (e.g., bucket ids in `[0, 2^20)`).
+//
+// Instead of a tree of nodes, it keeps an array of mapped values indexed by
+// key, a Fenwick tree (binary indexed tree) of those values for the prefix
+// sums, and a presence bitmap with a Fenwick tree of the per-word popcounts for
+// rank and select.  Every operation is O(log U), where U is the size of the key
+// range, with no pointer chasing and no allocation except when the range
+// grows, and the memory is about two `T`s and one bit per possible key.
+//
+// The key range grows (by doubling) as larger keys are inserted.  If a key
+// would make the array too large for the number of elements (more than
+// `kMaxKeysPerElement` possible keys per element, beyond a floor of
+// `kMinDenseKeys`), or at least `max_dense_keys`, the map moves its elements
+// into a PrefixSumMap.  Whenever the sparse map's size reaches a power of two,
+// it moves back if the array would fit again.  The answers are the same
+// either way.
+//
+// The interface follows PrefixSumMap, except that there are no iterators:
+// `find()` and `select()` return copies of the elements.
+//
+// `T` must support `+` and `-` (a Fenwick tree updates a value by adding the
+// difference).  For unsigned types the intermediate differences wrap around,
+// which gives the right answer.
+//
+// Example:
+//
+//   DensePrefixSumMap<uint32_t, uint64_t> bytes_by_bucket;
+//   bytes_by_bucket.insert_or_assign(bucket, bytes);
+//   uint64_t bytes_in_first_half =
+//       bytes_by_bucket.SumFirstN(bytes_by_bucket.size() / 2);
+
+#ifndef NET_BANDAID_BDN_CACHELIB_DENSE_PREFIX_SUM_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_DENSE_PREFIX_SUM_MAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/numeric/bits.h"
+#include "prefix_sum_map.h"
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// A Fenwick tree over `n` values, all initially zero.
+template <class T>
+class FenwickTree {
+ public:
+  FenwickTree() = default;
+
+  // Builds the tree over `values` in O(n) time.
+  explicit FenwickTree(const std::vector<T> &values)
+      : tree_(values.size() + 1) {
+    for (size_t i = 1; i < tree_.size(); ++i) {
+      tree_[i] = tree_[i] + values[i - 1];
+      size_t parent = i + LowBit(i);
+      if (parent < tree_.size()) tree_[parent] = tree_[parent] + tree_[i];
+    }
+  }
+
+  size_t size() const { return tree_.empty() ? 0 : tree_.size() - 1; }
+
+  // Adds `delta` to the value at `i`.
+  void Add(size_t i, const T &delta) {
+    for (++i; i < tree_.size(); i += LowBit(i)) tree_[i] = tree_[i] + delta;
+  }
+
+  // Returns the sum of the first `n` values.
+  T PrefixSum(size_t n) const {
+    T sum{};
+    for (; n > 0; n -= LowBit(n)) sum = sum + tree_[n];
+    return sum;
+  }
+
+  // For nonnegative values: Returns the largest `n` such that the sum of the
+  // first `n` values is at most `x`, and subtracts that sum from `*x`.
+  size_t FindPrefix(T *x) const {
+    size_t n = 0;
+    for (size_t step = absl::bit_floor(size()); step > 0; step >>= 1) {
+      if (n + step < tree_.size() && !(*x < tree_[n + step])) {
+        n += step;
+        *x = *x - tree_[n];
+      }
+    }
+    return n;
+  }
+
+ private:
+  static size_t LowBit(size_t i) { return i & (~i + 1); }
+
+  // `tree_[i]` is the sum of the `LowBit(i)` values ending at `i - 1`.
+  std::vector<T> tree_;
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class T>
+class DensePrefixSumMap {
+  static_assert(std::is_unsigned_v<Key>,
+                "DensePrefixSumMap needs an unsigned integer key");
+
+ public:
+  using key_type = Key;
+  using mapped_type = T;
+  using value_type = std::pair<const Key, T>;
+  using size_type = std::size_t;
+
+  // The dense array always may span `kMinDenseKeys` keys, and beyond that up
+  // to `kMaxKeysPerElement` keys per element.
+  static constexpr size_t kMinDenseKeys = 4096;
+  static constexpr size_t kMaxKeysPerElement = 16;
+
+  // Only keys below `max_dense_keys` are kept in the dense representation.
+  explicit DensePrefixSumMap(size_t max_dense_keys = size_t{1} << 22)
+      : max_dense_keys_(max_dense_keys) {}
+
+  //**************** Observers ****************
+
+  size_t size() const { return dense_ ? size_ : sparse_.size(); }
+  bool empty() const { return size() == 0; }
+
+  // Whether the map is in the dense representation.
+  bool is_dense() const { return dense_; }
+
+  // Returns a copy of the element with key `k`, if any.
+  std::optional<value_type> find(Key k) const {
+    std::optional<value_type> result;
+    if (dense_) {
+      if (Present(k)) result.emplace(k, values_[k]);
+    } else if (auto it = sparse_.find(k); it != sparse_.end()) {
+      result.emplace(*it);
+    }
+    return result;
+  }
+
+  bool contains(Key k) const {
+    return dense_ ? Present(k) : sparse_.contains(k);
+  }
+
+  // Returns the number of elements with keys less than `k`.
+  size_t rank(Key k) const {
+    if (!dense_) return sparse_.lower_bound(k).rank();
+    if (k >= capacity()) return size_;
+    size_t word = k / kBitsPerWord;
+    uint64_t below = bits_[word] & ((uint64_t{1} << (k % kBitsPerWord)) - 1);
+    return counts_.PrefixSum(word) + absl::popcount(below);
+  }
+
+  // Returns a copy of the element of rank `idx`, if there is one.
+  std::optional<value_type> select(size_t idx) const {
+    std::optional<value_type> result;
+    if (idx >= size()) return result;
+    if (dense_) {
+      Key k = SelectKey(idx);
+      result.emplace(k, values_[k]);
+    } else {
+      result.emplace(*sparse_.select(idx));
+    }
+    return result;
+  }
+
+  // Returns the sum of the mapped values of the first `n` elements.
+  T SumFirstN(size_t n) const {
+    if (!dense_) return sparse_.SumFirstN(n);
+    if (n >= size_) return sums_.PrefixSum(capacity());
+    return sums_.PrefixSum(SelectKey(n));
+  }
+
+  //**************** Mutators ****************
+
+  // Inserts `{k, v}`, or assigns `v` to the existing element with key `k`.
+  // Returns true iff the insertion happened.
+  bool insert_or_assign(Key k, T v) {
+    if (dense_ && k >= capacity()) Grow(k);
+    if (!dense_) {
+      bool inserted = sparse_.insert_or_assign(k, std::move(v)).second;
+      if (inserted) MaybeMakeDense();
+      return inserted;
+    }
+    if (Present(k)) {
+      sums_.Add(k, v - values_[k]);
+      values_[k] = std::move(v);
+      return false;
+    }
+    bits_[k / kBitsPerWord] |= Bit(k);
+    counts_.Add(k / kBitsPerWord, 1);
+    sums_.Add(k, v);
+    values_[k] = std::move(v);
+    ++size_;
+    return true;
+  }
+
+  // Erases the element with key `k`, if any.  Returns the number erased.
+  size_t erase(Key k) {
+    if (!dense_) return sparse_.erase(k);
+    if (!Present(k)) return 0;
+    bits_[k / kBitsPerWord] &= ~Bit(k);
+    // The counts are unsigned, so this subtracts one.
+    counts_.Add(k / kBitsPerWord, ~size_t{0});
+    sums_.Add(k, T{} - values_[k]);
+    values_[k] = T{};
+    --size_;
+    return 1;
+  }
+
+  // Erases everything, and goes back to the dense representation.
+  void clear() { *this = DensePrefixSumMap(max_dense_keys_); }
+
+  //**************** Debugging and test support ****************
+
+  // Checks the invariants.  Runs in time O(U).  Useful for testing.
+  void Check() const {
+    if (!dense_) {
+      CHECK(values_.empty());  // Crash OK
+      sparse_.Check();
+      return;
+    }
+    CHECK(sparse_.empty());  // Crash OK
+    size_t count = 0;
+    T sum{};
+    for (size_t k = 0; k < capacity(); ++k) {
+      if (Present(k)) {
+        ++count;
+        sum = sum + values_[k];
+      } else {
+        CHECK(values_[k] == T{});  // Crash OK
+      }
+      CHECK(sums_.PrefixSum(k + 1) == sum);  // Crash OK
+      if ((k + 1) % kBitsPerWord == 0) {
+        CHECK_EQ(counts_.PrefixSum((k + 1) / kBitsPerWord),  // Crash OK
+                 count);
+      }
+    }
+    CHECK_EQ(count, size_);  // Crash OK
+  }
+
+ private:
+  static constexpr size_t kBitsPerWord = 64;
+
+  static uint64_t Bit(size_t k) { return uint64_t{1} << (k % kBitsPerWord); }
+
+  size_t capacity() const { return values_.size(); }
+
+  bool Present(size_t k) const {
+    return k < capacity() && (bits_[k / kBitsPerWord] & Bit(k)) != 0;
+  }
+
+  // Returns the key of rank `idx`, which must be less than `size_`.
+  Key SelectKey(size_t idx) const {
+    size_t word = counts_.FindPrefix(&idx);
+    uint64_t bits = bits_[word];
+    // Clear the `idx` lowest set bits.
+    for (; idx > 0; --idx) bits &= bits - 1;
+    return word * kBitsPerWord + absl::countr_zero(bits);
+  }
+
+  // Whether an array reaching key `max_key` is small enough for `n`
+  // elements.  (Compares `max_key` before adding one to it, which would wrap
+  // for the largest `Key`.)
+  bool DenseFits(Key max_key, size_t n) const {
+    if (max_key >= max_dense_keys_) return false;
+    size_t key_range = static_cast<size_t>(max_key) + 1;
+    return key_range <= std::max(kMinDenseKeys, kMaxKeysPerElement * n);
+  }
+
+  // Makes room for key `k`: doubles the key range (or more, if that isn't
+  // enough, but no more than the density allows) and rebuilds the Fenwick
+  // trees, or moves to the sparse representation if the array would be too
+  // large.
+  void Grow(Key k) {
+    if (!DenseFits(k, size_ + 1)) {
+      MakeSparse();
+      return;
+    }
+    size_t key_range = static_cast<size_t>(k) + 1;
+    size_t limit = std::min(
+        max_dense_keys_,
+        std::max(kMinDenseKeys, kMaxKeysPerElement * (size_ + 1)));
+    Resize(std::max(key_range, std::min(capacity() * 2, limit)));
+    RebuildFenwickTrees();
+  }
+
+  // Moves the elements into `sparse_`.
+  void MakeSparse() {
+    std::vector<value_type> elements;
+    elements.reserve(size_);
+    for (size_t word = 0; word < bits_.size(); ++word) {
+      for (uint64_t bits = bits_[word]; bits != 0; bits &= bits - 1) {
+        Key key = word * kBitsPerWord + absl::countr_zero(bits);
+        elements.emplace_back(key, std::move(values_[key]));
+      }
+    }
+    sparse_.insert_sorted(elements.begin(), elements.end());
+    dense_ = false;
+    size_ = 0;
+    values_ = {};
+    bits_ = {};
+    sums_ = {};
+    counts_ = {};
+  }
+
+  // Moves the elements of `sparse_` back into the array if its size is a power
+  // of two and they fit.  Checking only at powers of two keeps the O(n) move
+  // (and the O(log n) check) amortized.
+  void MaybeMakeDense() {
+    size_t n = sparse_.size();
+    if ((n & (n - 1)) != 0) return;
+    Key max_key = sparse_.select(n - 1)->first;
+    if (!DenseFits(max_key, n)) return;
+    dense_ = true;
+    Resize(static_cast<size_t>(max_key) + 1);
+    for (const auto &[k, v] : sparse_) {
+      bits_[k / kBitsPerWord] |= Bit(k);
+      values_[k] = v;
+    }
+    size_ = n;
+    sparse_.clear();
+    RebuildFenwickTrees();
+  }
+
+  // Grows the array to span at least `key_range` keys (rounded up to a whole
+  // word of the bitmap).
+  void Resize(size_t key_range) {
+    size_t new_capacity =
+        (key_range + kBitsPerWord - 1) / kBitsPerWord * kBitsPerWord;
+    values_.resize(new_capacity);
+    bits_.resize(new_capacity / kBitsPerWord);
+  }
+
+  void RebuildFenwickTrees() {
+    sums_ = cachelib_internal::FenwickTree<T>(values_);
+    std::vector<size_t> counts(bits_.size());
+    for (size_t word = 0; word < bits_.size(); ++word) {
+      counts[word] = absl::popcount(bits_[word]);
+    }
+    counts_ = cachelib_internal::FenwickTree<size_t>(counts);
+  }
+
+  size_t max_dense_keys_;
+  bool dense_ = true;
+
+  // The dense representation.  `values_[k]` is zero for absent keys, so
+  // `sums_` can sum over all the keys.
+  size_t size_ = 0;
+  std::vector<T> values_;
+  std::vector<uint64_t> bits_;
+  cachelib_internal::FenwickTree<T> sums_;
+  cachelib_internal::FenwickTree<size_t> counts_;
+
+  // The sparse representation.
+  PrefixSumMap<Key, T> sparse_;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_DENSE_PREFIX_SUM_MAP_H_
@@ -0,0 +1,138 @@
+#include "dense_prefix_sum_map.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::Optional;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class DensePrefixSumMap<uint32_t, uint64_t>;
+template class DensePrefixSumMap<size_t, int64_t>;
+
+TEST(DensePrefixSumMapTest, Basic) {
+  DensePrefixSumMap<uint32_t, int64_t> map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(map.SumFirstN(3), 0);
+  EXPECT_EQ(map.select(0), std::nullopt);
+  EXPECT_TRUE(map.insert_or_assign(5, 50));
+  EXPECT_TRUE(map.insert_or_assign(200, 7));
+  EXPECT_TRUE(map.insert_or_assign(1, -10));
+  EXPECT_FALSE(map.insert_or_assign(5, 51));
+  EXPECT_EQ(map.size(), 3);
+  EXPECT_THAT(map.find(5), Optional(Pair(5, 51)));
+  EXPECT_EQ(map.find(6), std::nullopt);
+  EXPECT_FALSE(map.contains(100000));
+  EXPECT_THAT(map.select(2), Optional(Pair(200, 7)));
+  EXPECT_EQ(map.rank(5), 1);
+  EXPECT_EQ(map.rank(6), 2);
+  EXPECT_EQ(map.rank(100000), 3);
+  EXPECT_EQ(map.SumFirstN(2), 41);
+  EXPECT_EQ(map.SumFirstN(10), 48);
+  EXPECT_EQ(map.erase(5), 1);
+  EXPECT_EQ(map.erase(5), 0);
+  EXPECT_EQ(map.SumFirstN(2), -3);
+  EXPECT_TRUE(map.is_dense());
+  map.Check();
+  map.clear();
+  EXPECT_TRUE(map.empty());
+}
+
+// A single large key doesn't get a huge array: the map goes sparse, and goes
+// back to dense once there are enough elements for the key range.
+TEST(DensePrefixSumMapTest, Density) {
+  using Map = DensePrefixSumMap<uint32_t, int64_t>;
+  Map map;
+  EXPECT_TRUE(map.insert_or_assign(4000000, 1));
+  EXPECT_FALSE(map.is_dense());
+  EXPECT_EQ(map.SumFirstN(1), 1);
+  map.Check();
+
+  // 60000 keys would fit in an array of 64K keys at 16 keys per element once
+  // there are 4096 elements.
+  map.clear();
+  EXPECT_TRUE(map.insert_or_assign(60000, 60000));
+  EXPECT_FALSE(map.is_dense());
+  for (uint32_t k = 0; k < 4094; ++k) {
+    EXPECT_TRUE(map.insert_or_assign(k, k));
+    ASSERT_FALSE(map.is_dense()) << k;
+  }
+  EXPECT_TRUE(map.insert_or_assign(4094, 4094));
+  EXPECT_TRUE(map.is_dense());
+  map.Check();
+  EXPECT_EQ(map.size(), 4096);
+  EXPECT_EQ(map.rank(60000), 4095);
+  EXPECT_EQ(map.SumFirstN(4096), 4094 * 4095 / 2 + 60000);
+
+  // Keys within the floor stay dense however few there are.
+  map.clear();
+  EXPECT_TRUE(map.insert_or_assign(Map::kMinDenseKeys - 1, 1));
+  EXPECT_TRUE(map.is_dense());
+}
+
+// The largest key must go sparse rather than wrap the key range around to 0.
+TEST(DensePrefixSumMapTest, LargestKey) {
+  for (size_t max_dense_keys : {size_t{1} << 22, ~size_t{0}}) {
+    DensePrefixSumMap<uint64_t, int64_t> map(max_dense_keys);
+    EXPECT_TRUE(map.insert_or_assign(UINT64_MAX, 1));
+    EXPECT_FALSE(map.is_dense());
+    // The second element makes the size a power of two, where the map checks
+    // whether to go dense again.
+    EXPECT_TRUE(map.insert_or_assign(3, 2));
+    EXPECT_FALSE(map.is_dense());
+    EXPECT_EQ(map.rank(UINT64_MAX), 1);
+    EXPECT_EQ(map.SumFirstN(2), 3);
+    map.Check();
+    EXPECT_EQ(map.erase(3), 1);
+    EXPECT_THAT(map.select(0), Optional(Pair(UINT64_MAX, 1)));
+    map.Check();
+  }
+  DensePrefixSumMap<uint32_t, int64_t> map(/*max_dense_keys=*/~size_t{0});
+  EXPECT_TRUE(map.insert_or_assign(UINT32_MAX, 1));
+  EXPECT_FALSE(map.is_dense());
+  map.Check();
+}
+
+// Applies random writes to a DensePrefixSumMap and a std::map and checks that
+// every query agrees.  Some keys are larger than `max_dense_keys`, and once one
+// of those arrives the map must have switched to the sparse representation.
+TEST(DensePrefixSumMapTest, Randomized) {
+  absl::BitGen bitgen;
+  DensePrefixSumMap<uint32_t, uint64_t> map(/*max_dense_keys=*/5000);
+  std::map<uint32_t, uint64_t> expected;
+  for (size_t i = 0; i < 6000; ++i) {
+    uint32_t k = i < 4000 ? absl::Uniform<uint32_t>(bitgen, 0, 3000)
+                          : absl::Uniform<uint32_t>(bitgen, 0, 6000);
+    if (absl::Bernoulli(bitgen, 0.7)) {
+      uint64_t v = absl::Uniform<uint64_t>(bitgen, 0, 1000);
+      ASSERT_EQ(map.insert_or_assign(k, v),
+                expected.insert_or_assign(k, v).second);
+    } else {
+      ASSERT_EQ(map.erase(k), expected.erase(k));
+    }
+    if (i % 500 == 0) map.Check();
+    ASSERT_EQ(map.size(), expected.size());
+    EXPECT_EQ(map.contains(k), expected.count(k) == 1);
+    EXPECT_EQ(map.rank(k),
+              std::distance(expected.begin(), expected.lower_bound(k)));
+    if (expected.empty()) continue;
+    size_t idx = absl::Uniform<size_t>(bitgen, 0, expected.size());
+    auto it = std::next(expected.begin(), idx);
+    EXPECT_THAT(map.select(idx), Optional(Pair(it->first, it->second)));
+    uint64_t sum = 0;
+    for (auto j = expected.begin(); j != it; ++j) sum += j->second;
+    EXPECT_EQ(map.SumFirstN(idx), sum);
+  }
+  EXPECT_FALSE(map.is_dense());
+  map.Check();
+}
+
+}  // namespace cachelib
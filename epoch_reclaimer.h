@@ -0,0 +1,215 @@
+// An EpochReclaimer defers freeing memory until no reader can still be looking
+// at it.  It is used by the lock-free-reader trees (see
+// raw_snapshot_order_statistic_set.h and concurrent_order_statistic_map.h),
+// where a writer unlinks nodes that concurrent readers may still be
+// traversing.
+//
+// The protocol:
+//
+//   * Each reader thread owns a `Reader` (which occupies one slot in the
+//     reclaimer).  Before touching shared memory it calls `Pin()`, and it may
+//     use anything it reached through the shared root for as long as the
+//     returned `Guard` is alive.
+//
+//   * A writer first makes a node unreachable (e.g., by publishing a new root)
+//     and then calls `Retire(node)`.  The node is tagged with the current
+//     global epoch.
+//
+//   * `Collect()` advances the global epoch and frees every retired node whose
+//     tag is older than the oldest epoch that any reader is currently pinned
+//     at.
+//
+// A reader that pinned at epoch `e` may hold pointers to nodes retired at epoch
+// `e` or later, but cannot reach a node that was retired before it pinned
+// because the retirement happened after the node was unlinked.  All of the
+// atomics here use sequentially consistent ordering, which is what makes that
+// argument go through.  (Pinning is a store and a load, so it is cheap, and it
+// touches only the reader's own cache line.)
+
+#ifndef NET_BANDAID_BDN_CACHELIB_EPOCH_RECLAIMER_H_
+#define NET_BANDAID_BDN_CACHELIB_EPOCH_RECLAIMER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace cachelib {
+
+class EpochReclaimer {
+ public:
+  // `max_readers` is the number of `Reader` objects that may exist at the same
+  // time.  Constructing more than that many is a fatal error.
+  explicit EpochReclaimer(size_t max_readers = 128)
+      : slots_(new Slot[max_readers]), num_slots_(max_readers) {}
+
+  EpochReclaimer(const EpochReclaimer &) = delete;
+  EpochReclaimer &operator=(const EpochReclaimer &) = delete;
+
+  // Frees everything that is still waiting.  No reader may be pinned.
+  ~EpochReclaimer() {
+    for (const Retired &r : retired_) r.deleter(r.ptr);
+  }
+
+  // While a Guard is alive, memory reachable from the shared structure won't be
+  // freed.
+  class Guard {
+   public:
+    Guard(Guard &&other) : slot_(std::exchange(other.slot_, nullptr)) {}
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+    ~Guard() {
+      if (slot_) slot_->store(0);
+    }
+
+   private:
+    friend class EpochReclaimer;
+    explicit Guard(std::atomic<uint64_t> *slot) : slot_(slot) {}
+    std::atomic<uint64_t> *slot_;
+  };
+
+  // A Reader is a per-thread handle.  It must not be used by two threads at
+  // the same time, and `Pin()` must not be nested.
+  class Reader {
+   public:
+    explicit Reader(EpochReclaimer *reclaimer)
+        : reclaimer_(reclaimer), slot_(reclaimer->AcquireSlot()) {}
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+    ~Reader() { reclaimer_->ReleaseSlot(slot_); }
+
+    Guard Pin() {
+      std::atomic<uint64_t> &epoch = reclaimer_->slots_[slot_].epoch;
+      DCHECK_EQ(epoch.load(std::memory_order_relaxed), 0u);
+      epoch.store(reclaimer_->global_epoch_.load());
+      return Guard(&epoch);
+    }
+
+   private:
+    EpochReclaimer *reclaimer_;
+    size_t slot_;
+  };
+
+  // Arranges for `p` to be deleted once no reader can be using it.  `p` must
+  // already be unreachable from the shared structure.  Thread-safe.
+  template <class T>
+  void Retire(const T *p) {
+    std::lock_guard<std::mutex> lock(mu_);
+    retired_.push_back({const_cast<T *>(p), &Delete<T>,
+                        global_epoch_.load()});
+  }
+
+  // Objects to retire together, so that a busy writer takes the lock once per
+  // batch rather than once per object.  Not thread-safe: each writer thread
+  // keeps its own.
+  class Batch {
+   public:
+    // `p` must already be unreachable from the shared structure.
+    template <class T>
+    void Add(const T *p) {
+      items_.push_back({const_cast<T *>(p), &Delete<T>});
+    }
+
+    size_t size() const { return items_.size(); }
+
+   private:
+    friend class EpochReclaimer;
+    std::vector<std::pair<void *, void (*)(void *)>> items_;
+  };
+
+  // Retires everything in `batch` and empties it.  Tagging the objects with
+  // the current epoch, which may be later than when they became unreachable,
+  // only keeps them around longer.  Thread-safe.
+  void Retire(Batch *batch) {
+    std::lock_guard<std::mutex> lock(mu_);
+    uint64_t epoch = global_epoch_.load();
+    for (const auto &[ptr, deleter] : batch->items_) {
+      retired_.push_back({ptr, deleter, epoch});
+    }
+    batch->items_.clear();
+  }
+
+  // Advances the epoch and frees whatever is safe to free.  Returns the number
+  // of objects still waiting.  Thread-safe.
+  size_t Collect() {
+    // Nodes retired after the increment (perhaps by another writer, while we
+    // are scanning the slots) may still be reachable by a reader that pins
+    // after the scan, so they must survive this round even if nobody is
+    // pinned.
+    uint64_t oldest = global_epoch_.fetch_add(1) + 1;
+    for (size_t i = 0; i < num_slots_; ++i) {
+      uint64_t e = slots_[i].epoch.load();
+      if (e != 0 && e < oldest) oldest = e;
+    }
+    std::vector<Retired> to_free;
+    size_t kept = 0;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      for (Retired &r : retired_) {
+        if (r.epoch < oldest) {
+          to_free.push_back(r);
+        } else {
+          retired_[kept++] = r;
+        }
+      }
+      retired_.resize(kept);
+    }
+    for (const Retired &r : to_free) r.deleter(r.ptr);
+    return kept;
+  }
+
+  // Returns the number of retired objects that have not yet been freed.
+  size_t PendingForTest() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return retired_.size();
+  }
+
+ private:
+  // One cache line per reader so that pinning doesn't bounce lines between
+  // cores.
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{0};  // 0 means "not pinned".
+    std::atomic<bool> in_use{false};
+  };
+
+  struct Retired {
+    void *ptr;
+    void (*deleter)(void *);
+    uint64_t epoch;
+  };
+
+  template <class T>
+  static void Delete(void *p) {
+    delete static_cast<T *>(p);
+  }
+
+  size_t AcquireSlot() {
+    for (size_t i = 0; i < num_slots_; ++i) {
+      bool expected = false;
+      if (slots_[i].in_use.compare_exchange_strong(expected, true)) return i;
+    }
+    LOG(FATAL) << "More than " << num_slots_ << " EpochReclaimer readers";
+    return 0;
+  }
+
+  void ReleaseSlot(size_t slot) {
+    DCHECK_EQ(slots_[slot].epoch.load(), 0u);
+    slots_[slot].in_use.store(false);
+  }
+
+  // Starts at 1 since 0 means "not pinned".
+  std::atomic<uint64_t> global_epoch_{1};
+  std::unique_ptr<Slot[]> slots_;
+  size_t num_slots_;
+  mutable std::mutex mu_;
+  std::vector<Retired> retired_;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_EPOCH_RECLAIMER_H_
@@ -0,0 +1,306 @@
+// A FreeExtentMap keeps track of the free space of an allocator (such as a
+// slab or a flash device) as a set of disjoint, non-adjacent extents
+// `[offset, offset + length)`, ordered by offset.
+//
+// Every subtree keeps the length of its longest extent and the total length of
+// its extents, so
+//
+//   `allocate_first_fit(len)` finds the extent with the smallest offset that
+//   is at least `len` long, and allocates `len` from its start, in O(log n)
+//   time (instead of scanning the extents in order);
+//
+//   `allocate_best_fit(len)` allocates from the shortest extent that is at
+//   least `len` long (the one with the smallest offset, if there is a tie), in
+//   O(log n) time;
+//
+//   `free(offset, len)` returns space, merging it with the extents just before
+//   and after it, in O(log n) time; and
+//
+//   `total_free()` and `largest_free()` take O(1) time.
+//
+// Best fit can't be found from a summary of the subtrees, so it uses a second
+// OrderStatisticSet of the extents ordered by length, which doubles the memory
+// and the work done by each allocation and free.
+//
+// Like an OrderStatisticMap from offset to length, it supports iteration,
+// `find()`, `lower_bound()`, and `select()` by offset, but the extents may only
+// be changed by allocating and freeing.
+//
+// Example:
+//
+//   FreeExtentMap<uint64_t> free_space;
+//   free_space.free(0, device_size);
+//   std::optional<uint64_t> offset = free_space.allocate_first_fit(4096);
+//   ...
+//   free_space.free(*offset, 4096);
+
+#ifndef NET_BANDAID_BDN_CACHELIB_FREE_EXTENT_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_FREE_EXTENT_MAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include "glog/logging.h"
+#include "order_statistic_set.h"
+#include "raw_order_statistic_map.h"  // IWYU pragma: export
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// A node, mapping an extent's offset to its length, that keeps the longest and
+// the total length of the extents in its subtree.
+template <class Offset>
+class FreeExtentNode
+    : public RawMapNode<Offset, Offset, std::less<>, FreeExtentNode<Offset>> {
+  using Base = typename FreeExtentNode::RawMapNode;
+  using key_compare = typename FreeExtentNode::key_compare;
+
+ public:
+  using value_type = typename Base::value_type;
+
+  static constexpr bool kMutableValues = false;
+
+  explicit FreeExtentNode(value_type v)
+      : Base(std::move(v)),
+        max_length_(this->value_.second),
+        total_length_(this->value_.second) {}
+
+  // Checks the longest and total lengths.
+  void Check(bool recursive, const key_compare &lessthan) {
+    CHECK(max_length_ == ComputeMaxLength())  // Crash OK
+        << " node=" << this;
+    CHECK(total_length_ == ComputeTotalLength())  // Crash OK
+        << " node=" << this;
+    if (recursive) {
+      if (this->left_) this->left_->Check(recursive, lessthan);
+      if (this->right_) this->right_->Check(recursive, lessthan);
+    }
+    Base::Check(false, lessthan);
+  }
+
+  void RecomputeSummary() {
+    max_length_ = ComputeMaxLength();
+    total_length_ = ComputeTotalLength();
+    Base::RecomputeSummary();
+  }
+
+  static Offset MaxLength(const std::unique_ptr<FreeExtentNode> &n) {
+    return n ? n->max_length_ : Offset{};
+  }
+  static Offset TotalLength(const std::unique_ptr<FreeExtentNode> &n) {
+    return n ? n->total_length_ : Offset{};
+  }
+
+  // Returns the rank of, and a pointer to, the extent with the smallest offset
+  // that is at least `length` long, or `{0, nullptr}` if there is none.
+  static std::pair<size_t, FreeExtentNode *> FirstFit(
+      const FreeExtentNode *n, const Offset &length) {
+    if (n == nullptr || n->max_length_ < length) return {0, nullptr};
+    size_t rank = 0;
+    while (true) {
+      if (!(MaxLength(n->left_) < length)) {
+        n = n->left_.get();
+      } else if (!(n->value_.second < length)) {
+        return {rank + Base::Size(n->left_), const_cast<FreeExtentNode *>(n)};
+      } else {
+        // The extent must be on the right, since the subtree has one.
+        rank += Base::Size(n->left_) + 1;
+        n = n->right_.get();
+      }
+    }
+  }
+
+ private:
+  Offset ComputeMaxLength() const {
+    return std::max({this->value_.second, MaxLength(this->left_),
+                     MaxLength(this->right_)});
+  }
+
+  Offset ComputeTotalLength() const {
+    return TotalLength(this->left_) + this->value_.second +
+           TotalLength(this->right_);
+  }
+
+  Offset max_length_;
+  Offset total_length_;
+};
+
+}  // namespace cachelib_internal
+
+template <class Offset>
+class FreeExtentMap
+    : public cachelib_internal::RawOrderStatisticMap<
+          Offset, Offset, std::less<>,
+          cachelib_internal::FreeExtentNode<Offset>> {
+  using Base = typename FreeExtentMap::RawOrderStatisticMap;
+  using Node = typename Base::Node;
+
+ public:
+  using key_type = typename Base::key_type;
+  using mapped_type = typename Base::mapped_type;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using difference_type = typename Base::difference_type;
+  using key_compare = typename Base::key_compare;
+  using value_compare = typename Base::value_compare;
+  using const_reference = const value_type &;
+  using iterator = typename Base::iterator;
+  using const_iterator = typename Base::const_iterator;
+  using reverse_iterator = typename Base::reverse_iterator;
+  using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+  //**************** Allocation ****************
+
+  // Allocates `length` (which must be positive) from the start of the free
+  // extent with the smallest offset that is long enough, and returns the
+  // offset of the allocation, or `std::nullopt` if no extent is long enough.
+  std::optional<Offset> allocate_first_fit(Offset length) {
+    DCHECK(Offset{} < length);
+    auto [rank, n] = Node::FirstFit(this->root_.get(), length);
+    if (n == nullptr) return std::nullopt;
+    return Carve(n->value_.first, n->value_.second, length);
+  }
+
+  // Allocates `length` (which must be positive) from the start of the
+  // shortest free extent that is long enough (the one with the smallest
+  // offset among the shortest), and returns the offset of the allocation, or
+  // `std::nullopt` if no extent is long enough.
+  std::optional<Offset> allocate_best_fit(Offset length) {
+    DCHECK(Offset{} < length);
+    auto it = by_length_.lower_bound(std::make_pair(length, Offset{}));
+    if (it == by_length_.end()) return std::nullopt;
+    auto [extent_length, offset] = *it;
+    return Carve(offset, extent_length, length);
+  }
+
+  // Frees `[offset, offset + length)`, which must be nonempty and must not
+  // overlap any free extent, merging it with the free extents that end at
+  // `offset` or start at `offset + length`.
+  void free(Offset offset, Offset length) {
+    DCHECK(Offset{} < length);
+    Offset end = offset + length;
+    auto next = this->lower_bound(offset);
+    if (next != this->end()) {
+      DCHECK(!(next->first < end)) << "Freeing free space";
+      if (next->first == end) {
+        end += next->second;
+        next = Erase(next);
+      }
+    }
+    if (next != this->begin()) {
+      auto prev = std::prev(next);
+      Offset prev_end = prev->first + prev->second;
+      DCHECK(!(offset < prev_end)) << "Freeing free space";
+      if (prev_end == offset) {
+        offset = prev->first;
+        Erase(prev);
+      }
+    }
+    Insert(offset, end - offset);
+  }
+
+  //**************** Observers ****************
+
+  // Returns the total length of the free extents.
+  Offset total_free() const { return Node::TotalLength(this->root_); }
+
+  // Returns the length of the longest free extent (zero if there are none).
+  Offset largest_free() const { return Node::MaxLength(this->root_); }
+
+  // Removes all the free extents.
+  void clear() {
+    Base::clear();
+    by_length_.clear();
+  }
+
+  // Checks the invariants, including that the extents are disjoint and
+  // non-adjacent.  Runs in O(n) time.  Useful for testing.
+  void Check() const {
+    Base::Check();
+    CHECK_EQ(by_length_.size(), this->size());  // Crash OK
+    by_length_.Check();
+    const value_type *prev = nullptr;
+    for (const value_type &extent : *this) {
+      CHECK(Offset{} < extent.second);  // Crash OK
+      CHECK(by_length_.contains(  // Crash OK
+          std::make_pair(extent.second, extent.first)));
+      if (prev != nullptr) {
+        CHECK(prev->first + prev->second < extent.first);  // Crash OK
+      }
+      prev = &extent;
+    }
+  }
+
+  // See OrderStatisticSet's documentation for the specification of these
+  // functions.  The extents are `{offset, length}` pairs.
+
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::begin;
+
+  using Base::cbegin;
+
+  using Base::end;
+
+  using Base::cend;
+
+  using Base::rbegin;
+
+  using Base::crbegin;
+
+  using Base::rend;
+
+  using Base::crend;
+
+  using Base::find;
+
+  using Base::contains;
+
+  using Base::lower_bound;
+
+  using Base::upper_bound;
+
+  using Base::select;
+
+  using Base::key_comp;
+
+  using Base::value_comp;
+
+ private:
+  // Allocates `length` from the start of the extent at `offset`, which is
+  // `extent_length` long, and returns `offset`.
+  Offset Carve(Offset offset, Offset extent_length, Offset length) {
+    DCHECK(!(extent_length < length));
+    Base::erase(offset);
+    by_length_.erase(std::make_pair(extent_length, offset));
+    if (length < extent_length) Insert(offset + length, extent_length - length);
+    return offset;
+  }
+
+  void Insert(Offset offset, Offset length) {
+    Base::insert_or_assign(offset, length);
+    by_length_.insert(std::make_pair(length, offset));
+  }
+
+  // Erases the extent at `pos`, and returns an iterator to the next one.
+  iterator Erase(iterator pos) {
+    by_length_.erase(std::make_pair(pos->second, pos->first));
+    return Base::erase(pos);
+  }
+
+  // The extents as `{length, offset}` pairs, for best fit.
+  OrderStatisticSet<std::pair<Offset, Offset>> by_length_;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_FREE_EXTENT_MAP_H_
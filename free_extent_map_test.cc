@@ -0,0 +1,123 @@
+#include "free_extent_map.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::ElementsAre;
+using ::testing::Optional;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class FreeExtentMap<uint64_t>;
+
+TEST(FreeExtentMapTest, Basic) {
+  FreeExtentMap<int> extents;
+  EXPECT_EQ(extents.allocate_first_fit(1), std::nullopt);
+  extents.free(0, 100);
+  EXPECT_EQ(extents.total_free(), 100);
+  EXPECT_THAT(extents.allocate_first_fit(10), Optional(0));
+  EXPECT_THAT(extents.allocate_first_fit(20), Optional(10));
+  EXPECT_THAT(extents.allocate_first_fit(30), Optional(30));
+  EXPECT_THAT(extents, ElementsAre(Pair(60, 40)));
+  // Make holes of 10 at 0 and of 30 at 30.
+  extents.free(0, 10);
+  extents.free(30, 30);
+  EXPECT_THAT(extents, ElementsAre(Pair(0, 10), Pair(30, 70)));
+  EXPECT_EQ(extents.total_free(), 80);
+  EXPECT_EQ(extents.largest_free(), 70);
+  // Now [10, 30) is allocated.  First fit for 5 is at 0, and so is best fit.
+  EXPECT_THAT(extents.allocate_first_fit(5), Optional(0));
+  extents.free(0, 5);
+  EXPECT_THAT(extents.allocate_first_fit(11), Optional(30));
+  extents.free(30, 11);
+  EXPECT_THAT(extents.allocate_best_fit(10), Optional(0));
+  EXPECT_THAT(extents.allocate_best_fit(10), Optional(30));
+  EXPECT_EQ(extents.allocate_best_fit(61), std::nullopt);
+  // Freeing [0, 10) and [10, 40) merges everything back together.
+  extents.free(0, 10);
+  extents.free(10, 30);
+  EXPECT_THAT(extents, ElementsAre(Pair(0, 100)));
+  extents.Check();
+  extents.clear();
+  EXPECT_TRUE(extents.empty());
+  EXPECT_EQ(extents.total_free(), 0);
+}
+
+// Compares with a bitmap of the free units.
+TEST(FreeExtentMapTest, Randomized) {
+  absl::BitGen bitgen;
+  constexpr int kSize = 2000;
+  FreeExtentMap<int> extents;
+  extents.free(0, kSize);
+  std::vector<bool> is_free(kSize, true);
+  std::vector<std::pair<int, int>> allocated;
+  // Returns the free runs, as `{offset, length}` pairs.
+  auto runs = [&] {
+    std::vector<std::pair<int, int>> result;
+    for (int i = 0; i < kSize; ++i) {
+      if (!is_free[i]) continue;
+      if (!result.empty() && result.back().first + result.back().second == i) {
+        ++result.back().second;
+      } else {
+        result.emplace_back(i, 1);
+      }
+    }
+    return result;
+  };
+  for (size_t i = 0; i < 3000; ++i) {
+    if (allocated.empty() || absl::Bernoulli(bitgen, 0.55)) {
+      int length = absl::Uniform<int>(bitgen, 1, 60);
+      bool best = absl::Bernoulli(bitgen, 0.5);
+      std::optional<int> want;
+      int want_length = kSize + 1;
+      for (auto [offset, run_length] : runs()) {
+        if (run_length < length) continue;
+        if (!best) {
+          want = offset;
+          break;
+        }
+        if (run_length < want_length) {
+          want = offset;
+          want_length = run_length;
+        }
+      }
+      std::optional<int> got = best ? extents.allocate_best_fit(length)
+                                     : extents.allocate_first_fit(length);
+      ASSERT_EQ(got, want);
+      if (got) {
+        for (int j = *got; j < *got + length; ++j) is_free[j] = false;
+        allocated.emplace_back(*got, length);
+      }
+    } else {
+      size_t j = absl::Uniform<size_t>(bitgen, 0, allocated.size());
+      auto [offset, length] = allocated[j];
+      allocated[j] = allocated.back();
+      allocated.pop_back();
+      extents.free(offset, length);
+      for (int k = offset; k < offset + length; ++k) is_free[k] = true;
+    }
+    std::vector<std::pair<int, int>> got(extents.begin(), extents.end());
+    ASSERT_EQ(got, runs());
+    int total = 0, largest = 0;
+    for (auto [offset, length] : runs()) {
+      total += length;
+      largest = std::max(largest, length);
+    }
+    EXPECT_EQ(extents.total_free(), total);
+    EXPECT_EQ(extents.largest_free(), largest);
+    if (i % 300 == 0) extents.Check();
+  }
+  extents.Check();
+}
+
+}  // namespace cachelib
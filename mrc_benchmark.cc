@@ -0,0 +1,167 @@
+// A benchmark for the miss-ratio-curve trackers.
+//
+// It generates a trace of `accesses` accesses to keys drawn from `[0,
+// key_space)` (uniformly or with a Zipf distribution), each key with a fixed
+// size drawn uniformly from `[1, max_size]`, and feeds it to
+//
+//   exact:       a ReuseDistanceTracker,
+//   fixed_rate:  a SampledReuseDistanceTracker sampling at `rate`, and
+//   fixed_size:  a SampledReuseDistanceTracker starting at `rate` and keeping
+//                at most `max_keys` keys.
+//
+// It reports the throughput and memory (in sampled keys) of each, their
+// miss-ratio curves at `points` cache sizes spread geometrically up to the
+// number of distinct keys, and the mean absolute error of each estimated curve
+// against the exact one, for both object-count and byte capacities.  (A
+// sample at rate R can't tell apart cache sizes below about 1 / R objects, so
+// expect the smallest sizes to be off.)
+//
+// Example:
+//
+//   mrc_benchmark --accesses=10000000 --key_space=1000000 --keys=zipf
+//       --rate=0.001 --max_keys=8192
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/hash/hash.h"
+#include "absl/random/random.h"
+#include "absl/random/zipf_distribution.h"
+#include "absl/types/span.h"
+#include "reuse_distance_tracker.h"
+#include "sampled_reuse_distance_tracker.h"
+
+ABSL_FLAG(uint64_t, accesses, 10'000'000, "The length of the trace.");
+ABSL_FLAG(uint64_t, key_space, 1 << 20, "Keys are drawn from [0, key_space).");
+ABSL_FLAG(std::string, keys, "zipf", "The key distribution: uniform or zipf.");
+ABSL_FLAG(double, zipf_q, 1.1, "The exponent of the Zipf distribution.");
+ABSL_FLAG(uint64_t, max_size, 4096, "Object sizes are in [1, max_size].");
+ABSL_FLAG(double, rate, 0.01, "The sampling rate of the sampled trackers.");
+ABSL_FLAG(uint64_t, max_keys, 8192,
+          "The most keys the fixed-size sampled tracker keeps.");
+ABSL_FLAG(int, points, 10, "The number of points of the curve to print.");
+
+namespace cachelib {
+namespace {
+
+using Trace = std::vector<std::pair<uint64_t, uint64_t>>;
+
+Trace MakeTrace() {
+  absl::BitGen bitgen;
+  const uint64_t n = absl::GetFlag(FLAGS_accesses);
+  const uint64_t key_space = absl::GetFlag(FLAGS_key_space);
+  const uint64_t max_size = absl::GetFlag(FLAGS_max_size);
+  const bool zipf = absl::GetFlag(FLAGS_keys) == "zipf";
+  CHECK(zipf || absl::GetFlag(FLAGS_keys) == "uniform")
+      << "Unknown key distribution " << absl::GetFlag(FLAGS_keys);
+  absl::zipf_distribution<uint64_t> zipf_keys(key_space - 1,
+                                              absl::GetFlag(FLAGS_zipf_q));
+  // Each key gets a fixed size, derived from the key.
+  absl::Hash<uint64_t> hash;
+  Trace trace;
+  trace.reserve(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    uint64_t key = zipf ? zipf_keys(bitgen)
+                        : absl::Uniform<uint64_t>(bitgen, 0, key_space);
+    trace.emplace_back(key, hash(key) % max_size + 1);
+  }
+  return trace;
+}
+
+// Runs `fn` and returns the number of seconds it took.
+template <class Fn>
+double Time(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Feeds the trace to `tracker`, and prints its throughput and size.
+template <class Tracker>
+void Ingest(const char *name, const Trace &trace, Tracker *tracker) {
+  double seconds = Time([&] { tracker->access_batch(trace); });
+  size_t keys;
+  if constexpr (std::is_same_v<Tracker, ReuseDistanceTracker<uint64_t>>) {
+    keys = tracker->distinct_keys();
+  } else {
+    keys = tracker->sampled_keys();
+  }
+  printf("%-10s %8.2fM accesses/s %10zu keys\n", name,
+         trace.size() / seconds / 1e6, keys);
+}
+
+// Prints the curves at `sizes`, and the mean absolute errors.  `curve` returns
+// a tracker's curve.
+template <class Curve>
+void PrintCurves(const char *unit, absl::Span<const uint64_t> sizes,
+                 Curve curve) {
+  std::vector<double> exact = curve(0), fixed_rate = curve(1),
+                      fixed_size = curve(2);
+  printf("\n%14s %10s %10s %10s\n", unit, "exact", "fixed_rate",
+         "fixed_size");
+  double rate_error = 0, size_error = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    printf("%14lu %10.4f %10.4f %10.4f\n", sizes[i], exact[i], fixed_rate[i],
+           fixed_size[i]);
+    rate_error += std::abs(fixed_rate[i] - exact[i]);
+    size_error += std::abs(fixed_size[i] - exact[i]);
+  }
+  printf("%14s %10s %10.4f %10.4f\n", "mean_abs_error", "",
+         rate_error / sizes.size(), size_error / sizes.size());
+}
+
+void Run() {
+  Trace trace = MakeTrace();
+  ReuseDistanceTracker<uint64_t> exact;
+  SampledReuseDistanceTracker<uint64_t> fixed_rate(absl::GetFlag(FLAGS_rate));
+  SampledReuseDistanceTracker<uint64_t> fixed_size(
+      absl::GetFlag(FLAGS_rate), absl::GetFlag(FLAGS_max_keys));
+  Ingest("exact", trace, &exact);
+  Ingest("fixed_rate", trace, &fixed_rate);
+  Ingest("fixed_size", trace, &fixed_size);
+  printf("fixed_size ended at rate %g\n", fixed_size.rate());
+
+  const int points = absl::GetFlag(FLAGS_points);
+  const double distinct = exact.distinct_keys();
+  uint64_t total_bytes = 0;
+  for (const auto &[key, size] : trace) total_bytes += size;
+  // A cache as big as all the distinct keys needs about their share of the
+  // accessed bytes.
+  const double distinct_bytes = total_bytes * (distinct / trace.size());
+  std::vector<uint64_t> objects, bytes;
+  for (int i = 1; i <= points; ++i) {
+    objects.push_back(std::pow(distinct, 1.0 * i / points));
+    bytes.push_back(std::pow(distinct_bytes, 1.0 * i / points));
+  }
+  PrintCurves("objects", objects, [&](int which) {
+    return which == 0   ? exact.miss_ratio_curve(objects)
+           : which == 1 ? fixed_rate.miss_ratio_curve(objects)
+                        : fixed_size.miss_ratio_curve(objects);
+  });
+  PrintCurves("bytes", bytes, [&](int which) {
+    return which == 0   ? exact.byte_miss_ratio_curve(bytes)
+           : which == 1 ? fixed_rate.byte_miss_ratio_curve(bytes)
+                        : fixed_size.byte_miss_ratio_curve(bytes);
+  });
+}
+
+}  // namespace
+}  // namespace cachelib
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  cachelib::Run();
+  return 0;
+}
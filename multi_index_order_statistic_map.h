@@ -0,0 +1,519 @@
+// A MultiIndexOrderStatisticMap is a map from keys to mapped values that is
+// ordered two ways at once: by key, and by mapped value (ties broken by key).
+// It supports `select()` and rank in both orders in O(log n) time, which is
+// what an LRU or LFU eviction policy (keyed by object, ordered by last access
+// time or by frequency) or a leaderboard (keyed by player, ordered by score)
+// needs.
+//
+// Each entry is allocated once, in a node that belongs to two weight-balanced
+// trees: the node has a separate left child, right child, and subtree size for
+// each index.  Keeping two OrderStatisticMaps instead would allocate (and
+// store) every entry twice.  `assign()` changes an entry's mapped value by
+// unlinking its node from the by-value tree and relinking it at its new
+// position, without reallocating it, in O(log n) time.
+//
+// The balancing is OrderStatisticSet's (WeightBalancedTree, in
+// raw_order_statistic_set.h), applied to each index separately.  The trees are
+// intrusive, so the children are raw pointers: the nodes are owned by the map
+// and freed by walking the by-key tree.
+//
+// There are two kinds of iterator, which visit the entries by key
+// (`key_iterator`, from `begin()`) and by value (`value_iterator`, from
+// `value_begin()`).  Like OrderStatisticMap's iterators, they are random
+// access, their `rank()` is the rank in their order, and any insert or erase
+// invalidates them.  They refer to const entries (use `assign()` to change
+// the mapped value).
+//
+// Example:
+//
+//   // An LRU list: object -> time of last access.
+//   MultiIndexOrderStatisticMap<ObjectId, uint64_t> lru;
+//   lru.insert_or_assign(id, now);           // On every access.
+//   ObjectId victim = lru.select_by_value(0)->first;
+//   size_t age_rank = lru.rank_by_value(lru.find(id));
+
+#ifndef NET_BANDAID_BDN_CACHELIB_MULTI_INDEX_ORDER_STATISTIC_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_MULTI_INDEX_ORDER_STATISTIC_MAP_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include "glog/logging.h"
+#include "raw_order_statistic_set.h"
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// A node that belongs to `kIndices` trees.
+template <class Value, size_t kIndices>
+struct MultiIndexNode {
+  explicit MultiIndexNode(Value v) : value(std::move(v)) {}
+
+  struct Links {
+    MultiIndexNode *left = nullptr;
+    MultiIndexNode *right = nullptr;
+    size_t subtree_size = 1;
+  };
+
+  Value value;
+  std::array<Links, kIndices> links;
+};
+
+// The weight-balanced tree operations on index `I` of intrusive nodes such as
+// MultiIndexNode.  `Less` is a strict weak ordering of nodes that tells every
+// pair of distinct nodes apart.  The operations that change the tree take its
+// root and return the new root.
+template <class Node, size_t I, class Less>
+class IntrusiveIndex {
+ public:
+  static size_t Size(const Node *n) {
+    return n ? n->links[I].subtree_size : 0;
+  }
+  static Node *Left(const Node *n) { return n->links[I].left; }
+  static Node *Right(const Node *n) { return n->links[I].right; }
+
+  // Links the detached node `x`, which must not be equal to any node in the
+  // tree, into the tree.
+  static Node *Insert(Node *n, Node *x, const Less &less) {
+    if (n == nullptr) {
+      x->links[I] = {};
+      return x;
+    }
+    if (less(x, n)) {
+      Links::Left(n) = Insert(Left(n), x, less);
+    } else {
+      DCHECK(less(n, x));
+      Links::Right(n) = Insert(Right(n), x, less);
+    }
+    return MaybeRebalance(n);
+  }
+
+  // Unlinks `x`, which must be in the tree.  Doesn't free it.
+  static Node *Erase(Node *n, const Node *x, const Less &less) {
+    DCHECK(n != nullptr);
+    if (n == x) return DeleteNode(n);
+    if (less(x, n)) {
+      Links::Left(n) = Erase(Left(n), x, less);
+    } else {
+      Links::Right(n) = Erase(Right(n), x, less);
+    }
+    return MaybeRebalance(n);
+  }
+
+  // Returns the node of rank `idx`, or nullptr if there isn't one.
+  static Node *Select(Node *n, size_t idx) {
+    if (idx >= Size(n)) return nullptr;
+    while (true) {
+      size_t left_size = Size(Left(n));
+      if (idx < left_size) {
+        n = Left(n);
+      } else if (idx > left_size) {
+        idx -= left_size + 1;
+        n = Right(n);
+      } else {
+        return n;
+      }
+    }
+  }
+
+  // Returns the rank of `x`, which must be in the tree.
+  static size_t Rank(const Node *n, const Node *x, const Less &less) {
+    size_t rank = 0;
+    while (n != x) {
+      DCHECK(n != nullptr);
+      if (less(x, n)) {
+        n = Left(n);
+      } else {
+        rank += Size(Left(n)) + 1;
+        n = Right(n);
+      }
+    }
+    return rank + Size(Left(n));
+  }
+
+  // Returns the rank of, and a pointer to, the first node for which
+  // `before(node)` is false, or `{Size(n), nullptr}` if there is none.
+  // `before` must be true for a prefix of the nodes.
+  template <class Before>
+  static std::pair<size_t, Node *> LowerBound(Node *n, const Before &before) {
+    size_t rank = 0;
+    Node *result = nullptr;
+    size_t result_rank = Size(n);
+    while (n != nullptr) {
+      if (before(n)) {
+        rank += Size(Left(n)) + 1;
+        n = Right(n);
+      } else {
+        result = n;
+        result_rank = rank + Size(Left(n));
+        n = Left(n);
+      }
+    }
+    return {result_rank, result};
+  }
+
+  // Checks the sizes, the balance, and the order of the subtree, and returns
+  // its size.
+  static size_t Check(const Node *n, const Less &less) {
+    if (n == nullptr) return 0;
+    size_t size = 1 + Check(Left(n), less) + Check(Right(n), less);
+    CHECK_EQ(Size(n), size);  // Crash OK
+    CHECK(IsInBalance(n));    // Crash OK
+    if (Left(n)) {
+      CHECK(less(Left(n), n));  // Crash OK
+    }
+    if (Right(n)) {
+      CHECK(less(n, Right(n)));  // Crash OK
+    }
+    return size;
+  }
+
+ private:
+  // How WeightBalancedTree reaches the children in index `I`.
+  struct Links {
+    using Ptr = Node *;
+    static Node *&Left(Node *n) { return n->links[I].left; }
+    static Node *&Right(Node *n) { return n->links[I].right; }
+    static size_t Size(const Node *n) { return IntrusiveIndex::Size(n); }
+    static void PushDown(const Node *) {}
+    static void Recompute(Node *n) {
+      n->links[I].subtree_size = 1 + Size(Left(n)) + Size(Right(n));
+    }
+  };
+  using Balancing = WeightBalancedTree<Links>;
+
+  static Node *DeleteNode(Node *n) { return Balancing::DeleteNode(n); }
+  static bool IsInBalance(const Node *n) {
+    return Balancing::IsInBalance(Size(Left(n)), Size(Right(n)));
+  }
+  static Node *MaybeRebalance(Node *n) { return Balancing::MaybeRebalance(n); }
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class T, class KeyCompare = std::less<>,
+          class MappedCompare = std::less<>>
+class MultiIndexOrderStatisticMap {
+ public:
+  using key_type = Key;
+  using mapped_type = T;
+  using value_type = std::pair<const Key, T>;
+  using size_type = size_t;
+  using difference_type = std::ptrdiff_t;
+  using key_compare = KeyCompare;
+  using mapped_compare = MappedCompare;
+
+ private:
+  using Node = cachelib_internal::MultiIndexNode<value_type, 2>;
+
+  // The by-key index.
+  static constexpr size_t kByKey = 0;
+  // The by-value index, ordered by mapped value and then by key.
+  static constexpr size_t kByValue = 1;
+
+  struct KeyLess {
+    bool operator()(const Node *a, const Node *b) const {
+      return KeyCompare()(a->value.first, b->value.first);
+    }
+  };
+  struct ValueLess {
+    bool operator()(const Node *a, const Node *b) const {
+      if (MappedCompare()(a->value.second, b->value.second)) return true;
+      if (MappedCompare()(b->value.second, a->value.second)) return false;
+      return KeyCompare()(a->value.first, b->value.first);
+    }
+  };
+
+  template <size_t I>
+  using Index = cachelib_internal::IntrusiveIndex<
+      Node, I, std::conditional_t<I == kByKey, KeyLess, ValueLess>>;
+  using ByKey = Index<kByKey>;
+  using ByValue = Index<kByValue>;
+
+  template <size_t I>
+  class Iterator;
+
+ public:
+  using key_iterator = Iterator<kByKey>;
+  using value_iterator = Iterator<kByValue>;
+  using iterator = key_iterator;
+  using const_iterator = key_iterator;
+
+  MultiIndexOrderStatisticMap() = default;
+  MultiIndexOrderStatisticMap(MultiIndexOrderStatisticMap &&other) noexcept
+      : roots_(std::exchange(other.roots_, {})) {}
+  MultiIndexOrderStatisticMap &operator=(
+      MultiIndexOrderStatisticMap &&other) noexcept {
+    std::swap(roots_, other.roots_);
+    return *this;
+  }
+  ~MultiIndexOrderStatisticMap() { clear(); }
+
+  //**************** Observers ****************
+
+  size_t size() const { return ByKey::Size(roots_[kByKey]); }
+  bool empty() const { return roots_[kByKey] == nullptr; }
+
+  // Iterate by key.
+  key_iterator begin() const { return key_iterator(this, 0, Select<kByKey>(0)); }
+  key_iterator end() const { return key_iterator(this, size(), nullptr); }
+
+  // Iterate by mapped value (and then by key).
+  value_iterator value_begin() const {
+    return value_iterator(this, 0, Select<kByValue>(0));
+  }
+  value_iterator value_end() const {
+    return value_iterator(this, size(), nullptr);
+  }
+
+  // Returns an iterator to the entry with key `k`, or `end()`.
+  template <class K = Key>
+  key_iterator find(const K &k) const {
+    auto it = lower_bound(k);
+    if (it != end() && !KeyCompare()(k, it->first)) return it;
+    return end();
+  }
+
+  template <class K = Key>
+  bool contains(const K &k) const {
+    return find(k) != end();
+  }
+
+  // Returns an iterator to the first entry whose key is not less than `k`.
+  template <class K = Key>
+  key_iterator lower_bound(const K &k) const {
+    auto [rank, n] = ByKey::LowerBound(
+        roots_[kByKey],
+        [&k](const Node *n) { return KeyCompare()(n->value.first, k); });
+    return key_iterator(this, rank, n);
+  }
+
+  // Returns an iterator to the first entry, in value order, whose mapped value
+  // is not less than `v`.
+  value_iterator value_lower_bound(const T &v) const {
+    auto [rank, n] = ByValue::LowerBound(
+        roots_[kByValue],
+        [&v](const Node *n) { return MappedCompare()(n->value.second, v); });
+    return value_iterator(this, rank, n);
+  }
+
+  // Return the entry of rank `idx` by key, or by value, or the end iterator if
+  // `idx >= size()`.  Take O(log n) time.
+  key_iterator select_by_key(size_t idx) const {
+    return key_iterator(this, std::min(idx, size()), Select<kByKey>(idx));
+  }
+  value_iterator select_by_value(size_t idx) const {
+    return value_iterator(this, std::min(idx, size()), Select<kByValue>(idx));
+  }
+
+  // Returns the number of entries whose key is less than `k`.
+  template <class K = Key>
+  size_t rank_by_key(const K &k) const {
+    return lower_bound(k).rank();
+  }
+
+  // Returns the rank, in value order, of the entry at `it` (which must not be
+  // `end()`).  Takes O(log n) time.
+  size_t rank_by_value(key_iterator it) const {
+    DCHECK(it.node_ != nullptr);
+    return ByValue::Rank(roots_[kByValue], it.node_, ValueLess());
+  }
+
+  // Returns the number of entries whose mapped value is less than `v`.
+  size_t rank_by_value(const T &v) const { return value_lower_bound(v).rank(); }
+
+  // Converts between the two kinds of iterator to the same entry.
+  value_iterator to_value_iterator(key_iterator it) const {
+    if (it.node_ == nullptr) return value_end();
+    return value_iterator(this, rank_by_value(it), it.node_);
+  }
+  key_iterator to_key_iterator(value_iterator it) const {
+    if (it.node_ == nullptr) return end();
+    return key_iterator(this, ByKey::Rank(roots_[kByKey], it.node_, KeyLess()),
+                        it.node_);
+  }
+
+  //**************** Mutators ****************
+
+  // Inserts `{k, v}` if there is no entry with key `k`.  Returns an iterator
+  // to the entry with key `k` and whether it was inserted.
+  std::pair<key_iterator, bool> insert(Key k, T v) {
+    key_iterator it = lower_bound(k);
+    if (it != end() && !KeyCompare()(k, it->first)) return {it, false};
+    Node *n = new Node(value_type(std::move(k), std::move(v)));
+    roots_[kByKey] = ByKey::Insert(roots_[kByKey], n, KeyLess());
+    roots_[kByValue] = ByValue::Insert(roots_[kByValue], n, ValueLess());
+    return {key_iterator(this, it.rank(), n), true};
+  }
+
+  // Inserts `{k, v}`, or assigns `v` to the entry with key `k`.  Returns an
+  // iterator to the entry and whether it was inserted.
+  std::pair<key_iterator, bool> insert_or_assign(Key k, T v) {
+    key_iterator it = lower_bound(k);
+    if (it != end() && !KeyCompare()(k, it->first)) {
+      assign(it, std::move(v));
+      return {it, false};
+    }
+    return insert(std::move(k), std::move(v));
+  }
+
+  // Changes the mapped value of the entry at `it` (which must not be `end()`)
+  // to `v`, moving the entry to its new position in value order without
+  // reallocating it.  Key iterators stay valid.  Takes O(log n) time.
+  void assign(key_iterator it, T v) {
+    Node *n = it.node_;
+    DCHECK(n != nullptr);
+    roots_[kByValue] = ByValue::Erase(roots_[kByValue], n, ValueLess());
+    n->value.second = std::move(v);
+    roots_[kByValue] = ByValue::Insert(roots_[kByValue], n, ValueLess());
+  }
+
+  // Erases the entry at `it` (which must not be `end()`), and returns an
+  // iterator to the next entry by key.
+  key_iterator erase(key_iterator it) {
+    Node *n = it.node_;
+    DCHECK(n != nullptr);
+    size_t rank = it.rank();
+    roots_[kByKey] = ByKey::Erase(roots_[kByKey], n, KeyLess());
+    roots_[kByValue] = ByValue::Erase(roots_[kByValue], n, ValueLess());
+    delete n;
+    return select_by_key(rank);
+  }
+
+  // Erases the entry with key `k`, if there is one.  Returns the number of
+  // entries erased.
+  template <class K = Key>
+  size_t erase(const K &k) {
+    key_iterator it = find(k);
+    if (it == end()) return 0;
+    erase(it);
+    return 1;
+  }
+
+  void clear() {
+    Delete(roots_[kByKey]);
+    roots_ = {};
+  }
+
+  void swap(MultiIndexOrderStatisticMap &other) {
+    std::swap(roots_, other.roots_);
+  }
+
+  //**************** Debugging and test support ****************
+
+  // Checks both trees, and that they hold the same nodes.  Runs in O(n log n)
+  // time.
+  void Check() const {
+    CHECK_EQ(ByKey::Check(roots_[kByKey], KeyLess()),  // Crash OK
+             ByValue::Check(roots_[kByValue], ValueLess()));
+    for (key_iterator it = begin(); it != end(); ++it) {
+      size_t rank = rank_by_value(it);
+      CHECK_EQ(Select<kByValue>(rank), it.node_);  // Crash OK
+    }
+  }
+
+ private:
+  template <size_t I>
+  Node *Select(size_t idx) const {
+    return Index<I>::Select(roots_[I], idx);
+  }
+
+  static void Delete(Node *n) {
+    if (n == nullptr) return;
+    Delete(ByKey::Left(n));
+    Delete(ByKey::Right(n));
+    delete n;
+  }
+
+  std::array<Node *, 2> roots_ = {};
+};
+
+// Like OrderStatisticSet's iterators (see raw_order_statistic_set.h), the
+// iterator is a rank and a node, and moving it is a `select()`.
+template <class Key, class T, class KeyCompare, class MappedCompare>
+template <size_t I>
+class MultiIndexOrderStatisticMap<Key, T, KeyCompare,
+                                  MappedCompare>::Iterator {
+ public:
+  using iterator_category = std::random_access_iterator_tag;
+  using value_type = const typename MultiIndexOrderStatisticMap::value_type;
+  using difference_type = ptrdiff_t;
+  using pointer = value_type *;
+  using reference = value_type &;
+
+  Iterator(const MultiIndexOrderStatisticMap *map, size_t idx, Node *node)
+      : map_(map), idx_(idx), node_(node) {
+    DCHECK(idx <= map->size());
+  }
+
+  Iterator &operator++() { return *this += 1; }
+  Iterator &operator--() { return *this -= 1; }
+  Iterator operator++(int) {
+    Iterator tmp = *this;
+    ++*this;
+    return tmp;
+  }
+  Iterator operator--(int) {
+    Iterator tmp = *this;
+    --*this;
+    return tmp;
+  }
+  pointer operator->() const { return &node_->value; }
+  reference operator*() const { return node_->value; }
+  reference operator[](std::ptrdiff_t idx) const { return *(*this + idx); }
+  // The rank in this iterator's order.
+  size_t rank() const { return idx_; }
+
+  Iterator &operator+=(ptrdiff_t n) {
+    if (n < 0) {
+      CHECK_LE(-n, idx_);  // Crash OK
+    } else {
+      CHECK_LE(idx_ + n, map_->size());  // Crash OK
+    }
+    idx_ += n;
+    node_ = map_->template Select<I>(idx_);
+    return *this;
+  }
+  Iterator &operator-=(ptrdiff_t n) { return *this += -n; }
+  friend Iterator operator+(Iterator lhs, ptrdiff_t rhs) { return lhs += rhs; }
+  friend Iterator operator+(ptrdiff_t n, Iterator v) { return v + n; }
+  friend Iterator operator-(Iterator lhs, ptrdiff_t rhs) { return lhs -= rhs; }
+  friend ptrdiff_t operator-(Iterator lhs, Iterator rhs) {
+    return lhs.idx_ - rhs.idx_;
+  }
+
+  friend bool operator==(const Iterator &a, const Iterator &b) {
+    DCHECK(a.map_ == b.map_);
+    return a.idx_ == b.idx_;
+  }
+  friend bool operator!=(const Iterator &a, const Iterator &b) {
+    return !(a == b);
+  }
+  friend bool operator<(const Iterator &a, const Iterator &b) {
+    DCHECK(a.map_ == b.map_);
+    return a.idx_ < b.idx_;
+  }
+  friend bool operator<=(const Iterator &a, const Iterator &b) {
+    return !(b < a);
+  }
+  friend bool operator>(const Iterator &a, const Iterator &b) { return b < a; }
+  friend bool operator>=(const Iterator &a, const Iterator &b) {
+    return !(a < b);
+  }
+
+ private:
+  friend MultiIndexOrderStatisticMap;
+
+  const MultiIndexOrderStatisticMap *map_;
+  size_t idx_;
+  Node *node_;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_MULTI_INDEX_ORDER_STATISTIC_MAP_H_
@@ -0,0 +1,121 @@
+#include "multi_index_order_statistic_map.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::ElementsAre;
+using ::testing::Pair;
+
+TEST(MultiIndexOrderStatisticMapTest, Basic) {
+  MultiIndexOrderStatisticMap<std::string, int> scores;
+  EXPECT_TRUE(scores.empty());
+  EXPECT_TRUE(scores.insert("carol", 30).second);
+  EXPECT_TRUE(scores.insert("alice", 50).second);
+  EXPECT_TRUE(scores.insert("bob", 30).second);
+  EXPECT_FALSE(scores.insert("bob", 99).second);
+  EXPECT_EQ(scores.size(), 3);
+  EXPECT_THAT(scores,
+              ElementsAre(Pair("alice", 50), Pair("bob", 30), Pair("carol", 30)));
+  std::vector<std::string> by_value;
+  for (auto it = scores.value_begin(); it != scores.value_end(); ++it) {
+    by_value.push_back(it->first);
+  }
+  EXPECT_THAT(by_value, ElementsAre("bob", "carol", "alice"));
+  EXPECT_EQ(scores.select_by_key(1)->first, "bob");
+  EXPECT_EQ(scores.select_by_value(2)->first, "alice");
+  EXPECT_EQ(scores.select_by_value(3), scores.value_end());
+  EXPECT_EQ(scores.rank_by_key("bob"), 1);
+  EXPECT_EQ(scores.rank_by_value(scores.find("carol")), 1);
+  EXPECT_EQ(scores.rank_by_value(40), 2);
+  EXPECT_EQ(scores.value_lower_bound(40)->first, "alice");
+
+  // Moves bob to the top without reallocating him.
+  auto bob = scores.find("bob");
+  const auto *bob_address = &*bob;
+  scores.assign(bob, 70);
+  EXPECT_EQ(&*scores.find("bob"), bob_address);
+  EXPECT_EQ(scores.rank_by_value(bob), 2);
+  EXPECT_EQ(scores.to_value_iterator(bob).rank(), 2);
+  EXPECT_EQ(scores.to_key_iterator(scores.select_by_value(0))->first, "carol");
+  EXPECT_FALSE(scores.insert_or_assign("carol", 10).second);
+  EXPECT_EQ(scores.find("carol")->second, 10);
+  scores.Check();
+
+  EXPECT_EQ(scores.erase("alice"), 1);
+  EXPECT_EQ(scores.erase("alice"), 0);
+  auto next = scores.erase(scores.find("bob"));
+  EXPECT_EQ(next->first, "carol");
+  EXPECT_THAT(scores, ElementsAre(Pair("carol", 10)));
+  scores.Check();
+  scores.clear();
+  EXPECT_TRUE(scores.empty());
+}
+
+TEST(MultiIndexOrderStatisticMapTest, IteratorComparisons) {
+  MultiIndexOrderStatisticMap<int, int> map;
+  for (int k = 0; k < 10; ++k) map.insert(k, -k);
+  auto a = map.begin() + 3, b = map.begin() + 7;
+  EXPECT_TRUE(a < b);
+  EXPECT_TRUE(a <= b);
+  EXPECT_TRUE(a <= a);
+  EXPECT_FALSE(a > b);
+  EXPECT_TRUE(b > a);
+  EXPECT_TRUE(b >= a);
+  EXPECT_TRUE(b >= b);
+  EXPECT_FALSE(a >= b);
+  EXPECT_TRUE(b < map.end());
+  EXPECT_TRUE(map.value_begin() < map.value_end());
+  EXPECT_TRUE(map.value_end() >= map.value_begin() + 10);
+}
+
+TEST(MultiIndexOrderStatisticMapTest, Randomized) {
+  absl::BitGen bitgen;
+  MultiIndexOrderStatisticMap<int, int> map;
+  std::map<int, int> expected;
+  for (size_t i = 0; i < 10000; ++i) {
+    int k = absl::Uniform(bitgen, 0, 500);
+    int v = absl::Uniform(bitgen, 0, 50);
+    switch (absl::Uniform(bitgen, 0, 3)) {
+      case 0:
+        map.insert_or_assign(k, v);
+        expected[k] = v;
+        break;
+      case 1:
+        EXPECT_EQ(map.erase(k), expected.erase(k));
+        break;
+      case 2:
+        if (auto it = map.find(k); it != map.end()) {
+          map.assign(it, v);
+          expected[k] = v;
+        }
+        break;
+    }
+    ASSERT_EQ(map.size(), expected.size());
+    if (i % 100 != 0) continue;
+    map.Check();
+    std::vector<std::pair<int, int>> by_value;
+    for (const auto &[key, value] : expected) by_value.emplace_back(value, key);
+    std::sort(by_value.begin(), by_value.end());
+    for (size_t r = 0; r < by_value.size(); ++r) {
+      auto it = map.select_by_value(r);
+      EXPECT_EQ(it->first, by_value[r].second);
+      EXPECT_EQ(it->second, by_value[r].first);
+      EXPECT_EQ(map.rank_by_value(map.find(it->first)), r);
+    }
+    EXPECT_TRUE(std::equal(map.begin(), map.end(), expected.begin(),
+                           expected.end()));
+  }
+}
+
+}  // namespace cachelib
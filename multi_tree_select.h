@@ -0,0 +1,320 @@
+// Order statistics across many independent trees, without merging them.
+//
+// Given trees `t_0, ..., t_{m-1}` (such as per-tenant OrderStatisticSets, or
+// PrefixSumMaps), these functions answer questions about the multiset union of
+// their elements, ordered by key and then (among equivalent keys) by the index
+// of the tree:
+//
+//   MultiTreeRank(trees, k)   The number of elements less than `k`.
+//   MultiTreeSumLess(trees, k)
+//                             The sum of the mapped values of those elements
+//                             (for PrefixSumMaps).
+//   MultiTreeSelect(trees, r) The tree index of, and an iterator to, the
+//                             element of rank `r`.
+//   MultiTreeSelectByPrefixSum(trees, x)
+//                             The same for the first element at which the
+//                             running sum of the mapped values reaches `x`
+//                             (for PrefixSumMaps with arithmetic values).
+//
+// The selects are a pivot search in the style of Frederickson and Johnson.
+// Each tree keeps a window of the ranks that may still hold the answer.  Each
+// round takes the middle element of each nonempty window, picks the weighted
+// median of those (weighted by the window sizes) as the pivot, and finds the
+// pivot's rank in every tree with `lower_bound()` and `upper_bound()`.  Then
+// either the pivot is the answer, or every window is cut to the side of the
+// pivot that holds the answer, which removes at least a quarter of the
+// remaining candidates.  So a select makes O(log N) rounds of O(m' log n) time
+// each, for N elements in all, at most n in one tree, and m' trees whose
+// windows are still nonempty.  A tree whose window has emptied costs nothing
+// more, and a tree whose window didn't change keeps its middle element.
+//
+// That is linear in the number of trees, not polylogarithmic in N: each round
+// still searches every tree with a nonempty window, so with hundreds of trees
+// (say 512, of 10^4 elements each) a select takes milliseconds.  Getting
+// O(polylog N) would take an index over all the trees (such as a tree of the
+// trees' sizes and sums, kept up to date on every insert and erase), which
+// these functions, given only the trees, can't keep.  When selects across many
+// trees are frequent, keep one combined tree instead.
+//
+// Example:
+//
+//   std::vector<const OrderStatisticSet<uint64_t> *> tenants = ...;
+//   auto trees = absl::MakeConstSpan(tenants);
+//   if (auto found = MultiTreeSelect(trees, 1000000)) {
+//     auto [tenant, it] = *found;
+//     ...
+//   }
+
+#ifndef NET_BANDAID_BDN_CACHELIB_MULTI_TREE_SELECT_H_
+#define NET_BANDAID_BDN_CACHELIB_MULTI_TREE_SELECT_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/types/span.h"
+
+namespace cachelib {
+
+// A tree index and an iterator into that tree, or nullopt if there is no such
+// element.
+template <class Tree>
+using MultiTreeResult =
+    std::optional<std::pair<size_t, typename Tree::const_iterator>>;
+
+namespace cachelib_internal {
+
+// Returns the key of `v`, a set's value or a map's `(key, mapped)` pair.
+template <class Tree>
+const typename Tree::key_type &MultiTreeKey(
+    const typename Tree::value_type &v) {
+  if constexpr (std::is_same_v<typename Tree::key_type,
+                               typename Tree::value_type>) {
+    return v;
+  } else {
+    return v.first;
+  }
+}
+
+// The pivot search shared by the selects.  Each round calls `side(less,
+// not_greater)`, where `less[i]` and `not_greater[i]` are the numbers of
+// elements of tree `i` that are less than, and not greater than, the pivot.
+// `side` returns a negative number if the answer is less than the pivot, a
+// positive number if it is greater, and zero if it is equivalent, in which
+// case the search returns `resolve(less, not_greater)`.  Returns nullopt if
+// the windows run out.
+template <class Tree, class Side, class Resolve>
+MultiTreeResult<Tree> MultiTreeSearch(absl::Span<const Tree *const> trees,
+                                      Side side, Resolve resolve) {
+  using Key = typename Tree::key_type;
+  size_t m = trees.size();
+  if (m == 0) return std::nullopt;
+  std::vector<size_t> lo(m, 0), hi(m), less(m), not_greater(m);
+  for (size_t i = 0; i < m; ++i) hi[i] = trees[i]->size();
+  // The key in the middle of each tree's window, or nullptr if the window
+  // changed since it was found.
+  std::vector<const Key *> mid_key(m, nullptr);
+  struct Candidate {
+    const Key *key;
+    size_t weight;
+  };
+  std::vector<Candidate> candidates;
+  candidates.reserve(m);
+  auto key_comp = trees[0]->key_comp();
+  while (true) {
+    candidates.clear();
+    size_t remaining = 0;
+    for (size_t i = 0; i < m; ++i) {
+      if (lo[i] == hi[i]) continue;
+      if (mid_key[i] == nullptr) {
+        auto mid = trees[i]->select(lo[i] + (hi[i] - lo[i]) / 2);
+        mid_key[i] = &MultiTreeKey<Tree>(*mid);
+      }
+      candidates.push_back({mid_key[i], hi[i] - lo[i]});
+      remaining += hi[i] - lo[i];
+    }
+    if (candidates.empty()) return std::nullopt;
+    std::sort(candidates.begin(), candidates.end(),
+              [&key_comp](const Candidate &a, const Candidate &b) {
+                return key_comp(*a.key, *b.key);
+              });
+    // The weighted median: at least half the candidates are in windows whose
+    // middle is not greater than it, and at least half in windows whose
+    // middle is not less than it.
+    const Key *pivot = nullptr;
+    size_t below = 0;
+    for (const Candidate &c : candidates) {
+      below += c.weight;
+      if (2 * below >= remaining) {
+        pivot = c.key;
+        break;
+      }
+    }
+    for (size_t i = 0; i < m; ++i) {
+      // Every pivot lies between the earlier ones on the answer's side, so the
+      // elements below `lo[i]` are less than it and those from `hi[i]` on are
+      // greater.  A tree whose window is empty needs no search.
+      if (lo[i] == hi[i]) {
+        less[i] = not_greater[i] = lo[i];
+        continue;
+      }
+      // Only a tree that holds an equivalent of the pivot needs a second
+      // search for the end of the equivalents.
+      auto lower = trees[i]->lower_bound(*pivot);
+      less[i] = lower.rank();
+      if (lower == trees[i]->end() ||
+          key_comp(*pivot, MultiTreeKey<Tree>(*lower))) {
+        not_greater[i] = less[i];
+      } else {
+        not_greater[i] = trees[i]->upper_bound(*pivot).rank();
+      }
+    }
+    int s = side(less, not_greater);
+    if (s == 0) return resolve(less, not_greater);
+    for (size_t i = 0; i < m; ++i) {
+      size_t old_lo = lo[i], old_hi = hi[i];
+      if (s < 0) {
+        hi[i] = std::max(lo[i], std::min(hi[i], less[i]));
+      } else {
+        lo[i] = std::min(hi[i], std::max(lo[i], not_greater[i]));
+      }
+      if (lo[i] != old_lo || hi[i] != old_hi) mid_key[i] = nullptr;
+    }
+  }
+}
+
+// Returns `trees[i]->SumFirstN(n)`, remembering the last answer for each tree,
+// so that a tree asked the same `n` round after round (as one whose window
+// has emptied is) is summed only once.
+template <class Tree>
+class SumFirstNCache {
+ public:
+  using T = typename Tree::mapped_type;
+
+  explicit SumFirstNCache(absl::Span<const Tree *const> trees)
+      : trees_(trees), n_(trees.size(), kNone), sums_(trees.size()) {}
+
+  const T &SumFirstN(size_t i, size_t n) {
+    if (n_[i] != n) {
+      n_[i] = n;
+      sums_[i] = trees_[i]->SumFirstN(n);
+    }
+    return sums_[i];
+  }
+
+ private:
+  static constexpr size_t kNone = ~size_t{0};
+
+  absl::Span<const Tree *const> trees_;
+  std::vector<size_t> n_;
+  std::vector<T> sums_;
+};
+
+}  // namespace cachelib_internal
+
+// Returns the number of elements, in all of `trees`, that are less than `k`.
+// Takes O(m log n) time.
+template <class Tree, class K>
+size_t MultiTreeRank(absl::Span<const Tree *const> trees, const K &k) {
+  size_t rank = 0;
+  for (const Tree *tree : trees) rank += tree->lower_bound(k).rank();
+  return rank;
+}
+
+// Returns the sum of the mapped values of the elements, in all of `trees`
+// (which are PrefixSumMaps), whose keys are less than `k`.  Takes O(m log n)
+// time.
+template <class Tree, class K>
+typename Tree::mapped_type MultiTreeSumLess(absl::Span<const Tree *const> trees,
+                                            const K &k) {
+  typename Tree::mapped_type sum{};
+  for (const Tree *tree : trees) sum += tree->SumLess(k);
+  return sum;
+}
+
+// Returns the index of the tree holding the element of rank `r` in the union
+// of `trees`, and an iterator to it, or nullopt if there are at most `r`
+// elements in all.  Takes O(m log N (log n + log m)) time.
+template <class Tree>
+MultiTreeResult<Tree> MultiTreeSelect(absl::Span<const Tree *const> trees,
+                                      size_t r) {
+  size_t total_less = 0;
+  auto side = [r, &total_less](const std::vector<size_t> &less,
+                               const std::vector<size_t> &not_greater) {
+    size_t total_not_greater = 0;
+    total_less = 0;
+    for (size_t i = 0; i < less.size(); ++i) {
+      total_less += less[i];
+      total_not_greater += not_greater[i];
+    }
+    if (r < total_less) return -1;
+    if (r >= total_not_greater) return 1;
+    return 0;
+  };
+  auto resolve = [&trees, r, &total_less](
+                     const std::vector<size_t> &less,
+                     const std::vector<size_t> &not_greater)
+      -> MultiTreeResult<Tree> {
+    // The pivot's equivalents come in tree order.
+    size_t rank = total_less;
+    for (size_t i = 0; i < trees.size(); ++i) {
+      size_t equal = not_greater[i] - less[i];
+      if (r < rank + equal) {
+        return std::make_pair(i, trees[i]->select(less[i] + (r - rank)));
+      }
+      rank += equal;
+    }
+    LOG(FATAL) << "The pivot's equivalents don't hold rank " << r;
+    return std::nullopt;
+  };
+  return cachelib_internal::MultiTreeSearch(trees, side, resolve);
+}
+
+// Returns the index of the tree holding the first element (in the order of
+// the union of `trees`, which are PrefixSumMaps) at which the running sum of
+// the mapped values reaches `x`, and an iterator to it, or nullopt if the sum
+// of all the values is less than `x`.  This is the union's analogue of
+// `PrefixSumMap::SelectByPrefixSum()`.  The mapped values must be arithmetic
+// and not negative.  Takes O(m log N (log n + log m)) time.
+template <class Tree>
+MultiTreeResult<Tree> MultiTreeSelectByPrefixSum(
+    absl::Span<const Tree *const> trees,
+    const typename Tree::mapped_type &x) {
+  using T = typename Tree::mapped_type;
+  static_assert(std::is_arithmetic_v<T>,
+                "Selecting across trees needs an arithmetic mapped type");
+  T sum_less{};
+  cachelib_internal::SumFirstNCache<Tree> sums_less(trees),
+      sums_not_greater(trees);
+  auto side = [&trees, &x, &sum_less, &sums_less, &sums_not_greater](
+                  const std::vector<size_t> &less,
+                  const std::vector<size_t> &not_greater) {
+    size_t total_less = 0;
+    T sum_not_greater{};
+    sum_less = T{};
+    for (size_t i = 0; i < trees.size(); ++i) {
+      total_less += less[i];
+      sum_less += sums_less.SumFirstN(i, less[i]);
+      sum_not_greater += less[i] == not_greater[i]
+                             ? sums_less.SumFirstN(i, less[i])
+                             : sums_not_greater.SumFirstN(i, not_greater[i]);
+    }
+    if (total_less > 0 && !(sum_less < x)) return -1;
+    if (sum_not_greater < x) return 1;
+    return 0;
+  };
+  auto resolve = [&trees, &x, &sum_less, &sums_less](
+                     const std::vector<size_t> &less,
+                     const std::vector<size_t> &not_greater)
+      -> MultiTreeResult<Tree> {
+    // The pivot's equivalents come in tree order.
+    T sum = sum_less;
+    for (size_t i = 0; i < trees.size(); ++i) {
+      if (less[i] == not_greater[i]) continue;
+      if (!(sum < x)) return std::make_pair(i, trees[i]->select(less[i]));
+      T before = sums_less.SumFirstN(i, less[i]);
+      T equal = trees[i]->SumRange(less[i], not_greater[i]);
+      if (!(sum + equal < x)) {
+        // Every element before `less[i]` has a running sum of at most
+        // `before`, which is less than this target, so this finds an
+        // equivalent of the pivot.
+        auto found = trees[i]->SelectByPrefixSum(x - sum + before).first;
+        DCHECK_GE(found.rank(), less[i]);
+        DCHECK_LT(found.rank(), not_greater[i]);
+        return std::make_pair(i, found);
+      }
+      sum += equal;
+    }
+    LOG(FATAL) << "The pivot's equivalents don't reach " << x;
+    return std::nullopt;
+  };
+  return cachelib_internal::MultiTreeSearch(trees, side, resolve);
+}
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_MULTI_TREE_SELECT_H_
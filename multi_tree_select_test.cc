@@ -0,0 +1,112 @@
+#include "multi_tree_select.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+#include "absl/types/span.h"
+#include "order_statistic_set.h"
+#include "prefix_sum_map.h"
+
+namespace cachelib {
+
+TEST(MultiTreeSelectTest, Sets) {
+  absl::BitGen bitgen;
+  using Set = OrderStatisticSet<int>;
+  std::vector<Set> sets(17);
+  // The union, as (key, tree) pairs in the order the functions use.
+  std::vector<std::pair<int, size_t>> all;
+  for (size_t i = 0; i < sets.size(); ++i) {
+    // Some trees are empty, and the keys collide across trees.
+    size_t n = i % 5 == 0 ? 0 : absl::Uniform<size_t>(bitgen, 1, 300);
+    for (size_t j = 0; j < n; ++j) {
+      int k = absl::Uniform<int>(bitgen, 0, 1000);
+      if (sets[i].insert(k).second) all.emplace_back(k, i);
+    }
+  }
+  std::sort(all.begin(), all.end());
+  std::vector<const Set *> pointers;
+  for (const Set &s : sets) pointers.push_back(&s);
+  auto trees = absl::MakeConstSpan(pointers);
+
+  for (size_t r = 0; r < all.size(); ++r) {
+    auto found = MultiTreeSelect(trees, r);
+    ASSERT_TRUE(found.has_value()) << r;
+    auto [tree, it] = *found;
+    EXPECT_EQ(tree, all[r].second) << r;
+    EXPECT_EQ(*it, all[r].first) << r;
+    EXPECT_EQ(MultiTreeRank(trees, *it),
+              std::lower_bound(all.begin(), all.end(),
+                               std::make_pair(*it, size_t{0})) -
+                  all.begin());
+  }
+  EXPECT_FALSE(MultiTreeSelect(trees, all.size()).has_value());
+  EXPECT_EQ(MultiTreeRank(trees, -1), 0);
+  EXPECT_EQ(MultiTreeRank(trees, 1000), all.size());
+  EXPECT_FALSE(
+      MultiTreeSelect(absl::Span<const Set *const>(), 0).has_value());
+}
+
+TEST(MultiTreeSelectTest, WeightedPrefixSumMaps) {
+  absl::BitGen bitgen;
+  using Map = PrefixSumMap<int, int64_t>;
+  std::vector<Map> maps(9);
+  // The union, as (key, tree, weight) in the order the functions use.
+  std::vector<std::tuple<int, size_t, int64_t>> all;
+  for (size_t i = 0; i < maps.size(); ++i) {
+    size_t n = i == 4 ? 0 : absl::Uniform<size_t>(bitgen, 1, 200);
+    for (size_t j = 0; j < n; ++j) {
+      int k = absl::Uniform<int>(bitgen, 0, 500);
+      // A quarter of the weights are zero.
+      int64_t w = std::max<int64_t>(0, absl::Uniform<int64_t>(bitgen, -3, 10));
+      if (maps[i].contains(k)) continue;
+      maps[i].insert_or_assign(k, w);
+      all.emplace_back(k, i, w);
+    }
+  }
+  std::sort(all.begin(), all.end());
+  std::vector<const Map *> pointers;
+  for (const Map &m : maps) pointers.push_back(&m);
+  auto trees = absl::MakeConstSpan(pointers);
+
+  int64_t total = 0;
+  for (const auto &[k, tree, w] : all) total += w;
+  for (int64_t x = 0; x <= total + 1; ++x) {
+    // The first element at which the running sum reaches `x`.
+    int64_t sum = 0;
+    size_t expected = all.size();
+    for (size_t r = 0; r < all.size(); ++r) {
+      sum += std::get<2>(all[r]);
+      if (sum >= x) {
+        expected = r;
+        break;
+      }
+    }
+    auto found = MultiTreeSelectByPrefixSum(trees, x);
+    if (expected == all.size()) {
+      EXPECT_FALSE(found.has_value()) << x;
+      continue;
+    }
+    ASSERT_TRUE(found.has_value()) << x;
+    auto [tree, it] = *found;
+    EXPECT_EQ(tree, std::get<1>(all[expected])) << x;
+    EXPECT_EQ(it->first, std::get<0>(all[expected])) << x;
+  }
+  // The unweighted functions work on maps too.
+  for (size_t r = 0; r < all.size(); r += 7) {
+    auto [tree, it] = *MultiTreeSelect(trees, r);
+    EXPECT_EQ(tree, std::get<1>(all[r]));
+    EXPECT_EQ(it->first, std::get<0>(all[r]));
+  }
+  int64_t less_than_250 = 0;
+  for (const auto &[k, tree, w] : all) less_than_250 += k < 250 ? w : 0;
+  EXPECT_EQ(MultiTreeSumLess(trees, 250), less_than_250);
+}
+
+}  // namespace cachelib
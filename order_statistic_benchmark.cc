@@ -0,0 +1,567 @@
+// A multi-threaded benchmark for the order-statistic containers.
+//
+// Each run prefills a container and then has `T` threads apply a random mix of
+// operations (find, select, rank, insert, erase, SumFirstN) for a fixed time,
+// for each of the requested containers and thread counts.  It reports the
+// total throughput, and the throughput and latency percentiles for each kind
+// of operation.
+//
+// The containers are wrapped in synchronization adapters, which all provide the
+// same per-thread `Handle` interface:
+//
+//   mutex:          PrefixSumMap behind a std::mutex.
+//   shared_mutex:   PrefixSumMap behind a std::shared_mutex (reads shared).
+//   buffered_mutex: WriteBufferedMap<PrefixSumMap> behind a std::mutex.
+//   single_writer:  SingleWriterPrefixSumMap: lock-free readers, and writers
+//                   serialized by a std::mutex.
+//   concurrent:     ConcurrentOrderStatisticMap (no SumFirstN).
+//   combining:      CombiningOrderStatisticMap (no SumFirstN).
+//
+// Example:
+//
+//   order_statistic_benchmark --containers=mutex,combining
+//       --threads=1,2,4,8,16,32 --keys=zipf --find=50 --insert=25 --erase=25
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/random/random.h"
+#include "absl/random/zipf_distribution.h"
+#include "combining_order_statistic_map.h"
+#include "concurrent_order_statistic_map.h"
+#include "prefix_sum_map.h"
+#include "single_writer_order_statistic_set.h"
+#include "write_buffered_map.h"
+
+ABSL_FLAG(std::vector<std::string>, containers,
+          std::vector<std::string>({"mutex", "shared_mutex", "buffered_mutex",
+                                    "single_writer", "concurrent",
+                                    "combining"}),
+          "Which containers to benchmark.");
+ABSL_FLAG(std::vector<std::string>, threads,
+          std::vector<std::string>({"1", "2", "4", "8"}),
+          "The thread counts to run with.");
+ABSL_FLAG(std::string, keys, "uniform",
+          "The key distribution: uniform, zipf, or sequential.");
+ABSL_FLAG(uint64_t, key_space, 1 << 20, "Keys are drawn from [0, key_space).");
+ABSL_FLAG(double, zipf_q, 1.1, "The exponent of the Zipf distribution.");
+ABSL_FLAG(double, prefill, 0.5,
+          "The fraction of the key space inserted before timing starts.");
+ABSL_FLAG(double, seconds, 2.0, "How long to run each configuration.");
+ABSL_FLAG(int, find, 40, "Relative weight of find operations.");
+ABSL_FLAG(int, select, 10, "Relative weight of select operations.");
+ABSL_FLAG(int, rank, 10, "Relative weight of rank operations.");
+ABSL_FLAG(int, insert, 20, "Relative weight of insert_or_assign operations.");
+ABSL_FLAG(int, erase, 20, "Relative weight of erase operations.");
+ABSL_FLAG(int, sum, 0,
+          "Relative weight of SumFirstN operations (only for containers that "
+          "support it).");
+
+namespace cachelib {
+namespace {
+
+enum OpKind { kFind, kSelect, kRank, kInsert, kErase, kSum, kNumOpKinds };
+constexpr std::array<const char *, kNumOpKinds> kOpNames = {
+    "find", "select", "rank", "insert", "erase", "sum"};
+
+//**************** Latency histogram ****************
+
+// A log-linear histogram of latencies in nanoseconds: each power of two is
+// split into 16 buckets, so percentiles are accurate to about 6%.
+class Histogram {
+ public:
+  void Add(uint64_t ns) {
+    ++counts_[Bucket(ns)];
+    ++total_;
+  }
+
+  void Merge(const Histogram &other) {
+    for (size_t i = 0; i < kNumBuckets; ++i) counts_[i] += other.counts_[i];
+    total_ += other.total_;
+  }
+
+  uint64_t count() const { return total_; }
+
+  // Returns (an upper bound for) the latency at quantile `q`.
+  uint64_t Percentile(double q) const {
+    uint64_t target = static_cast<uint64_t>(std::ceil(q * total_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= target && seen > 0) return UpperBound(i);
+    }
+    return 0;
+  }
+
+ private:
+  static constexpr size_t kSubBits = 4;
+  static constexpr size_t kSub = 1 << kSubBits;
+  static constexpr size_t kNumBuckets = 64 * kSub;
+
+  static size_t Bucket(uint64_t ns) {
+    if (ns < kSub) return ns;
+    int log = 63 - __builtin_clzll(ns);
+    uint64_t sub = (ns >> (log - kSubBits)) & (kSub - 1);
+    return (log - kSubBits + 1) * kSub + sub;
+  }
+
+  static uint64_t UpperBound(size_t bucket) {
+    if (bucket < kSub) return bucket;
+    size_t log = bucket / kSub + kSubBits - 1;
+    uint64_t sub = bucket % kSub;
+    return ((kSub + sub + 1) << (log - kSubBits)) - 1;
+  }
+
+  std::array<uint64_t, kNumBuckets> counts_{};
+  uint64_t total_ = 0;
+};
+
+//**************** Synchronization adapters ****************
+
+// Each adapter has a nested `Handle`, constructed once per thread, with the
+// operations `Find(k)`, `Select(r)` (selects rank `r % size`), `Rank(k)`,
+// `Insert(k, v)`, `Erase(k)`, and `Sum(r)` (sums the first `r % (size + 1)`
+// values).  The results are returned so that they can't be optimized away.
+
+template <class Tree, class Mutex = std::mutex>
+class LockedAdapter {
+ public:
+  static constexpr bool kHasSums = true;
+
+  class Handle {
+   public:
+    explicit Handle(LockedAdapter *adapter) : a_(adapter) {}
+
+    uint64_t Find(uint64_t k) {
+      std::shared_lock<Mutex> lock(a_->mu_);
+      return a_->tree_.contains(k);
+    }
+    uint64_t Select(uint64_t r) {
+      std::shared_lock<Mutex> lock(a_->mu_);
+      size_t size = a_->tree_.size();
+      if (size == 0) return 0;
+      return a_->tree_.select(r % size)->first;
+    }
+    uint64_t Rank(uint64_t k) {
+      std::shared_lock<Mutex> lock(a_->mu_);
+      return a_->tree_.lower_bound(k).rank();
+    }
+    uint64_t Insert(uint64_t k, uint64_t v) {
+      std::lock_guard<Mutex> lock(a_->mu_);
+      return a_->tree_.insert_or_assign(k, v).second;
+    }
+    uint64_t Erase(uint64_t k) {
+      std::lock_guard<Mutex> lock(a_->mu_);
+      return a_->tree_.erase(k);
+    }
+    uint64_t Sum(uint64_t r) {
+      std::shared_lock<Mutex> lock(a_->mu_);
+      return a_->tree_.SumFirstN(r % (a_->tree_.size() + 1));
+    }
+
+   private:
+    LockedAdapter *a_;
+  };
+
+ private:
+  Mutex mu_;
+  Tree tree_;
+};
+
+// A std::mutex has no lock_shared(), so give it one.
+class ExclusiveMutex : public std::mutex {
+ public:
+  void lock_shared() { lock(); }
+  void unlock_shared() { unlock(); }
+};
+
+using MutexAdapter = LockedAdapter<PrefixSumMap<uint64_t, uint64_t>,
+                                   ExclusiveMutex>;
+using SharedMutexAdapter = LockedAdapter<PrefixSumMap<uint64_t, uint64_t>,
+                                         std::shared_mutex>;
+
+// The WriteBufferedMap has a different interface, so it gets its own adapter.
+class BufferedMutexAdapter {
+ public:
+  static constexpr bool kHasSums = true;
+
+  class Handle {
+   public:
+    explicit Handle(BufferedMutexAdapter *adapter) : a_(adapter) {}
+
+    uint64_t Find(uint64_t k) {
+      std::lock_guard<std::mutex> lock(a_->mu_);
+      return a_->map_.contains(k);
+    }
+    uint64_t Select(uint64_t r) {
+      std::lock_guard<std::mutex> lock(a_->mu_);
+      size_t size = a_->map_.size();
+      if (size == 0) return 0;
+      return a_->map_.select(r % size)->first;
+    }
+    uint64_t Rank(uint64_t k) {
+      std::lock_guard<std::mutex> lock(a_->mu_);
+      return a_->map_.rank(k);
+    }
+    uint64_t Insert(uint64_t k, uint64_t v) {
+      std::lock_guard<std::mutex> lock(a_->mu_);
+      return a_->map_.insert_or_assign(k, v);
+    }
+    uint64_t Erase(uint64_t k) {
+      std::lock_guard<std::mutex> lock(a_->mu_);
+      return a_->map_.erase(k);
+    }
+    uint64_t Sum(uint64_t r) {
+      std::lock_guard<std::mutex> lock(a_->mu_);
+      return a_->map_.SumFirstN(r % (a_->map_.size() + 1));
+    }
+
+   private:
+    BufferedMutexAdapter *a_;
+  };
+
+ private:
+  std::mutex mu_;
+  WriteBufferedMap<PrefixSumMap<uint64_t, uint64_t>> map_;
+};
+
+// Shared code for the containers whose readers work on snapshots.
+template <class Snapshotter>
+uint64_t SnapshotSelect(Snapshotter &reader, uint64_t r) {
+  auto snapshot = reader.snapshot();
+  size_t size = snapshot.size();
+  if (size == 0) return 0;
+  return snapshot.select(r % size)->first;
+}
+
+class SingleWriterAdapter {
+ public:
+  static constexpr bool kHasSums = true;
+
+  class Handle {
+   public:
+    explicit Handle(SingleWriterAdapter *adapter)
+        : a_(adapter), reader_(&adapter->map_) {}
+
+    uint64_t Find(uint64_t k) { return reader_.contains(k); }
+    uint64_t Select(uint64_t r) { return SnapshotSelect(reader_, r); }
+    uint64_t Rank(uint64_t k) { return reader_.rank(k); }
+    uint64_t Insert(uint64_t k, uint64_t v) {
+      std::lock_guard<std::mutex> lock(a_->writer_mu_);
+      return a_->map_.insert_or_assign(k, v);
+    }
+    uint64_t Erase(uint64_t k) {
+      std::lock_guard<std::mutex> lock(a_->writer_mu_);
+      return a_->map_.erase(k);
+    }
+    uint64_t Sum(uint64_t r) {
+      auto snapshot = reader_.snapshot();
+      return snapshot.SumFirstN(r % (snapshot.size() + 1));
+    }
+
+   private:
+    SingleWriterAdapter *a_;
+    SingleWriterPrefixSumMap<uint64_t, uint64_t>::Reader reader_;
+  };
+
+ private:
+  std::mutex writer_mu_;
+  SingleWriterPrefixSumMap<uint64_t, uint64_t> map_;
+};
+
+class ConcurrentAdapter {
+ public:
+  static constexpr bool kHasSums = false;
+
+  class Handle {
+   public:
+    explicit Handle(ConcurrentAdapter *adapter) : handle_(&adapter->map_) {}
+
+    uint64_t Find(uint64_t k) { return handle_.contains(k); }
+    uint64_t Select(uint64_t r) {
+      // The size may change before the select, in which case we come up
+      // empty, which is fine for a benchmark.
+      size_t size = handle_.size();
+      if (size == 0) return 0;
+      auto v = handle_.select(r % size);
+      return v ? v->first : 0;
+    }
+    uint64_t Rank(uint64_t k) { return handle_.rank(k); }
+    uint64_t Insert(uint64_t k, uint64_t v) {
+      return handle_.insert_or_assign(k, v);
+    }
+    uint64_t Erase(uint64_t k) { return handle_.erase(k); }
+    uint64_t Sum(uint64_t) {
+      LOG(FATAL) << "No SumFirstN";
+      return 0;
+    }
+
+   private:
+    ConcurrentOrderStatisticMap<uint64_t, uint64_t>::Handle handle_;
+  };
+
+ private:
+  ConcurrentOrderStatisticMap<uint64_t, uint64_t> map_;
+};
+
+class CombiningAdapter {
+ public:
+  static constexpr bool kHasSums = false;
+
+  class Handle {
+   public:
+    explicit Handle(CombiningAdapter *adapter) : handle_(&adapter->map_) {}
+
+    uint64_t Find(uint64_t k) { return handle_.contains(k); }
+    uint64_t Select(uint64_t r) {
+      // The size may change before the select, in which case we come up
+      // empty, which is fine for a benchmark.
+      size_t size = handle_.size();
+      if (size == 0) return 0;
+      auto v = handle_.select(r % size);
+      return v ? v->first : 0;
+    }
+    uint64_t Rank(uint64_t k) { return handle_.rank(k); }
+    uint64_t Insert(uint64_t k, uint64_t v) {
+      return handle_.insert_or_assign(k, v);
+    }
+    uint64_t Erase(uint64_t k) { return handle_.erase(k); }
+    uint64_t Sum(uint64_t) {
+      LOG(FATAL) << "No SumFirstN";
+      return 0;
+    }
+
+   private:
+    CombiningOrderStatisticMap<uint64_t, uint64_t>::Handle handle_;
+  };
+
+ private:
+  CombiningOrderStatisticMap<uint64_t, uint64_t> map_;
+};
+
+//**************** The workload ****************
+
+enum class KeyDistribution { kUniform, kZipf, kSequential };
+
+struct Workload {
+  KeyDistribution keys;
+  uint64_t key_space;
+  double zipf_q;
+  double prefill;
+  double seconds;
+  // Cumulative weights, indexed by OpKind.
+  std::array<int, kNumOpKinds> cumulative_weights;
+};
+
+// Generates keys for one thread.
+class KeyGenerator {
+ public:
+  KeyGenerator(const Workload &w, std::atomic<uint64_t> *sequence)
+      : w_(w),
+        sequence_(sequence),
+        zipf_(w.key_space - 1, w.zipf_q) {}
+
+  uint64_t Next() {
+    switch (w_.keys) {
+      case KeyDistribution::kZipf:
+        return zipf_(bitgen_);
+      case KeyDistribution::kSequential:
+        // All the threads share one counter, so they work on adjacent keys.
+        return sequence_->fetch_add(1, std::memory_order_relaxed) %
+               w_.key_space;
+      default:
+        return absl::Uniform<uint64_t>(bitgen_, 0, w_.key_space);
+    }
+  }
+
+  absl::BitGen &bitgen() { return bitgen_; }
+
+ private:
+  const Workload &w_;
+  std::atomic<uint64_t> *sequence_;
+  absl::BitGen bitgen_;
+  absl::zipf_distribution<uint64_t> zipf_;
+};
+
+struct ThreadResult {
+  std::array<Histogram, kNumOpKinds> latencies;
+  uint64_t sink = 0;
+};
+
+template <class Adapter>
+void RunThread(Adapter *adapter, const Workload &w,
+               std::atomic<uint64_t> *sequence, std::atomic<bool> *start,
+               std::atomic<bool> *stop, ThreadResult *result) {
+  typename Adapter::Handle handle(adapter);
+  KeyGenerator keys(w, sequence);
+  const int total_weight = w.cumulative_weights.back();
+  while (!start->load(std::memory_order_acquire)) std::this_thread::yield();
+  while (!stop->load(std::memory_order_relaxed)) {
+    int pick = absl::Uniform<int>(keys.bitgen(), 0, total_weight);
+    int op = std::upper_bound(w.cumulative_weights.begin(),
+                              w.cumulative_weights.end(), pick) -
+             w.cumulative_weights.begin();
+    uint64_t k = keys.Next();
+    auto t0 = std::chrono::steady_clock::now();
+    switch (op) {
+      case kFind:
+        result->sink += handle.Find(k);
+        break;
+      case kSelect:
+        result->sink += handle.Select(k);
+        break;
+      case kRank:
+        result->sink += handle.Rank(k);
+        break;
+      case kInsert:
+        result->sink += handle.Insert(k, k);
+        break;
+      case kErase:
+        result->sink += handle.Erase(k);
+        break;
+      case kSum:
+        result->sink += handle.Sum(k);
+        break;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    result->latencies[op].Add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+  }
+}
+
+template <class Adapter>
+void RunOne(const std::string &name, size_t n_threads, const Workload &w) {
+  if (!Adapter::kHasSums && w.cumulative_weights[kSum] >
+                                w.cumulative_weights[kSum - 1]) {
+    printf("%-15s %3zu threads: skipped (no SumFirstN)\n", name.c_str(),
+           n_threads);
+    return;
+  }
+  auto adapter = std::make_unique<Adapter>();
+  {
+    // Prefill with every other key (or a random sample, for the larger
+    // fractions), single-threaded.
+    typename Adapter::Handle handle(adapter.get());
+    absl::BitGen bitgen;
+    uint64_t n = static_cast<uint64_t>(w.prefill * w.key_space);
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t k = w.prefill <= 0.5
+                       ? i * 2
+                       : absl::Uniform<uint64_t>(bitgen, 0, w.key_space);
+      handle.Insert(k, k);
+    }
+  }
+  std::atomic<uint64_t> sequence = 0;
+  std::atomic<bool> start = false;
+  std::atomic<bool> stop = false;
+  std::vector<ThreadResult> results(n_threads);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < n_threads; ++t) {
+    threads.emplace_back(RunThread<Adapter>, adapter.get(), std::cref(w),
+                         &sequence, &start, &stop, &results[t]);
+  }
+  auto t0 = std::chrono::steady_clock::now();
+  start.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(std::chrono::duration<double>(w.seconds));
+  stop.store(true);
+  for (auto &t : threads) t.join();
+  double elapsed =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+          .count();
+
+  std::array<Histogram, kNumOpKinds> merged;
+  uint64_t total = 0;
+  for (const ThreadResult &r : results) {
+    for (size_t op = 0; op < kNumOpKinds; ++op) {
+      merged[op].Merge(r.latencies[op]);
+    }
+  }
+  for (const Histogram &h : merged) total += h.count();
+  printf("%-15s %3zu threads: %12.0f ops/s\n", name.c_str(), n_threads,
+         total / elapsed);
+  for (size_t op = 0; op < kNumOpKinds; ++op) {
+    const Histogram &h = merged[op];
+    if (h.count() == 0) continue;
+    printf("    %-8s %12.0f ops/s  p50 %8lu ns  p99 %8lu ns  p999 %8lu ns\n",
+           kOpNames[op], h.count() / elapsed, h.Percentile(0.5),
+           h.Percentile(0.99), h.Percentile(0.999));
+  }
+}
+
+void Run(const std::string &container, size_t n_threads, const Workload &w) {
+  if (container == "mutex") {
+    RunOne<MutexAdapter>(container, n_threads, w);
+  } else if (container == "shared_mutex") {
+    RunOne<SharedMutexAdapter>(container, n_threads, w);
+  } else if (container == "buffered_mutex") {
+    RunOne<BufferedMutexAdapter>(container, n_threads, w);
+  } else if (container == "single_writer") {
+    RunOne<SingleWriterAdapter>(container, n_threads, w);
+  } else if (container == "concurrent") {
+    RunOne<ConcurrentAdapter>(container, n_threads, w);
+  } else if (container == "combining") {
+    RunOne<CombiningAdapter>(container, n_threads, w);
+  } else {
+    LOG(FATAL) << "Unknown container " << container;
+  }
+}
+
+}  // namespace
+}  // namespace cachelib
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  cachelib::Workload w;
+  const std::string keys = absl::GetFlag(FLAGS_keys);
+  if (keys == "uniform") {
+    w.keys = cachelib::KeyDistribution::kUniform;
+  } else if (keys == "zipf") {
+    w.keys = cachelib::KeyDistribution::kZipf;
+  } else if (keys == "sequential") {
+    w.keys = cachelib::KeyDistribution::kSequential;
+  } else {
+    LOG(FATAL) << "Unknown key distribution " << keys;
+  }
+  w.key_space = absl::GetFlag(FLAGS_key_space);
+  CHECK_GT(w.key_space, 1u);
+  w.zipf_q = absl::GetFlag(FLAGS_zipf_q);
+  w.prefill = absl::GetFlag(FLAGS_prefill);
+  w.seconds = absl::GetFlag(FLAGS_seconds);
+  std::array<int, cachelib::kNumOpKinds> weights = {
+      absl::GetFlag(FLAGS_find),   absl::GetFlag(FLAGS_select),
+      absl::GetFlag(FLAGS_rank),   absl::GetFlag(FLAGS_insert),
+      absl::GetFlag(FLAGS_erase),  absl::GetFlag(FLAGS_sum)};
+  int sum = 0;
+  for (size_t i = 0; i < weights.size(); ++i) {
+    CHECK_GE(weights[i], 0);
+    sum += weights[i];
+    w.cumulative_weights[i] = sum;
+  }
+  CHECK_GT(sum, 0) << "All the operation weights are zero";
+
+  printf("keys=%s key_space=%lu prefill=%.2f seconds=%.1f\n", keys.c_str(),
+         w.key_space, w.prefill, w.seconds);
+  for (const std::string &container : absl::GetFlag(FLAGS_containers)) {
+    for (const std::string &threads : absl::GetFlag(FLAGS_threads)) {
+      size_t n_threads = std::stoul(threads);
+      CHECK_GT(n_threads, 0u);
+      cachelib::Run(container, n_threads, w);
+    }
+  }
+  return 0;
+}
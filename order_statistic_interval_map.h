@@ -0,0 +1,267 @@
+// An OrderStatisticIntervalMap holds half-open intervals `[start, end)` (such as
+// the byte ranges of a partially cached object), keyed by `start`.  It is an
+// OrderStatisticMap from `start` to `end`, so `select()` and `rank()` work by
+// start offset, and in addition every subtree keeps the maximum `end` in it.
+// That lets it find the intervals that overlap a query range without looking
+// at the ones that don't:
+//
+//   `overlapping(a, b, fn)` calls `fn` on each interval that overlaps
+//   `[a, b)`, in O(min(n, (k + 1) log n)) time for k overlapping intervals.
+//   (That is O(log n + k) when the k intervals are adjacent in start order, as
+//   they are in a map built with `insert_coalesce()`, but when they are spread
+//   out it grows as k log(n/k).)
+//
+//   `first_overlap(a, b)` returns the overlapping interval with the smallest
+//   start in O(log n) time.
+//
+//   `insert_coalesce(start, end)` inserts an interval, merging it with every
+//   interval that it overlaps or touches, so that a map built only with
+//   `insert_coalesce()` holds disjoint, non-adjacent intervals.
+//
+// Intervals may also be inserted without coalescing (with `insert()` or
+// `insert_or_assign()`), in which case they may overlap each other, but no two
+// may have the same start.
+//
+// Example:
+//
+//   OrderStatisticIntervalMap<uint64_t> cached;
+//   cached.insert_coalesce(0, 4096);
+//   cached.insert_coalesce(4096, 8192);  // Now [0, 8192).
+//   cached.overlapping(100, 200, [](const auto &interval) { ... });
+
+#ifndef NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_INTERVAL_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_INTERVAL_MAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "raw_order_statistic_map.h"  // IWYU pragma: export
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// A node that keeps the largest end in its subtree.
+template <class Offset>
+class IntervalMapNode
+    : public RawMapNode<Offset, Offset, std::less<>, IntervalMapNode<Offset>> {
+  using Base = typename IntervalMapNode::RawMapNode;
+  using key_compare = typename IntervalMapNode::key_compare;
+
+ public:
+  using value_type = typename Base::value_type;
+
+  // `max_end_` depends on the ends, so they may only be changed through the
+  // map's methods.
+  static constexpr bool kMutableValues = false;
+
+  explicit IntervalMapNode(value_type v)
+      : Base(std::move(v)), max_end_(this->value_.second) {}
+
+  // Checks that `max_end_` is the largest end in the subtree.
+  void Check(bool recursive, const key_compare &lessthan) {
+    CHECK(max_end_ == ComputeMaxEnd())  // Crash OK
+        << " node=" << this;
+    if (recursive) {
+      if (this->left_) this->left_->Check(recursive, lessthan);
+      if (this->right_) this->right_->Check(recursive, lessthan);
+    }
+    Base::Check(false, lessthan);
+  }
+
+  void RecomputeSummary() {
+    max_end_ = ComputeMaxEnd();
+    Base::RecomputeSummary();
+  }
+
+  // Calls `fn(value)` on each interval in the subtree that overlaps `[a, b)`,
+  // in order of start.  If `touching` is true, then also on each interval that
+  // just touches it (that is, ends at `a` or starts at `b`).
+  //
+  // A subtree whose `max_end_` is before `a` has no such interval, and neither
+  // does anything to the right of a node that starts after `b`, so every node
+  // visited is on the path from the root to `b`, or on the path from the root
+  // to a reported interval.  Those paths share their tops, so the total is
+  // O(min(n, (k + 1) log n)) for k reported intervals.
+  template <class Fn>
+  static void Overlapping(const std::unique_ptr<IntervalMapNode> &n,
+                          const Offset &a, const Offset &b, bool touching,
+                          Fn &fn) {
+    auto ends_after_a = [&](const Offset &end) {
+      return touching ? !(end < a) : a < end;
+    };
+    if (!n || !ends_after_a(n->max_end_)) return;
+    Overlapping(n->left_, a, b, touching, fn);
+    const Offset &start = n->value_.first;
+    if (touching ? b < start : !(start < b)) return;
+    if (ends_after_a(n->value_.second)) fn(n->value_);
+    Overlapping(n->right_, a, b, touching, fn);
+  }
+
+  // Returns the rank of, and a pointer to, the interval in the subtree with
+  // the smallest start that overlaps `[a, b)`, or `{0, nullptr}` if there is
+  // none.  `rank_so_far` is the rank of the subtree's first interval.
+  static std::pair<size_t, IntervalMapNode *> FirstOverlap(
+      const std::unique_ptr<IntervalMapNode> &n, const Offset &a,
+      const Offset &b, size_t rank_so_far) {
+    if (!n || !(a < n->max_end_)) return {0, nullptr};
+    if (n->left_ && a < n->left_->max_end_) {
+      auto result = FirstOverlap(n->left_, a, b, rank_so_far);
+      // If `n` starts before `b`, then so does every interval on the left, so
+      // the one that ends after `a` overlaps and the search succeeded.
+      // Otherwise nothing at or to the right of `n` can overlap either.
+      if (result.second || !(n->value_.first < b)) return result;
+    }
+    if (!(n->value_.first < b)) return {0, nullptr};
+    size_t rank = rank_so_far + IntervalMapNode::Size(n->left_);
+    if (a < n->value_.second) return {rank, n.get()};
+    return FirstOverlap(n->right_, a, b, rank + 1);
+  }
+
+ private:
+  Offset ComputeMaxEnd() const {
+    Offset result = this->value_.second;
+    if (this->left_) result = std::max(result, this->left_->max_end_);
+    if (this->right_) result = std::max(result, this->right_->max_end_);
+    return result;
+  }
+
+  Offset max_end_;
+};
+
+}  // namespace cachelib_internal
+
+template <class Offset>
+class OrderStatisticIntervalMap
+    : public cachelib_internal::RawOrderStatisticMap<
+          Offset, Offset, std::less<>,
+          cachelib_internal::IntervalMapNode<Offset>> {
+  using Base = typename OrderStatisticIntervalMap::RawOrderStatisticMap;
+  using Node = typename Base::Node;
+
+ public:
+  using key_type = typename Base::key_type;
+  using mapped_type = typename Base::mapped_type;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using difference_type = typename Base::difference_type;
+  using key_compare = typename Base::key_compare;
+  using value_compare = typename Base::value_compare;
+  // TODO(bradleybear): Add allocator_type
+  using reference = value_type &;
+  using const_reference = const value_type &;
+  // TODO(bradleybear): Add pointer and const_pointer
+  using iterator = typename Base::iterator;
+  using const_iterator = typename Base::const_iterator;
+  using reverse_iterator = typename Base::reverse_iterator;
+  using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+  // The new methods supported by OrderStatisticIntervalMap:
+
+  // Calls `fn(interval)` on each interval (a `const value_type &`, that is,
+  // `{start, end}`) that overlaps `[a, b)`, in order of start.  Takes
+  // O(min(n, (k + 1) log n)) time, where k is the number of such intervals
+  // (see the comment at the top of the file).  `fn` must not modify the map.
+  template <class Fn>
+  void overlapping(const Offset &a, const Offset &b, Fn fn) const {
+    Node::Overlapping(this->root_, a, b, /*touching=*/false, fn);
+  }
+
+  // Returns an iterator to the interval with the smallest start that overlaps
+  // `[a, b)`, or `end()` if there is none.  Takes O(log n) time.
+  const_iterator first_overlap(const Offset &a, const Offset &b) const {
+    auto [rank, n] = Node::FirstOverlap(this->root_, a, b, 0);
+    if (n == nullptr) return this->end();
+    return const_iterator(this, rank, n);
+  }
+  iterator first_overlap(const Offset &a, const Offset &b) {
+    auto [rank, n] = Node::FirstOverlap(this->root_, a, b, 0);
+    if (n == nullptr) return this->end();
+    return iterator(this, rank, n);
+  }
+
+  // Inserts `[start, end)`, which must not be empty, merged with every interval
+  // that it overlaps or touches (that is, every `[s, e)` with `s <= end` and
+  // `start <= e`), and returns an iterator to the merged interval.  Takes
+  // O((k + 1) log n) time, where k is the number of intervals merged.
+  iterator insert_coalesce(Offset start, Offset end) {
+    DCHECK(start < end);
+    std::vector<Offset> merged;
+    Offset new_start = start, new_end = end;
+    auto merge = [&](const value_type &interval) {
+      merged.push_back(interval.first);
+      new_start = std::min(new_start, interval.first);
+      new_end = std::max(new_end, interval.second);
+    };
+    Node::Overlapping(this->root_, start, end, /*touching=*/true, merge);
+    for (const Offset &s : merged) this->erase(s);
+    return this->insert_or_assign(new_start, new_end).first;
+  }
+
+  // See OrderStatisticSet's documentation for the specification of these
+  // functions.
+
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::begin;
+
+  using Base::cbegin;
+
+  using Base::end;
+
+  using Base::cend;
+
+  using Base::rbegin;
+
+  using Base::crbegin;
+
+  using Base::rend;
+
+  using Base::crend;
+
+  using Base::find;
+
+  using Base::contains;
+
+  using Base::lower_bound;
+
+  using Base::upper_bound;
+
+  using Base::select;
+
+  using Base::sample;
+
+  using Base::sample_n;
+
+  using Base::clear;
+
+  using Base::insert;
+
+  using Base::insert_sorted;
+
+  using Base::erase;
+
+  using Base::key_comp;
+
+  using Base::value_comp;
+
+  // See OrderStatisticMap's documentation for the specification of these
+  // functions.  (`update()` changes an interval's end.)
+  using Base::insert_or_assign;
+
+  using Base::insert_or_assign_sorted;
+
+  using Base::update;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_INTERVAL_MAP_H_
@@ -0,0 +1,173 @@
+#include "order_statistic_interval_map.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::ElementsAre;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class OrderStatisticIntervalMap<uint64_t>;
+template class OrderStatisticIntervalMap<double>;
+
+std::vector<std::pair<int, int>> Overlapping(
+    const OrderStatisticIntervalMap<int> &map, int a, int b) {
+  std::vector<std::pair<int, int>> result;
+  map.overlapping(a, b, [&](const auto &interval) {
+    result.emplace_back(interval.first, interval.second);
+  });
+  return result;
+}
+
+TEST(OrderStatisticIntervalMapTest, Basic) {
+  OrderStatisticIntervalMap<int> map;
+  EXPECT_EQ(map.first_overlap(0, 10), map.end());
+  map.insert_or_assign(10, 20);
+  map.insert_or_assign(0, 100);  // Overlaps the others.
+  map.insert_or_assign(30, 40);
+  EXPECT_THAT(Overlapping(map, 20, 30), ElementsAre(Pair(0, 100)));
+  EXPECT_THAT(Overlapping(map, 15, 35),
+              ElementsAre(Pair(0, 100), Pair(10, 20), Pair(30, 40)));
+  EXPECT_THAT(Overlapping(map, 100, 200), ElementsAre());
+  EXPECT_THAT(*map.first_overlap(35, 36), Pair(0, 100));
+  map.update(map.find(0), 5);
+  EXPECT_THAT(Overlapping(map, 20, 30), ElementsAre());
+  auto it = map.first_overlap(19, 31);
+  EXPECT_THAT(*it, Pair(10, 20));
+  EXPECT_EQ(it.rank(), 1);
+  EXPECT_THAT(*map.first_overlap(20, 31), Pair(30, 40));
+  EXPECT_EQ(map.first_overlap(20, 30), map.end());
+  map.Check();
+}
+
+TEST(OrderStatisticIntervalMapTest, InsertCoalesce) {
+  OrderStatisticIntervalMap<int> map;
+  map.insert_coalesce(0, 10);
+  map.insert_coalesce(20, 30);
+  map.insert_coalesce(40, 50);
+  EXPECT_EQ(map.size(), 3);
+  // Touching on both sides.
+  EXPECT_THAT(*map.insert_coalesce(10, 20), Pair(0, 30));
+  EXPECT_EQ(map.size(), 2);
+  // Contained.
+  EXPECT_THAT(*map.insert_coalesce(42, 45), Pair(40, 50));
+  // Spanning.
+  EXPECT_THAT(*map.insert_coalesce(-5, 60), Pair(-5, 60));
+  EXPECT_EQ(map.size(), 1);
+  map.Check();
+}
+
+// Compares with brute force over random intervals.
+TEST(OrderStatisticIntervalMapTest, Randomized) {
+  absl::BitGen bitgen;
+  OrderStatisticIntervalMap<int> map;
+  std::map<int, int> expected;
+  for (size_t i = 0; i < 3000; ++i) {
+    int start = absl::Uniform<int>(bitgen, 0, 10000);
+    int end = start + absl::Uniform<int>(bitgen, 1, 500);
+    if (absl::Bernoulli(bitgen, 0.6)) {
+      map.insert_or_assign(start, end);
+      expected.insert_or_assign(start, end);
+    } else if (!expected.empty()) {
+      auto it = std::next(expected.begin(),
+                          absl::Uniform<size_t>(bitgen, 0, expected.size()));
+      EXPECT_EQ(map.erase(it->first), 1);
+      expected.erase(it);
+    }
+    if (i % 300 == 0) map.Check();
+    int a = absl::Uniform<int>(bitgen, 0, 10500);
+    int b = a + absl::Uniform<int>(bitgen, 1, 200);
+    std::vector<std::pair<int, int>> want;
+    for (const auto &[s, e] : expected) {
+      if (s < b && a < e) want.emplace_back(s, e);
+    }
+    EXPECT_EQ(Overlapping(map, a, b), want);
+    auto first = map.first_overlap(a, b);
+    if (want.empty()) {
+      EXPECT_EQ(first, map.end());
+    } else {
+      ASSERT_NE(first, map.end());
+      EXPECT_EQ(first->first, want[0].first);
+      EXPECT_EQ(first.rank(), std::distance(expected.begin(),
+                                            expected.find(want[0].first)));
+    }
+  }
+  map.Check();
+}
+
+TEST(OrderStatisticIntervalMapTest, RandomizedCoalesce) {
+  absl::BitGen bitgen;
+  OrderStatisticIntervalMap<int> map;
+  std::vector<bool> covered(2100);
+  for (size_t i = 0; i < 500; ++i) {
+    int start = absl::Uniform<int>(bitgen, 0, 2000);
+    int end = start + absl::Uniform<int>(bitgen, 1, 50);
+    map.insert_coalesce(start, end);
+    for (int j = start; j < end; ++j) covered[j] = true;
+    // The intervals must be exactly the maximal runs of covered offsets.
+    std::vector<std::pair<int, int>> runs;
+    for (int j = 0; j < static_cast<int>(covered.size()); ++j) {
+      if (!covered[j]) continue;
+      if (!runs.empty() && runs.back().second == j) {
+        ++runs.back().second;
+      } else {
+        runs.emplace_back(j, j + 1);
+      }
+    }
+    ASSERT_EQ(Overlapping(map, 0, 3000), runs);
+  }
+  map.Check();
+}
+
+// An offset that counts the comparisons made on it, which tracks the number of
+// nodes that `overlapping()` visits (each visit makes one to three).
+struct CountedOffset {
+  int offset;
+  static inline size_t comparisons = 0;
+  friend bool operator<(const CountedOffset &a, const CountedOffset &b) {
+    ++comparisons;
+    return a.offset < b.offset;
+  }
+};
+
+// Pins the cost of `overlapping()`.  When the k overlapping intervals are
+// adjacent in start order, the query visits about k + 2 log n nodes.  When they
+// are spread out, each one sits in a different subtree and costs its own walk
+// down from the top of that subtree, so the query visits about k log(n/k)
+// nodes.  In all cases it is O(min(n, (k + 1) log n)), not O(log n + k).
+TEST(OrderStatisticIntervalMapTest, OverlappingVisits) {
+  constexpr int kN = 1 << 14, kLogN = 14, kK = 64, kLogNOverK = 8;
+  OrderStatisticIntervalMap<CountedOffset> adjacent, spread;
+  for (int i = 0; i < kN; ++i) {
+    adjacent.insert_or_assign({2 * i}, {2 * i + 1});
+    // Every (n/k)th interval runs past all the others.
+    int end = i % (kN / kK) == 0 ? 4 * kN : 2 * i + 1;
+    spread.insert_or_assign({2 * i}, {end});
+  }
+  size_t found = 0;
+  auto count = [&found](const auto &) { ++found; };
+
+  CountedOffset::comparisons = 0;
+  adjacent.overlapping({kN}, {kN + 2 * kK}, count);
+  EXPECT_EQ(found, kK);
+  EXPECT_LE(CountedOffset::comparisons, 3 * (kK + 2 * kLogN));
+
+  found = 0;
+  CountedOffset::comparisons = 0;
+  spread.overlapping({2 * kN}, {4 * kN}, count);
+  EXPECT_EQ(found, kK);
+  EXPECT_GE(CountedOffset::comparisons, kK * kLogNOverK);
+  EXPECT_LE(CountedOffset::comparisons, 3 * (kK + 1) * kLogN);
+}
+
+}  // namespace cachelib
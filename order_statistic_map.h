@@ -65,6 +65,24 @@ class OrderStatisticMap
   //   the existing element and returns an iterator to the elemnt and false.
   using Base::insert_or_assign;
 
+  // template <class RandomIt>
+  // size_t insert_or_assign_sorted(RandomIt first, RandomIt last,
+  //                                bool *did_insert = nullptr);
+  //
+  //   Inserts or assigns each of the values in `[first, last)`, which must be
+  //   sorted by strictly increasing key, in a single merge pass.  See
+  //   OrderStatisticSet::insert_sorted().
+  using Base::insert_or_assign_sorted;
+
+  // iterator push_back(Key k, T v);
+  //
+  //   Inserts `{k, v}`, where `k` must be greater than every key in the map,
+  //   and returns an iterator to it.  With `pop_front()` (which removes the
+  //   first element) this supports maps keyed by an increasing stream, such as
+  //   timestamps, more cheaply than `insert()` and `erase(begin())`.  See
+  //   OrderStatisticSet::push_back().
+  using Base::push_back;
+
   // See OrderStatisticSet's documentation for the specification of these
   // functions.
   //
@@ -100,12 +118,20 @@ class OrderStatisticMap
 
   using Base::select;
 
+  using Base::sample;
+
+  using Base::sample_n;
+
   using Base::clear;
 
   using Base::insert;
 
+  using Base::insert_sorted;
+
   using Base::erase;
 
+  using Base::pop_front;
+
   using Base::key_comp;
 
   using Base::value_comp;
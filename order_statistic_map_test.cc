@@ -1,13 +1,17 @@
 #include "net/bandaid/bdn/cachelib/order_statistic_map.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <memory>
+#include <random>
 #include <string>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "net/bandaid/bdn/cachelib/order_statistic_test_common.h"
 #include "testing/base/public/gmock.h"
@@ -249,6 +253,33 @@ TEST(OrderStatisticMapTest, Erase) {
     EXPECT_EQ(map, ost);
     EXPECT_EQ(ost.size(), 3 - i);
   }
+
+  // The iterator returned has the rank of the erased element.
+  for (size_t k = 0; k < 100; ++k) ost.insert_or_assign(k, k);
+  for (size_t k = 1; k < 99; k += 2) {
+    auto it = ost.erase(ost.find(k));
+    EXPECT_EQ(it.rank(), k / 2 + 1);
+    EXPECT_EQ(it->first, k + 1);
+    EXPECT_EQ(std::prev(it)->first, k - 1);
+  }
+}
+
+TEST(OrderStatisticMapTest, InsertRank) {
+  OrderStatisticMap<size_t, size_t> ost;
+  // The iterator returned has the rank of the key, whether or not it was
+  // inserted.
+  for (size_t k = 0; k < 100; k += 2) {
+    EXPECT_EQ(ost.insert({k, k}).first.rank(), k / 2);
+  }
+  for (size_t k = 1; k < 100; k += 2) {
+    EXPECT_EQ(ost.insert_or_assign(k, k).first.rank(), k);
+  }
+  for (size_t k = 0; k < 100; ++k) {
+    auto [it, inserted] = ost.insert({k, 0});
+    EXPECT_FALSE(inserted);
+    EXPECT_EQ(it.rank(), k);
+    EXPECT_EQ(std::next(it), ost.find(k + 1));
+  }
 }
 
 // Check that we can pass in strings as strings, string_views, or string
@@ -298,6 +329,101 @@ TEST(OrderStatisticMapTest, Randomized) {
       []([[maybe_unused]] auto& a, [[maybe_unused]] auto& b) {});
 }
 
+// Merges batches of various sizes and key distributions into trees of various
+// sizes, including batches much bigger than the tree (which forces subtrees to
+// be rebuilt) and batches that land in one spot.
+TEST(OrderStatisticMapTest, InsertOrAssignSorted) {
+  absl::BitGen bitgen;
+  for (size_t tree_size : {0, 1, 10, 1000}) {
+    for (size_t batch_size : {0, 1, 7, 100, 5000}) {
+      for (bool clustered : {false, true}) {
+        OrderStatisticMap<size_t, size_t> ost;
+        std::map<size_t, size_t> map;
+        for (size_t i = 0; i < tree_size; ++i) {
+          size_t k = absl::Uniform<size_t>(bitgen, 0, 100000);
+          ost.insert_or_assign(k, k);
+          map.insert_or_assign(k, k);
+        }
+        std::map<size_t, size_t> batch_map;
+        size_t base = absl::Uniform<size_t>(bitgen, 0, 100000);
+        while (batch_map.size() < batch_size) {
+          size_t k = clustered ? base + batch_map.size() * 2
+                               : absl::Uniform<size_t>(bitgen, 0, 100000);
+          batch_map.insert_or_assign(k, k + 1);
+        }
+        std::vector<std::pair<const size_t, size_t>> batch(batch_map.begin(),
+                                                           batch_map.end());
+        std::unique_ptr<bool[]> did_insert(new bool[batch.size()]);
+        size_t expected_inserted = 0;
+        for (const auto& [k, v] : batch) {
+          expected_inserted += map.insert_or_assign(k, v).second;
+        }
+        std::vector<bool> expected_did_insert;
+        for (const auto& [k, v] : batch) {
+          expected_did_insert.push_back(ost.find(k) == ost.end());
+        }
+        EXPECT_EQ(ost.insert_or_assign_sorted(batch.begin(), batch.end(),
+                                              did_insert.get()),
+                  expected_inserted);
+        for (size_t i = 0; i < batch.size(); ++i) {
+          EXPECT_EQ(did_insert[i], expected_did_insert[i]) << i;
+        }
+        ost.Check();
+        EXPECT_EQ(map, ost);
+      }
+    }
+  }
+  // Without assignment, existing values are left alone.
+  OrderStatisticMap<size_t, size_t> ost;
+  ost.insert_or_assign(2, 2);
+  std::vector<std::pair<const size_t, size_t>> batch = {{1, 10}, {2, 20}};
+  EXPECT_EQ(ost.insert_sorted(batch.begin(), batch.end()), 1);
+  EXPECT_THAT(*ost.find(2), Pair(2, 2));
+  EXPECT_THAT(*ost.find(1), Pair(1, 10));
+}
+
+TEST(OrderStatisticMapTest, Sample) {
+  std::mt19937_64 rng(42);
+  OrderStatisticMap<int, int> ost;
+  EXPECT_EQ(ost.sample(rng), ost.end());
+  EXPECT_TRUE(ost.sample_n(rng, 5, /*with_replacement=*/true).empty());
+  for (int i = 0; i < 10; ++i) ost.insert_or_assign(i, i);
+  std::vector<size_t> counts(10);
+  for (size_t i = 0; i < 10000; ++i) ++counts[ost.sample(rng)->first];
+  for (size_t c : counts) {
+    EXPECT_GT(c, 800);
+    EXPECT_LT(c, 1200);
+  }
+  // Without replacement: distinct, in rank order, and all of them if k is too
+  // big.
+  for (size_t k : {0, 3, 10, 20}) {
+    auto sample = ost.sample_n(rng, k, /*with_replacement=*/false);
+    ASSERT_EQ(sample.size(), std::min<size_t>(k, 10));
+    for (size_t i = 0; i < sample.size(); ++i) {
+      EXPECT_EQ(sample[i]->first, sample[i].rank());
+      if (i > 0) {
+        EXPECT_LT(sample[i - 1].rank(), sample[i].rank());
+      }
+    }
+  }
+  // With replacement: in rank order, and roughly uniform.
+  const auto& cost = ost;
+  auto sample = cost.sample_n(rng, 10000, /*with_replacement=*/true);
+  ASSERT_EQ(sample.size(), 10000);
+  std::fill(counts.begin(), counts.end(), 0);
+  for (size_t i = 0; i < sample.size(); ++i) {
+    EXPECT_EQ(sample[i]->first, sample[i].rank());
+    if (i > 0) {
+      EXPECT_LE(sample[i - 1].rank(), sample[i].rank());
+    }
+    ++counts[sample[i]->first];
+  }
+  for (size_t c : counts) {
+    EXPECT_GT(c, 800);
+    EXPECT_LT(c, 1200);
+  }
+}
+
 TEST(OrderStatisticMapTest, Iterator) {
   OrderStatisticMap<size_t, size_t> t;
   EXPECT_EQ(t.begin(), t.end());
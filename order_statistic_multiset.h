@@ -0,0 +1,403 @@
+// An OrderStatisticMultiset is a sorted multiset that stores each distinct key
+// once, with its multiplicity, so its memory grows with the number of distinct
+// keys rather than with the number of elements.  That suits distributions
+// with many repeated values, such as latencies in microseconds or object
+// sizes.
+//
+// Every subtree keeps the total multiplicity of its keys, so `select()` and
+// `rank()` work on the expanded sequence (the one in which each key appears as
+// many times as its multiplicity) in O(log n) time, for n distinct keys.
+// `insert()` and `erase_one()` of a key that is already present just change
+// its multiplicity, in O(log n) time and without allocating.
+//
+// An OrderStatisticMultimap is the same for `{key, mapped}` pairs: each
+// distinct pair is stored once with its multiplicity, ordered by key and then
+// by mapped value (so `T` must be ordered by `<`), and `rank()`, `count()`, and
+// the bounds also work on keys alone.
+//
+// The iterators visit the distinct entries, as `{entry, multiplicity}` pairs
+// (where the entry is the key for a multiset and the `{key, mapped}` pair for a
+// multimap), and refer to const values.  Their `rank()` is the rank among the
+// distinct entries.
+//
+// Example:
+//
+//   OrderStatisticMultiset<uint32_t> latencies_us;
+//   for (uint32_t latency : samples) latencies_us.insert(latency);
+//   uint32_t p99 = latencies_us.select(latencies_us.size() * 99 / 100)->first;
+
+#ifndef NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_MULTISET_H_
+#define NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_MULTISET_H_
+
+#include <cstddef>
+#include <functional>
+#include <utility>
+
+#include "glog/logging.h"
+#include "prefix_sum_map.h"
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// The implementation shared by OrderStatisticMultiset and
+// OrderStatisticMultimap: a PrefixSumMap from each distinct entry to its
+// multiplicity.
+template <class Entry, class Compare>
+class RawOrderStatisticMultiset {
+ protected:
+  using Counts = PrefixSumMap<Entry, size_t, Compare>;
+
+ public:
+  using value_type = typename Counts::value_type;
+  using size_type = size_t;
+  using difference_type = std::ptrdiff_t;
+  using const_reference = const value_type &;
+  using iterator = typename Counts::const_iterator;
+  using const_iterator = typename Counts::const_iterator;
+  using reverse_iterator = typename Counts::const_reverse_iterator;
+  using const_reverse_iterator = typename Counts::const_reverse_iterator;
+
+ protected:
+  //**************** Observers ****************
+
+  // The number of elements, counting multiplicities.
+  size_t size() const { return counts_.SumFirstN(counts_.size()); }
+
+  // The number of distinct entries.
+  size_t distinct_size() const { return counts_.size(); }
+
+  bool empty() const { return counts_.empty(); }
+
+  const_iterator begin() const { return counts_.cbegin(); }
+  const_iterator cbegin() const { return counts_.cbegin(); }
+  const_iterator end() const { return counts_.cend(); }
+  const_iterator cend() const { return counts_.cend(); }
+  const_reverse_iterator rbegin() const { return counts_.crbegin(); }
+  const_reverse_iterator crbegin() const { return counts_.crbegin(); }
+  const_reverse_iterator rend() const { return counts_.crend(); }
+  const_reverse_iterator crend() const { return counts_.crend(); }
+
+  // Returns an iterator to the entry `e`, or `end()`.
+  template <class K>
+  const_iterator find(const K &e) const {
+    return counts_.find(e);
+  }
+
+  template <class K>
+  const_iterator lower_bound(const K &e) const {
+    return counts_.lower_bound(e);
+  }
+
+  template <class K>
+  const_iterator upper_bound(const K &e) const {
+    return counts_.upper_bound(e);
+  }
+
+  // Returns the number of elements less than `e`, counting multiplicities.
+  template <class K>
+  size_t rank(const K &e) const {
+    return counts_.SumLess(e);
+  }
+
+  // Returns an iterator to the entry at position `idx` of the expanded
+  // sequence (that is, the entry whose copies occupy positions `[rank(key),
+  // rank(key) + multiplicity)`), or `end()` if `idx >= size()`.
+  const_iterator select(size_t idx) const {
+    return counts_.SelectByPrefixSum(idx + 1).first;
+  }
+
+  //**************** Mutators ****************
+
+  // Adds `n` copies of `e` (which must be positive), and returns an iterator
+  // to its entry.  Takes O(log n) time, and allocates only if `e` wasn't
+  // present.
+  const_iterator Insert(Entry e, size_t n) {
+    DCHECK_GT(n, 0u);
+    auto it = counts_.find(e);
+    if (it == counts_.end()) return counts_.insert({std::move(e), n}).first;
+    counts_.add(it, n);
+    return it;
+  }
+
+  // Removes one copy of `e`, if there is one.  Returns whether there was.
+  template <class K>
+  bool erase_one(const K &e) {
+    return erase_n(e, 1) == 1;
+  }
+
+  // Removes `n` copies of `e`, or all of them if there are fewer.  Returns the
+  // number removed.  Takes O(log n) time however many copies are removed.
+  template <class K>
+  size_t erase_n(const K &e, size_t n) {
+    auto it = counts_.find(e);
+    if (it == counts_.end()) return 0;
+    if (it->second <= n) {
+      n = it->second;
+      counts_.erase(it);
+    } else {
+      // The counts are unsigned, so this subtracts `n`.
+      counts_.add(it, -n);
+    }
+    return n;
+  }
+
+  // Removes every copy of `e`.  Returns the number removed.
+  template <class K>
+  size_t erase(const K &e) {
+    auto it = counts_.find(e);
+    if (it == counts_.end()) return 0;
+    size_t n = it->second;
+    counts_.erase(it);
+    return n;
+  }
+
+  void clear() { counts_.clear(); }
+
+ public:
+  //**************** Debugging and test support ****************
+
+  // Checks the invariants.  Runs in O(n) time.
+  void Check() const {
+    counts_.Check();
+    for (const value_type &entry : counts_) {
+      CHECK_GT(entry.second, 0u);  // Crash OK
+    }
+  }
+
+ protected:
+  Counts counts_;
+};
+
+// Stand-ins for a key `k` that compare less than (`KeyLowerBound`) or greater
+// than (`KeyUpperBound`) every `{k, mapped}` pair of an OrderStatisticMultimap.
+// (Comparing with `k` itself would make all those pairs equal to it, and the
+// tree's lookups expect at most one equal entry.)
+template <class Key>
+struct KeyLowerBound {
+  const Key &key;
+};
+template <class Key>
+struct KeyUpperBound {
+  const Key &key;
+};
+
+// Orders the `{key, mapped}` pairs of an OrderStatisticMultimap by key and then
+// by mapped value, and compares them with `KeyLowerBound`s and
+// `KeyUpperBound`s.
+template <class Key, class T, class Compare>
+struct MultimapEntryCompare {
+  using is_transparent = void;
+  using Entry = std::pair<Key, T>;
+
+  bool operator()(const Entry &a, const Entry &b) const {
+    if (Compare()(a.first, b.first)) return true;
+    if (Compare()(b.first, a.first)) return false;
+    return a.second < b.second;
+  }
+  bool operator()(const Entry &a, const KeyLowerBound<Key> &k) const {
+    return Compare()(a.first, k.key);
+  }
+  bool operator()(const KeyLowerBound<Key> &k, const Entry &a) const {
+    return !Compare()(a.first, k.key);
+  }
+  bool operator()(const Entry &a, const KeyUpperBound<Key> &k) const {
+    return !Compare()(k.key, a.first);
+  }
+  bool operator()(const KeyUpperBound<Key> &k, const Entry &a) const {
+    return Compare()(k.key, a.first);
+  }
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class Compare = std::less<>>
+class OrderStatisticMultiset
+    : public cachelib_internal::RawOrderStatisticMultiset<Key, Compare> {
+  using Base = typename OrderStatisticMultiset::RawOrderStatisticMultiset;
+
+ public:
+  using key_type = Key;
+  using key_compare = Compare;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using difference_type = typename Base::difference_type;
+  using const_reference = typename Base::const_reference;
+  using iterator = typename Base::iterator;
+  using const_iterator = typename Base::const_iterator;
+  using reverse_iterator = typename Base::reverse_iterator;
+  using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+  // Adds `n` copies of `k`.
+  const_iterator insert(Key k, size_t n = 1) {
+    return this->Insert(std::move(k), n);
+  }
+
+  // Returns the multiplicity of `k`.
+  template <class K>
+  size_t count(const K &k) const {
+    auto it = this->counts_.find(k);
+    return it == this->counts_.end() ? 0 : it->second;
+  }
+
+  template <class K>
+  bool contains(const K &k) const {
+    return this->counts_.contains(k);
+  }
+
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::distinct_size;
+
+  using Base::empty;
+
+  using Base::begin;
+
+  using Base::cbegin;
+
+  using Base::end;
+
+  using Base::cend;
+
+  using Base::rbegin;
+
+  using Base::crbegin;
+
+  using Base::rend;
+
+  using Base::crend;
+
+  using Base::find;
+
+  using Base::lower_bound;
+
+  using Base::upper_bound;
+
+  using Base::rank;
+
+  using Base::select;
+
+  using Base::erase_one;
+
+  using Base::erase_n;
+
+  using Base::erase;
+
+  using Base::clear;
+};
+
+template <class Key, class T, class Compare = std::less<>>
+class OrderStatisticMultimap
+    : public cachelib_internal::RawOrderStatisticMultiset<
+          std::pair<Key, T>,
+          cachelib_internal::MultimapEntryCompare<Key, T, Compare>> {
+  using Base = typename OrderStatisticMultimap::RawOrderStatisticMultiset;
+  using Entry = std::pair<Key, T>;
+  using LowerBound = cachelib_internal::KeyLowerBound<Key>;
+  using UpperBound = cachelib_internal::KeyUpperBound<Key>;
+
+ public:
+  using key_type = Key;
+  using mapped_type = T;
+  using key_compare = Compare;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using difference_type = typename Base::difference_type;
+  using const_reference = typename Base::const_reference;
+  using iterator = typename Base::iterator;
+  using const_iterator = typename Base::const_iterator;
+  using reverse_iterator = typename Base::reverse_iterator;
+  using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+  // Adds `n` copies of `{k, v}`.
+  const_iterator insert(Key k, T v, size_t n = 1) {
+    return this->Insert(Entry(std::move(k), std::move(v)), n);
+  }
+
+  // Returns the number of elements with key `k`.
+  size_t count(const Key &k) const {
+    return this->counts_.SumLess(UpperBound{k}) -
+           this->counts_.SumLess(LowerBound{k});
+  }
+
+  // Returns the multiplicity of `{k, v}`.
+  size_t count(const Key &k, const T &v) const {
+    auto it = this->counts_.find(Entry(k, v));
+    return it == this->counts_.end() ? 0 : it->second;
+  }
+
+  bool contains(const Key &k) const { return lower_bound(k) != upper_bound(k); }
+
+  // Returns the number of elements with keys less than `k`, or (for the
+  // second form) less than `{k, v}`, counting multiplicities.
+  size_t rank(const Key &k) const {
+    return this->counts_.SumLess(LowerBound{k});
+  }
+  size_t rank(const Entry &e) const { return this->counts_.SumLess(e); }
+
+  // Return the first entry with key (or entry) not less than, or greater than,
+  // `k` (or `e`).
+  const_iterator lower_bound(const Key &k) const {
+    return this->counts_.lower_bound(LowerBound{k});
+  }
+  const_iterator lower_bound(const Entry &e) const {
+    return this->counts_.lower_bound(e);
+  }
+  const_iterator upper_bound(const Key &k) const {
+    return this->counts_.lower_bound(UpperBound{k});
+  }
+  const_iterator upper_bound(const Entry &e) const {
+    return this->counts_.upper_bound(e);
+  }
+
+  // Returns the range of entries with key `k`.
+  std::pair<const_iterator, const_iterator> equal_range(const Key &k) const {
+    return {lower_bound(k), upper_bound(k)};
+  }
+
+  // Returns an iterator to the entry `{k, v}`, or `end()`.
+  const_iterator find(const Key &k, const T &v) const {
+    return this->counts_.find(Entry(k, v));
+  }
+
+  // Removes one copy of `{k, v}`, if there is one.  Returns whether there was.
+  bool erase_one(const Key &k, const T &v) {
+    return Base::erase_one(Entry(k, v));
+  }
+
+  // Removes every copy of `{k, v}`.  Returns the number removed.
+  size_t erase(const Key &k, const T &v) { return Base::erase(Entry(k, v)); }
+
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::distinct_size;
+
+  using Base::empty;
+
+  using Base::begin;
+
+  using Base::cbegin;
+
+  using Base::end;
+
+  using Base::cend;
+
+  using Base::rbegin;
+
+  using Base::crbegin;
+
+  using Base::rend;
+
+  using Base::crend;
+
+  using Base::select;
+
+  using Base::clear;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_MULTISET_H_
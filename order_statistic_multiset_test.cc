@@ -0,0 +1,155 @@
+#include "order_statistic_multiset.h"
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::ElementsAre;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class OrderStatisticMultiset<std::string>;
+template class OrderStatisticMultimap<int, std::string>;
+
+TEST(OrderStatisticMultisetTest, Basic) {
+  OrderStatisticMultiset<int> set;
+  EXPECT_TRUE(set.empty());
+  EXPECT_EQ(set.select(0), set.end());
+  set.insert(5);
+  set.insert(3, 2);
+  set.insert(5);
+  set.insert(9);
+  // Expanded: 3 3 5 5 9
+  EXPECT_EQ(set.size(), 5);
+  EXPECT_EQ(set.distinct_size(), 3);
+  EXPECT_THAT(set, ElementsAre(Pair(3, 2), Pair(5, 2), Pair(9, 1)));
+  EXPECT_EQ(set.count(5), 2);
+  EXPECT_EQ(set.count(4), 0);
+  EXPECT_TRUE(set.contains(9));
+  EXPECT_EQ(set.rank(3), 0);
+  EXPECT_EQ(set.rank(4), 2);
+  EXPECT_EQ(set.rank(9), 4);
+  EXPECT_EQ(set.rank(10), 5);
+  std::vector<int> selected;
+  for (size_t i = 0; i < set.size(); ++i) selected.push_back(set.select(i)->first);
+  EXPECT_THAT(selected, ElementsAre(3, 3, 5, 5, 9));
+  EXPECT_EQ(set.select(5), set.end());
+  EXPECT_TRUE(set.erase_one(5));
+  EXPECT_EQ(set.count(5), 1);
+  EXPECT_TRUE(set.erase_one(5));
+  EXPECT_FALSE(set.contains(5));
+  EXPECT_FALSE(set.erase_one(5));
+  EXPECT_EQ(set.erase(3), 2);
+  set.insert(7, 4);
+  EXPECT_EQ(set.erase_n(7, 3), 3);
+  EXPECT_EQ(set.count(7), 1);
+  EXPECT_EQ(set.erase_n(7, 3), 1);
+  EXPECT_FALSE(set.contains(7));
+  EXPECT_THAT(set, ElementsAre(Pair(9, 1)));
+  set.Check();
+}
+
+TEST(OrderStatisticMultisetTest, Randomized) {
+  absl::BitGen bitgen;
+  OrderStatisticMultiset<int> set;
+  std::multiset<int> expected;
+  for (size_t i = 0; i < 5000; ++i) {
+    int k = absl::Uniform<int>(bitgen, 0, 50);
+    if (absl::Bernoulli(bitgen, 0.6)) {
+      size_t n = absl::Uniform<size_t>(bitgen, 1, 4);
+      set.insert(k, n);
+      for (size_t j = 0; j < n; ++j) expected.insert(k);
+    } else {
+      auto it = expected.find(k);
+      EXPECT_EQ(set.erase_one(k), it != expected.end());
+      if (it != expected.end()) expected.erase(it);
+    }
+    ASSERT_EQ(set.size(), expected.size());
+    EXPECT_EQ(set.count(k), expected.count(k));
+    EXPECT_EQ(set.rank(k), std::distance(expected.begin(),
+                                         expected.lower_bound(k)));
+    if (!expected.empty()) {
+      size_t idx = absl::Uniform<size_t>(bitgen, 0, expected.size());
+      EXPECT_EQ(set.select(idx)->first, *std::next(expected.begin(), idx));
+    }
+    if (i % 500 == 0) set.Check();
+  }
+  set.Check();
+}
+
+TEST(OrderStatisticMultimapTest, Basic) {
+  OrderStatisticMultimap<int, std::string> map;
+  map.insert(2, "b");
+  map.insert(1, "z", 3);
+  map.insert(2, "a");
+  map.insert(2, "b");
+  // Expanded: (1,z) (1,z) (1,z) (2,a) (2,b) (2,b)
+  EXPECT_EQ(map.size(), 6);
+  EXPECT_EQ(map.distinct_size(), 3);
+  EXPECT_THAT(map, ElementsAre(Pair(Pair(1, "z"), 3), Pair(Pair(2, "a"), 1),
+                               Pair(Pair(2, "b"), 2)));
+  EXPECT_EQ(map.count(1), 3);
+  EXPECT_EQ(map.count(2), 3);
+  EXPECT_EQ(map.count(3), 0);
+  EXPECT_EQ(map.count(2, "b"), 2);
+  EXPECT_TRUE(map.contains(2));
+  EXPECT_FALSE(map.contains(0));
+  EXPECT_EQ(map.rank(2), 3);
+  EXPECT_EQ(map.rank(std::make_pair(2, std::string("b"))), 4);
+  EXPECT_EQ(map.select(4)->first, std::make_pair(2, std::string("b")));
+  auto [first, last] = map.equal_range(2);
+  EXPECT_EQ(std::distance(first, last), 2);
+  EXPECT_EQ(map.upper_bound(1)->first.first, 2);
+  EXPECT_EQ(map.lower_bound(2).rank(), 1);
+  EXPECT_EQ(map.find(2, "a").rank(), 1);
+  EXPECT_TRUE(map.erase_one(2, "b"));
+  EXPECT_EQ(map.count(2), 2);
+  EXPECT_EQ(map.erase(1, "z"), 3);
+  EXPECT_EQ(map.size(), 2);
+  map.Check();
+}
+
+TEST(OrderStatisticMultimapTest, Randomized) {
+  absl::BitGen bitgen;
+  OrderStatisticMultimap<int, int> map;
+  std::multiset<std::pair<int, int>> expected;
+  for (size_t i = 0; i < 5000; ++i) {
+    int k = absl::Uniform<int>(bitgen, 0, 20);
+    int v = absl::Uniform<int>(bitgen, 0, 5);
+    if (absl::Bernoulli(bitgen, 0.6)) {
+      map.insert(k, v);
+      expected.emplace(k, v);
+    } else {
+      auto it = expected.find({k, v});
+      EXPECT_EQ(map.erase_one(k, v), it != expected.end());
+      if (it != expected.end()) expected.erase(it);
+    }
+    ASSERT_EQ(map.size(), expected.size());
+    auto lo = expected.lower_bound({k, INT_MIN});
+    auto hi = expected.lower_bound({k + 1, INT_MIN});
+    EXPECT_EQ(map.count(k), std::distance(lo, hi));
+    EXPECT_EQ(map.count(k, v), expected.count({k, v}));
+    EXPECT_EQ(map.rank(k), std::distance(expected.begin(), lo));
+    EXPECT_EQ(map.rank({k, v}),
+              std::distance(expected.begin(), expected.lower_bound({k, v})));
+    if (!expected.empty()) {
+      size_t idx = absl::Uniform<size_t>(bitgen, 0, expected.size());
+      EXPECT_EQ(map.select(idx)->first, *std::next(expected.begin(), idx));
+    }
+  }
+  map.Check();
+}
+
+}  // namespace cachelib
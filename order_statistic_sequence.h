@@ -0,0 +1,418 @@
+// An OrderStatisticSequence is a list that is indexed by position, like a
+// `std::vector`, but in which every operation, including inserting and erasing
+// in the middle, takes O(log n) time.  It is a weight-balanced tree ordered by
+// position rather than by key (an "implicit-key" tree): a node's position is
+// the number of nodes before it, which the subtree sizes give, so the tree
+// needs no keys and makes no comparisons.
+//
+// Besides `insert_at()`, `erase_at()`, and `at()`, it supports
+//
+//   `move(from, to)`, which moves an element to a new position by relinking
+//   its node (without copying or reallocating the element);
+//
+//   `split(idx)`, which removes the elements from position `idx` on and
+//   returns them as a new sequence; and
+//
+//   `append(other)`, which moves all of `other`'s elements to the end.
+//
+// `split()` and `append()` take O(log n) time; they relink subtrees instead of
+// moving the elements.
+//
+// A PrefixSumSequence also keeps the sum of the values in each subtree, like a
+// PrefixSumMap, so `SumFirstN()` and `SumRange()` take O(log n) time.  Its
+// values can be changed only through `set_at()` and `add_at()`, which fix up
+// the sums.
+//
+// The iterators are the same as OrderStatisticSet's: random access, with
+// `rank()` being the position, and invalidated by inserts and erases.
+//
+// Example:
+//
+//   // An admission queue in which an entry can be promoted.
+//   OrderStatisticSequence<Request> queue;
+//   queue.push_back(r);
+//   queue.move(queue_position, 0);
+//   Request next = queue.pop_front();
+
+#ifndef NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_SEQUENCE_H_
+#define NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_SEQUENCE_H_
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/memory/memory.h"
+#include "prefix_sum_map.h"
+#include "raw_order_statistic_set.h"  // IWYU pragma: export
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// The "comparator" of a sequence.  Sequences have no keys, and none of the
+// key-based operations of RawOrderStatisticSet is made available.
+struct SequenceOrder {};
+
+template <class T>
+class SequenceNode : public RawNode<T, T, SequenceOrder, SequenceNode<T>> {
+  using Base = typename SequenceNode::RawNode;
+
+ public:
+  using value_type = T;
+
+  explicit SequenceNode(T v) : Base(std::move(v)) {}
+
+  void Check(bool recursive, const SequenceOrder &order) {
+    if (recursive) {
+      if (this->left_) this->left_->Check(recursive, order);
+      if (this->right_) this->right_->Check(recursive, order);
+    }
+    Base::CheckShape();
+  }
+};
+
+// Returns the part of a sequence's value that a PrefixSumSequence adds up: all
+// of it.
+struct WholeValueOf {
+  template <class V>
+  const V &operator()(const V &v) const {
+    return v;
+  }
+};
+
+// A sequence node that keeps the sum of the values in its subtree.
+template <class T>
+class SequenceSumNode
+    : public RawNode<T, T, SequenceOrder, SequenceSumNode<T>> {
+  using Base = typename SequenceSumNode::RawNode;
+  using Traits = PrefixSumTraits<T>;
+
+ public:
+  using value_type = T;
+
+  // The sums depend on the values, so they may only be changed through the
+  // sequence's methods.
+  static constexpr bool kMutableValues = false;
+
+  explicit SequenceSumNode(T v) : Base(std::move(v)), sum_(this->value_) {}
+
+  void Check(bool recursive, const SequenceOrder &order) {
+    CHECK(sum_ == ComputeSum())  // Crash OK
+        << " node=" << this;
+    if (recursive) {
+      if (this->left_) this->left_->Check(recursive, order);
+      if (this->right_) this->right_->Check(recursive, order);
+    }
+    Base::CheckShape();
+  }
+
+  void RecomputeSummary() {
+    sum_ = ComputeSum();
+    Base::RecomputeSummary();
+  }
+
+  // The rank-based sum walks, shared with PrefixMapNode.
+  using SumWalker = PrefixSumWalker<SequenceSumNode, T, WholeValueOf>;
+
+ private:
+  friend SumWalker;
+
+  T ComputeSum() const {
+    T sum = this->value_;
+    if (this->left_) Traits::AddTo(&sum, this->left_->sum_);
+    if (this->right_) Traits::AddTo(&sum, this->right_->sum_);
+    return sum;
+  }
+
+  T sum_;
+};
+
+// The implementation shared by OrderStatisticSequence and PrefixSumSequence.
+template <class T, class NodeType>
+class RawOrderStatisticSequence
+    : public RawOrderStatisticSet<T, T, SequenceOrder, NodeType> {
+  using Base = typename RawOrderStatisticSequence::RawOrderStatisticSet;
+
+ protected:
+  using Node = NodeType;
+
+ public:
+  using value_type = T;
+  using size_type = typename Base::size_type;
+  using difference_type = typename Base::difference_type;
+  using reference = value_type &;
+  using const_reference = const value_type &;
+  using iterator = typename Base::iterator;
+  using const_iterator = typename Base::const_iterator;
+  using reverse_iterator = typename Base::reverse_iterator;
+  using const_reverse_iterator = typename Base::const_reverse_iterator;
+
+  RawOrderStatisticSequence() = default;
+
+  // Builds a sequence of `values`, in order, in O(n) time.
+  explicit RawOrderStatisticSequence(std::vector<T> values) {
+    this->root_ = Node::Build(values.begin(), values.end());
+    this->UpdateEnds();
+  }
+
+ protected:
+  //**************** Access ****************
+
+  // Returns the element at position `idx`, which must be less than `size()`.
+  const T &at(size_t idx) const {
+    CHECK_LT(idx, this->size());  // Crash OK
+    return Node::Select(this->root_, idx)->value_;
+  }
+
+  const T &front() const { return at(0); }
+  const T &back() const { return at(this->size() - 1); }
+
+  //**************** Mutators ****************
+
+  // Inserts `v` at position `idx` (which must be at most `size()`), shifting
+  // the elements from `idx` on back by one, and returns an iterator to it.
+  iterator insert_at(size_t idx, T v) {
+    CHECK_LE(idx, this->size());  // Crash OK
+    // Using new to access non-public constructor that make_unique cannot
+    // access.
+    auto x = absl::WrapUnique(new Node(std::move(v)));
+    Node *n = x.get();
+    this->root_ = Node::InsertNodeAt(std::move(this->root_), idx, std::move(x));
+    this->NoteInserted(idx, n);
+    return iterator(this, idx, n);
+  }
+
+  void push_back(T v) { insert_at(this->size(), std::move(v)); }
+  void push_front(T v) { insert_at(0, std::move(v)); }
+
+  // Erases the element at position `idx` (which must be less than `size()`),
+  // and returns an iterator to the element that takes its place.
+  iterator erase_at(size_t idx) {
+    Take(idx);
+    return this->select(idx);
+  }
+
+  // Erases and returns the first (or last) element.  The sequence must not be
+  // empty.
+  T pop_front() { return std::move(Take(0)->value_); }
+  T pop_back() { return std::move(Take(this->size() - 1)->value_); }
+
+  // Moves the element at position `from` to position `to` (both must be less
+  // than `size()`), shifting the ones in between by one.  The element isn't
+  // copied, and references to it stay valid.
+  void move(size_t from, size_t to) {
+    CHECK_LT(to, this->size());  // Crash OK
+    std::unique_ptr<Node> x = Take(from);
+    Node *n = x.get();
+    this->root_ = Node::InsertNodeAt(std::move(this->root_), to, std::move(x));
+    this->NoteInserted(to, n);
+  }
+
+  // Moves the elements of `other` to the end of this sequence, leaving `other`
+  // empty.  Takes O(log n) time.
+  void append(RawOrderStatisticSequence &&other) {
+    this->root_ =
+        Node::Concat(std::move(this->root_), std::move(other.root_));
+    this->UpdateEnds();
+  }
+
+  // Removes the elements at positions `idx` and later (`idx` must be at most
+  // `size()`), and returns them.  Takes O(log n) time.
+  template <class Sequence>
+  Sequence SplitInternal(size_t idx) {
+    CHECK_LE(idx, this->size());  // Crash OK
+    auto [first, rest] = Node::SplitAt(std::move(this->root_), idx);
+    this->root_ = std::move(first);
+    this->UpdateEnds();
+    Sequence result;
+    result.root_ = std::move(rest);
+    result.UpdateEnds();
+    return result;
+  }
+
+ private:
+  // Unlinks the node at position `idx`, and returns it.
+  std::unique_ptr<Node> Take(size_t idx) {
+    CHECK_LT(idx, this->size());  // Crash OK
+    std::unique_ptr<Node> x;
+    this->root_ = Node::EraseNodeAt(std::move(this->root_), idx, &x);
+    this->UpdateEnds();
+    return x;
+  }
+};
+
+}  // namespace cachelib_internal
+
+template <class T>
+class OrderStatisticSequence
+    : public cachelib_internal::RawOrderStatisticSequence<
+          T, cachelib_internal::SequenceNode<T>> {
+  using Base = typename OrderStatisticSequence::RawOrderStatisticSequence;
+  using Node = typename Base::Node;
+
+ public:
+  using Base::Base;
+
+  // Returns a mutable reference to the element at position `idx`, which must
+  // be less than `size()`.
+  T &at(size_t idx) {
+    CHECK_LT(idx, this->size());  // Crash OK
+    return Node::Select(this->root_, idx)->value_;
+  }
+  const T &at(size_t idx) const { return Base::at(idx); }
+  T &operator[](size_t idx) { return at(idx); }
+  const T &operator[](size_t idx) const { return at(idx); }
+
+  // Removes the elements at positions `idx` and later, and returns them.
+  OrderStatisticSequence split(size_t idx) {
+    return this->template SplitInternal<OrderStatisticSequence>(idx);
+  }
+
+  // Moves the elements of `other` to the end, leaving `other` empty.
+  void append(OrderStatisticSequence &&other) { Base::append(std::move(other)); }
+
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::begin;
+
+  using Base::cbegin;
+
+  using Base::end;
+
+  using Base::cend;
+
+  using Base::rbegin;
+
+  using Base::crbegin;
+
+  using Base::rend;
+
+  using Base::crend;
+
+  using Base::select;
+
+  using Base::front;
+
+  using Base::back;
+
+  using Base::insert_at;
+
+  using Base::push_back;
+
+  using Base::push_front;
+
+  using Base::erase_at;
+
+  using Base::pop_front;
+
+  using Base::pop_back;
+
+  using Base::move;
+
+  using Base::clear;
+
+  using Base::swap;
+};
+
+template <class T>
+class PrefixSumSequence
+    : public cachelib_internal::RawOrderStatisticSequence<
+          T, cachelib_internal::SequenceSumNode<T>> {
+  using Base = typename PrefixSumSequence::RawOrderStatisticSequence;
+  using Node = typename Base::Node;
+
+ public:
+  using Base::Base;
+
+  const T &at(size_t idx) const { return Base::at(idx); }
+  const T &operator[](size_t idx) const { return at(idx); }
+
+  // Returns the sum of the first `n` values.
+  T SumFirstN(size_t n) const {
+    T sum{};
+    Node::SumWalker::AddFirstN(this->root_.get(), n, &sum);
+    return sum;
+  }
+
+  // Returns the sum of the values at positions in `[lo, hi)`.
+  T SumRange(size_t lo, size_t hi) const {
+    T sum{};
+    Node::SumWalker::AddRange(this->root_.get(), lo, hi, &sum);
+    return sum;
+  }
+
+  // Sets the value at position `idx` to `v`, or adds `delta` to it.
+  void set_at(size_t idx, T v) {
+    CHECK_LT(idx, this->size());  // Crash OK
+    auto fn = [&v](T &value) { value = std::move(v); };
+    Node::ModifyAtRank(this->root_, idx, fn);
+  }
+  void add_at(size_t idx, const T &delta) {
+    CHECK_LT(idx, this->size());  // Crash OK
+    auto fn = [&delta](T &value) { PrefixSumTraits<T>::AddTo(&value, delta); };
+    Node::ModifyAtRank(this->root_, idx, fn);
+  }
+
+  // Removes the elements at positions `idx` and later, and returns them.
+  PrefixSumSequence split(size_t idx) {
+    return this->template SplitInternal<PrefixSumSequence>(idx);
+  }
+
+  // Moves the elements of `other` to the end, leaving `other` empty.
+  void append(PrefixSumSequence &&other) { Base::append(std::move(other)); }
+
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::begin;
+
+  using Base::cbegin;
+
+  using Base::end;
+
+  using Base::cend;
+
+  using Base::rbegin;
+
+  using Base::crbegin;
+
+  using Base::rend;
+
+  using Base::crend;
+
+  using Base::select;
+
+  using Base::front;
+
+  using Base::back;
+
+  using Base::insert_at;
+
+  using Base::push_back;
+
+  using Base::push_front;
+
+  using Base::erase_at;
+
+  using Base::pop_front;
+
+  using Base::pop_back;
+
+  using Base::move;
+
+  using Base::clear;
+
+  using Base::swap;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_ORDER_STATISTIC_SEQUENCE_H_
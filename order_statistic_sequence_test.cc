@@ -0,0 +1,160 @@
+#include "order_statistic_sequence.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::ElementsAre;
+
+TEST(OrderStatisticSequenceTest, Basic) {
+  OrderStatisticSequence<std::string> seq;
+  EXPECT_TRUE(seq.empty());
+  seq.push_back("b");
+  seq.push_back("d");
+  seq.push_front("a");
+  auto it = seq.insert_at(2, "c");
+  EXPECT_EQ(*it, "c");
+  EXPECT_EQ(it.rank(), 2);
+  EXPECT_THAT(seq, ElementsAre("a", "b", "c", "d"));
+  EXPECT_EQ(seq.at(1), "b");
+  seq[1] = "B";
+  EXPECT_EQ(seq.front(), "a");
+  EXPECT_EQ(seq.back(), "d");
+
+  const std::string *d = &seq.at(3);
+  seq.move(3, 0);
+  EXPECT_EQ(&seq.at(0), d);
+  EXPECT_THAT(seq, ElementsAre("d", "a", "B", "c"));
+  seq.move(0, 3);
+  EXPECT_THAT(seq, ElementsAre("a", "B", "c", "d"));
+
+  EXPECT_EQ(*seq.erase_at(1), "c");
+  EXPECT_EQ(seq.pop_front(), "a");
+  EXPECT_EQ(seq.pop_back(), "d");
+  EXPECT_THAT(seq, ElementsAre("c"));
+  seq.Check();
+}
+
+TEST(OrderStatisticSequenceTest, SplitAndAppend) {
+  std::vector<int> values(1000);
+  std::iota(values.begin(), values.end(), 0);
+  OrderStatisticSequence<int> seq(values);
+  seq.Check();
+  for (size_t idx : {0, 1, 333, 999, 1000}) {
+    OrderStatisticSequence<int> rest = seq.split(idx);
+    seq.Check();
+    rest.Check();
+    ASSERT_EQ(seq.size(), idx);
+    ASSERT_EQ(rest.size(), 1000 - idx);
+    if (idx > 0) {
+      EXPECT_EQ(seq.back(), idx - 1);
+    }
+    if (idx < 1000) {
+      EXPECT_EQ(rest.front(), idx);
+    }
+    seq.append(std::move(rest));
+    seq.Check();
+    EXPECT_TRUE(rest.empty());
+    EXPECT_TRUE(std::equal(seq.begin(), seq.end(), values.begin(),
+                           values.end()));
+  }
+  // Appending trees of very different sizes.
+  OrderStatisticSequence<int> small({-1});
+  small.append(std::move(seq));
+  small.Check();
+  EXPECT_EQ(small.size(), 1001);
+  EXPECT_EQ(small.front(), -1);
+  EXPECT_EQ(small.back(), 999);
+}
+
+TEST(OrderStatisticSequenceTest, Randomized) {
+  absl::BitGen bitgen;
+  OrderStatisticSequence<int> seq;
+  std::vector<int> expected;
+  for (int i = 0; i < 20000; ++i) {
+    size_t n = expected.size();
+    switch (absl::Uniform(bitgen, 0, 5)) {
+      case 0:
+      case 1: {
+        size_t idx = absl::Uniform<size_t>(bitgen, 0, n + 1);
+        seq.insert_at(idx, i);
+        expected.insert(expected.begin() + idx, i);
+        break;
+      }
+      case 2:
+        if (n > 0) {
+          size_t idx = absl::Uniform<size_t>(bitgen, 0, n);
+          seq.erase_at(idx);
+          expected.erase(expected.begin() + idx);
+        }
+        break;
+      case 3:
+        if (n > 0) {
+          size_t from = absl::Uniform<size_t>(bitgen, 0, n);
+          size_t to = absl::Uniform<size_t>(bitgen, 0, n);
+          seq.move(from, to);
+          int v = expected[from];
+          expected.erase(expected.begin() + from);
+          expected.insert(expected.begin() + to, v);
+        }
+        break;
+      case 4: {
+        size_t idx = absl::Uniform<size_t>(bitgen, 0, n + 1);
+        OrderStatisticSequence<int> rest = seq.split(idx);
+        OrderStatisticSequence<int> middle = std::move(seq);
+        seq = std::move(rest);
+        seq.append(std::move(middle));
+        std::rotate(expected.begin(), expected.begin() + idx, expected.end());
+        break;
+      }
+    }
+    ASSERT_EQ(seq.size(), expected.size());
+    if (i % 500 == 0) {
+      seq.Check();
+      EXPECT_TRUE(std::equal(seq.begin(), seq.end(), expected.begin(),
+                             expected.end()));
+    }
+  }
+}
+
+TEST(PrefixSumSequenceTest, Sums) {
+  absl::BitGen bitgen;
+  PrefixSumSequence<int64_t> seq;
+  std::vector<int64_t> expected;
+  for (int i = 0; i < 2000; ++i) {
+    size_t idx = absl::Uniform<size_t>(bitgen, 0, expected.size() + 1);
+    int64_t v = absl::Uniform(bitgen, 0, 100);
+    seq.insert_at(idx, v);
+    expected.insert(expected.begin() + idx, v);
+    size_t at = absl::Uniform<size_t>(bitgen, 0, expected.size());
+    seq.add_at(at, 5);
+    expected[at] += 5;
+    if (i % 7 == 0) {
+      seq.set_at(at, 1);
+      expected[at] = 1;
+    }
+    size_t lo = absl::Uniform<size_t>(bitgen, 0, expected.size() + 1);
+    size_t hi = absl::Uniform<size_t>(bitgen, lo, expected.size() + 1);
+    EXPECT_EQ(seq.SumFirstN(hi),
+              std::accumulate(expected.begin(), expected.begin() + hi, 0));
+    EXPECT_EQ(seq.SumRange(lo, hi),
+              std::accumulate(expected.begin() + lo, expected.begin() + hi, 0));
+  }
+  PrefixSumSequence<int64_t> rest = seq.split(1000);
+  EXPECT_EQ(seq.SumFirstN(seq.size()) + rest.SumFirstN(rest.size()),
+            std::accumulate(expected.begin(), expected.end(), int64_t{0}));
+  seq.Check();
+  rest.Check();
+}
+
+}  // namespace cachelib
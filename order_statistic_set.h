@@ -187,6 +187,22 @@ class OrderStatisticSet
   //   compare less than the element.
   using Base::select;
 
+  // template <class URBG> iterator sample(URBG &&g);
+  // template <class URBG> const_iterator sample(URBG &&g) const;
+  //
+  //   Returns an iterator to an element chosen uniformly at random using the
+  //   uniform random bit generator `g`, or `end()` if the container is empty.
+  using Base::sample;
+
+  // template <class URBG>
+  // std::vector<iterator> sample_n(URBG &&g, size_t k, bool with_replacement);
+  //
+  //   Returns iterators to `k` elements chosen uniformly at random, in rank
+  //   order.  Without replacement, the elements are distinct, and at most
+  //   `size()` of them are returned.  The elements are found in one walk over
+  //   the tree, which is cheaper than `k` calls to `sample()`.
+  using Base::sample_n;
+
   // void clear() const;
   //
   // Erases all the elements from the container.
@@ -207,6 +223,23 @@ class OrderStatisticSet
   // Iterators are invalidated.  References remain valid.
   using Base::insert;
 
+  // template <class RandomIt>
+  // size_t insert_sorted(RandomIt first, RandomIt last,
+  //                      bool *did_insert = nullptr);
+  //
+  //   Inserts each of the values in `[first, last)`, which must be sorted by
+  //   strictly increasing key, as though by calling `insert()` on each one.
+  //   The values are moved from.  If `did_insert` is not null, then
+  //   `did_insert[i]` is set to whether `first[i]` was inserted.  Returns the
+  //   number of values inserted.
+  //
+  //   The batch is merged into the tree in a single pass, which is faster than
+  //   inserting the values one at a time, especially when the batch is large
+  //   or its keys are clustered.
+  //
+  //   Iterators are invalidated.  References remain valid.
+  using Base::insert_sorted;
+
   // iterator erase(iterator pos);
   //
   //   Removes the element at `pos`, returning an iterator following the removed
@@ -227,6 +260,25 @@ class OrderStatisticSet
   //   `Key`.  Returns the number of elements removed (0 or 1).
   using Base::erase;
 
+  // iterator push_back(value_type value);
+  //
+  //   Inserts `value`, which must be greater than every element in the set,
+  //   and returns an iterator to it.  Appending walks the right spine without
+  //   comparing keys, so sets filled in increasing order (timestamps, log
+  //   offsets) should prefer it to `insert()`.  Crashes if `value` is out of
+  //   order.
+  //
+  //   Iterators are invalidated.  References remain valid.
+  using Base::push_back;
+
+  // void pop_front();
+  //
+  //   Removes the first element, which must exist.  Together with `push_back()`
+  //   this makes the set a sliding window over an increasing stream.
+  //
+  //   Iterators are invalidated.  References to other elements remain valid.
+  using Base::pop_front;
+
   // void swap(OrderStatisticSet& other);
   //
   //   Exchanges the contents of the container with those of other.  Does not
@@ -1,23 +1,185 @@
 // The PrefixMap is an extension of OrderStatisticMap that allows you to ask for
 // the sum of the first n mapped values.
 //
+// The mapped values are added up with `PrefixSumTraits<T>`, which uses `T`'s
+// `+` by default (or `+=`, if `T` has it, to add in place) and adds
+// `std::array`s elementwise.  So one tree with a
+// `std::array<uint64_t, N>` mapped type can keep N metrics per key, and
+// `SumFirstN()` returns all N sums from a single descent.
+//
 // See the order_statistic_set.h and order_statistic_map.h comments for more
 // information.
 
 #ifndef NET_BANDAID_BDN_CACHELIB_PREFIX_SUM_MAP_H_
 #define NET_BANDAID_BDN_CACHELIB_PREFIX_SUM_MAP_H_
 
+#include <algorithm>
+#include <array>
 #include <cstddef>
 #include <functional>
 #include <memory>
+#include <ostream>
+#include <random>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "base/logging.h"
+#include "absl/types/span.h"
 #include "net/bandaid/bdn/cachelib/raw_order_statistic_map.h"  // IWYU pragma: export
 
 namespace cachelib {
 namespace cachelib_internal {
 
+// Whether `T` has `+=`.
+template <class T, class = void>
+struct HasPlusAssign : std::false_type {};
+template <class T>
+struct HasPlusAssign<
+    T, std::void_t<decltype(std::declval<T &>() += std::declval<const T &>())>>
+    : std::true_type {};
+
+// Whether `T` can be written to a `std::ostream`, for CHECK messages.
+template <class T, class = void>
+struct IsStreamable : std::false_type {};
+template <class T>
+struct IsStreamable<T, std::void_t<decltype(std::declval<std::ostream &>()
+                                            << std::declval<const T &>())>>
+    : std::true_type {};
+
+}  // namespace cachelib_internal
+
+// How a PrefixSumMap adds up its mapped values.  By default it uses `T`'s own
+// operators.  Specialize this for a mapped type that doesn't have them (or for
+// which there is a faster way).
+template <class T>
+struct PrefixSumTraits {
+  // `*sum += v`, or `*sum = *sum + v` if `T` has only `+`.
+  static void AddTo(T *sum, const T &v) {
+    if constexpr (cachelib_internal::HasPlusAssign<T>::value) {
+      *sum += v;
+    } else {
+      *sum = *sum + v;
+    }
+  }
+  // `v` added up `n` times.  Needed only for `AddToRange()`, and available
+  // only if `T` has `*` and converts from `size_t`.
+  template <class U = T>
+  static auto Scale(const U &v, size_t n) -> decltype(v * static_cast<U>(n)) {
+    return v * static_cast<U>(n);
+  }
+  // Whether `v` is the zero value, `T{}`.
+  static bool IsZero(const T &v) { return v == T{}; }
+};
+
+// A fixed-width vector of metrics, such as `std::array<uint64_t, 4>` for
+// bytes, hits, misses, and total latency, is added up elementwise.  Keeping
+// all the metrics in one tree shares the nodes, the keys, and the descents
+// among them, and since `N` is a compile-time constant the compiler turns
+// these loops into SIMD adds.
+template <class E, size_t N>
+struct PrefixSumTraits<std::array<E, N>> {
+  static void AddTo(std::array<E, N> *sum, const std::array<E, N> &v) {
+    for (size_t i = 0; i < N; ++i) (*sum)[i] += v[i];
+  }
+  static std::array<E, N> Scale(const std::array<E, N> &v, size_t n) {
+    std::array<E, N> result;
+    for (size_t i = 0; i < N; ++i) result[i] = v[i] * static_cast<E>(n);
+    return result;
+  }
+  static bool IsZero(const std::array<E, N> &v) {
+    bool zero = true;
+    for (size_t i = 0; i < N; ++i) zero &= v[i] == E{};
+    return zero;
+  }
+};
+
+namespace cachelib_internal {
+
+// Whether `PrefixSumTraits<T>` can scale a `T`, which `AddToRange()` needs.
+template <class T, class = void>
+struct CanScale : std::false_type {};
+template <class T>
+struct CanScale<T, std::void_t<decltype(PrefixSumTraits<T>::Scale(
+                       std::declval<const T &>(), size_t{0}))>>
+    : std::true_type {};
+
+// Returns the part of a map's value that a PrefixSumMap adds up: the mapped
+// value.
+struct MappedValueOf {
+  template <class V>
+  const auto &operator()(const V &v) const {
+    return v.second;
+  }
+};
+
+// The rank-based sum walks shared by the node types that keep the sum of
+// their subtree in `sum_` (PrefixMapNode, and SequenceSumNode in
+// order_statistic_sequence.h).  `Summand` projects a node's value onto the
+// part that is added up.  The walks go down the tree iteratively, call
+// `PushDown()` on each node before looking at its children, and add into
+// `*sum` in place so that a large `T` isn't copied at every level.  A node type
+// that uses this must befriend it.
+template <class Node, class T, class Summand>
+class PrefixSumWalker {
+  using Traits = PrefixSumTraits<T>;
+
+ public:
+  // Adds to `*sum` the values with rank < idx.
+  static void AddFirstN(Node *n, size_t idx, T *sum) {
+    while (n != nullptr) {
+      n->PushDown();
+      size_t left_size = Node::Size(n->left_);
+      if (idx <= left_size) {
+        n = n->left_.get();
+      } else {
+        if (n->left_) Traits::AddTo(sum, n->left_->sum_);
+        Traits::AddTo(sum, Summand()(n->value_));
+        idx -= left_size + 1;
+        n = n->right_.get();
+      }
+    }
+  }
+
+  // Adds to `*sum` the values with rank >= idx.
+  static void AddFrom(Node *n, size_t idx, T *sum) {
+    while (n != nullptr) {
+      n->PushDown();
+      size_t left_size = Node::Size(n->left_);
+      if (idx <= left_size) {
+        Traits::AddTo(sum, Summand()(n->value_));
+        if (n->right_) Traits::AddTo(sum, n->right_->sum_);
+        n = n->left_.get();
+      } else {
+        idx -= left_size + 1;
+        n = n->right_.get();
+      }
+    }
+  }
+
+  // Adds to `*sum` the values with ranks in `[lo, hi)`.  Walks down to the
+  // lowest common ancestor of the range and then adds the part of its left
+  // subtree at or after `lo` and the part of its right subtree before `hi`.
+  static void AddRange(Node *n, size_t lo, size_t hi, T *sum) {
+    while (n != nullptr && lo < hi) {
+      n->PushDown();
+      size_t left_size = Node::Size(n->left_);
+      if (hi <= left_size) {
+        n = n->left_.get();
+      } else if (lo > left_size) {
+        lo -= left_size + 1;
+        hi -= left_size + 1;
+        n = n->right_.get();
+      } else {
+        AddFrom(n->left_.get(), lo, sum);
+        Traits::AddTo(sum, Summand()(n->value_));
+        AddFirstN(n->right_.get(), hi - left_size - 1, sum);
+        return;
+      }
+    }
+  }
+};
+
 // A prefix tree that adds up the T's
 template <class Key, class T, class Compare = std::less<>>
 class PrefixMapNode
@@ -31,18 +193,26 @@ class PrefixMapNode
   using value_type = typename Base::value_type;
 
  public:
+  // The sums depend on the mapped values, so they may only be changed through
+  // the map's methods.
+  static constexpr bool kMutableValues = false;
+
   explicit PrefixMapNode(value_type v)
       : Base(std::move(v)), sum_(this->value_.second) {}
 
   // Checks the invariant on the sum (the sum equals the sum of the value and
   // the children's sum).  This should probably be called only in test code.
   void Check(bool recursive, const key_compare &lessthan) {
-    const T &nv = this->value_.second;
-    T sum = this->left_ ? this->left_->sum_ + nv : nv;
-    sum = this->right_ ? sum + this->right_->sum_ : sum;
-    CHECK_EQ(sum_, sum)                                          // Crash OK
-        << " node=" << this << " leftsum=" << this->left_->sum_  //
-        << " rightsum=" << this->right_->sum_ << " this val=" << nv;
+    PushDown();
+    if constexpr (cachelib_internal::IsStreamable<T>::value) {
+      CHECK(sum_ == ComputeSum())  // Crash OK
+          << " node=" << this << " sum=" << sum_
+          << " expected=" << ComputeSum()
+          << " this val=" << this->value_.second;
+    } else {
+      CHECK(sum_ == ComputeSum())  // Crash OK
+          << " node=" << this;
+    }
     if (recursive) {
       if (this->left_) this->left_->Check(recursive, lessthan);
       if (this->right_) this->right_->Check(recursive, lessthan);
@@ -52,33 +222,268 @@ class PrefixMapNode
     Base::Check(false, lessthan);
   }
 
+  // Applies the pending range add (see `AddToKeys()`) to the children.  A
+  // `T` that can't be scaled never has one.
+  void PushDown() {
+    if constexpr (CanScale<T>::value) {
+      if (Traits::IsZero(pending_add_)) return;
+      if (this->left_) this->left_->AddToAll(pending_add_);
+      if (this->right_) this->right_->AddToAll(pending_add_);
+      pending_add_ = T{};
+    }
+  }
+
   // Maintains the sum and invokes RecomputeSummary() on the base type (which in
-  // this case maintains the rank information).
+  // this case maintains the rank information).  There must be no pending range
+  // add (which is the case whenever the children have changed, since changing
+  // them requires `PushDown()` first).
   void RecomputeSummary() {
-    const T &nv = this->value_.second;
-    const std::unique_ptr<PrefixMapNode> &left = this->left_;
-    const std::unique_ptr<PrefixMapNode> &right = this->right_;
-    T leftsum = (left ? left->sum_ + nv : nv);
-    sum_ = (right ? leftsum + right->sum_ : leftsum);
+    sum_ = ComputeSum();
     Base::RecomputeSummary();
   }
 
  public:
-  // The query operation: Returns the sum of the all the values with rank < idx.
-  static T SumFirstN(const std::unique_ptr<PrefixMapNode> &n, size_t idx) {
-    if (n == nullptr) return T{};  // zero
-    size_t left_size = PrefixMapNode::Size(n->left_);
-    if (left_size >= idx) {
-      return SumFirstN(n->left_, idx);
+  // The rank-based query operations, `AddFirstN()`, `AddFrom()`, and
+  // `AddRange()`.
+  using SumWalker = PrefixSumWalker<PrefixMapNode, T, MappedValueOf>;
+
+  // The key-based query operations.  Like the rank-based ones, they walk down
+  // the tree iteratively and add into `*sum` in place.  They add with
+  // `PrefixSumTraits<T>::AddTo()`, which is `+=` or `+` unless specialized.
+
+  // Adds to `*sum` the values with keys less than `k`.
+  template <class K>
+  static void AddLess(PrefixMapNode *n, const K &k,
+                      const key_compare &lessthan, T *sum) {
+    while (n != nullptr) {
+      n->PushDown();
+      if (lessthan(PrefixMapNode::key(n->value_), k)) {
+        if (n->left_) AddTo(sum, n->left_->sum_);
+        AddTo(sum, n->value_.second);
+        n = n->right_.get();
+      } else {
+        n = n->left_.get();
+      }
+    }
+  }
+
+  // Returns the rank of `k` and the node with key `k` (or nullptr if there is
+  // none), and adds to `*sum` the values with keys less than `k`.
+  template <class K>
+  static std::pair<size_t, PrefixMapNode *> FindAddLess(
+      PrefixMapNode *n, const K &k, const key_compare &lessthan, T *sum) {
+    size_t idx = 0;
+    while (n != nullptr) {
+      n->PushDown();
+      if (lessthan(PrefixMapNode::key(n->value_), k)) {
+        if (n->left_) AddTo(sum, n->left_->sum_);
+        AddTo(sum, n->value_.second);
+        idx += PrefixMapNode::Size(n->left_) + 1;
+        n = n->right_.get();
+      } else if (lessthan(k, PrefixMapNode::key(n->value_))) {
+        n = n->left_.get();
+      } else {
+        if (n->left_) AddTo(sum, n->left_->sum_);
+        return {idx + PrefixMapNode::Size(n->left_), n};
+      }
+    }
+    return {idx, nullptr};
+  }
+
+  // Adds to `*sum` the values with keys not less than `k`.
+  template <class K>
+  static void AddNotLess(PrefixMapNode *n, const K &k,
+                         const key_compare &lessthan, T *sum) {
+    while (n != nullptr) {
+      n->PushDown();
+      if (lessthan(PrefixMapNode::key(n->value_), k)) {
+        n = n->right_.get();
+      } else {
+        AddTo(sum, n->value_.second);
+        if (n->right_) AddTo(sum, n->right_->sum_);
+        n = n->left_.get();
+      }
+    }
+  }
+
+  // Adds to `*sum` the values with keys in `[lo, hi)`, splitting at the lowest
+  // common ancestor like `PrefixSumWalker::AddRange()`.
+  template <class K>
+  static void AddKeys(PrefixMapNode *n, const K &lo, const K &hi,
+                      const key_compare &lessthan, T *sum) {
+    while (n != nullptr) {
+      n->PushDown();
+      const Key &k = PrefixMapNode::key(n->value_);
+      if (lessthan(k, lo)) {
+        n = n->right_.get();
+      } else if (!lessthan(k, hi)) {
+        n = n->left_.get();
+      } else {
+        AddNotLess(n->left_.get(), lo, lessthan, sum);
+        AddTo(sum, n->value_.second);
+        AddLess(n->right_.get(), hi, lessthan, sum);
+        return;
+      }
+    }
+  }
+
+  // Returns the sum of the values in the subtree.
+  static T Sum(const std::unique_ptr<PrefixMapNode> &n) {
+    return n ? n->sum_ : T{};
+  }
+
+  // Calls `emit(rank, node)`, for each target `x` in `[first, last)` (which
+  // must be sorted), on the node whose value spans `x` in the running sums:
+  // the node such that `base` plus the sum of the values before it is at
+  // most `x`, and that plus its own value is more than `x`.  `offset` is the
+  // rank of the subtree's first node.  Shares the descents to nearby targets.
+  template <class It, class Emit>
+  static void SelectByPrefixSums(PrefixMapNode *n, It first, It last,
+                                 size_t offset, const T &base, Emit &emit) {
+    if (first == last || n == nullptr) return;
+    n->PushDown();
+    T left_end = base;
+    if (n->left_) AddTo(&left_end, n->left_->sum_);
+    T node_end = left_end;
+    AddTo(&node_end, n->value_.second);
+    It mid = std::lower_bound(first, last, left_end);
+    It after = std::lower_bound(mid, last, node_end);
+    size_t rank = offset + PrefixMapNode::Size(n->left_);
+    SelectByPrefixSums(n->left_.get(), first, mid, offset, base, emit);
+    for (It it = mid; it != after; ++it) emit(rank, n);
+    SelectByPrefixSums(n->right_.get(), after, last, rank + 1, node_end, emit);
+  }
+
+  // Adds `delta` to the mapped value of rank `idx` (which must exist), and to
+  // the sums on the way down to it.
+  static void AddAtRank(PrefixMapNode *n, size_t idx, const T &delta) {
+    while (true) {
+      DCHECK(n != nullptr);
+      n->PushDown();
+      AddTo(&n->sum_, delta);
+      size_t left_size = PrefixMapNode::Size(n->left_);
+      if (idx < left_size) {
+        n = n->left_.get();
+      } else if (idx > left_size) {
+        idx -= left_size + 1;
+        n = n->right_.get();
+      } else {
+        AddTo(&n->value_.second, delta);
+        return;
+      }
+    }
+  }
+
+  // Adds each delta in `[first, last)`, a range of `(rank, delta)` pairs
+  // sorted by rank, to the mapped value of rank `rank - offset` in the subtree
+  // rooted at `n`.  Recomputes the sum of each affected node just once, after
+  // its children are done.
+  template <class It>
+  static void AddAtRanks(PrefixMapNode *n, It first, It last, size_t offset) {
+    if (first == last) return;
+    DCHECK(n != nullptr);
+    n->PushDown();
+    size_t rank = offset + PrefixMapNode::Size(n->left_);
+    It mid = std::partition_point(
+        first, last, [rank](const auto &p) { return p.first < rank; });
+    It after = std::partition_point(
+        mid, last, [rank](const auto &p) { return p.first == rank; });
+    AddAtRanks(n->left_.get(), first, mid, offset);
+    for (It it = mid; it != after; ++it) AddTo(&n->value_.second, it->second);
+    AddAtRanks(n->right_.get(), after, last, rank + 1);
+    n->RecomputeSummary();
+  }
+
+  // Adds `delta` to the mapped values with keys in `[lo, hi)`.  `lo_bounded`
+  // and `hi_bounded` say whether `lo` and `hi` still constrain the subtree.
+  // Once a whole subtree is in the range, the add is applied to its root and
+  // left pending for the rest (see `PushDown()`), so this visits O(log n)
+  // nodes no matter how many values it changes.
+  template <class K>
+  static void AddToKeys(PrefixMapNode *n, const K &lo, bool lo_bounded,
+                        const K &hi, bool hi_bounded, const T &delta,
+                        const key_compare &lessthan) {
+    if (n == nullptr) return;
+    if (!lo_bounded && !hi_bounded) {
+      n->AddToAll(delta);
+      return;
+    }
+    n->PushDown();
+    const Key &k = PrefixMapNode::key(n->value_);
+    if (lo_bounded && lessthan(k, lo)) {
+      AddToKeys(n->right_.get(), lo, lo_bounded, hi, hi_bounded, delta,
+                lessthan);
+    } else if (hi_bounded && !lessthan(k, hi)) {
+      AddToKeys(n->left_.get(), lo, lo_bounded, hi, hi_bounded, delta,
+                lessthan);
     } else {
-      const T &nv = n->value_.second;
-      T sum = n->left_ ? n->left_->sum_ + nv : nv;
-      return sum + SumFirstN(n->right_, idx - left_size - 1);
+      AddToKeys(n->left_.get(), lo, lo_bounded, hi, false, delta, lessthan);
+      AddTo(&n->value_.second, delta);
+      AddToKeys(n->right_.get(), lo, false, hi, hi_bounded, delta, lessthan);
     }
+    n->RecomputeSummary();
+  }
+
+  // The inverse of SumFirstN(): Returns the rank of, and a pointer to, the
+  // first node whose inclusive prefix sum satisfies `pred`, and adds the values
+  // up to and including that node to `*sum`.  If no prefix satisfies `pred`,
+  // returns `{Size(n), nullptr}` and adds all the values.
+  //
+  // `pred` must be monotone: false for every prefix shorter than some length
+  // and true for every prefix at least that long.  Uses the subtree sums to
+  // decide which way to go at each node, so it's a single root-to-leaf
+  // descent.
+  template <class Pred>
+  static std::pair<size_t, PrefixMapNode *> SelectByPrefixSum(
+      const std::unique_ptr<PrefixMapNode> &root, Pred &pred, T *sum) {
+    size_t idx = 0;
+    PrefixMapNode *n = root.get();
+    while (n != nullptr) {
+      n->PushDown();
+      if (n->left_) {
+        T with_left = *sum;
+        AddTo(&with_left, n->left_->sum_);
+        if (pred(with_left)) {
+          n = n->left_.get();
+          continue;
+        }
+        *sum = std::move(with_left);
+        idx += PrefixMapNode::Size(n->left_);
+      }
+      AddTo(sum, n->value_.second);
+      if (pred(*sum)) return {idx, n};
+      ++idx;
+      n = n->right_.get();
+    }
+    return {idx, nullptr};
   }
 
  private:
+  friend SumWalker;
+  using Traits = PrefixSumTraits<T>;
+
+  static void AddTo(T *sum, const T &v) { Traits::AddTo(sum, v); }
+
+  // Returns the sum of the value and the children's sums.
+  T ComputeSum() const {
+    T sum = this->value_.second;
+    if (this->left_) AddTo(&sum, this->left_->sum_);
+    if (this->right_) AddTo(&sum, this->right_->sum_);
+    return sum;
+  }
+
+  // Adds `delta` to every value in the subtree: to this node's value and sum
+  // now, and to the descendants when they are reached.
+  void AddToAll(const T &delta) {
+    AddTo(&this->value_.second, delta);
+    AddTo(&sum_, Traits::Scale(delta, this->subtree_size_));
+    AddTo(&pending_add_, delta);
+  }
+
   T sum_;
+  // An add that applies to every value in the children's subtrees but hasn't
+  // been applied to them yet.  It is already included in `sum_`.
+  T pending_add_{};
 };
 
 }  // namespace cachelib_internal
@@ -107,10 +512,175 @@ class PrefixSumMap
   using reverse_iterator = typename Base::reverse_iterator;
   using const_reverse_iterator = typename Base::const_reverse_iterator;
 
-  // The new method supported by PrefixSumMap:
+  // The new methods supported by PrefixSumMap:
   //
   // Returns the sum of the first n keys in the tree.
-  T SumFirstN(size_t n) const { return Node::SumFirstN(this->root_, n); }
+  T SumFirstN(size_t n) const {
+    T sum{};
+    Node::SumWalker::AddFirstN(this->root_.get(), n, &sum);
+    return sum;
+  }
+
+  // Returns the sum of the values with ranks in `[rank_lo, rank_hi)`.
+  T SumRange(size_t rank_lo, size_t rank_hi) const {
+    T sum{};
+    Node::SumWalker::AddRange(this->root_.get(), rank_lo, rank_hi, &sum);
+    return sum;
+  }
+
+  // Returns the sum of the values with keys in `[lo, hi)`.  Like
+  // `SumRange()`, this is one descent, instead of two `lower_bound()` calls
+  // and two `SumFirstN()` calls.
+  template <class K>
+  T SumKeys(const K &lo, const K &hi) const {
+    T sum{};
+    Node::AddKeys(this->root_.get(), lo, hi, this->lessthan_, &sum);
+    return sum;
+  }
+
+  // Returns the sum of the values with keys less than `k`.
+  template <class K>
+  T SumLess(const K &k) const {
+    T sum{};
+    Node::AddLess(this->root_.get(), k, this->lessthan_, &sum);
+    return sum;
+  }
+
+  // Returns `find(k)` together with `SumLess(k)`, from a single descent.
+  template <class K>
+  std::pair<iterator, T> FindWithPrefixSum(const K &k) {
+    return FindWithPrefixSumInternal<iterator>(k);
+  }
+  template <class K>
+  std::pair<const_iterator, T> FindWithPrefixSum(const K &k) const {
+    return FindWithPrefixSumInternal<const_iterator>(k);
+  }
+
+  // Returns an iterator to the first element at which the running sum of the
+  // mapped values reaches `x` (that is, the element of the smallest rank `r`
+  // such that `SumFirstN(r + 1) >= x`), together with that running sum.  If
+  // the sum of all the values is less than `x`, returns `end()` and the sum
+  // of all the values.  The mapped values must not be negative.
+  //
+  // This is the inverse of `SumFirstN()`.  For example, if the values are
+  // object sizes in eviction order, then `SelectByPrefixSum(x).first.rank()
+  // + 1` is the number of objects to evict to free `x` bytes.  It takes
+  // O(log n) time, instead of the O(log^2 n) of a binary search over
+  // `SumFirstN()`.
+  std::pair<iterator, T> SelectByPrefixSum(const T &x) {
+    return SelectByPrefixSum(ReachesAtLeast{x});
+  }
+  std::pair<const_iterator, T> SelectByPrefixSum(const T &x) const {
+    return SelectByPrefixSum(ReachesAtLeast{x});
+  }
+
+  // Adds `delta` to the mapped value at `pos`, fixing the sums on the way
+  // down to it.  This finds the node by rank, so it makes no key comparisons.
+  // `pos` stays valid.
+  //
+  // The iterators of a PrefixSumMap refer to const values, since changing a
+  // value through an iterator would leave the sums wrong.  Use `add()`,
+  // `update()` (which replaces the value), `update_batch()`, or
+  // `insert_or_assign()` instead.
+  void add(const_iterator pos, const T &delta) {
+    DCHECK_LT(pos.rank(), size());
+    Node::AddAtRank(this->root_.get(), pos.rank(), delta);
+  }
+
+  // Adds each `delta` to the mapped value of rank `rank`, for each
+  // `(rank, delta)` in `deltas`.  A rank may appear more than once.  Every
+  // node whose sum changes is recomputed only once, so this is cheaper than
+  // calling `add()` for each delta when the ranks share ancestors.
+  void update_batch(absl::Span<const std::pair<size_t, T>> deltas) {
+    auto by_rank = [](const std::pair<size_t, T> &a,
+                      const std::pair<size_t, T> &b) {
+      return a.first < b.first;
+    };
+    if (std::is_sorted(deltas.begin(), deltas.end(), by_rank)) {
+      if (!deltas.empty()) {
+        CHECK_LT(deltas.back().first, size());  // Crash OK
+      }
+      Node::AddAtRanks(this->root_.get(), deltas.begin(), deltas.end(), 0);
+      return;
+    }
+    std::vector<std::pair<size_t, T>> sorted(deltas.begin(), deltas.end());
+    std::sort(sorted.begin(), sorted.end(), by_rank);
+    CHECK_LT(sorted.back().first, size());  // Crash OK
+    Node::AddAtRanks(this->root_.get(), sorted.begin(), sorted.end(), 0);
+  }
+
+  // Adds `delta` to every mapped value with a key in `[lo, hi)`, in O(log n)
+  // time no matter how many values that is.  This needs
+  // `PrefixSumTraits<T>::Scale()`, which by default needs `T` to support `*`
+  // and conversion from `size_t`.
+  //
+  // The add is applied to whole subtrees lazily: it is recorded at the root of
+  // each subtree that lies inside the range and pushed down to the children
+  // by whichever later operation first reaches them.  The sums, and the values
+  // seen through iterators obtained after the call, are up to date.  But an
+  // iterator obtained before the call may still see the old value, since its
+  // node may sit below a pending add: a range add makes the values of earlier
+  // iterators stale, much as inserting or erasing invalidates them.  Look the
+  // elements up again.  And since the pushing down happens in const operations
+  // too, after a range add even const methods must not be called
+  // concurrently.
+  template <class K>
+  void AddToRange(const K &lo, const K &hi, const T &delta) {
+    static_assert(cachelib_internal::CanScale<T>::value,
+                  "AddToRange needs PrefixSumTraits<T>::Scale()");
+    Node::AddToKeys(this->root_.get(), lo, true, hi, true, delta,
+                    this->lessthan_);
+    // Brings the cached first and last values up to date.
+    this->UpdateEnds();
+  }
+
+  // Returns an iterator to an element chosen at random with probability
+  // proportional to its mapped value, using the uniform random bit generator
+  // `g`.  Returns `end()` if the sum of the values isn't positive.  `T` must
+  // be an arithmetic type, and the values must not be negative.  This is one
+  // descent, like `SelectByPrefixSum()`.
+  template <class URBG>
+  iterator sample_weighted(URBG &&g) {
+    return SampleWeightedInternal<iterator>(g);
+  }
+  template <class URBG>
+  const_iterator sample_weighted(URBG &&g) const {
+    return SampleWeightedInternal<const_iterator>(g);
+  }
+
+  // Returns iterators to `k` elements chosen independently (that is, with
+  // replacement) as by `sample_weighted()`, in rank order.  The targets are
+  // drawn first and sorted, and then found in one walk over the tree that
+  // shares the descents to nearby targets.
+  template <class URBG>
+  std::vector<iterator> sample_weighted_n(URBG &&g, size_t k) {
+    return SampleWeightedNInternal<iterator>(g, k);
+  }
+  template <class URBG>
+  std::vector<const_iterator> sample_weighted_n(URBG &&g, size_t k) const {
+    return SampleWeightedNInternal<const_iterator>(g, k);
+  }
+
+  // The general form: Returns an iterator to the first element whose running
+  // sum `s` (including the element's own value) satisfies `pred(s)`, together
+  // with `s`.  `pred` must be monotone along the running sums: once it
+  // returns true, it must return true for every longer prefix.
+  template <class Pred, class = std::enable_if_t<
+                            std::is_invocable_r_v<bool, Pred &, const T &>>>
+  std::pair<iterator, T> SelectByPrefixSum(Pred pred) {
+    T sum{};
+    auto [idx, n] = Node::SelectByPrefixSum(this->root_, pred, &sum);
+    if (n == nullptr) return {this->end(), std::move(sum)};
+    return {iterator(this, idx, n), std::move(sum)};
+  }
+  template <class Pred, class = std::enable_if_t<
+                            std::is_invocable_r_v<bool, Pred &, const T &>>>
+  std::pair<const_iterator, T> SelectByPrefixSum(Pred pred) const {
+    T sum{};
+    auto [idx, n] = Node::SelectByPrefixSum(this->root_, pred, &sum);
+    if (n == nullptr) return {this->end(), std::move(sum)};
+    return {const_iterator(this, idx, n), std::move(sum)};
+  }
 
   // See OrderStatisticSet's documentation for the specification of these
   // functions.
@@ -147,12 +717,20 @@ class PrefixSumMap
 
   using Base::select;
 
+  using Base::sample;
+
+  using Base::sample_n;
+
   using Base::clear;
 
   using Base::insert;
 
+  using Base::insert_sorted;
+
   using Base::erase;
 
+  using Base::pop_front;
+
   using Base::key_comp;
 
   using Base::value_comp;
@@ -160,6 +738,77 @@ class PrefixSumMap
   // See OrderStatisticMap's documentation for the specification of this
   // function.
   using Base::insert_or_assign;
+
+  using Base::insert_or_assign_sorted;
+
+  using Base::push_back;
+
+  using Base::update;
+
+ private:
+  // Returns a value drawn uniformly from `[0, total)`.
+  template <class URBG>
+  static T UniformBelow(URBG &g, const T &total) {
+    static_assert(std::is_arithmetic_v<T>,
+                  "Weighted sampling needs an arithmetic mapped type");
+    if constexpr (std::is_integral_v<T>) {
+      return std::uniform_int_distribution<T>(0, total - 1)(g);
+    } else {
+      // Rounding can make the distribution return `total` itself.
+      T x;
+      do {
+        x = std::uniform_real_distribution<T>(0, total)(g);
+      } while (!(x < total));
+      return x;
+    }
+  }
+
+  // Helper function for `FindWithPrefixSum()`.
+  template <class It, class K>
+  std::pair<It, T> FindWithPrefixSumInternal(const K &k) const {
+    T sum{};
+    auto [idx, n] =
+        Node::FindAddLess(this->root_.get(), k, this->lessthan_, &sum);
+    if (n == nullptr) return {It(this, size(), nullptr), std::move(sum)};
+    return {It(this, idx, n), std::move(sum)};
+  }
+
+  // Helper function for `sample_weighted()`.
+  template <class It, class URBG>
+  It SampleWeightedInternal(URBG &g) const {
+    T total = Node::Sum(this->root_);
+    if (!(T{} < total)) return It(this, size(), nullptr);
+    T x = UniformBelow(g, total);
+    auto pred = [&x](const T &sum) { return x < sum; };
+    T sum{};
+    auto [idx, n] = Node::SelectByPrefixSum(this->root_, pred, &sum);
+    return It(this, idx, n);
+  }
+
+  // Helper function for `sample_weighted_n()`.
+  template <class It, class URBG>
+  std::vector<It> SampleWeightedNInternal(URBG &g, size_t k) const {
+    std::vector<It> result;
+    T total = Node::Sum(this->root_);
+    if (!(T{} < total)) return result;
+    std::vector<T> targets;
+    targets.reserve(k);
+    for (size_t i = 0; i < k; ++i) targets.push_back(UniformBelow(g, total));
+    std::sort(targets.begin(), targets.end());
+    result.reserve(k);
+    auto emit = [this, &result](size_t rank, Node *n) {
+      result.push_back(It(this, rank, n));
+    };
+    Node::SelectByPrefixSums(this->root_.get(), targets.begin(), targets.end(),
+                             0, T{}, emit);
+    return result;
+  }
+
+  // The predicate for `SelectByPrefixSum(x)`.
+  struct ReachesAtLeast {
+    const T &x;
+    bool operator()(const T &sum) const { return !(sum < x); }
+  };
 };
 
 }  // namespace cachelib
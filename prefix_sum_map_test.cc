@@ -0,0 +1,491 @@
+#include "prefix_sum_map.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class PrefixSumMap<size_t, size_t>;
+template class PrefixSumMap<std::string, int64_t>;
+template class PrefixSumMap<size_t, std::array<uint64_t, 8>>;
+
+// Changing a value through an iterator would corrupt the sums.
+static_assert(std::is_const_v<std::remove_reference_t<
+                  decltype(*PrefixSumMap<int, int>().begin())>>);
+
+TEST(PrefixSumMapTest, UpdateAndAdd) {
+  PrefixSumMap<int, int64_t> map;
+  for (int k = 0; k < 10; ++k) map.insert_or_assign(k, 1);
+  map.add(map.find(3), 5);
+  EXPECT_EQ(map.find(3)->second, 6);
+  EXPECT_EQ(map.SumFirstN(4), 9);
+  auto it = map.find(7);
+  map.update(it, 20);
+  EXPECT_EQ(it->second, 20);
+  EXPECT_EQ(map.SumFirstN(10), 34);
+  map.update_batch({{9, 2}, {0, -1}, {9, 3}});
+  EXPECT_EQ(map.find(9)->second, 6);
+  EXPECT_EQ(map.find(0)->second, 0);
+  EXPECT_EQ(map.SumFirstN(10), 38);
+  map.update_batch({});
+  map.Check();
+}
+
+TEST(PrefixSumMapTest, RandomizedUpdates) {
+  absl::BitGen bitgen;
+  PrefixSumMap<size_t, int64_t> map;
+  std::map<size_t, int64_t> expected;
+  for (size_t k = 0; k < 1000; ++k) {
+    int64_t v = absl::Uniform<int64_t>(bitgen, 0, 100);
+    map.insert_or_assign(k * 3, v);
+    expected.insert_or_assign(k * 3, v);
+  }
+  for (size_t i = 0; i < 300; ++i) {
+    switch (absl::Uniform<int>(bitgen, 0, 3)) {
+      case 0: {
+        size_t rank = absl::Uniform<size_t>(bitgen, 0, expected.size());
+        int64_t delta = absl::Uniform<int64_t>(bitgen, -50, 50);
+        map.add(map.select(rank), delta);
+        std::next(expected.begin(), rank)->second += delta;
+        break;
+      }
+      case 1: {
+        size_t rank = absl::Uniform<size_t>(bitgen, 0, expected.size());
+        int64_t v = absl::Uniform<int64_t>(bitgen, -50, 50);
+        map.update(map.select(rank), v);
+        std::next(expected.begin(), rank)->second = v;
+        break;
+      }
+      case 2: {
+        std::vector<std::pair<size_t, int64_t>> deltas;
+        for (size_t j = absl::Uniform<size_t>(bitgen, 0, 50); j > 0; --j) {
+          deltas.emplace_back(absl::Uniform<size_t>(bitgen, 0, expected.size()),
+                              absl::Uniform<int64_t>(bitgen, -50, 50));
+          std::next(expected.begin(), deltas.back().first)->second +=
+              deltas.back().second;
+        }
+        if (absl::Bernoulli(bitgen, 0.5)) {
+          std::sort(deltas.begin(), deltas.end());
+        }
+        map.update_batch(deltas);
+        break;
+      }
+    }
+    if (i % 50 == 0) map.Check();
+    size_t n = absl::Uniform<size_t>(bitgen, 0, expected.size() + 1);
+    int64_t sum = 0;
+    for (auto it = expected.begin(), end = std::next(expected.begin(), n);
+         it != end; ++it) {
+      sum += it->second;
+    }
+    EXPECT_EQ(map.SumFirstN(n), sum);
+    size_t lo = absl::Uniform<size_t>(bitgen, 0, expected.size() + 1);
+    size_t hi = absl::Uniform<size_t>(bitgen, lo, expected.size() + 1);
+    int64_t range_sum = 0;
+    for (auto it = std::next(expected.begin(), lo),
+              end = std::next(expected.begin(), hi);
+         it != end; ++it) {
+      range_sum += it->second;
+    }
+    EXPECT_EQ(map.SumRange(lo, hi), range_sum) << lo << " " << hi;
+  }
+  map.Check();
+  EXPECT_TRUE(std::equal(map.begin(), map.end(), expected.begin(),
+                         expected.end()));
+}
+
+TEST(PrefixSumMapTest, RangeSums) {
+  PrefixSumMap<int, int64_t> map;
+  EXPECT_EQ(map.SumRange(0, 10), 0);
+  EXPECT_EQ(map.SumKeys(0, 10), 0);
+  for (int k = 1; k <= 10; ++k) map.insert_or_assign(k * 2, k);
+  // Keys 2 4 ... 20 with values 1 2 ... 10.
+  EXPECT_EQ(map.SumFirstN(3), 6);
+  EXPECT_EQ(map.SumRange(0, 10), 55);
+  EXPECT_EQ(map.SumRange(2, 5), 3 + 4 + 5);
+  EXPECT_EQ(map.SumRange(8, 100), 19);
+  EXPECT_EQ(map.SumRange(5, 5), 0);
+  EXPECT_EQ(map.SumRange(6, 2), 0);
+  EXPECT_EQ(map.SumKeys(4, 8), 2 + 3);
+  EXPECT_EQ(map.SumKeys(3, 9), 2 + 3 + 4);
+  EXPECT_EQ(map.SumKeys(-5, 100), 55);
+  EXPECT_EQ(map.SumKeys(8, 4), 0);
+  EXPECT_EQ(map.SumLess(2), 0);
+  EXPECT_EQ(map.SumLess(7), 6);
+  EXPECT_EQ(map.SumLess(21), 55);
+}
+
+TEST(PrefixSumMapTest, RandomizedRangeSums) {
+  absl::BitGen bitgen;
+  PrefixSumMap<int, int64_t> map;
+  std::map<int, int64_t> expected;
+  for (size_t i = 0; i < 2000; ++i) {
+    int k = absl::Uniform<int>(bitgen, 0, 500);
+    if (absl::Bernoulli(bitgen, 0.7)) {
+      int64_t v = absl::Uniform<int64_t>(bitgen, -100, 100);
+      map.insert_or_assign(k, v);
+      expected.insert_or_assign(k, v);
+    } else {
+      EXPECT_EQ(map.erase(k), expected.erase(k));
+    }
+    size_t lo = absl::Uniform<size_t>(bitgen, 0, expected.size() + 1);
+    size_t hi = absl::Uniform<size_t>(bitgen, lo, expected.size() + 2);
+    int klo = absl::Uniform<int>(bitgen, -1, 501);
+    int khi = absl::Uniform<int>(bitgen, -1, 501);
+    int64_t by_rank = 0, by_key = 0, less = 0;
+    size_t rank = 0;
+    for (const auto &[key, v] : expected) {
+      if (lo <= rank && rank < hi) by_rank += v;
+      if (klo <= key && key < khi) by_key += v;
+      if (key < khi) less += v;
+      ++rank;
+    }
+    EXPECT_EQ(map.SumRange(lo, hi), by_rank);
+    EXPECT_EQ(map.SumKeys(klo, khi), by_key);
+    EXPECT_EQ(map.SumLess(khi), less);
+    auto [it, sum] = map.FindWithPrefixSum(khi);
+    EXPECT_EQ(it, map.find(khi));
+    EXPECT_EQ(sum, less);
+  }
+}
+
+TEST(PrefixSumMapTest, SelectByPrefixSum) {
+  PrefixSumMap<int, size_t> map;
+  EXPECT_EQ(map.SelectByPrefixSum(0).first, map.end());
+  // Values by rank: 10 0 20 5
+  for (auto [k, v] : std::vector<std::pair<int, size_t>>{
+           {1, 10}, {2, 0}, {3, 20}, {4, 5}}) {
+    map.insert_or_assign(k, v);
+  }
+  const auto &cmap = map;
+  EXPECT_EQ(map.SelectByPrefixSum(0).first, map.begin());
+  EXPECT_EQ(map.SelectByPrefixSum(0).second, 10);
+  EXPECT_THAT(*map.SelectByPrefixSum(10).first, Pair(1, 10));
+  EXPECT_THAT(*map.SelectByPrefixSum(11).first, Pair(3, 20));
+  EXPECT_EQ(cmap.SelectByPrefixSum(11).second, 30);
+  EXPECT_EQ(cmap.SelectByPrefixSum(35).first.rank(), 3);
+  auto [it, sum] = map.SelectByPrefixSum(36);
+  EXPECT_EQ(it, map.end());
+  EXPECT_EQ(sum, 35);
+  // A general monotone predicate.
+  EXPECT_THAT(*map.SelectByPrefixSum([](size_t s) { return s > 30; }).first,
+              Pair(4, 5));
+}
+
+TEST(PrefixSumMapTest, RandomizedSelectByPrefixSum) {
+  absl::BitGen bitgen;
+  PrefixSumMap<size_t, size_t> map;
+  std::map<size_t, size_t> expected;
+  for (size_t i = 0; i < 2000; ++i) {
+    size_t k = absl::Uniform<size_t>(bitgen, 0, 500);
+    if (absl::Bernoulli(bitgen, 0.7)) {
+      size_t v = absl::Uniform<size_t>(bitgen, 0, 100);
+      map.insert_or_assign(k, v);
+      expected.insert_or_assign(k, v);
+    } else {
+      EXPECT_EQ(map.erase(k), expected.erase(k));
+    }
+    if (i % 100 == 0) map.Check();
+    size_t total = 0;
+    for (const auto &[key, v] : expected) total += v;
+    size_t x = absl::Uniform<size_t>(bitgen, 0, total + 10);
+    // Find the answer by a linear scan.
+    size_t sum = 0;
+    auto want = expected.begin();
+    while (want != expected.end() && (sum += want->second) < x) ++want;
+    auto [it, got_sum] = map.SelectByPrefixSum(x);
+    EXPECT_EQ(got_sum, sum);
+    if (want == expected.end()) {
+      EXPECT_EQ(it, map.end());
+    } else {
+      ASSERT_NE(it, map.end());
+      EXPECT_EQ(it->first, want->first);
+      EXPECT_EQ(it.rank(), std::distance(expected.begin(), want));
+      EXPECT_EQ(map.SumFirstN(it.rank() + 1), sum);
+    }
+  }
+}
+
+TEST(PrefixSumMapTest, AddToRange) {
+  PrefixSumMap<int, int64_t> map;
+  map.AddToRange(0, 10, 5);
+  for (int k = 0; k < 10; ++k) map.insert_or_assign(k, k);
+  map.AddToRange(3, 7, 100);
+  EXPECT_EQ(map.find(2)->second, 2);
+  EXPECT_EQ(map.find(3)->second, 103);
+  EXPECT_EQ(map.find(6)->second, 106);
+  EXPECT_EQ(map.find(7)->second, 7);
+  EXPECT_EQ(map.SumFirstN(10), 445);
+  EXPECT_EQ(map.SumRange(2, 8), 427);
+  map.AddToRange(-100, 100, -1);
+  EXPECT_EQ(map.SumKeys(0, 3), 0);
+  map.AddToRange(5, 5, 1000);
+  EXPECT_EQ(map.SumFirstN(10), 435);
+  map.Check();
+}
+
+// Iterators obtained after a range add see the new values, however deep their
+// nodes are below the pending adds.
+TEST(PrefixSumMapTest, AddToRangeAndIterators) {
+  PrefixSumMap<int, int64_t> map;
+  for (int k = 0; k < 64; ++k) map.insert_or_assign(k, 1);
+  auto before = map.find(20);
+  map.AddToRange(0, 64, 100);
+  // `before` still refers to key 20, but its value may be stale.
+  EXPECT_EQ(before->first, 20);
+  EXPECT_EQ(map.find(20)->second, 101);
+  EXPECT_EQ(map.select(33)->second, 101);
+  EXPECT_EQ(map.lower_bound(40)->second, 101);
+  for (const auto &[k, v] : map) EXPECT_EQ(v, 101) << k;
+  for (auto it = map.rbegin(); it != map.rend(); ++it) {
+    EXPECT_EQ(it->second, 101) << it->first;
+  }
+  map.Check();
+}
+
+// Interleaves range adds with everything that restructures the tree or reads
+// values, and compares with a std::map.
+TEST(PrefixSumMapTest, RandomizedAddToRange) {
+  absl::BitGen bitgen;
+  PrefixSumMap<int, int64_t> map;
+  std::map<int, int64_t> expected;
+  for (size_t i = 0; i < 5000; ++i) {
+    int k = absl::Uniform<int>(bitgen, 0, 1000);
+    switch (absl::Uniform<int>(bitgen, 0, 5)) {
+      case 0:
+      case 1: {
+        int64_t v = absl::Uniform<int64_t>(bitgen, -100, 100);
+        map.insert_or_assign(k, v);
+        expected.insert_or_assign(k, v);
+        break;
+      }
+      case 2:
+        EXPECT_EQ(map.erase(k), expected.erase(k));
+        break;
+      case 3: {
+        int hi = absl::Uniform<int>(bitgen, k, 1001);
+        int64_t delta = absl::Uniform<int64_t>(bitgen, -10, 10);
+        map.AddToRange(k, hi, delta);
+        for (auto it = expected.lower_bound(k);
+             it != expected.end() && it->first < hi; ++it) {
+          it->second += delta;
+        }
+        break;
+      }
+      case 4: {
+        std::vector<std::pair<const int, int64_t>> batch;
+        for (int j = k; j < k + 20; j += 3) {
+          batch.emplace_back(j, j);
+          expected.insert_or_assign(j, j);
+        }
+        map.insert_or_assign_sorted(batch.begin(), batch.end());
+        break;
+      }
+    }
+    if (i % 250 == 0) map.Check();
+    ASSERT_EQ(map.size(), expected.size());
+    if (auto it = expected.find(k); it != expected.end()) {
+      EXPECT_EQ(map.find(k)->second, it->second);
+    }
+    size_t n = absl::Uniform<size_t>(bitgen, 0, expected.size() + 1);
+    int64_t sum = 0;
+    for (auto it = expected.begin(), end = std::next(expected.begin(), n);
+         it != end; ++it) {
+      sum += it->second;
+    }
+    EXPECT_EQ(map.SumFirstN(n), sum);
+    size_t lo = absl::Uniform<size_t>(bitgen, 0, expected.size() + 1);
+    size_t hi = absl::Uniform<size_t>(bitgen, lo, expected.size() + 1);
+    int64_t range_sum = 0;
+    for (auto it = std::next(expected.begin(), lo),
+              end = std::next(expected.begin(), hi);
+         it != end; ++it) {
+      range_sum += it->second;
+    }
+    EXPECT_EQ(map.SumRange(lo, hi), range_sum) << lo << " " << hi;
+  }
+  map.Check();
+  EXPECT_TRUE(std::equal(map.begin(), map.end(), expected.begin(),
+                         expected.end()));
+}
+
+// One tree with four metrics per key, compared with four separate trees.
+TEST(PrefixSumMapTest, VectorValued) {
+  using Metrics = std::array<int64_t, 4>;
+  absl::BitGen bitgen;
+  PrefixSumMap<int, Metrics> map;
+  std::array<PrefixSumMap<int, int64_t>, 4> separate;
+  for (size_t i = 0; i < 3000; ++i) {
+    int k = absl::Uniform<int>(bitgen, 0, 500);
+    switch (absl::Uniform<int>(bitgen, 0, 4)) {
+      case 0:
+      case 1: {
+        Metrics v;
+        for (size_t j = 0; j < 4; ++j) {
+          v[j] = absl::Uniform<int64_t>(bitgen, -100, 100);
+          separate[j].insert_or_assign(k, v[j]);
+        }
+        map.insert_or_assign(k, v);
+        break;
+      }
+      case 2:
+        map.erase(k);
+        for (auto &tree : separate) tree.erase(k);
+        break;
+      case 3: {
+        int hi = absl::Uniform<int>(bitgen, k, 501);
+        Metrics delta = {1, -2, 3, 0};
+        map.AddToRange(k, hi, delta);
+        for (size_t j = 0; j < 4; ++j) {
+          separate[j].AddToRange(k, hi, delta[j]);
+        }
+        break;
+      }
+    }
+    if (i % 300 == 0) map.Check();
+    size_t n = absl::Uniform<size_t>(bitgen, 0, map.size() + 1);
+    Metrics sums = map.SumFirstN(n);
+    Metrics key_sums = map.SumKeys(k, k + 100);
+    for (size_t j = 0; j < 4; ++j) {
+      EXPECT_EQ(sums[j], separate[j].SumFirstN(n));
+      EXPECT_EQ(key_sums[j], separate[j].SumKeys(k, k + 100));
+    }
+  }
+  map.Check();
+}
+
+// A mapped type with `+` but no `+=`, which the default PrefixSumTraits add
+// with `+`.
+struct Money {
+  int64_t cents;
+  friend Money operator+(Money a, Money b) { return {a.cents + b.cents}; }
+  friend bool operator==(Money a, Money b) { return a.cents == b.cents; }
+};
+
+TEST(PrefixSumMapTest, PlusOnly) {
+  PrefixSumMap<int, Money> map;
+  for (int k = 0; k < 100; ++k) map.insert_or_assign(k, Money{k});
+  EXPECT_EQ(map.SumFirstN(10).cents, 45);
+  EXPECT_EQ(map.SumKeys(90, 100).cents, 945);
+  EXPECT_EQ(map.erase(5), 1);
+  EXPECT_EQ(map.SumFirstN(10).cents, 45 - 5 + 10);
+  map.Check();
+}
+
+TEST(PrefixSumMapTest, PushBackPopFront) {
+  absl::BitGen bitgen;
+  PrefixSumMap<int64_t, int64_t> map;
+  std::map<int64_t, int64_t> reference;
+  int64_t next_key = 0;
+  for (size_t i = 0; i < 20000; ++i) {
+    // Drift the window size up and down so that both spines get rebalanced.
+    bool grow = (i / 2000) % 2 == 0;
+    if (reference.empty() || absl::Bernoulli(bitgen, grow ? 0.7 : 0.3)) {
+      next_key += absl::Uniform<int64_t>(bitgen, 1, 5);
+      int64_t v = absl::Uniform<int64_t>(bitgen, 0, 100);
+      auto it = map.push_back(next_key, v);
+      EXPECT_THAT(*it, Pair(next_key, v));
+      EXPECT_EQ(it.rank(), reference.size());
+      reference.emplace(next_key, v);
+    } else {
+      map.pop_front();
+      reference.erase(reference.begin());
+    }
+    ASSERT_EQ(map.size(), reference.size());
+    if (!reference.empty()) {
+      EXPECT_THAT(*map.begin(), Pair(reference.begin()->first,
+                                     reference.begin()->second));
+      EXPECT_THAT(*map.rbegin(), Pair(reference.rbegin()->first,
+                                      reference.rbegin()->second));
+    }
+    if (i % 1000 == 0) {
+      map.Check();
+      int64_t sum = 0;
+      size_t n = 0;
+      for (const auto &[k, v] : reference) {
+        if (n % 97 == 0) {
+          EXPECT_EQ(map.SumFirstN(n), sum);
+        }
+        sum += v;
+        ++n;
+      }
+      EXPECT_EQ(map.SumFirstN(n), sum);
+    }
+  }
+  map.Check();
+  // The cached ends follow the generic operations too.
+  next_key += 1;
+  map.push_back(next_key, 1);
+  reference.emplace(next_key, 1);
+  map.insert_or_assign(-1, 1);
+  EXPECT_EQ(map.begin()->first, -1);
+  map.insert_or_assign(next_key + 1, 1);
+  EXPECT_EQ(map.rbegin()->first, next_key + 1);
+  EXPECT_EQ(map.select(map.size() - 1)->first, next_key + 1);
+  map.erase(next_key + 1);
+  EXPECT_EQ(map.rbegin()->first, next_key);
+  map.erase(map.begin());
+  EXPECT_EQ(map.begin()->first, reference.begin()->first);
+  map.clear();
+  map.push_back(3, 3);
+  EXPECT_EQ(map.begin()->first, 3);
+  EXPECT_EQ(map.rbegin()->first, 3);
+  map.pop_front();
+  EXPECT_TRUE(map.empty());
+  map.Check();
+}
+
+TEST(PrefixSumMapTest, SampleWeighted) {
+  std::mt19937_64 rng(7);
+  PrefixSumMap<int, size_t> map;
+  EXPECT_EQ(map.sample_weighted(rng), map.end());
+  // Weights 0, 1, 2, 3, 4, 0, so probabilities of 0, 0.1, ... 0.4, 0.
+  for (int k = 0; k < 6; ++k) map.insert_or_assign(k, k == 5 ? 0 : k);
+  std::vector<size_t> counts(6);
+  for (size_t i = 0; i < 10000; ++i) ++counts[map.sample_weighted(rng)->first];
+  auto batch = map.sample_weighted_n(rng, 10000);
+  ASSERT_EQ(batch.size(), 10000);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    EXPECT_EQ(batch[i]->first, batch[i].rank());
+    if (i > 0) {
+      EXPECT_LE(batch[i - 1].rank(), batch[i].rank());
+    }
+    ++counts[batch[i]->first];
+  }
+  EXPECT_EQ(counts[0], 0);
+  EXPECT_EQ(counts[5], 0);
+  for (int k = 1; k < 5; ++k) {
+    EXPECT_GT(counts[k], k * 1800) << k;
+    EXPECT_LT(counts[k], k * 2200) << k;
+  }
+}
+
+TEST(PrefixSumMapTest, SampleWeightedFloatingPoint) {
+  std::mt19937_64 rng(7);
+  PrefixSumMap<int, double> map;
+  map.insert_or_assign(1, 0.25);
+  map.insert_or_assign(2, 0.75);
+  const auto &cmap = map;
+  size_t twos = 0;
+  for (auto it : cmap.sample_weighted_n(rng, 10000)) twos += it->first == 2;
+  EXPECT_GT(twos, 7200);
+  EXPECT_LT(twos, 7800);
+}
+
+}  // namespace cachelib
@@ -0,0 +1,135 @@
+// A benchmark comparing one PrefixSumMap with N metrics per key (a
+// `std::array<uint64_t, N>` mapped type) against N separate PrefixSumMaps
+// with the same keys, for N = 2, 4, and 8.
+//
+// For each it inserts `elements` random keys, then asks `queries` random
+// SumFirstN()s (getting all N sums each time), and reports the time per insert
+// and per query and the memory per key.  The memory is the number of bytes
+// the trees allocated, counted by this file's `operator new` (not counting the
+// allocator's own overhead, which only makes N separate trees look better).
+//
+// Example:
+//
+//   prefix_sum_vector_benchmark --elements=1000000 --queries=1000000
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/random/random.h"
+#include "prefix_sum_map.h"
+
+ABSL_FLAG(uint64_t, elements, 1'000'000, "The number of keys.");
+ABSL_FLAG(uint64_t, queries, 1'000'000, "The number of SumFirstN queries.");
+
+namespace {
+
+std::atomic<size_t> bytes_allocated{0};
+
+}  // namespace
+
+void *operator new(size_t size) {
+  bytes_allocated.fetch_add(size, std::memory_order_relaxed);
+  if (void *p = std::malloc(size)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace cachelib {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double NanosPer(Clock::duration d, uint64_t n) {
+  return std::chrono::duration<double, std::nano>(d).count() / n;
+}
+
+// One tree whose mapped values hold all N metrics.
+template <size_t N>
+class OneTree {
+ public:
+  void Insert(uint64_t k, const std::array<uint64_t, N> &v) {
+    map_.insert_or_assign(k, v);
+  }
+  std::array<uint64_t, N> SumFirstN(size_t n) const {
+    return map_.SumFirstN(n);
+  }
+
+ private:
+  PrefixSumMap<uint64_t, std::array<uint64_t, N>> map_;
+};
+
+// N trees with the same keys, one per metric.
+template <size_t N>
+class SeparateTrees {
+ public:
+  void Insert(uint64_t k, const std::array<uint64_t, N> &v) {
+    for (size_t i = 0; i < N; ++i) maps_[i].insert_or_assign(k, v[i]);
+  }
+  std::array<uint64_t, N> SumFirstN(size_t n) const {
+    std::array<uint64_t, N> sums;
+    for (size_t i = 0; i < N; ++i) sums[i] = maps_[i].SumFirstN(n);
+    return sums;
+  }
+
+ private:
+  std::array<PrefixSumMap<uint64_t, uint64_t>, N> maps_;
+};
+
+template <class Trees, size_t N>
+void Run(const char *name, const std::vector<uint64_t> &keys,
+         const std::vector<size_t> &queries) {
+  size_t bytes_before = bytes_allocated.load();
+  Clock::time_point start = Clock::now();
+  auto trees = std::make_unique<Trees>();
+  for (uint64_t k : keys) {
+    std::array<uint64_t, N> v;
+    for (size_t i = 0; i < N; ++i) v[i] = k + i;
+    trees->Insert(k, v);
+  }
+  Clock::time_point inserted = Clock::now();
+  size_t bytes = bytes_allocated.load() - bytes_before;
+  uint64_t checksum = 0;
+  for (size_t n : queries) checksum += trees->SumFirstN(n)[N - 1];
+  Clock::time_point queried = Clock::now();
+  printf("N=%zu %-9s insert %7.1f ns  SumFirstN %7.1f ns  %6.1f bytes/key"
+         "  (checksum %llu)\n",
+         N, name, NanosPer(inserted - start, keys.size()),
+         NanosPer(queried - inserted, queries.size()),
+         static_cast<double>(bytes) / keys.size(),
+         static_cast<unsigned long long>(checksum));
+}
+
+template <size_t N>
+void Compare(const std::vector<uint64_t> &keys,
+             const std::vector<size_t> &queries) {
+  Run<OneTree<N>, N>("one", keys, queries);
+  Run<SeparateTrees<N>, N>("separate", keys, queries);
+}
+
+}  // namespace
+}  // namespace cachelib
+
+int main(int argc, char **argv) {
+  absl::ParseCommandLine(argc, argv);
+  absl::BitGen bitgen;
+  std::vector<uint64_t> keys(absl::GetFlag(FLAGS_elements));
+  for (uint64_t &k : keys) k = absl::Uniform<uint64_t>(bitgen);
+  std::vector<size_t> queries(absl::GetFlag(FLAGS_queries));
+  for (size_t &n : queries) n = absl::Uniform<size_t>(bitgen, 0, keys.size());
+  cachelib::Compare<2>(keys, queries);
+  cachelib::Compare<4>(keys, queries);
+  cachelib::Compare<8>(keys, queries);
+  return 0;
+}
@@ -60,8 +60,34 @@ class RawOrderStatisticMap : public cachelib_internal::RawOrderStatisticSet<
         Node::Insert(std::move(this->root_), {std::move(k), std::move(v)}, 0,
                      true, this->lessthan_);
     this->root_ = std::move(new_root);
+    if (did_insert) this->NoteInserted(inserted_at_idx, inserted_at_node);
     return {iterator(this, inserted_at_idx, inserted_at_node), did_insert};
   }
+
+  // Inserts or assigns each of the values in `[first, last)`, which must be
+  // sorted by strictly increasing key, as though by calling
+  // `insert_or_assign()` on each one.  See `insert_sorted()` for the meaning
+  // of `did_insert` and the return value.
+  template <class RandomIt>
+  size_t insert_or_assign_sorted(RandomIt first, RandomIt last,
+                                 bool *did_insert = nullptr) {
+    return this->InsertSortedInternal(first, last, /*assign=*/true,
+                                      did_insert);
+  }
+
+  // Appends `{k, v}`, where `k` must be greater than every key in the map (see
+  // `RawOrderStatisticSet::push_back()`).
+  iterator push_back(Key k, T v) {
+    return Base::push_back({std::move(k), std::move(v)});
+  }
+
+  // Replaces the mapped value at `pos` with `v`, keeping any summaries of the
+  // mapped values correct.  This finds the node by rank, so it makes no key
+  // comparisons.  `pos` stays valid.
+  void update(const_iterator pos, T v) {
+    auto assign = [&v](value_type &value) { value.second = std::move(v); };
+    Node::ModifyAtRank(this->root_, pos.rank(), assign);
+  }
 };
 
 }  // namespace cachelib_internal
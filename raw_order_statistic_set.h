@@ -14,14 +14,18 @@
 #ifndef NET_BANDAID_BDN_CACHELIB_RAW_ORDER_STATISTIC_SET_H_
 #define NET_BANDAID_BDN_CACHELIB_RAW_ORDER_STATISTIC_SET_H_
 
+#include <algorithm>
 #include <cstddef>
 #include <functional>
 #include <iterator>
 #include <memory>
+#include <random>
 #include <string>
 #include <tuple>
 #include <type_traits>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "glog/logging.h"
 #include "absl/memory/memory.h"
@@ -217,7 +221,7 @@ class RawOrderStatisticSet {
   // Helper function for `Select()`.
   template <bool is_const_iterator>
   Iterator<is_const_iterator> SelectInternal(size_t idx) const {
-    Node *n = Node::Select(root_, idx);
+    Node *n = SelectNode(idx);
     if (n)
       return Iterator<is_const_iterator>(this, idx, n);
     else
@@ -235,6 +239,86 @@ class RawOrderStatisticSet {
   // iterator, except that most operations take log time instead of constant
   // time.
 
+ private:
+  // Helper function for `sample()`.
+  template <bool is_const_iterator, class URBG>
+  Iterator<is_const_iterator> SampleInternal(URBG &g) const {
+    if (empty()) return End<is_const_iterator>();
+    return SelectInternal<is_const_iterator>(
+        std::uniform_int_distribution<size_t>(0, size() - 1)(g));
+  }
+
+  // Helper function for `sample_n()`.
+  template <bool is_const_iterator, class URBG>
+  std::vector<Iterator<is_const_iterator>> SampleNInternal(
+      URBG &g, size_t k, bool with_replacement) const {
+    std::vector<size_t> ranks = SampleRanks(g, size(), k, with_replacement);
+    std::vector<Iterator<is_const_iterator>> result;
+    result.reserve(ranks.size());
+    auto emit = [this, &result](size_t rank, Node *n) {
+      result.push_back(Iterator<is_const_iterator>(this, rank, n));
+    };
+    Node::SelectSorted(root_, ranks.begin(), ranks.end(), 0, emit);
+    return result;
+  }
+
+ protected:
+  // Returns an iterator to an element chosen uniformly at random, using the
+  // uniform random bit generator `g`, or `end()` if the tree is empty.
+  template <class URBG>
+  const_iterator sample(URBG &&g) const {
+    return SampleInternal<true>(g);
+  }
+  template <class URBG>
+  iterator sample(URBG &&g) {
+    return SampleInternal<false>(g);
+  }
+
+  // Returns iterators to `k` elements chosen uniformly at random, in rank
+  // order.  If `with_replacement` is false, the elements are distinct (and if
+  // `k` is more than `size()`, then all the elements are returned).
+  //
+  // The ranks are drawn first and sorted, and then all the elements are found
+  // in one walk over the tree that shares the descents to nearby ranks.  So
+  // this is cheaper than `k` calls to `sample()`, especially when `k` is
+  // large.
+  template <class URBG>
+  std::vector<const_iterator> sample_n(URBG &&g, size_t k,
+                                       bool with_replacement) const {
+    return SampleNInternal<true>(g, k, with_replacement);
+  }
+  template <class URBG>
+  std::vector<iterator> sample_n(URBG &&g, size_t k, bool with_replacement) {
+    return SampleNInternal<false>(g, k, with_replacement);
+  }
+
+  // Returns `k` ranks drawn uniformly at random from `[0, n)`, sorted.  If
+  // `with_replacement` is false, then the ranks are distinct, and there are
+  // only `min(k, n)` of them.
+  template <class URBG>
+  static std::vector<size_t> SampleRanks(URBG &g, size_t n, size_t k,
+                                         bool with_replacement) {
+    std::vector<size_t> ranks;
+    if (n == 0) return ranks;
+    if (with_replacement) {
+      std::uniform_int_distribution<size_t> dist(0, n - 1);
+      ranks.reserve(k);
+      for (size_t i = 0; i < k; ++i) ranks.push_back(dist(g));
+    } else {
+      // Floyd's algorithm: k draws, each of which adds one new rank.
+      k = std::min(k, n);
+      std::unordered_set<size_t> chosen;
+      chosen.reserve(k);
+      for (size_t j = n - k; j < n; ++j) {
+        size_t t = std::uniform_int_distribution<size_t>(0, j)(g);
+        chosen.insert(chosen.count(t) ? j : t);
+      }
+      ranks.assign(chosen.begin(), chosen.end());
+    }
+    std::sort(ranks.begin(), ranks.end());
+    return ranks;
+  }
+
  private:
   // Helper function for `begin()`.
   template <bool is_const_iterator>
@@ -293,25 +377,74 @@ class RawOrderStatisticSet {
         Node::Insert(std::move(root_), std::move(value), 0, /*assign*/ false,
                      lessthan_);
     root_ = std::move(new_root);
+    if (did_insert) NoteInserted(inserted_at_idx, inserted_at_node);
     return std::pair(iterator(this, inserted_at_idx, inserted_at_node),
                      did_insert);
   }
 
+  // Inserts the values in `[first, last)`, which must be sorted by strictly
+  // increasing key, as though by calling `insert()` on each one.  The values
+  // are moved from.  If `did_insert` is not null, then `did_insert[i]` is set
+  // to whether `first[i]` was inserted.  Returns the number of values
+  // inserted.
+  //
+  // The batch is merged into the tree in a single pass, so that each node of
+  // the tree is visited at most once rather than once per value.
+  template <class RandomIt>
+  size_t insert_sorted(RandomIt first, RandomIt last,
+                       bool *did_insert = nullptr) {
+    return InsertSortedInternal(first, last, /*assign=*/false, did_insert);
+  }
+
   // Erases the value referenced by pos, returning an iterator that points at
   // the successor.
   iterator erase(iterator pos);
 
+  // The append-mode operations, for trees (such as maps keyed by time or by
+  // log offset) into which keys arrive in increasing order and from which the
+  // oldest are removed first.
+  //
+  // `push_back()` appends `value`, whose key must be greater than every key in
+  // the tree, and returns an iterator to it.  It checks the order with one
+  // comparison against the cached last node, and then walks down the right
+  // spine without comparing keys.  `pop_front()` erases the first element
+  // (which must exist) by walking down the left spine.  Both are iterative
+  // and touch only the spine, rotating where it is out of balance.
+  iterator push_back(Value value) {
+    CHECK(empty() || lessthan_(Node::key(rightmost_->value_),  // Crash OK
+                               Node::key(value)))
+        << "push_back requires increasing keys";
+    // Using new to access non-public constructor that make_unique cannot
+    // access.
+    auto x = absl::WrapUnique(new Node(std::move(value)));
+    Node *n = x.get();
+    Node::PushBack(&root_, std::move(x));
+    if (size() == 1) leftmost_ = n;
+    rightmost_ = n;
+    return iterator(this, size() - 1, n);
+  }
+  void pop_front() {
+    CHECK(!empty());  // Crash OK
+    std::unique_ptr<Node> removed;
+    leftmost_ = Node::PopFront(&root_, &removed);
+  }
+
   // Erases k, if it exists, from the tree.
   template <class K = Key>
   size_t erase(const key_arg<K> &k) {
     auto [new_root, rank_of_erased, new_successor, n_erased] =
         Node::Erase(std::move(root_), k, 0, nullptr, lessthan_);
     root_ = std::move(new_root);
+    if (n_erased) NoteErased(rank_of_erased, new_successor);
     return n_erased;
   }
 
   // Implements std::swap(*this, other).
-  void swap(RawOrderStatisticSet &other) { std::swap(root_, other.root_); }
+  void swap(RawOrderStatisticSet &other) {
+    std::swap(root_, other.root_);
+    std::swap(leftmost_, other.leftmost_);
+    std::swap(rightmost_, other.rightmost_);
+  }
 
   key_compare key_comp() const { return key_compare(); }
   value_compare value_comp() const { return value_compare(); }
@@ -330,8 +463,60 @@ class RawOrderStatisticSet {
       std::ostream &out, std::function<std::string(const Value &)> kp) const;
 
  protected:
+  // Helper for `insert_sorted()` and the map's `insert_or_assign_sorted()`.
+  template <class RandomIt>
+  size_t InsertSortedInternal(RandomIt first, RandomIt last, bool assign,
+                              bool *did_insert) {
+    DCHECK(std::adjacent_find(first, last,
+                              [this](const Value &a, const Value &b) {
+                                return !lessthan_(Node::key(a), Node::key(b));
+                              }) == last)
+        << "insert_sorted requires strictly increasing keys";
+    size_t old_size = size();
+    root_ = Node::InsertSorted(std::move(root_), first, last, assign,
+                               lessthan_, did_insert);
+    UpdateEnds();
+    return size() - old_size;
+  }
+
+  // Returns the node of rank `idx`, or nullptr if there is none.  Takes O(1)
+  // time for the first and last nodes.
+  Node *SelectNode(size_t idx) const {
+    size_t n = size();
+    if (idx >= n) return nullptr;
+    if (idx == 0) return leftmost_;
+    if (idx == n - 1) return rightmost_;
+    return Node::Select(root_, idx);
+  }
+
+  // Keep `leftmost_` and `rightmost_` up to date after a change to the tree:
+  // `NoteInserted()` after inserting `n` at rank `idx`, `NoteErased()` after
+  // erasing the element of rank `idx` (whose successor is `successor`), and
+  // `UpdateEnds()` after any other change, which finds both ends again in
+  // O(log n) time.
+  void NoteInserted(size_t idx, Node *n) {
+    if (idx == 0) leftmost_ = n;
+    if (idx + 1 == size()) rightmost_ = n;
+  }
+  void NoteErased(size_t idx, Node *successor) {
+    if (empty()) return;
+    if (idx == 0) leftmost_ = successor;
+    if (idx == size()) rightmost_ = Node::RightMost(root_);
+  }
+  void UpdateEnds() {
+    if (empty()) return;
+    leftmost_ = Node::LeftMost(root_);
+    rightmost_ = Node::RightMost(root_);
+  }
+
   std::unique_ptr<Node> root_;
   key_compare lessthan_;
+  // The first and last nodes.  They are meaningful only if `root_` isn't null
+  // (so a moved-from tree needs no fixing).  Every change to the tree keeps
+  // them up to date, which also pushes down any pending update (see
+  // `RawNode::PushDown()`) on the paths to them, so their values are current.
+  Node *leftmost_ = nullptr;
+  Node *rightmost_ = nullptr;
 };
 
 // The iterator is represented by an index and a pointer to the node.  The nodes
@@ -356,8 +541,11 @@ class RawOrderStatisticSet<Key, Value, Compare, Node>::Iterator {
 
  public:
   using iterator_category = std::random_access_iterator_tag;
+  // The values are also const if the node type keeps a summary of them (see
+  // `RawNode::kMutableValues`).
   using value_type =
-      typename std::conditional_t<is_const_iterator, const Value, Value>;
+      typename std::conditional_t<is_const_iterator || !Node::kMutableValues,
+                                  const Value, Value>;
   using difference_type = ptrdiff_t;
   using pointer = value_type *;
   using reference = value_type &;
@@ -392,11 +580,9 @@ class RawOrderStatisticSet<Key, Value, Compare, Node>::Iterator {
     return tmp;
   }
   // Pointer-like operators
-  const Value *operator->() const { return &node_->value_; }
-  Value *operator->() { return &node_->value_; }
-  const Value &operator*() const { return node_->value_; }
-  Value &operator*() { return node_->value_; }
-  const Value &operator[](std::ptrdiff_t idx) const { return *(*this + idx); }
+  pointer operator->() const { return &node_->value_; }
+  reference operator*() const { return node_->value_; }
+  reference operator[](std::ptrdiff_t idx) const { return *(*this + idx); }
   // Rank
   size_t rank() const { return idx_; }
 
@@ -410,11 +596,7 @@ class RawOrderStatisticSet<Key, Value, Compare, Node>::Iterator {
       CHECK_LE(idx_ + n, tree_->size());  // Crash OK
     }
     idx_ += n;
-    if (idx_ < tree_->size()) {
-      node_ = Node::Select(tree_->root_, idx_);
-    } else {
-      node_ = nullptr;
-    }
+    node_ = tree_->SelectNode(idx_);
     return *this;
   }
   Iterator &operator-=(ptrdiff_t n) {
@@ -476,12 +658,169 @@ RawOrderStatisticSet<Key, Value, Compare, Node>::erase(iterator pos) {
   auto [new_root, new_idx, successor, n_erased] =
       Node::Erase(std::move(root_), Node::key(*pos), 0, nullptr, lessthan_);
   root_ = std::move(new_root);
+  NoteErased(new_idx, successor);
   if (successor == nullptr)
     return end();
   else
     return iterator(this, new_idx, successor);
 }
 
+// The restructuring of a weight-balanced tree: the balance test, the
+// rotations, and unlinking a node.  RawNode uses it, and so do trees whose
+// nodes aren't RawNodes (such as the intrusive trees of
+// multi_index_order_statistic_map.h).  `Links` says how to reach a node's
+// children through a `Ptr` (an owning or a raw pointer to a node):
+//
+//   using Ptr = ...;
+//   static Ptr &Left(const Ptr &n);
+//   static Ptr &Right(const Ptr &n);
+//   static size_t Size(const Ptr &n);    // 0 for null.
+//   static void PushDown(const Ptr &n);  // Before the children are touched.
+//   static void Recompute(const Ptr &n); // After the children changed.
+//
+// Each operation takes the root of a subtree and returns the new root.
+template <class Links>
+class WeightBalancedTree {
+ public:
+  using Ptr = typename Links::Ptr;
+
+  // 4 is a convenient rebalancing factor.  Smaller factors lead to more work to
+  // maintain balance, whereas larger factors lead to deeper trees (and hence
+  // more work during search.).  Traditional weight-balanced trees require that
+  // the rebalance factor be between 3.414 and 5.5 in order to make the
+  // rotations work right.  See, for example,
+  // https://en.wikipedia.org/wiki/Weight-balanced_tree.
+  static constexpr size_t kRebalanceFactor = 4;
+
+  // Returns true if subtrees of sizes `left_size` and `right_size` may be the
+  // children of one node.
+  static bool IsInBalance(size_t left_size, size_t right_size) {
+    size_t left_weight = 1 + left_size;
+    size_t right_weight = 1 + right_size;
+    size_t total_weight = left_weight + right_weight;
+    // Return true if 1/4 <= left_weight/total_weight <= 3/4
+    // where "4" is kRebalanceFactor and "3" is kRebalanceFactor-1.
+    size_t four = kRebalanceFactor;
+    size_t three = four - 1;
+    bool r = (total_weight <= four * left_weight) &&
+             (four * left_weight <= three * total_weight);
+    return r;
+  }
+
+  // Returns true if the tree is balanced at `n`.
+  static bool IsInBalance(const Ptr &n) {
+    return IsInBalance(Links::Size(Links::Left(n)),
+                       Links::Size(Links::Right(n)));
+  }
+
+  // If needed, rebalances the tree at n, returning the new root.  Recomputes
+  // `n`'s summary either way.
+  static Ptr MaybeRebalance(Ptr n) {
+    DCHECK(n);
+    Links::PushDown(n);
+    if (IsInBalance(n)) {
+      Links::Recompute(n);  // even if it's balanced the summary could be
+                            // wrong after a modification.
+      return n;
+    }
+    const Ptr &left = Links::Left(n);
+    const Ptr &right = Links::Right(n);
+    if (Links::Size(left) < Links::Size(right)) {
+      size_t rl_size = 1 + Links::Size(Links::Left(right));
+      size_t rr_size = 1 + Links::Size(Links::Right(right));
+      size_t sum_size = rl_size + rr_size;
+      // Check to see if rl_size/sum_size < 2/3
+      // where 2/3 is really (kRebalanceFactor-2)/(kRebalanceFactor-1).
+      if (rl_size * (kRebalanceFactor - 1) <
+          sum_size * (kRebalanceFactor - 2)) {
+        return RotateLeft(std::move(n));
+      } else {
+        return RotateRightLeft(std::move(n));
+      }
+    } else {
+      size_t ll_size = 1 + Links::Size(Links::Left(left));
+      size_t lr_size = 1 + Links::Size(Links::Right(left));
+      size_t sum_size = ll_size + lr_size;
+      if (lr_size * (kRebalanceFactor - 1) <
+          sum_size * (kRebalanceFactor - 2)) {
+        return RotateRight(std::move(n));
+      } else {
+        return RotateLeftRight(std::move(n));
+      }
+    }
+  }
+
+  // Removes the rightmost node from the subtree, storing it in removed_node.
+  // Returns the root of the revised subtree.
+  static Ptr UnlinkRightMost(Ptr n, Ptr *removed_node) {
+    DCHECK(n);
+    Links::PushDown(n);
+    if (Links::Right(n)) {
+      Ptr right = UnlinkRightMost(std::move(Links::Right(n)), removed_node);
+      Links::Right(n) = std::move(right);
+      return MaybeRebalance(std::move(n));
+    } else {
+      Ptr left = std::move(Links::Left(n));
+      *removed_node = std::move(n);
+      return left;
+    }
+  }
+
+  // Removes the root `n` from the tree, returning the new root.  (If `Ptr`
+  // owns, `n` is freed.)
+  static Ptr DeleteNode(Ptr n) {
+    DCHECK(n);
+    Links::PushDown(n);
+    if (Links::Left(n)) {
+      Ptr new_n{};
+      Ptr new_left = UnlinkRightMost(std::move(Links::Left(n)), &new_n);
+      Links::Left(new_n) = std::move(new_left);
+      Links::Right(new_n) = std::move(Links::Right(n));
+      return MaybeRebalance(std::move(new_n));
+    } else {
+      return std::move(Links::Right(n));
+    }
+  }
+
+ private:
+  // Swaps a := b,  b := c, c := a (where c gets the original a).
+  static void swap3left(Ptr &a, Ptr &b, Ptr &c) {
+    std::swap(a, b);
+    std::swap(b, c);
+  }
+
+  // Rotates the tree left, returning the new root.
+  static Ptr RotateLeft(Ptr n) {
+    Links::PushDown(n);
+    Links::PushDown(Links::Right(n));
+    swap3left(Links::Right(n), Links::Left(Links::Right(n)), n);
+    Links::Recompute(Links::Left(n));
+    Links::Recompute(n);
+    return n;
+  }
+
+  // Rotates the tree right, returning the new root.
+  static Ptr RotateRight(Ptr n) {
+    Links::PushDown(n);
+    Links::PushDown(Links::Left(n));
+    swap3left(Links::Left(n), Links::Right(Links::Left(n)), n);
+    Links::Recompute(Links::Right(n));
+    Links::Recompute(n);
+    return n;
+  }
+
+  // Double rotations
+  static Ptr RotateRightLeft(Ptr n) {
+    Links::Right(n) = RotateRight(std::move(Links::Right(n)));
+    return RotateLeft(std::move(n));
+  }
+
+  static Ptr RotateLeftRight(Ptr n) {
+    Links::Left(n) = RotateLeft(std::move(Links::Left(n)));
+    return RotateRight(std::move(n));
+  }
+};
+
 // When extending RawNode for the actual node type used in a tree, the extended
 // type must define
 //
@@ -505,8 +844,41 @@ class RawNode {
  public:
   explicit RawNode(Value v) : value_(std::move(v)) {}
 
+  // Whether iterators may hand out mutable references to the values.  A node
+  // type that keeps a summary of the values (such as a sum of the mapped
+  // values) sets this to false, so that the only way to change a value is
+  // through a method that also fixes the summaries (see `ModifyAtRank()`).
+  static constexpr bool kMutableValues = true;
+
   void SetMappedValue([[maybe_unused]] const Value &k) {}
 
+  // A hook for node types that apply updates to whole subtrees lazily (see
+  // `PrefixMapNode::AddToKeys()`): Applies any update that is pending for the
+  // node's children to them.  Every operation calls this on a node before it
+  // looks at or changes the node's children, so a node that an operation
+  // reaches (or returns) is always up to date.
+  void PushDown() {}
+
+  // Calls `fn(value)` on the value of rank `idx` (which must exist) in the
+  // subtree rooted at `n`, and then recomputes the summaries of that node and
+  // its ancestors.  `fn` must not change the key.  Takes O(log n) time and
+  // makes no key comparisons.
+  template <class Fn>
+  static void ModifyAtRank(const std::unique_ptr<Node> &n, size_t idx,
+                           Fn &fn) {
+    DCHECK(n != nullptr);
+    n->PushDown();
+    size_t left_size = Size(n->left_);
+    if (idx < left_size) {
+      ModifyAtRank(n->left_, idx, fn);
+    } else if (idx > left_size) {
+      ModifyAtRank(n->right_, idx - left_size - 1, fn);
+    } else {
+      fn(n->value_);
+    }
+    n->RecomputeSummary();
+  }
+
   // Returns the number of nodes in the subtree.
   static size_t Size(const std::unique_ptr<Node> &n) {
     return n ? n->subtree_size_ : 0;
@@ -547,11 +919,12 @@ class RawNode {
       new_node = n.get();
       new_rank = rank_so_far;
     } else {
+      n->PushDown();
       if (lessthan(Node::key(n->value_), Node::key(k))) {
         size_t left_size = Size(n->left_);
         auto [new_root, inserted_idx, inserted_node, sub_did_insert] =
-            Insert(std::move(n->right_), std::move(k), rank_so_far + left_size,
-                   assign, lessthan);
+            Insert(std::move(n->right_), std::move(k),
+                   rank_so_far + left_size + 1, assign, lessthan);
         n->UpdateRight(std::move(new_root));
         new_rank = inserted_idx;
         did_insert = sub_did_insert;
@@ -565,7 +938,7 @@ class RawNode {
         new_node = inserted_node;
       } else {
         // Equal
-        new_rank = rank_so_far;
+        new_rank = rank_so_far + Size(n->left_);
         new_node = n.get();
         if (assign) {
           n->SetMappedValue(k);
@@ -578,6 +951,48 @@ class RawNode {
         std::move(n), new_rank, new_node, did_insert);
   }
 
+  // Merges the values in `[first, last)`, which are sorted by strictly
+  // increasing key, into the subtree rooted at `n`, moving from the values.
+  // Returns the new root.  If `did_insert` is not null, sets `did_insert[i]` to
+  // whether `first[i]` was inserted (as opposed to being a no-op or an assign,
+  // just as for `Insert()`).
+  //
+  // The batch is split around the root's key, and the two halves are merged
+  // into the two children recursively.  Since a large batch can make a subtree
+  // too lopsided for a single rotation to fix, a subtree that is still out of
+  // balance after `MaybeRebalance()` is rebuilt from scratch.
+  template <class RandomIt>
+  static std::unique_ptr<Node> InsertSorted(std::unique_ptr<Node> n,
+                                            RandomIt first, RandomIt last,
+                                            bool assign,
+                                            const key_compare &lessthan,
+                                            bool *did_insert) {
+    if (first == last) return n;
+    if (!n) {
+      if (did_insert) std::fill(did_insert, did_insert + (last - first), true);
+      return BuildSorted(first, last);
+    }
+    n->PushDown();
+    RandomIt mid = std::lower_bound(
+        first, last, n->value_, [&lessthan](const Value &a, const Value &b) {
+          return lessthan(Node::key(a), Node::key(b));
+        });
+    RandomIt right_first = mid;
+    if (mid != last && !lessthan(Node::key(n->value_), Node::key(*mid))) {
+      // Equal
+      if (assign) n->SetMappedValue(*mid);
+      if (did_insert) did_insert[mid - first] = false;
+      ++right_first;
+    }
+    std::unique_ptr<Node> left = InsertSorted(std::move(n->left_), first, mid,
+                                              assign, lessthan, did_insert);
+    std::unique_ptr<Node> right = InsertSorted(
+        std::move(n->right_), right_first, last, assign, lessthan,
+        did_insert ? did_insert + (right_first - first) : nullptr);
+    n->UpdateLeftAndRight(std::move(left), std::move(right));
+    return RebalanceOrRebuild(std::move(n));
+  }
+
   //
   // Note: In the following functions, we don't bother to qualify the Karg
   // parameter with is_transparent.  The check is done in the tree.
@@ -623,11 +1038,12 @@ class RawNode {
         Node *successor_node, key_compare &lessthan) {
     // Compare k, not Node::key(k) since k is already a Karg (for a map, it's
     // just the key part of the map, and for a set it's the whole thing.)
-    if (n == nullptr) {
-      return {nullptr, rank_so_far, nullptr, 0};
-    } else if (lessthan(Node::key(n->value_), k)) {
+    if (n == nullptr) return {nullptr, rank_so_far, nullptr, 0};
+    n->PushDown();
+    if (lessthan(Node::key(n->value_), k)) {
       auto [newroot, rank, successor, n_erased] =
-          Erase(std::move(n->right_), k, rank_so_far, successor_node, lessthan);
+          Erase(std::move(n->right_), k, rank_so_far + Size(n->left_) + 1,
+                successor_node, lessthan);
       n->UpdateRight(std::move(newroot));
       return {MaybeRebalance(std::move(n)), rank, successor, n_erased};
     } else if (lessthan(k, Node::key(n->value_))) {
@@ -638,7 +1054,8 @@ class RawNode {
     } else {
       // Equal
       Node *successor = n->right_ ? LeftMost(n->right_) : successor_node;
-      return {DeleteNode(std::move(n)), rank_so_far, successor, 1};
+      size_t rank = rank_so_far + Size(n->left_);
+      return {DeleteNode(std::move(n)), rank, successor, 1};
     }
   }
 
@@ -651,6 +1068,7 @@ class RawNode {
     // Compare k, not Node::key(k) since k is already a Karg (for a map, it's
     // just the key part of the map, and for a set it's the whole thing.)
     if (!n) return {0, nullptr};
+    n->PushDown();
     if (lessthan(k, Node::key(n->value_))) {
       return Find(n->left_, k, lessthan);
     } else if (lessthan(Node::key(n->value_), k)) {
@@ -669,6 +1087,7 @@ class RawNode {
     // Compare k, not Node::key(k) since k is already a Karg (for a map, it's
     // just the key part of the map, and for a set it's the whole thing.)
     if (!n) return {0, nullptr};
+    n->PushDown();
     if (lessthan(k, Node::key(n->value_))) {
       auto [rank, resultnode] = LowerBound(n->left_, k, lessthan);
       if (resultnode == nullptr) {
@@ -691,6 +1110,7 @@ class RawNode {
     // Compare k, not Node::key(k) since k is already a Karg (for a map, it's
     // just the key part of the map, and for a set it's the whole thing.)
     if (!n) return {0, nullptr};
+    n->PushDown();
     if (lessthan(k, Node::key(n->value_))) {
       auto [rank, resultnode] = UpperBound(n->left_, k, lessthan);
       if (resultnode == nullptr)
@@ -708,6 +1128,7 @@ class RawNode {
   static Node *Select(const std::unique_ptr<Node> &n, size_t idx) {
     if (n == nullptr) return nullptr;
     if (Size(n) <= idx) return nullptr;
+    n->PushDown();
     if (Size(n->left_) == idx) {
       return n.get();
     } else if (Size(n->left_) > idx) {
@@ -717,14 +1138,204 @@ class RawNode {
     }
   }
 
+  // Calls `emit(offset + rank, node)` for the node of each rank in
+  // `[first, last)`, which must be sorted (repeats are allowed) and less than
+  // `Size(n)` after subtracting `offset`.  Each node on the paths to the
+  // ranks is visited once, no matter how many of the ranks are below it.
+  template <class It, class Emit>
+  static void SelectSorted(const std::unique_ptr<Node> &n, It first, It last,
+                           size_t offset, Emit &emit) {
+    if (first == last) return;
+    DCHECK(n != nullptr);
+    n->PushDown();
+    size_t rank = offset + Size(n->left_);
+    It mid = std::lower_bound(first, last, rank);
+    It after = std::upper_bound(mid, last, rank);
+    SelectSorted(n->left_, first, mid, offset, emit);
+    for (It it = mid; it != after; ++it) emit(rank, n.get());
+    SelectSorted(n->right_, after, last, rank + 1, emit);
+  }
+
+  // Return the first (or last) node of the subtree, which must not be empty.
+  static Node *LeftMost(const std::unique_ptr<Node> &n) {
+    n->PushDown();
+    if (n->left_)
+      return LeftMost(n->left_);
+    else
+      return n.get();
+  }
+  static Node *RightMost(const std::unique_ptr<Node> &n) {
+    n->PushDown();
+    if (n->right_)
+      return RightMost(n->right_);
+    else
+      return n.get();
+  }
+
+  // Links the detached node `x` after all the nodes of the tree rooted at
+  // `*root`.  Walks down the right spine and back up iteratively, fixing the
+  // summaries and rotating where the spine is out of balance.
+  static void PushBack(std::unique_ptr<Node> *root, std::unique_ptr<Node> x) {
+    std::unique_ptr<Node> *path[kMaxHeight];
+    size_t depth = 0;
+    std::unique_ptr<Node> *slot = root;
+    while (*slot) {
+      DCHECK_LT(depth, kMaxHeight);
+      (*slot)->PushDown();
+      path[depth++] = slot;
+      slot = &(*slot)->right_;
+    }
+    *slot = std::move(x);
+    FixSpine(path, depth);
+  }
+
+  // Unlinks the first node of the tree rooted at `*root` (which must not be
+  // empty), storing it, detached, in `removed`.  Returns the new first node
+  // (or nullptr if the tree is now empty).
+  static Node *PopFront(std::unique_ptr<Node> *root,
+                        std::unique_ptr<Node> *removed) {
+    std::unique_ptr<Node> *path[kMaxHeight];
+    size_t depth = 0;
+    std::unique_ptr<Node> *slot = root;
+    (*slot)->PushDown();
+    while ((*slot)->left_) {
+      DCHECK_LT(depth, kMaxHeight);
+      path[depth++] = slot;
+      slot = &(*slot)->left_;
+      (*slot)->PushDown();
+    }
+    *removed = std::move(*slot);
+    *slot = std::move((*removed)->right_);
+    (*removed)->RecomputeSummary();
+    // The rotations below don't change the order, so this stays the first.
+    Node *first = *slot                ? LeftMost(*slot)
+                  : depth > 0          ? path[depth - 1]->get()
+                                       : nullptr;
+    FixSpine(path, depth);
+    return first;
+  }
+
+  // The rank-based operations, for trees whose order isn't given by keys (see
+  // OrderStatisticSequence).  They make no key comparisons, and the nodes they
+  // take and return are detached (they have no children).
+
+  // Links the detached node `x` into the subtree so that it has rank `idx`
+  // (which must be at most `Size(n)`), and returns the new root.
+  static std::unique_ptr<Node> InsertNodeAt(std::unique_ptr<Node> n,
+                                            size_t idx,
+                                            std::unique_ptr<Node> x) {
+    if (!n) return x;
+    n->PushDown();
+    size_t left_size = Size(n->left_);
+    if (idx <= left_size) {
+      n->UpdateLeft(InsertNodeAt(std::move(n->left_), idx, std::move(x)));
+    } else {
+      n->UpdateRight(InsertNodeAt(std::move(n->right_), idx - left_size - 1,
+                                  std::move(x)));
+    }
+    return MaybeRebalance(std::move(n));
+  }
+
+  // Unlinks the node of rank `idx` (which must be less than `Size(n)`),
+  // storing it, detached, in `removed`.  Returns the new root.
+  static std::unique_ptr<Node> EraseNodeAt(std::unique_ptr<Node> n, size_t idx,
+                                           std::unique_ptr<Node> *removed) {
+    DCHECK(n);
+    n->PushDown();
+    size_t left_size = Size(n->left_);
+    if (idx < left_size) {
+      n->UpdateLeft(EraseNodeAt(std::move(n->left_), idx, removed));
+    } else if (idx > left_size) {
+      n->UpdateRight(
+          EraseNodeAt(std::move(n->right_), idx - left_size - 1, removed));
+    } else {
+      std::unique_ptr<Node> left = std::move(n->left_);
+      std::unique_ptr<Node> right = std::move(n->right_);
+      n->RecomputeSummary();
+      *removed = std::move(n);
+      return Concat(std::move(left), std::move(right));
+    }
+    return MaybeRebalance(std::move(n));
+  }
+
+  // Returns a tree of the nodes of `left`, then the detached node `middle`,
+  // then the nodes of `right`.  Walks down the spine of the larger tree to a
+  // subtree in balance with the smaller one, so it takes O(log(n / m)) time
+  // for trees of sizes n and m (plus the occasional rebuild).
+  static std::unique_ptr<Node> Join(std::unique_ptr<Node> left,
+                                    std::unique_ptr<Node> middle,
+                                    std::unique_ptr<Node> right) {
+    DCHECK(middle && !middle->left_ && !middle->right_);
+    if (IsInBalance(Size(left), Size(right))) {
+      middle->UpdateLeftAndRight(std::move(left), std::move(right));
+      return middle;
+    }
+    if (Size(left) > Size(right)) {
+      left->PushDown();
+      left->UpdateRight(Join(std::move(left->right_), std::move(middle),
+                             std::move(right)));
+      return RebalanceOrRebuild(std::move(left));
+    } else {
+      right->PushDown();
+      right->UpdateLeft(
+          Join(std::move(left), std::move(middle), std::move(right->left_)));
+      return RebalanceOrRebuild(std::move(right));
+    }
+  }
+
+  // Returns a tree of the nodes of `left` followed by the nodes of `right`.
+  static std::unique_ptr<Node> Concat(std::unique_ptr<Node> left,
+                                      std::unique_ptr<Node> right) {
+    if (!left) return right;
+    if (!right) return left;
+    std::unique_ptr<Node> middle;
+    left = UnlinkRightMost(std::move(left), &middle);
+    middle->RecomputeSummary();
+    return Join(std::move(left), std::move(middle), std::move(right));
+  }
+
+  // Splits the subtree into the nodes of rank less than `idx` and the rest.
+  // Takes O(log n) time.
+  static std::pair<std::unique_ptr<Node>, std::unique_ptr<Node>> SplitAt(
+      std::unique_ptr<Node> n, size_t idx) {
+    if (!n) return {nullptr, nullptr};
+    n->PushDown();
+    size_t left_size = Size(n->left_);
+    std::unique_ptr<Node> left = std::move(n->left_);
+    std::unique_ptr<Node> right = std::move(n->right_);
+    n->RecomputeSummary();
+    if (idx <= left_size) {
+      auto [first, rest] = SplitAt(std::move(left), idx);
+      return {std::move(first),
+              Join(std::move(rest), std::move(n), std::move(right))};
+    } else {
+      auto [first, rest] = SplitAt(std::move(right), idx - left_size - 1);
+      return {Join(std::move(left), std::move(n), std::move(first)),
+              std::move(rest)};
+    }
+  }
+
+  // Builds a perfectly balanced tree of the values in `[first, last)`, in
+  // order, moving from them.
+  template <class RandomIt>
+  static std::unique_ptr<Node> Build(RandomIt first, RandomIt last) {
+    return BuildSorted(first, last);
+  }
+
+  // Checks that the subtree sizes add up and that the node is in balance, but
+  // not the order (for trees whose order isn't given by keys).
+  void CheckShape() const {
+    CHECK_EQ(subtree_size_,  // Crash OK
+             1 + Size(left_) + Size(right_));
+    CHECK(IsInBalance());  // Crash OK
+  }
+
   // Checks the tree invariants: The sizes of the subtree add up and the tree is
   // in search-tree order.  Doesn't check for balance, since we don't manage to
   // keep the tree always balanced.  This should probably be called only in test
   // code.
   void Check(bool check_recursive, const key_compare &lessthan) {
-    CHECK_EQ(subtree_size_,  // Crash OK
-             1 + Size(left_) + Size(right_));
-    CHECK(IsInBalance());  // Crash OK
+    CheckShape();
     if (left_) {
       CHECK(lessthan(Node::key(left_->value_),  // Crash OK
                      Node::key(value_)));
@@ -767,132 +1378,113 @@ class RawNode {
     static_cast<Node *>(this)->RecomputeSummary();
   }
 
-  static Node *LeftMost(const std::unique_ptr<Node> &n) {
-    if (n->left_)
-      return LeftMost(n->left_);
-    else
-      return n.get();
-  }
+  // How the balancing machinery reaches a node's children.
+  struct Links {
+    using Ptr = std::unique_ptr<Node>;
+    static Ptr &Left(const Ptr &n) { return n->left_; }
+    static Ptr &Right(const Ptr &n) { return n->right_; }
+    static size_t Size(const Ptr &n) { return RawNode::Size(n); }
+    static void PushDown(const Ptr &n) { n->PushDown(); }
+    static void Recompute(const Ptr &n) { n->RecomputeSummary(); }
+  };
+  using Balancing = WeightBalancedTree<Links>;
 
   // Removes the rightmost node from the subtree, storing it in removed_node.
   // Returns the root of the revised subtree.
   static std::unique_ptr<Node> UnlinkRightMost(
       std::unique_ptr<Node> n, std::unique_ptr<Node> *removed_node) {
-    DCHECK(n);
-    if (n->right_) {
-      n->UpdateRight(UnlinkRightMost(std::move(n->right_), removed_node));
-      return MaybeRebalance(std::move(n));
-    } else {
-      std::unique_ptr<Node> left = std::move(n->left_);
-      *removed_node = std::move(n);
-      return left;
-    }
+    return Balancing::UnlinkRightMost(std::move(n), removed_node);
   }
 
   // Removes this from the tree, returning the new root.
   static std::unique_ptr<Node> DeleteNode(std::unique_ptr<Node> n) {
-    DCHECK(n);
-    if (n->left_) {
-      std::unique_ptr<Node> new_n;
-      std::unique_ptr<Node> new_left =
-          UnlinkRightMost(std::move(n->left_), &new_n);
-      new_n->UpdateLeftAndRight(std::move(new_left), std::move(n->right_));
-      new_n = MaybeRebalance(std::move(new_n));
-      return new_n;
-    } else {
-      return std::move(n->right_);
-    }
+    return Balancing::DeleteNode(std::move(n));
   }
 
-  // Swaps a := b,  b := c, c := a (where c gets the original a).
-  template <class T>
-  static void swap3left(T &a, T &b, T &c) {
-    std::swap(a, b);
-    std::swap(b, c);
+  // Fixes the summaries and the balance of the nodes at `*path[depth - 1]`,
+  // ..., `*path[0]`, each of which is a child of the next one, after one node
+  // was added to or removed from below the first.
+  static void FixSpine(std::unique_ptr<Node> **path, size_t depth) {
+    while (depth > 0) {
+      std::unique_ptr<Node> &n = *path[--depth];
+      n->RecomputeSummary();
+      if (!n->IsInBalance()) n = MaybeRebalance(std::move(n));
+    }
   }
 
-  // Rotates the tree left, returning the new root.
-  static std::unique_ptr<Node> RotateLeft(std::unique_ptr<Node> n) {
-    swap3left(n->right_, n->right_->left_, n);
-    if (n->left_) n->left_->RecomputeSummary();
-    n->RecomputeSummary();
-    return n;
-  }
+ protected:
+  // The balancing machinery is also available to node types that restructure
+  // subtrees themselves (see `TombstoneNode`).
 
-  // Rotates the tree right, returning the new root.
-  static std::unique_ptr<Node> RotateRight(std::unique_ptr<Node> n) {
-    swap3left(n->left_, n->left_->right_, n);
-    if (n->right_) n->right_->RecomputeSummary();
-    n->RecomputeSummary();
-    return n;
+  // A bound on the height of a tree: every node has at least a quarter of its
+  // subtree's weight on each side, so a tree of height h has at least
+  // (4/3)^h nodes, and no more than 2^64.
+  static constexpr size_t kMaxHeight = 160;
+
+  // Returns true if the tree is balanced at this node.
+  bool IsInBalance() const { return IsInBalance(Size(left_), Size(right_)); }
+
+  // Returns true if subtrees of sizes `left_size` and `right_size` may be the
+  // children of one node.
+  static bool IsInBalance(size_t left_size, size_t right_size) {
+    return Balancing::IsInBalance(left_size, right_size);
   }
 
-  // Double rotations
-  static std::unique_ptr<Node> RotateRightLeft(std::unique_ptr<Node> n) {
-    n->right_ = RotateRight(std::move(n->right_));
-    return RotateLeft(std::move(n));
+  // If needed, rebalances the tree at n, returning the new root.
+  static std::unique_ptr<Node> MaybeRebalance(std::unique_ptr<Node> n) {
+    return Balancing::MaybeRebalance(std::move(n));
   }
 
-  static std::unique_ptr<Node> RotateLeftRight(std::unique_ptr<Node> n) {
-    n->left_ = RotateLeft(std::move(n->left_));
-    return RotateRight(std::move(n));
+  // Like `MaybeRebalance()`, but also handles subtrees that are arbitrarily
+  // far out of balance (which can happen after `InsertSorted()`) by rebuilding
+  // them.  Requires that the children are themselves in balance.
+  static std::unique_ptr<Node> RebalanceOrRebuild(std::unique_ptr<Node> n) {
+    n = MaybeRebalance(std::move(n));
+    // The rotations change only the children of the new root and its two
+    // children, so those are the only nodes that might be out of balance.
+    if (n->IsInBalance() && (!n->left_ || n->left_->IsInBalance()) &&
+        (!n->right_ || n->right_->IsInBalance())) {
+      return n;
+    }
+    std::vector<std::unique_ptr<Node>> nodes;
+    nodes.reserve(Size(n));
+    Flatten(std::move(n), &nodes);
+    return Link(nodes.data(), nodes.data() + nodes.size());
   }
 
-  // 4 is a convenient rebalancing factor.  Smaller factors lead to more work to
-  // maintain balance, whereas larger factors lead to deeper trees (and hence
-  // more work during search.).  Traditional weight-balanced trees require that
-  // the rebalance factor be between 3.414 and 5.5 in order to make the
-  // rotations work right.  See, for example,
-  // https://en.wikipedia.org/wiki/Weight-balanced_tree.
-  static constexpr size_t kRebalanceFactor = 4;
+  // Builds a perfectly balanced tree from the sorted values in `[first,
+  // last)`.
+  template <class RandomIt>
+  static std::unique_ptr<Node> BuildSorted(RandomIt first, RandomIt last) {
+    if (first == last) return nullptr;
+    RandomIt mid = first + (last - first) / 2;
+    // Using new to access non-public constructor that make_unique cannot
+    // access.
+    auto n = absl::WrapUnique(new Node(std::move(*mid)));
+    n->UpdateLeftAndRight(BuildSorted(first, mid), BuildSorted(mid + 1, last));
+    return n;
+  }
 
-  // Returns true if the tree is balanced at this node.
-  bool IsInBalance() const {
-    size_t left_weight = 1 + Size(left_);
-    size_t right_weight = 1 + Size(right_);
-    size_t total_weight = left_weight + right_weight;
-    // Return true if 1/4 <= left_weight/total_weight <= 3/4
-    // where "4" is kRebalanceFactor and "3" is kRebalanceFactor-1.
-    size_t four = kRebalanceFactor;
-    size_t three = four - 1;
-    bool r = (total_weight <= four * left_weight) &&
-             (four * left_weight <= three * total_weight);
-    return r;
+  // Appends the nodes of the subtree to `nodes` in order, detaching them from
+  // each other.
+  static void Flatten(std::unique_ptr<Node> n,
+                      std::vector<std::unique_ptr<Node>> *nodes) {
+    if (!n) return;
+    n->PushDown();
+    Flatten(std::move(n->left_), nodes);
+    std::unique_ptr<Node> right = std::move(n->right_);
+    nodes->push_back(std::move(n));
+    Flatten(std::move(right), nodes);
   }
 
-  // If needed, rebalances the tree at n, returning the new root.
-  static std::unique_ptr<Node> MaybeRebalance(std::unique_ptr<Node> n) {
-    DCHECK(n);
-    if (n->IsInBalance()) {
-      n->RecomputeSummary();  // even if it's balanced the summary could be
-                              // wrong after a modification.
-      return n;
-    }
-    const std::unique_ptr<Node> &left = n->left_;
-    const std::unique_ptr<Node> &right = n->right_;
-    if (Size(left) < Size(right)) {
-      size_t rl_size = 1 + Size(right->left_);
-      size_t rr_size = 1 + Size(right->right_);
-      size_t sum_size = rl_size + rr_size;
-      // Check to see if rl_size/sum_size < 2/3
-      // where 2/3 is really (kRebalanceFactor-2)/(kRebalanceFactor-1).
-      if (rl_size * (kRebalanceFactor - 1) <
-          sum_size * (kRebalanceFactor - 2)) {
-        return RotateLeft(std::move(n));
-      } else {
-        return RotateRightLeft(std::move(n));
-      }
-    } else {
-      size_t ll_size = 1 + Size(left->left_);
-      size_t lr_size = 1 + Size(left->right_);
-      size_t sum_size = ll_size + lr_size;
-      if (lr_size * (kRebalanceFactor - 1) <
-          sum_size * (kRebalanceFactor - 2)) {
-        return RotateRight(std::move(n));
-      } else {
-        return RotateLeftRight(std::move(n));
-      }
-    }
+  // Links the detached nodes in `[first, last)` into a perfectly balanced tree.
+  static std::unique_ptr<Node> Link(std::unique_ptr<Node> *first,
+                                    std::unique_ptr<Node> *last) {
+    if (first == last) return nullptr;
+    std::unique_ptr<Node> *mid = first + (last - first) / 2;
+    std::unique_ptr<Node> n = std::move(*mid);
+    n->UpdateLeftAndRight(Link(first, mid), Link(mid + 1, last));
+    return n;
   }
 
  protected:
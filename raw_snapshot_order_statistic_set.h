@@ -0,0 +1,631 @@
+// Base class for the order-statistic trees that support lock-free readers.
+//
+// The tree is the same weight-balanced tree as in raw_order_statistic_set.h,
+// but nodes are immutable once they are reachable from the published root.  A
+// writer never modifies a published node.  Instead it copies the nodes on the
+// path it changes (including the nodes involved in rotations), builds the new
+// version of the tree off to the side, and then publishes the new root with a
+// single atomic store.  Readers load the root once and then walk a tree that
+// nobody will change underneath them, so every read observes exactly one
+// version of the tree (i.e., reads are linearizable with respect to the
+// writes).  The nodes that the writer replaced are handed to an
+// `EpochReclaimer`, which frees them once no reader can still be looking at
+// them.
+//
+// A write copies O(log n) nodes, so writes are somewhat more expensive than for
+// `RawOrderStatisticSet`, and `Value` must be copyable.  In exchange readers
+// take no locks and write no shared cache lines.
+//
+// Within one write, a node that was created by that same write ("fresh") is
+// not yet visible to anybody, so it is modified in place rather than copied
+// again.  Each write gets a unique stamp, and each node remembers the stamp of
+// the write that created it.
+//
+// As in raw_order_statistic_set.h, `RawSnapshotNode` is a CRTP base class that
+// does the real work, and node types can extend it with additional summary
+// information by overriding `RecomputeSummary()` and `Check()`.
+
+#ifndef NET_BANDAID_BDN_CACHELIB_RAW_SNAPSHOT_ORDER_STATISTIC_SET_H_
+#define NET_BANDAID_BDN_CACHELIB_RAW_SNAPSHOT_ORDER_STATISTIC_SET_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "epoch_reclaimer.h"
+#include "raw_order_statistic_set.h"
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// The bookkeeping for one attempt to modify a snapshot tree: the stamp that
+// identifies fresh nodes, the fresh nodes themselves (so they can be freed if
+// the attempt is abandoned), and the published nodes that the new version no
+// longer uses (so they can be retired once the new version is published).
+template <class Node>
+class SnapshotWriteContext {
+ public:
+  explicit SnapshotWriteContext(uint64_t stamp) : stamp_(stamp) {}
+
+  uint64_t stamp() const { return stamp_; }
+
+  const std::vector<const Node *> &fresh() const { return fresh_; }
+  const std::vector<const Node *> &replaced() const { return replaced_; }
+
+  void AddFresh(const Node *n) { fresh_.push_back(n); }
+  void AddReplaced(const Node *n) { replaced_.push_back(n); }
+
+  // Frees the fresh nodes.  Used when the attempt is abandoned.
+  void DeleteFresh() {
+    for (const Node *n : fresh_) delete n;
+    fresh_.clear();
+    replaced_.clear();
+  }
+
+ private:
+  uint64_t stamp_;
+  std::vector<const Node *> fresh_;
+  std::vector<const Node *> replaced_;
+};
+
+// When extending RawSnapshotNode, the extended type must define
+//
+//   1. a constructor taking a `value_type`;
+//
+//   2. a member type `value_type`; and
+//
+//   3. a static function `static const Key &key(const value_type &value)`.
+//
+// These are the same requirements as for `RawNode`.
+template <class Key, class Value, class Compare, class NodeType>
+class RawSnapshotNode {
+ private:
+  using Node = NodeType;
+  using value_type = Value;
+
+ protected:
+  using key_compare = Compare;
+
+ public:
+  using WriteContext = SnapshotWriteContext<Node>;
+
+  explicit RawSnapshotNode(Value v) : value_(std::move(v)) {}
+
+  // Returns the number of nodes in the subtree.
+  static size_t Size(const Node *n) { return n ? n->subtree_size_ : 0; }
+
+  // Returns the rank of k and the node holding k (or nullptr if k isn't
+  // present).
+  template <class Karg>
+  static std::pair<size_t, const Node *> Find(const Node *n, const Karg &k,
+                                              const key_compare &lessthan) {
+    size_t rank = 0;
+    while (n) {
+      if (lessthan(k, Node::key(n->value_))) {
+        n = n->left_;
+      } else if (lessthan(Node::key(n->value_), k)) {
+        rank += Size(n->left_) + 1;
+        n = n->right_;
+      } else {
+        return {rank + Size(n->left_), n};
+      }
+    }
+    return {rank, nullptr};
+  }
+
+  // Returns the rank of the first element that is not less than `k`, and its
+  // node (or nullptr if there is no such element).
+  template <class Karg>
+  static std::pair<size_t, const Node *> LowerBound(
+      const Node *n, const Karg &k, const key_compare &lessthan) {
+    size_t rank = 0;
+    const Node *result = nullptr;
+    size_t result_rank = 0;
+    while (n) {
+      if (lessthan(Node::key(n->value_), k)) {
+        rank += Size(n->left_) + 1;
+        n = n->right_;
+      } else {
+        result = n;
+        result_rank = rank + Size(n->left_);
+        n = n->left_;
+      }
+    }
+    return {result ? result_rank : rank, result};
+  }
+
+  // Returns the node of rank idx, or nullptr.
+  static const Node *Select(const Node *n, size_t idx) {
+    while (n) {
+      size_t left_size = Size(n->left_);
+      if (idx < left_size) {
+        n = n->left_;
+      } else if (idx == left_size) {
+        return n;
+      } else {
+        idx -= left_size + 1;
+        n = n->right_;
+      }
+    }
+    return nullptr;
+  }
+
+  // Returns the root of a version of the subtree rooted at `n` that contains
+  // `v`.  If an equivalent key is already present, it is replaced by `v` if
+  // `assign` is true.  Sets `*did_insert` to true iff the key wasn't present.
+  // If nothing changes, returns `n` itself.
+  static const Node *Insert(const Node *n, Value v, bool assign,
+                            const key_compare &lessthan, WriteContext &ctx,
+                            bool *did_insert) {
+    if (!n) {
+      *did_insert = true;
+      return Make(std::move(v), nullptr, nullptr, ctx);
+    }
+    if (lessthan(Node::key(n->value_), Node::key(v))) {
+      const Node *r =
+          Insert(n->right_, std::move(v), assign, lessthan, ctx, did_insert);
+      if (r == n->right_) return n;
+      Node *c = Copy(n, ctx);
+      c->right_ = r;
+      return MaybeRebalance(c, ctx);
+    } else if (lessthan(Node::key(v), Node::key(n->value_))) {
+      const Node *l =
+          Insert(n->left_, std::move(v), assign, lessthan, ctx, did_insert);
+      if (l == n->left_) return n;
+      Node *c = Copy(n, ctx);
+      c->left_ = l;
+      return MaybeRebalance(c, ctx);
+    } else {
+      // Equal
+      *did_insert = false;
+      if (!assign) return n;
+      Node *c = Make(std::move(v), n->left_, n->right_, ctx);
+      Discard(n, ctx);
+      return c;
+    }
+  }
+
+  // Returns the root of a version of the subtree rooted at `n` that doesn't
+  // contain `k`.  Sets `*n_erased` to the number of elements erased (zero or
+  // one).  If nothing changes, returns `n` itself.
+  template <class Karg>
+  static const Node *Erase(const Node *n, const Karg &k,
+                           const key_compare &lessthan, WriteContext &ctx,
+                           size_t *n_erased) {
+    if (!n) {
+      *n_erased = 0;
+      return nullptr;
+    }
+    if (lessthan(Node::key(n->value_), k)) {
+      const Node *r = Erase(n->right_, k, lessthan, ctx, n_erased);
+      if (r == n->right_) return n;
+      Node *c = Copy(n, ctx);
+      c->right_ = r;
+      return MaybeRebalance(c, ctx);
+    } else if (lessthan(k, Node::key(n->value_))) {
+      const Node *l = Erase(n->left_, k, lessthan, ctx, n_erased);
+      if (l == n->left_) return n;
+      Node *c = Copy(n, ctx);
+      c->left_ = l;
+      return MaybeRebalance(c, ctx);
+    } else {
+      // Equal
+      *n_erased = 1;
+      return DeleteNode(n, ctx);
+    }
+  }
+
+  // Hands every node in the subtree to `ctx` as replaced.
+  static void DiscardTree(const Node *n, WriteContext &ctx) {
+    if (!n) return;
+    DiscardTree(n->left_, ctx);
+    DiscardTree(n->right_, ctx);
+    Discard(n, ctx);
+  }
+
+  // Frees every node in the subtree immediately.  Only safe if no reader can be
+  // looking at the subtree.
+  static void DeleteTree(const Node *n) {
+    if (!n) return;
+    DeleteTree(n->left_);
+    DeleteTree(n->right_);
+    delete n;
+  }
+
+  // Checks the tree invariants: sizes, balance, and search-tree order.  This
+  // should probably be called only in test code.
+  void Check(bool check_recursive, const key_compare &lessthan) const {
+    CHECK_EQ(subtree_size_,  // Crash OK
+             1 + Size(left_) + Size(right_));
+    CHECK(IsInBalance());  // Crash OK
+    if (left_) {
+      CHECK(lessthan(Node::key(left_->value_),  // Crash OK
+                     Node::key(value_)));
+      if (check_recursive) left_->Check(check_recursive, lessthan);
+    }
+    if (right_) {
+      CHECK(
+          lessthan(Node::key(value_), Node::key(right_->value_)));  // Crash OK
+      if (check_recursive) right_->Check(check_recursive, lessthan);
+    }
+  }
+
+ protected:
+  // Recomputes the subtree_size_ (and, in the derived type, the other summary
+  // information).  Only ever called on fresh nodes.
+  void RecomputeSummary() { subtree_size_ = 1ul + Size(left_) + Size(right_); }
+
+ private:
+  // Creates a fresh node.
+  static Node *Make(Value v, const Node *left, const Node *right,
+                    WriteContext &ctx) {
+    Node *n = new Node(std::move(v));
+    n->left_ = left;
+    n->right_ = right;
+    n->stamp_ = ctx.stamp();
+    n->RecomputeSummary();
+    ctx.AddFresh(n);
+    return n;
+  }
+
+  // Returns a modifiable version of `n`: `n` itself if it is fresh, otherwise
+  // a fresh copy (in which case `n` is recorded as replaced).  The caller must
+  // arrange for RecomputeSummary() to be called after modifying the copy.
+  static Node *Copy(const Node *n, WriteContext &ctx) {
+    if (n->stamp_ == ctx.stamp()) return const_cast<Node *>(n);
+    Node *c = Make(n->value_, n->left_, n->right_, ctx);
+    ctx.AddReplaced(n);
+    return c;
+  }
+
+  // Records that the published node `n` is no longer part of the tree.  (A
+  // single write never removes a node that it created itself.)
+  static void Discard(const Node *n, WriteContext &ctx) {
+    DCHECK_NE(n->stamp_, ctx.stamp());
+    ctx.AddReplaced(n);
+  }
+
+  static const Node *DeleteNode(const Node *n, WriteContext &ctx) {
+    if (n->left_) {
+      const Node *removed;
+      const Node *new_left = UnlinkRightMost(n->left_, ctx, &removed);
+      Node *c = Copy(removed, ctx);
+      c->left_ = new_left;
+      c->right_ = n->right_;
+      Discard(n, ctx);
+      return MaybeRebalance(c, ctx);
+    } else {
+      const Node *right = n->right_;
+      Discard(n, ctx);
+      return right;
+    }
+  }
+
+  // Returns the subtree without its rightmost node, which is stored in
+  // `removed`.
+  static const Node *UnlinkRightMost(const Node *n, WriteContext &ctx,
+                                     const Node **removed) {
+    if (n->right_) {
+      const Node *r = UnlinkRightMost(n->right_, ctx, removed);
+      Node *c = Copy(n, ctx);
+      c->right_ = r;
+      return MaybeRebalance(c, ctx);
+    } else {
+      *removed = n;
+      return n->left_;
+    }
+  }
+
+  // The rotations take a fresh node and return a fresh node.
+  static Node *RotateLeft(Node *n, WriteContext &ctx) {
+    Node *r = Copy(n->right_, ctx);
+    n->right_ = r->left_;
+    n->RecomputeSummary();
+    r->left_ = n;
+    r->RecomputeSummary();
+    return r;
+  }
+
+  static Node *RotateRight(Node *n, WriteContext &ctx) {
+    Node *l = Copy(n->left_, ctx);
+    n->left_ = l->right_;
+    n->RecomputeSummary();
+    l->right_ = n;
+    l->RecomputeSummary();
+    return l;
+  }
+
+  static Node *RotateRightLeft(Node *n, WriteContext &ctx) {
+    n->right_ = RotateRight(Copy(n->right_, ctx), ctx);
+    return RotateLeft(n, ctx);
+  }
+
+  static Node *RotateLeftRight(Node *n, WriteContext &ctx) {
+    n->left_ = RotateLeft(Copy(n->left_, ctx), ctx);
+    return RotateRight(n, ctx);
+  }
+
+  // The same balance criterion as `RawNode`.
+  static constexpr size_t kRebalanceFactor = 4;
+
+  bool IsInBalance() const {
+    size_t left_weight = 1 + Size(left_);
+    size_t right_weight = 1 + Size(right_);
+    size_t total_weight = left_weight + right_weight;
+    return (total_weight <= kRebalanceFactor * left_weight) &&
+           (kRebalanceFactor * left_weight <=
+            (kRebalanceFactor - 1) * total_weight);
+  }
+
+  // Rebalances the fresh node `n` if needed, returning the new (fresh) root.
+  static Node *MaybeRebalance(Node *n, WriteContext &ctx) {
+    if (n->IsInBalance()) {
+      n->RecomputeSummary();
+      return n;
+    }
+    if (Size(n->left_) < Size(n->right_)) {
+      size_t rl_size = 1 + Size(n->right_->left_);
+      size_t rr_size = 1 + Size(n->right_->right_);
+      if (rl_size * (kRebalanceFactor - 1) <
+          (rl_size + rr_size) * (kRebalanceFactor - 2)) {
+        return RotateLeft(n, ctx);
+      } else {
+        return RotateRightLeft(n, ctx);
+      }
+    } else {
+      size_t ll_size = 1 + Size(n->left_->left_);
+      size_t lr_size = 1 + Size(n->left_->right_);
+      if (lr_size * (kRebalanceFactor - 1) <
+          (ll_size + lr_size) * (kRebalanceFactor - 2)) {
+        return RotateRight(n, ctx);
+      } else {
+        return RotateLeftRight(n, ctx);
+      }
+    }
+  }
+
+ protected:
+  const Node *left_ = nullptr;
+  const Node *right_ = nullptr;
+  size_t subtree_size_ = 1;
+  // The stamp of the write that created this node.
+  uint64_t stamp_ = 0;
+
+ public:
+  Value value_;
+};
+
+// The tree itself.  As for `RawOrderStatisticSet`, everything is `protected`
+// and the public container classes make the relevant members visible.
+//
+// Writes are made on the tree object itself, and must be serialized by the
+// caller (there is exactly one writer at a time).  Reads are made through a
+// `Reader`, of which each reading thread needs its own.  A `Snapshot` pins one
+// version of the tree so that several reads can be made against it; the
+// pointers it hands out remain valid for as long as the `Snapshot` is alive.
+template <class Key, class Value, class Compare, class NodeType>
+class RawSnapshotOrderStatisticSet {
+ protected:
+  using Node = NodeType;
+  using WriteContext = typename Node::WriteContext;
+
+  template <class K>
+  using key_arg =
+      typename KeyArg<IsTransparent<Compare>::value>::template type<K, Key>;
+
+ public:
+  using key_type = Key;
+  using value_type = typename Node::value_type;
+  using size_type = std::size_t;
+  using key_compare = Compare;
+
+  // A consistent view of one version of the tree.  Don't keep a Snapshot
+  // alive for long: nodes retired while it is alive can't be freed.
+  class Snapshot {
+   public:
+    Snapshot(Snapshot &&) = default;
+
+    // Returns the number of elements.
+    size_t size() const { return Node::Size(root_); }
+
+    bool empty() const { return root_ == nullptr; }
+
+    // Returns the element with a key equivalent to `k`, or nullptr.
+    template <class K = Key>
+    const value_type *find(const key_arg<K> &k) const {
+      const Node *n = Node::Find(root_, k, *lessthan_).second;
+      return n ? &n->value_ : nullptr;
+    }
+
+    template <class K = Key>
+    bool contains(const key_arg<K> &k) const {
+      return find<K>(k) != nullptr;
+    }
+
+    // Returns the first element that is not less than `k`, or nullptr.
+    template <class K = Key>
+    const value_type *lower_bound(const key_arg<K> &k) const {
+      const Node *n = Node::LowerBound(root_, k, *lessthan_).second;
+      return n ? &n->value_ : nullptr;
+    }
+
+    // Returns the number of elements less than `k`.
+    template <class K = Key>
+    size_t rank(const key_arg<K> &k) const {
+      return Node::LowerBound(root_, k, *lessthan_).first;
+    }
+
+    // Returns the element of rank `idx`, or nullptr.
+    const value_type *select(size_t idx) const {
+      const Node *n = Node::Select(root_, idx);
+      return n ? &n->value_ : nullptr;
+    }
+
+    // Returns the sum of the first `n` mapped values.  Only available for node
+    // types that maintain sums.
+    auto SumFirstN(size_t n) const { return Node::SumFirstN(root_, n); }
+
+   private:
+    friend class RawSnapshotOrderStatisticSet;
+    Snapshot(const RawSnapshotOrderStatisticSet *tree,
+             EpochReclaimer::Guard guard)
+        : guard_(std::move(guard)),
+          root_(tree->root_.load()),
+          lessthan_(&tree->lessthan_) {}
+
+    EpochReclaimer::Guard guard_;
+    const Node *root_;
+    const key_compare *lessthan_;
+  };
+
+  // A per-thread handle for reading.  Each query pins the tree for just the
+  // duration of the call and returns a copy of the result.
+  class Reader {
+   public:
+    explicit Reader(const RawSnapshotOrderStatisticSet *tree)
+        : tree_(tree),
+          reader_(const_cast<EpochReclaimer *>(&tree->reclaimer_)) {}
+
+    Snapshot snapshot() { return Snapshot(tree_, reader_.Pin()); }
+
+    size_t size() { return snapshot().size(); }
+
+    template <class K = Key>
+    std::optional<value_type> find(const key_arg<K> &k) {
+      return Copy(snapshot().template find<K>(k));
+    }
+
+    template <class K = Key>
+    bool contains(const key_arg<K> &k) {
+      return snapshot().template contains<K>(k);
+    }
+
+    template <class K = Key>
+    size_t rank(const key_arg<K> &k) {
+      return snapshot().template rank<K>(k);
+    }
+
+    std::optional<value_type> select(size_t idx) {
+      return Copy(snapshot().select(idx));
+    }
+
+    auto SumFirstN(size_t n) { return snapshot().SumFirstN(n); }
+
+   private:
+    static std::optional<value_type> Copy(const value_type *v) {
+      if (v == nullptr) return std::nullopt;
+      return *v;
+    }
+
+    const RawSnapshotOrderStatisticSet *tree_;
+    EpochReclaimer::Reader reader_;
+  };
+
+ protected:
+  explicit RawSnapshotOrderStatisticSet(size_t max_readers)
+      : reclaimer_(max_readers) {}
+
+  // No readers may be active.
+  ~RawSnapshotOrderStatisticSet() { Node::DeleteTree(root_.load()); }
+
+  RawSnapshotOrderStatisticSet(const RawSnapshotOrderStatisticSet &) = delete;
+  RawSnapshotOrderStatisticSet &operator=(
+      const RawSnapshotOrderStatisticSet &) = delete;
+
+  // The writer's view of the size.
+  size_t size() const {
+    return Node::Size(root_.load(std::memory_order_relaxed));
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // Inserts `value` if no equivalent key is present (or, if `assign` is true,
+  // replaces the equivalent element).  Returns true iff the key was not
+  // present.
+  bool InsertInternal(Value value, bool assign) {
+    bool did_insert = false;
+    Publish([&](const Node *root, WriteContext &ctx) {
+      return Node::Insert(root, std::move(value), assign, lessthan_, ctx,
+                          &did_insert);
+    });
+    return did_insert;
+  }
+
+  // Inserts `value` if no equivalent key is present.  Returns true iff the
+  // insertion happened.
+  bool insert(Value value) { return InsertInternal(std::move(value), false); }
+
+  // Erases `k` if present.  Returns the number of elements erased.
+  template <class K = Key>
+  size_t erase(const key_arg<K> &k) {
+    size_t n_erased = 0;
+    Publish([&](const Node *root, WriteContext &ctx) {
+      return Node::Erase(root, k, lessthan_, ctx, &n_erased);
+    });
+    return n_erased;
+  }
+
+  // Erases everything.
+  void clear() {
+    Publish([&](const Node *root, WriteContext &ctx) {
+      Node::DiscardTree(root, ctx);
+      return nullptr;
+    });
+  }
+
+  key_compare key_comp() const { return key_compare(); }
+
+ public:
+  //**************** Debugging and test support ****************
+
+  // Checks the current version of the tree.  Must be called by the writer.
+  void Check() const {
+    if (const Node *root = root_.load()) root->Check(true, lessthan_);
+  }
+
+  // Frees whatever retired nodes can be freed now, returning the number that
+  // are still waiting for readers.
+  size_t CollectForTest() { return reclaimer_.Collect(); }
+
+ protected:
+  // Applies `mutate`, which maps the current root to a new root, and publishes
+  // the result.  Only one writer may call this at a time.
+  template <class Mutate>
+  void Publish(Mutate mutate) {
+    const Node *old_root = root_.load(std::memory_order_relaxed);
+    WriteContext ctx(++stamp_);
+    const Node *new_root = mutate(old_root, ctx);
+    if (new_root != old_root) root_.store(new_root);
+    Retire(ctx);
+  }
+
+  // Hands the nodes that `ctx` replaced to the reclaimer, collecting every
+  // so often.
+  void Retire(const WriteContext &ctx) {
+    for (const Node *n : ctx.replaced()) reclaimer_.Retire(n);
+    retired_since_collect_ += ctx.replaced().size();
+    if (retired_since_collect_ >= kCollectThreshold) {
+      retired_since_collect_ = 0;
+      reclaimer_.Collect();
+    }
+  }
+
+  // How many nodes to retire between calls to `EpochReclaimer::Collect()`,
+  // which has to look at every reader's slot.
+  static constexpr size_t kCollectThreshold = 256;
+
+  EpochReclaimer reclaimer_;
+  std::atomic<const Node *> root_{nullptr};
+  key_compare lessthan_;
+  uint64_t stamp_ = 0;
+  size_t retired_since_collect_ = 0;
+};
+
+}  // namespace cachelib_internal
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_RAW_SNAPSHOT_ORDER_STATISTIC_SET_H_
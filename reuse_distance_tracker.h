@@ -0,0 +1,490 @@
+// A ReuseDistanceTracker computes the LRU stack distance (Mattson et al.,
+// 1970) of every access in a stream of `(key, size)` accesses, and from those
+// the miss-ratio curve of an LRU cache of any size.
+//
+// The reuse distance of an access to a key is the number of distinct other
+// keys accessed since the previous access to it, and its byte distance is the
+// total size of those keys.  An LRU cache of `c` objects hits exactly the
+// accesses with reuse distance less than `c`, and (ignoring fragmentation) an
+// LRU cache of `b` bytes hits exactly the accesses whose byte distance plus
+// the size of the object is at most `b`.  The first access to a key is a cold
+// miss for every cache size.
+//
+// Every key is kept in a PrefixSumMap, keyed by the time of its last access
+// and mapping to its size, so the keys accessed since a key's last access are
+// exactly the ones after it in the tree: the reuse distance is a rank, and the
+// byte distance is a suffix sum.  A hash map gives the time of each key's last
+// access.  Each access takes O(log n) time, where n is the number of distinct
+// keys, and the memory is O(n).
+//
+// `access_batch()` is the fast way to feed a trace.  It works out the
+// distances of a few thousand accesses at a time with small Fenwick trees over
+// the batch, and then updates the tree in two sorted passes, so each batch
+// costs one tree lookup per distinct key that it moves instead of three
+// rebalancing tree operations per access.
+//
+// The distances are recorded in log-linear histograms, so recording one is
+// O(1) and the miss ratios are those of a cache within about 0.1% of the size
+// asked for (and exact below 2048 objects or bytes); see ReuseHistogram.
+//
+// Example:
+//
+//   ReuseDistanceTracker<std::string> tracker;
+//   for (const Request &r : trace) tracker.access(r.key, r.bytes);
+//   double miss_ratio_at_1gb = tracker.byte_miss_ratio(1 << 30);
+
+#ifndef NET_BANDAID_BDN_CACHELIB_REUSE_DISTANCE_TRACKER_H_
+#define NET_BANDAID_BDN_CACHELIB_REUSE_DISTANCE_TRACKER_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/numeric/bits.h"
+#include "absl/types/span.h"
+#include "dense_prefix_sum_map.h"
+#include "prefix_sum_map.h"
+
+namespace cachelib {
+
+// The result of one access.
+struct ReuseDistance {
+  // True for the first access to a key, for which the distances are zero.
+  bool cold = false;
+  // The number of distinct other keys accessed since the last access.
+  uint64_t distance = 0;
+  // The total size of those keys.
+  uint64_t bytes = 0;
+};
+
+namespace cachelib_internal {
+
+// A histogram of `uint64_t` values with weights of type `Weight`, in
+// log-linear buckets (as in HdrHistogram): the values below
+// `2^(kSubBucketBits + 1)` each get a bucket of their own, and each larger
+// power-of-two range is split into `2^kSubBucketBits` equal buckets.  So a
+// bucket's values are within a factor of `1 + 2^-kSubBucketBits` of each
+// other, and there are at most about `64 * 2^kSubBucketBits` buckets, however
+// many distinct values are added.
+//
+// `Add()` is O(1).  `SumAtMost()` adds up the buckets in O(B) time, where B is
+// the number of buckets up to the largest value added.
+template <class Weight>
+class LogLinearHistogram {
+ public:
+  static constexpr int kSubBucketBits = 10;
+
+  // Adds `weight` to the bucket of `value`.
+  void Add(uint64_t value, Weight weight) {
+    size_t bucket = BucketOf(value);
+    if (bucket >= buckets_.size()) buckets_.resize(bucket + 1);
+    buckets_[bucket] += weight;
+  }
+
+  // Returns the weight of the values at most `value`, plus that of the values
+  // in the same bucket as `value`.  That is exact for `value`s below
+  // `2^(kSubBucketBits + 1)`, and otherwise lies between the weight at most
+  // `value` and the weight at most `value * (1 + 2^-kSubBucketBits)`.
+  Weight SumAtMost(uint64_t value) const {
+    size_t end = std::min(BucketOf(value) + 1, buckets_.size());
+    Weight sum{};
+    for (size_t i = 0; i < end; ++i) sum += buckets_[i];
+    return sum;
+  }
+
+ private:
+  static size_t BucketOf(uint64_t value) {
+    if (value < (uint64_t{2} << kSubBucketBits)) return value;
+    // The top `kSubBucketBits + 1` bits of `value`, which start with a 1, and
+    // the number of bits below them.
+    int shift = absl::bit_width(value) - 1 - kSubBucketBits;
+    return (static_cast<size_t>(shift) << kSubBucketBits) + (value >> shift);
+  }
+
+  std::vector<Weight> buckets_;
+};
+
+// Histograms of the reuse distances of a stream of accesses, from which the
+// miss ratio of an LRU cache of any size can be read off.  Each access has a
+// weight (the number of accesses it stands for), of type `Weight`.
+//
+// The distances are kept in LogLinearHistograms, so recording one is O(1),
+// and the hits of a cache are those of a cache up to `1 +
+// 2^-kSubBucketBits` (about 0.1%) larger: a distance is counted as a hit if
+// any distance in its bucket would be.  The hits are exact for caches of fewer
+// than `2^(kSubBucketBits + 1)` (2048) objects or bytes.
+template <class Weight>
+class ReuseHistogram {
+ public:
+  // Records an access with reuse distance `distance` that needs an LRU cache
+  // of at least `bytes_needed` bytes to hit.
+  void RecordReuse(uint64_t distance, uint64_t bytes_needed,
+                   Weight weight = 1) {
+    by_count_.Add(distance, weight);
+    by_bytes_.Add(bytes_needed, weight);
+    total_ += weight;
+  }
+
+  // Records a cold miss.
+  void RecordCold(Weight weight = 1) { total_ += weight; }
+
+  // The total weight of the accesses recorded.
+  Weight Total() const { return total_; }
+
+  // Returns the weight of the recorded reuses that hit in an LRU cache of
+  // `objects` objects.
+  Weight Hits(uint64_t objects) const {
+    if (objects == 0) return Weight{};
+    return by_count_.SumAtMost(objects - 1);
+  }
+
+  // Returns the weight of the recorded reuses that hit in an LRU cache of
+  // `bytes` bytes.
+  Weight ByteHits(uint64_t bytes) const { return by_bytes_.SumAtMost(bytes); }
+
+  void clear() { *this = ReuseHistogram(); }
+
+ private:
+  // The weight of all the accesses.
+  Weight total_{};
+  // The weight of the reuses with each reuse distance.
+  LogLinearHistogram<Weight> by_count_;
+  // The weight of the reuses that need each number of bytes to hit.
+  LogLinearHistogram<Weight> by_bytes_;
+};
+
+// An LRU stack of keys with sizes, which computes the distances of each
+// access (see ReuseDistanceTracker).
+//
+// The stack is a PrefixSumMap from the time of each key's last access to a
+// slot of `{1, size}`.  `AccessBatch()` leaves behind the slots of the keys it
+// moves, zeroed, rather than erasing them one at a time, so the distances are
+// sums over the slots rather than ranks.  The zeroed slots are compacted away
+// once they are half of the stack.
+template <class Key, class Hash, class Eq>
+class LruStack {
+ public:
+  size_t size() const { return last_access_.size(); }
+
+  // Moves `key` to the top of the stack (or pushes it, if it isn't there),
+  // with size `size`, and returns its distances.
+  ReuseDistance Access(const Key &key, uint64_t size) {
+    ReuseDistance result;
+    uint64_t now = now_++;
+    auto [last, inserted] = last_access_.try_emplace(key, now);
+    if (inserted) {
+      result.cold = true;
+    } else {
+      auto [it, before] = stack_.FindWithPrefixSum(last->second);
+      DCHECK(it != stack_.end());
+      result.distance = last_access_.size() - before[kCount] - 1;
+      result.bytes = stack_bytes_ - before[kBytes] - it->second[kBytes];
+      stack_bytes_ -= it->second[kBytes];
+      stack_.erase(it);
+      last->second = now;
+    }
+    // `now` is larger than every key, so this goes at the end.
+    stack_.insert({now, {1, size}});
+    stack_bytes_ += size;
+    return result;
+  }
+
+  // Like calling `Access()` on each of `accesses` in order, but stores the
+  // distances in `results`, which must be the same size.
+  //
+  // Rather than moving each key to the top as it comes, this first finds the
+  // previous access of each one, and then works out all the distances with
+  // Fenwick trees over the batch: one over the accesses in the batch that are
+  // still the latest for their key, and one over the slots from before the
+  // batch that the batch has moved so far.  Then it zeroes the moved slots
+  // with one `update_batch()` (sorted by rank, so each node of the tree is
+  // fixed up once) and appends the batch's surviving accesses with one
+  // `insert_sorted()`.  That takes one lookup per distinct key from before the
+  // batch, instead of a lookup, an erase, and an insert, each rebalancing the
+  // tree, per access.
+  void AccessBatch(absl::Span<const std::pair<Key, uint64_t>> accesses,
+                   absl::Span<ReuseDistance> results) {
+    CHECK_EQ(accesses.size(), results.size());  // Crash OK
+    const uint64_t start = now_;
+    const size_t m = accesses.size();
+    now_ += m;
+
+    // The time of the previous access to each access's key, or `kCold`.  The
+    // times from before the batch are also collected in `moved`, once each.
+    std::vector<uint64_t> previous(m);
+    std::vector<Moved> moved;
+    size_t n_cold = 0;
+    for (size_t j = 0; j < m; ++j) {
+      auto [last, inserted] = last_access_.try_emplace(accesses[j].first,
+                                                       start + j);
+      if (inserted) {
+        previous[j] = kCold;
+        ++n_cold;
+        continue;
+      }
+      previous[j] = last->second;
+      if (last->second < start) moved.push_back({last->second});
+      last->second = start + j;
+    }
+
+    // Find the distances of the moved slots as of the start of the batch.
+    std::sort(moved.begin(), moved.end(),
+              [](const Moved &a, const Moved &b) { return a.time < b.time; });
+    const uint64_t live = last_access_.size() - n_cold;
+    for (Moved &slot : moved) {
+      auto [it, before] = stack_.FindWithPrefixSum(slot.time);
+      DCHECK(it != stack_.end());
+      slot.rank = it.rank();
+      slot.size = it->second[kBytes];
+      slot.count_after = live - before[kCount] - 1;
+      slot.bytes_after = stack_bytes_ - before[kBytes] - slot.size;
+    }
+
+    // Walk the batch.  `in_batch_*` cover the accesses in the batch so far
+    // that are still the latest for their key, and `moved_*` cover the slots
+    // from before the batch that the batch has moved so far.
+    FenwickTree<uint64_t> in_batch_count{std::vector<uint64_t>(m)};
+    FenwickTree<uint64_t> in_batch_bytes{std::vector<uint64_t>(m)};
+    FenwickTree<uint64_t> moved_count{std::vector<uint64_t>(moved.size())};
+    FenwickTree<uint64_t> moved_bytes{std::vector<uint64_t>(moved.size())};
+    for (size_t j = 0; j < m; ++j) {
+      ReuseDistance &result = results[j];
+      result = ReuseDistance();
+      uint64_t p = previous[j];
+      if (p == kCold) {
+        result.cold = true;
+      } else if (p >= start) {
+        // Only the accesses between the two in the batch count, and the
+        // earlier one is no longer the latest.
+        size_t i = p - start;
+        result.distance =
+            in_batch_count.PrefixSum(j) - in_batch_count.PrefixSum(i + 1);
+        result.bytes =
+            in_batch_bytes.PrefixSum(j) - in_batch_bytes.PrefixSum(i + 1);
+        in_batch_count.Add(i, 0 - uint64_t{1});
+        in_batch_bytes.Add(i, 0 - accesses[i].second);
+      } else {
+        // The slots after `p` from before the batch, less the ones the batch
+        // has already moved, and everything in the batch so far.
+        size_t i = std::partition_point(moved.begin(), moved.end(),
+                                        [p](const Moved &slot) {
+                                          return slot.time < p;
+                                        }) -
+                   moved.begin();
+        const Moved &slot = moved[i];
+        result.distance = slot.count_after -
+                          (moved_count.PrefixSum(moved.size()) -
+                           moved_count.PrefixSum(i + 1)) +
+                          in_batch_count.PrefixSum(j);
+        result.bytes = slot.bytes_after -
+                       (moved_bytes.PrefixSum(moved.size()) -
+                        moved_bytes.PrefixSum(i + 1)) +
+                       in_batch_bytes.PrefixSum(j);
+        moved_count.Add(i, 1);
+        moved_bytes.Add(i, slot.size);
+      }
+      in_batch_count.Add(j, 1);
+      in_batch_bytes.Add(j, accesses[j].second);
+    }
+
+    // Zero the moved slots, and append the accesses that are still the
+    // latest for their key.
+    std::vector<std::pair<size_t, Slot>> zeroes;
+    zeroes.reserve(moved.size());
+    for (const Moved &slot : moved) {
+      zeroes.push_back({slot.rank, {0 - uint64_t{1}, 0 - slot.size}});
+      stack_bytes_ -= slot.size;
+    }
+    stack_.update_batch(zeroes);
+    dead_ += moved.size();
+    std::vector<std::pair<uint64_t, Slot>> appended;
+    for (size_t j = 0; j < m; ++j) {
+      const auto &[key, size] = accesses[j];
+      if (last_access_.find(key)->second != start + j) continue;
+      appended.push_back({start + j, {1, size}});
+      stack_bytes_ += size;
+    }
+    stack_.insert_sorted(appended.begin(), appended.end());
+    if (dead_ > last_access_.size()) Compact();
+  }
+
+  // Removes `key`, if it is there.
+  void Erase(const Key &key) {
+    auto last = last_access_.find(key);
+    if (last == last_access_.end()) return;
+    auto it = stack_.find(last->second);
+    DCHECK(it != stack_.end());
+    stack_bytes_ -= it->second[kBytes];
+    stack_.erase(it);
+    last_access_.erase(last);
+  }
+
+  void clear() { *this = LruStack(); }
+
+  void Check() const {
+    stack_.Check();
+    CHECK_EQ(stack_.size(), last_access_.size() + dead_);  // Crash OK
+    Slot total = stack_.SumFirstN(stack_.size());
+    CHECK_EQ(total[kCount], last_access_.size());  // Crash OK
+    CHECK_EQ(total[kBytes], stack_bytes_);         // Crash OK
+    for (const auto &[key, time] : last_access_) {
+      auto it = stack_.find(time);
+      CHECK(it != stack_.end());      // Crash OK
+      CHECK_EQ(it->second[kCount], 1);  // Crash OK
+    }
+  }
+
+ private:
+  // The number of keys (0 or 1) and their total size.
+  using Slot = std::array<uint64_t, 2>;
+  static constexpr size_t kCount = 0;
+  static constexpr size_t kBytes = 1;
+
+  static constexpr uint64_t kCold = std::numeric_limits<uint64_t>::max();
+
+  // A slot from before a batch that the batch moves, and its distances as of
+  // the start of the batch.
+  struct Moved {
+    uint64_t time;
+    size_t rank = 0;
+    uint64_t size = 0;
+    uint64_t count_after = 0;
+    uint64_t bytes_after = 0;
+  };
+
+  // Rebuilds the stack without the zeroed slots.
+  void Compact() {
+    std::vector<std::pair<uint64_t, Slot>> live;
+    live.reserve(last_access_.size());
+    for (const auto &[time, slot] : stack_) {
+      if (slot[kCount] != 0) live.push_back({time, slot});
+    }
+    stack_.clear();
+    stack_.insert_sorted(live.begin(), live.end());
+    dead_ = 0;
+  }
+
+  // The time of the next access.
+  uint64_t now_ = 0;
+  // The time of the last access to each key.
+  absl::flat_hash_map<Key, uint64_t, Hash, Eq> last_access_;
+  // The slot of each key, by the time of its last access: the LRU stack, with
+  // the most recently used key last, and with the zeroed slots that
+  // `AccessBatch()` leaves behind.
+  PrefixSumMap<uint64_t, Slot> stack_;
+  // The total size of the keys in `stack_`.
+  uint64_t stack_bytes_ = 0;
+  // The number of zeroed slots in `stack_`.
+  size_t dead_ = 0;
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class Hash = absl::Hash<Key>,
+          class Eq = std::equal_to<Key>>
+class ReuseDistanceTracker {
+ public:
+  //**************** Ingest ****************
+
+  // Records an access to `key`, which has size `size`, and returns its
+  // distances.
+  ReuseDistance access(const Key &key, uint64_t size) {
+    ReuseDistance result = stack_.Access(key, size);
+    Record(result, size);
+    return result;
+  }
+
+  // Records each of the `{key, size}` accesses in `accesses`, in order, as
+  // though by calling `access()` on each one, but much faster: they are
+  // processed in batches (see `LruStack::AccessBatch()`).
+  void access_batch(absl::Span<const std::pair<Key, uint64_t>> accesses) {
+    std::vector<ReuseDistance> results;
+    while (!accesses.empty()) {
+      auto batch = accesses.subspan(0, kBatchSize);
+      accesses.remove_prefix(batch.size());
+      results.resize(batch.size());
+      stack_.AccessBatch(batch, absl::MakeSpan(results));
+      for (size_t i = 0; i < batch.size(); ++i) {
+        Record(results[i], batch[i].second);
+      }
+    }
+  }
+
+  //**************** Miss ratios ****************
+
+  // The number of accesses recorded.
+  uint64_t accesses() const { return histogram_.Total(); }
+
+  // The number of distinct keys accessed, which is the number of cold misses.
+  size_t distinct_keys() const { return stack_.size(); }
+
+  // Returns the fraction of the accesses that miss in an LRU cache that holds
+  // `objects` objects.
+  double miss_ratio(uint64_t objects) const {
+    return MissRatio(histogram_.Hits(objects));
+  }
+
+  // Returns the fraction of the accesses that miss in an LRU cache that holds
+  // `bytes` bytes.
+  double byte_miss_ratio(uint64_t bytes) const {
+    return MissRatio(histogram_.ByteHits(bytes));
+  }
+
+  // Returns `miss_ratio()` (or `byte_miss_ratio()`) for each of the `sizes`.
+  std::vector<double> miss_ratio_curve(absl::Span<const uint64_t> sizes) const {
+    std::vector<double> result;
+    result.reserve(sizes.size());
+    for (uint64_t objects : sizes) result.push_back(miss_ratio(objects));
+    return result;
+  }
+  std::vector<double> byte_miss_ratio_curve(
+      absl::Span<const uint64_t> sizes) const {
+    std::vector<double> result;
+    result.reserve(sizes.size());
+    for (uint64_t bytes : sizes) result.push_back(byte_miss_ratio(bytes));
+    return result;
+  }
+
+  // Forgets everything.
+  void clear() {
+    stack_.clear();
+    histogram_.clear();
+  }
+
+  //**************** Debugging and test support ****************
+
+  // Checks the invariants.  Runs in O(n) time.
+  void Check() const { stack_.Check(); }
+
+ private:
+  // The number of accesses that `access_batch()` hands to the stack at once.
+  static constexpr size_t kBatchSize = 4096;
+
+  void Record(const ReuseDistance &result, uint64_t size) {
+    if (result.cold) {
+      histogram_.RecordCold();
+    } else {
+      histogram_.RecordReuse(result.distance, result.bytes + size);
+    }
+  }
+
+  double MissRatio(uint64_t hits) const {
+    uint64_t accesses = histogram_.Total();
+    if (accesses == 0) return 0;
+    return static_cast<double>(accesses - hits) / accesses;
+  }
+
+  cachelib_internal::LruStack<Key, Hash, Eq> stack_;
+  cachelib_internal::ReuseHistogram<uint64_t> histogram_;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_REUSE_DISTANCE_TRACKER_H_
@@ -0,0 +1,170 @@
+#include "reuse_distance_tracker.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::DoubleEq;
+using ::testing::ElementsAre;
+using ::testing::FieldsAre;
+
+// Make sure it all compiles.
+template class ReuseDistanceTracker<std::string>;
+
+TEST(ReuseDistanceTrackerTest, Basic) {
+  ReuseDistanceTracker<std::string> tracker;
+  EXPECT_EQ(tracker.miss_ratio(10), 0);
+  EXPECT_THAT(tracker.access("a", 10), FieldsAre(true, 0, 0));
+  EXPECT_THAT(tracker.access("b", 20), FieldsAre(true, 0, 0));
+  EXPECT_THAT(tracker.access("c", 30), FieldsAre(true, 0, 0));
+  EXPECT_THAT(tracker.access("a", 10), FieldsAre(false, 2, 50));
+  EXPECT_THAT(tracker.access("a", 15), FieldsAre(false, 0, 0));
+  // The new size of "a" counts from now on.
+  EXPECT_THAT(tracker.access("b", 20), FieldsAre(false, 2, 45));
+  EXPECT_EQ(tracker.accesses(), 6);
+  EXPECT_EQ(tracker.distinct_keys(), 3);
+  // Distances: cold, cold, cold, 2, 0, 2.
+  EXPECT_THAT(tracker.miss_ratio_curve({0, 1, 2, 3, 100}),
+              ElementsAre(1.0, DoubleEq(5.0 / 6), DoubleEq(5.0 / 6), 0.5, 0.5));
+  // Bytes needed: 60, 15, 65.
+  EXPECT_THAT(tracker.byte_miss_ratio_curve({14, 15, 60, 65}),
+              ElementsAre(1.0, DoubleEq(5.0 / 6), DoubleEq(4.0 / 6), 0.5));
+  tracker.Check();
+  tracker.clear();
+  EXPECT_EQ(tracker.accesses(), 0);
+  EXPECT_THAT(tracker.access("a", 10), FieldsAre(true, 0, 0));
+}
+
+TEST(ReuseDistanceTrackerTest, LogLinearHistogram) {
+  cachelib_internal::LogLinearHistogram<uint64_t> histogram;
+  EXPECT_EQ(histogram.SumAtMost(100), 0);
+  // Small values are exact.
+  histogram.Add(0, 1);
+  histogram.Add(2047, 2);
+  EXPECT_EQ(histogram.SumAtMost(0), 1);
+  EXPECT_EQ(histogram.SumAtMost(2046), 1);
+  EXPECT_EQ(histogram.SumAtMost(2047), 3);
+  // Larger values share a bucket with values within a factor of 1 + 2^-10.
+  absl::BitGen bitgen;
+  std::vector<uint64_t> values;
+  for (int i = 0; i < 1000; ++i) {
+    uint64_t v = absl::LogUniform<uint64_t>(bitgen, 2048, uint64_t{1} << 62);
+    histogram.Add(v, 1);
+    values.push_back(v);
+  }
+  std::sort(values.begin(), values.end());
+  for (uint64_t v : values) {
+    uint64_t at_most_v =
+        std::upper_bound(values.begin(), values.end(), v) - values.begin();
+    uint64_t slack = std::upper_bound(values.begin(), values.end(),
+                                      v + (v >> 10)) -
+                     values.begin();
+    uint64_t sum = histogram.SumAtMost(v) - 3;
+    EXPECT_GE(sum, at_most_v);
+    EXPECT_LE(sum, slack);
+  }
+}
+
+// Compares with simulated LRU caches, and `access_batch()` with `access()`.
+TEST(ReuseDistanceTrackerTest, Randomized) {
+  absl::BitGen bitgen;
+  std::vector<std::pair<int, uint64_t>> trace;
+  for (size_t i = 0; i < 5000; ++i) {
+    int key = absl::Zipf<int>(bitgen, 400, 1.2);
+    trace.emplace_back(key, key % 7 + 1);
+  }
+  ReuseDistanceTracker<int> tracker, batched;
+  for (const auto &[key, size] : trace) tracker.access(key, size);
+  for (size_t i = 0; i < trace.size(); i += 1000) {
+    batched.access_batch(absl::MakeConstSpan(trace).subspan(i, 1000));
+  }
+  tracker.Check();
+  for (uint64_t capacity : {1, 5, 20, 100, 500}) {
+    // Simulate LRU caches of `capacity` objects and of `capacity` bytes.
+    std::list<std::pair<int, uint64_t>> lru;  // Most recent first.
+    std::list<std::pair<int, uint64_t>> byte_lru;
+    uint64_t misses = 0, byte_misses = 0;
+    for (const auto &[key, size] : trace) {
+      auto access = [&](std::list<std::pair<int, uint64_t>> *cache,
+                        bool by_bytes) {
+        bool hit = false;
+        for (auto it = cache->begin(); it != cache->end(); ++it) {
+          if (it->first == key) {
+            cache->erase(it);
+            hit = true;
+            break;
+          }
+        }
+        cache->emplace_front(key, size);
+        uint64_t used = 0;
+        for (auto it = cache->begin(); it != cache->end(); ++it) {
+          used += by_bytes ? it->second : 1;
+          if (used > capacity) {
+            cache->erase(it, cache->end());
+            break;
+          }
+        }
+        return hit;
+      };
+      misses += !access(&lru, false);
+      byte_misses += !access(&byte_lru, true);
+    }
+    EXPECT_DOUBLE_EQ(tracker.miss_ratio(capacity),
+                     static_cast<double>(misses) / trace.size());
+    EXPECT_DOUBLE_EQ(tracker.byte_miss_ratio(capacity),
+                     static_cast<double>(byte_misses) / trace.size());
+    EXPECT_EQ(batched.miss_ratio(capacity), tracker.miss_ratio(capacity));
+    EXPECT_EQ(batched.byte_miss_ratio(capacity),
+              tracker.byte_miss_ratio(capacity));
+  }
+}
+
+// Checks every distance that `LruStack::AccessBatch()` computes against
+// `Access()`, with batches of all sizes, some single accesses and erases in
+// between, and enough moves to compact the stack.
+TEST(ReuseDistanceTrackerTest, RandomizedAccessBatch) {
+  absl::BitGen bitgen;
+  cachelib_internal::LruStack<int, absl::Hash<int>, std::equal_to<int>>
+      stack, batched;
+  for (size_t round = 0; round < 300; ++round) {
+    size_t n = absl::Uniform<size_t>(bitgen, 0, 200);
+    std::vector<std::pair<int, uint64_t>> accesses;
+    for (size_t i = 0; i < n; ++i) {
+      int key = absl::Uniform<int>(bitgen, 0, round < 150 ? 300 : 3000);
+      accesses.emplace_back(key, absl::Uniform<uint64_t>(bitgen, 1, 100));
+    }
+    std::vector<ReuseDistance> results(n);
+    batched.AccessBatch(accesses, absl::MakeSpan(results));
+    for (size_t i = 0; i < n; ++i) {
+      ReuseDistance want = stack.Access(accesses[i].first, accesses[i].second);
+      ASSERT_THAT(results[i], FieldsAre(want.cold, want.distance, want.bytes))
+          << "round " << round << " access " << i;
+    }
+    int key = absl::Uniform<int>(bitgen, 0, 300);
+    if (absl::Bernoulli(bitgen, 0.3)) {
+      stack.Erase(key);
+      batched.Erase(key);
+    } else {
+      uint64_t size = absl::Uniform<uint64_t>(bitgen, 1, 100);
+      ReuseDistance want = stack.Access(key, size);
+      EXPECT_THAT(batched.Access(key, size),
+                  FieldsAre(want.cold, want.distance, want.bytes));
+    }
+    if (round % 20 == 0) batched.Check();
+  }
+  batched.Check();
+  EXPECT_EQ(batched.size(), stack.size());
+}
+
+}  // namespace cachelib
@@ -0,0 +1,185 @@
+// A SampledReuseDistanceTracker estimates the LRU miss-ratio curve of a stream
+// of `(key, size)` accesses, like ReuseDistanceTracker, but from a sample of
+// the keys, so it needs memory proportional to the sample instead of to the
+// number of distinct keys.  It implements SHARDS (Waldspurger et al., "Efficient
+// MRC Construction with SHARDS", FAST 2015).
+//
+// Sampling is spatial: a key is sampled if its hash, modulo P = 2^24, is below
+// a threshold T, so either every access to a key is sampled or none is, and the
+// sampling rate is R = T / P.  The sampled accesses go through an exact LRU
+// stack, which sees about R times as many distinct keys between two accesses
+// as the full stream, so their distances are divided by R.  Each sampled
+// access stands for 1 / R accesses, and the miss ratio is the weight of the
+// sampled misses divided by the number of accesses (sampled or not), which
+// corrects for the sample happening to hold more or fewer accesses than
+// expected (SHARDS_adj).
+//
+// With a fixed rate, the number of sampled keys still grows with the number
+// of distinct keys.  If `max_keys` is given, the tracker keeps at most that
+// many (fixed-size SHARDS): when there are too many, it evicts the sampled
+// keys with the largest hash and lowers T to that hash, which lowers the rate.
+// Accesses recorded before are weighted by the rate at the time.
+//
+// Example:
+//
+//   // Start at 1% and keep at most 64K keys.
+//   SampledReuseDistanceTracker<std::string> tracker(0.01, 1 << 16);
+//   for (const Request &r : trace) tracker.access(r.key, r.bytes);
+//   double miss_ratio_at_1gb = tracker.byte_miss_ratio(1 << 30);
+
+#ifndef NET_BANDAID_BDN_CACHELIB_SAMPLED_REUSE_DISTANCE_TRACKER_H_
+#define NET_BANDAID_BDN_CACHELIB_SAMPLED_REUSE_DISTANCE_TRACKER_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/hash/hash.h"
+#include "absl/types/span.h"
+#include "order_statistic_map.h"
+#include "reuse_distance_tracker.h"
+
+namespace cachelib {
+
+template <class Key, class Hash = absl::Hash<Key>,
+          class Eq = std::equal_to<Key>>
+class SampledReuseDistanceTracker {
+ public:
+  // Samples the keys at rate `rate`, which must be in `(0, 1]`.  If `max_keys`
+  // isn't zero, then lowers the rate as needed to keep at most `max_keys`
+  // sampled keys.
+  explicit SampledReuseDistanceTracker(double rate, size_t max_keys = 0,
+                                       Hash hash = Hash())
+      : threshold_(static_cast<uint64_t>(std::ceil(rate * kModulus))),
+        max_keys_(max_keys),
+        hash_(std::move(hash)) {
+    CHECK(0 < rate && rate <= 1) << rate;  // Crash OK
+  }
+
+  //**************** Ingest ****************
+
+  // Records an access to `key`, which has size `size`.  Returns whether the
+  // access was sampled.
+  bool access(const Key &key, uint64_t size) {
+    ++accesses_;
+    uint64_t h = hash_(key) % kModulus;
+    if (h >= threshold_) return false;
+    ReuseDistance d = stack_.Access(key, size);
+    double scale = static_cast<double>(kModulus) / threshold_;
+    if (d.cold) {
+      histogram_.RecordCold(scale);
+      if (max_keys_ != 0) {
+        by_hash_.insert({{h, next_serial_++}, key});
+        if (stack_.size() > max_keys_) Evict();
+      }
+    } else {
+      histogram_.RecordReuse(
+          static_cast<uint64_t>(std::llround(d.distance * scale)),
+          static_cast<uint64_t>(std::llround(d.bytes * scale)) + size, scale);
+    }
+    return true;
+  }
+
+  // Records each of the `{key, size}` accesses in `accesses`, in order, as
+  // though by calling `access()` on each one.
+  void access_batch(absl::Span<const std::pair<Key, uint64_t>> accesses) {
+    for (const auto &[key, size] : accesses) access(key, size);
+  }
+
+  //**************** Miss ratios ****************
+
+  // The number of accesses, sampled or not.
+  uint64_t accesses() const { return accesses_; }
+
+  // The number of keys in the sample.
+  size_t sampled_keys() const { return stack_.size(); }
+
+  // The current sampling rate.
+  double rate() const { return static_cast<double>(threshold_) / kModulus; }
+
+  // Returns the estimated fraction of the accesses that miss in an LRU cache
+  // that holds `objects` objects.
+  double miss_ratio(uint64_t objects) const {
+    return MissRatio(histogram_.Hits(objects));
+  }
+
+  // Returns the estimated fraction of the accesses that miss in an LRU cache
+  // that holds `bytes` bytes.
+  double byte_miss_ratio(uint64_t bytes) const {
+    return MissRatio(histogram_.ByteHits(bytes));
+  }
+
+  // Returns `miss_ratio()` (or `byte_miss_ratio()`) for each of the `sizes`.
+  std::vector<double> miss_ratio_curve(absl::Span<const uint64_t> sizes) const {
+    std::vector<double> result;
+    result.reserve(sizes.size());
+    for (uint64_t objects : sizes) result.push_back(miss_ratio(objects));
+    return result;
+  }
+  std::vector<double> byte_miss_ratio_curve(
+      absl::Span<const uint64_t> sizes) const {
+    std::vector<double> result;
+    result.reserve(sizes.size());
+    for (uint64_t bytes : sizes) result.push_back(byte_miss_ratio(bytes));
+    return result;
+  }
+
+  //**************** Debugging and test support ****************
+
+  // Checks the invariants.  Runs in O(n) time for n sampled keys.
+  void Check() const {
+    stack_.Check();
+    if (max_keys_ == 0) return;
+    CHECK_LE(stack_.size(), max_keys_);          // Crash OK
+    CHECK_EQ(by_hash_.size(), stack_.size());    // Crash OK
+    for (const auto &[hash_and_serial, key] : by_hash_) {
+      CHECK_LT(hash_and_serial.first, threshold_);  // Crash OK
+    }
+  }
+
+ private:
+  static constexpr uint64_t kModulus = uint64_t{1} << 24;
+
+  // Evicts the keys with the largest hash, and lowers the threshold to that
+  // hash, until there are at most `max_keys_` keys.
+  void Evict() {
+    while (stack_.size() > max_keys_) {
+      uint64_t h = by_hash_.rbegin()->first.first;
+      while (!by_hash_.empty() && by_hash_.rbegin()->first.first == h) {
+        auto last = std::prev(by_hash_.end());
+        stack_.Erase(last->second);
+        by_hash_.erase(last);
+      }
+      threshold_ = h;
+    }
+  }
+
+  double MissRatio(double hits) const {
+    if (accesses_ == 0) return 0;
+    double misses = histogram_.Total() - hits;
+    return std::clamp(misses / accesses_, 0.0, 1.0);
+  }
+
+  // A key is sampled if its hash modulo `kModulus` is below `threshold_`.
+  uint64_t threshold_;
+  size_t max_keys_;
+  Hash hash_;
+  uint64_t accesses_ = 0;
+  cachelib_internal::LruStack<Key, Hash, Eq> stack_;
+  // Each sampled access is weighted by the inverse of the sampling rate.
+  cachelib_internal::ReuseHistogram<double> histogram_;
+  // For fixed-size sampling: the sampled keys, by their hash (and then by the
+  // order in which they were sampled, to tell apart keys with equal hashes).
+  OrderStatisticMap<std::pair<uint64_t, uint64_t>, Key> by_hash_;
+  uint64_t next_serial_ = 0;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_SAMPLED_REUSE_DISTANCE_TRACKER_H_
@@ -0,0 +1,113 @@
+#include "sampled_reuse_distance_tracker.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+#include "absl/random/zipf_distribution.h"
+#include "reuse_distance_tracker.h"
+
+namespace cachelib {
+
+// Make sure it all compiles.
+template class SampledReuseDistanceTracker<std::string>;
+
+// Makes the sampling predictable: key `k` is sampled at rate `R` iff
+// `k < R * 2^24`.
+struct IdentityHash {
+  size_t operator()(uint64_t k) const { return k; }
+};
+
+constexpr uint64_t kHalf = uint64_t{1} << 23;
+
+TEST(SampledReuseDistanceTrackerTest, Basic) {
+  SampledReuseDistanceTracker<uint64_t, IdentityHash> tracker(0.5);
+  EXPECT_EQ(tracker.rate(), 0.5);
+  EXPECT_EQ(tracker.miss_ratio(1), 0);
+  // Sampled: 0, 1, 2.  Not sampled: kHalf + anything.
+  for (uint64_t k : {0, 1, 2}) EXPECT_TRUE(tracker.access(k, 10));
+  EXPECT_FALSE(tracker.access(kHalf, 10));
+  EXPECT_FALSE(tracker.access(kHalf + 1, 10));
+  // Distance 2, scaled to 4, and 20 bytes, scaled to 40.
+  EXPECT_TRUE(tracker.access(0, 10));
+  EXPECT_FALSE(tracker.access(kHalf, 10));
+  EXPECT_EQ(tracker.accesses(), 7);
+  EXPECT_EQ(tracker.sampled_keys(), 3);
+  // The sampled accesses stand for 8 accesses (3 cold misses, each weighted
+  // 2, and one reuse, also weighted 2), out of 7 in all, so the estimate is
+  // clamped.
+  EXPECT_EQ(tracker.miss_ratio(4), 1.0);
+  EXPECT_DOUBLE_EQ(tracker.miss_ratio(5), 6.0 / 7);
+  EXPECT_EQ(tracker.byte_miss_ratio(49), 1.0);
+  EXPECT_DOUBLE_EQ(tracker.byte_miss_ratio(50), 6.0 / 7);
+  tracker.Check();
+}
+
+TEST(SampledReuseDistanceTrackerTest, FullRateIsExact) {
+  absl::BitGen bitgen;
+  ReuseDistanceTracker<int> exact;
+  SampledReuseDistanceTracker<int> sampled(1.0);
+  for (size_t i = 0; i < 5000; ++i) {
+    int key = absl::Zipf<int>(bitgen, 300, 1.1);
+    uint64_t size = key % 5 + 1;
+    exact.access(key, size);
+    EXPECT_TRUE(sampled.access(key, size));
+  }
+  for (uint64_t size : {0, 1, 10, 100, 1000}) {
+    EXPECT_DOUBLE_EQ(sampled.miss_ratio(size), exact.miss_ratio(size));
+    EXPECT_DOUBLE_EQ(sampled.byte_miss_ratio(size),
+                     exact.byte_miss_ratio(size));
+  }
+  sampled.Check();
+}
+
+TEST(SampledReuseDistanceTrackerTest, FixedSize) {
+  SampledReuseDistanceTracker<uint64_t, IdentityHash> tracker(1.0, 100);
+  for (uint64_t k = 0; k < 1000; ++k) {
+    tracker.access(k * 1000, 1);
+    ASSERT_LE(tracker.sampled_keys(), 100);
+  }
+  // The 100 smallest hashes remain, so the threshold is the 101st.
+  EXPECT_EQ(tracker.sampled_keys(), 100);
+  EXPECT_DOUBLE_EQ(tracker.rate(), 100'000.0 / (1 << 24));
+  EXPECT_TRUE(tracker.access(99'000, 1));
+  EXPECT_FALSE(tracker.access(100'000, 1));
+  tracker.Check();
+}
+
+// The estimated curves should be close to the exact ones.
+TEST(SampledReuseDistanceTrackerTest, Accuracy) {
+  absl::BitGen bitgen;
+  absl::zipf_distribution<uint64_t> zipf(100'000, 1.05);
+  ReuseDistanceTracker<uint64_t> exact;
+  SampledReuseDistanceTracker<uint64_t> fixed_rate(0.1);
+  SampledReuseDistanceTracker<uint64_t> fixed_size(0.5, 2000);
+  for (size_t i = 0; i < 300'000; ++i) {
+    uint64_t key = zipf(bitgen);
+    uint64_t size = key % 100 + 1;
+    exact.access(key, size);
+    fixed_rate.access(key, size);
+    fixed_size.access(key, size);
+  }
+  EXPECT_LE(fixed_size.sampled_keys(), 2000);
+  EXPECT_LT(fixed_size.rate(), 0.5);
+  double error_rate = 0, error_size = 0;
+  int points = 0;
+  for (uint64_t objects = 100; objects < 100'000; objects *= 2, ++points) {
+    double want = exact.miss_ratio(objects);
+    error_rate += std::abs(fixed_rate.miss_ratio(objects) - want);
+    error_size += std::abs(fixed_size.miss_ratio(objects) - want);
+  }
+  EXPECT_LT(error_rate / points, 0.03);
+  EXPECT_LT(error_size / points, 0.03);
+  fixed_rate.Check();
+  fixed_size.Check();
+}
+
+}  // namespace cachelib
@@ -0,0 +1,225 @@
+// Order-statistic containers for one writer thread and many reader threads.
+//
+// The readers take no locks: each read runs against an immutable version of
+// the tree that the writer published atomically, so every read observes some
+// state of the container that actually existed between two writes.  See
+// raw_snapshot_order_statistic_set.h for how that works.
+//
+// Usage:
+//
+//   SingleWriterOrderStatisticSet<int> set;
+//
+//   // In the writer thread (writes must not run concurrently with each
+//   // other):
+//   set.insert(42);
+//   set.erase(17);
+//
+//   // In each reader thread:
+//   SingleWriterOrderStatisticSet<int>::Reader reader(&set);
+//   std::optional<int> third = reader.select(2);
+//   size_t r = reader.rank(42);
+//
+//   // Several reads against the same version:
+//   auto snapshot = reader.snapshot();
+//   const int *p = snapshot.find(42);
+//   size_t n = snapshot.size();
+//
+// Readers copy their results out unless they use a `Snapshot`, in which case
+// the returned pointers remain valid until the snapshot is destroyed.  There
+// are no iterators.
+//
+// The writer may read the container directly (via `size()` and `Check()`), but
+// other threads must go through a Reader.  All Readers must be destroyed before
+// the container.
+
+#ifndef NET_BANDAID_BDN_CACHELIB_SINGLE_WRITER_ORDER_STATISTIC_SET_H_
+#define NET_BANDAID_BDN_CACHELIB_SINGLE_WRITER_ORDER_STATISTIC_SET_H_
+
+#include <cstddef>
+#include <functional>
+#include <utility>
+
+#include "glog/logging.h"
+#include "raw_snapshot_order_statistic_set.h"  // IWYU pragma: export
+
+namespace cachelib {
+namespace cachelib_internal {
+
+template <class Key, class Compare>
+class SnapshotSetNode
+    : public RawSnapshotNode<Key, Key, Compare, SnapshotSetNode<Key, Compare>> {
+  using Base = typename SnapshotSetNode::RawSnapshotNode;
+
+ public:
+  explicit SnapshotSetNode(Key k) : Base(std::move(k)) {}
+  using value_type = Key;
+  static const Key &key(const value_type &value) { return value; }
+};
+
+// The snapshot analogue of `PrefixMapNode`.
+template <class Key, class T, class Compare>
+class SnapshotPrefixMapNode
+    : public RawSnapshotNode<Key, std::pair<const Key, T>, Compare,
+                             SnapshotPrefixMapNode<Key, T, Compare>> {
+  using Base = typename SnapshotPrefixMapNode::RawSnapshotNode;
+  using key_compare = typename SnapshotPrefixMapNode::key_compare;
+
+ public:
+  using value_type = std::pair<const Key, T>;
+  explicit SnapshotPrefixMapNode(value_type v)
+      : Base(std::move(v)), sum_(this->value_.second) {}
+  static const Key &key(const value_type &value) { return value.first; }
+
+  void Check(bool recursive, const key_compare &lessthan) const {
+    const T &nv = this->value_.second;
+    T sum = this->left_ ? this->left_->sum_ + nv : nv;
+    sum = this->right_ ? sum + this->right_->sum_ : sum;
+    CHECK_EQ(sum_, sum);  // Crash OK
+    if (recursive) {
+      if (this->left_) this->left_->Check(recursive, lessthan);
+      if (this->right_) this->right_->Check(recursive, lessthan);
+    }
+    Base::Check(false, lessthan);
+  }
+
+  void RecomputeSummary() {
+    const T &nv = this->value_.second;
+    T leftsum = this->left_ ? this->left_->sum_ + nv : nv;
+    sum_ = this->right_ ? leftsum + this->right_->sum_ : leftsum;
+    Base::RecomputeSummary();
+  }
+
+  // Returns the sum of all the values with rank < idx.
+  static T SumFirstN(const SnapshotPrefixMapNode *n, size_t idx) {
+    T sum{};
+    while (n != nullptr && idx > 0) {
+      size_t left_size = Base::Size(n->left_);
+      if (left_size >= idx) {
+        n = n->left_;
+      } else {
+        if (n->left_) sum = sum + n->left_->sum_;
+        sum = sum + n->value_.second;
+        idx -= left_size + 1;
+        n = n->right_;
+      }
+    }
+    return sum;
+  }
+
+ private:
+  T sum_;
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class Compare = std::less<>>
+class SingleWriterOrderStatisticSet
+    : public cachelib_internal::RawSnapshotOrderStatisticSet<
+          Key, Key, Compare, cachelib_internal::SnapshotSetNode<Key, Compare>> {
+  using Base = typename SingleWriterOrderStatisticSet::
+      RawSnapshotOrderStatisticSet;
+
+ public:
+  using key_type = typename Base::key_type;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using key_compare = typename Base::key_compare;
+
+  // Reader
+  //
+  //   A per-thread read handle.  Provides `size()`, `find(k)`, `contains(k)`,
+  //   `rank(k)` (the number of elements less than `k`), and `select(idx)`,
+  //   each of which runs against one version of the set.  `find` and `select`
+  //   return `std::optional<value_type>`.
+  //
+  // Snapshot
+  //
+  //   Obtained from `Reader::snapshot()`.  Provides the same operations, all
+  //   against the same version, plus `lower_bound(k)`.  `find`, `lower_bound`,
+  //   and `select` return `const value_type*` (nullptr if there is no such
+  //   element) that remain valid for the life of the Snapshot.
+  using Reader = typename Base::Reader;
+  using Snapshot = typename Base::Snapshot;
+
+  // `max_readers` bounds the number of Readers that may exist at once.
+  explicit SingleWriterOrderStatisticSet(size_t max_readers = 128)
+      : Base(max_readers) {}
+
+  // The writer-side operations.  At most one thread may be calling these at a
+  // time.
+
+  // bool insert(value_type value);
+  //
+  //   Inserts `value` unless an equivalent element is present.  Returns true
+  //   iff the insertion happened.
+  using Base::insert;
+
+  // size_type erase(const key_type &k);
+  //
+  //   Erases the element equivalent to `k`, if any.  Returns the number of
+  //   elements erased (0 or 1).
+  using Base::erase;
+
+  // void clear();
+  //
+  //   Erases everything.
+  using Base::clear;
+
+  // size_type size() const;
+  // bool empty() const;
+  //
+  //   The writer's view of the size.  Readers should use Reader::size().
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::key_comp;
+};
+
+template <class Key, class T, class Compare = std::less<>>
+class SingleWriterPrefixSumMap
+    : public cachelib_internal::RawSnapshotOrderStatisticSet<
+          Key, std::pair<const Key, T>, Compare,
+          cachelib_internal::SnapshotPrefixMapNode<Key, T, Compare>> {
+  using Base = typename SingleWriterPrefixSumMap::RawSnapshotOrderStatisticSet;
+
+ public:
+  using key_type = typename Base::key_type;
+  using mapped_type = T;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using key_compare = typename Base::key_compare;
+
+  // As for SingleWriterOrderStatisticSet, and additionally `SumFirstN(n)`,
+  // which returns the sum of the first `n` mapped values.
+  using Reader = typename Base::Reader;
+  using Snapshot = typename Base::Snapshot;
+
+  explicit SingleWriterPrefixSumMap(size_t max_readers = 128)
+      : Base(max_readers) {}
+
+  // bool insert_or_assign(Key k, T v);
+  //
+  //   Inserts `{k, v}`, or assigns `v` to the existing element with key `k`.
+  //   Returns true iff the insertion happened.
+  bool insert_or_assign(Key k, T v) {
+    return this->InsertInternal({std::move(k), std::move(v)}, /*assign=*/true);
+  }
+
+  // See SingleWriterOrderStatisticSet for the specification of these.
+  using Base::insert;
+
+  using Base::erase;
+
+  using Base::clear;
+
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::key_comp;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_SINGLE_WRITER_ORDER_STATISTIC_SET_H_
@@ -0,0 +1,161 @@
+#include "single_writer_order_statistic_set.h"
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::Optional;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class SingleWriterOrderStatisticSet<size_t>;
+template class SingleWriterOrderStatisticSet<std::string>;
+template class SingleWriterPrefixSumMap<size_t, size_t>;
+
+TEST(SingleWriterOrderStatisticSetTest, Basic) {
+  SingleWriterOrderStatisticSet<size_t> set;
+  SingleWriterOrderStatisticSet<size_t>::Reader reader(&set);
+  EXPECT_TRUE(set.empty());
+  EXPECT_EQ(reader.size(), 0);
+  EXPECT_TRUE(set.insert(3));
+  EXPECT_TRUE(set.insert(1));
+  EXPECT_FALSE(set.insert(3));
+  EXPECT_EQ(set.size(), 2);
+  EXPECT_EQ(reader.size(), 2);
+  EXPECT_TRUE(reader.contains(1));
+  EXPECT_FALSE(reader.contains(2));
+  EXPECT_THAT(reader.find(3), Optional(3));
+  EXPECT_EQ(reader.find(2), std::nullopt);
+  EXPECT_THAT(reader.select(0), Optional(1));
+  EXPECT_THAT(reader.select(1), Optional(3));
+  EXPECT_EQ(reader.select(2), std::nullopt);
+  EXPECT_EQ(reader.rank(0), 0);
+  EXPECT_EQ(reader.rank(2), 1);
+  EXPECT_EQ(reader.rank(3), 1);
+  EXPECT_EQ(reader.rank(4), 2);
+  {
+    auto snapshot = reader.snapshot();
+    // Writes don't affect a snapshot that has already been taken.
+    EXPECT_EQ(set.erase(1), 1);
+    EXPECT_EQ(set.erase(1), 0);
+    EXPECT_EQ(snapshot.size(), 2);
+    ASSERT_NE(snapshot.find(1), nullptr);
+    EXPECT_EQ(*snapshot.find(1), 1);
+    ASSERT_NE(snapshot.lower_bound(2), nullptr);
+    EXPECT_EQ(*snapshot.lower_bound(2), 3);
+    EXPECT_EQ(snapshot.lower_bound(4), nullptr);
+  }
+  EXPECT_EQ(set.CollectForTest(), 0);
+  set.clear();
+  EXPECT_EQ(reader.size(), 0);
+  set.Check();
+}
+
+TEST(SingleWriterOrderStatisticSetTest, Randomized) {
+  absl::BitGen bitgen;
+  std::set<size_t> expected;
+  SingleWriterOrderStatisticSet<size_t> set;
+  SingleWriterOrderStatisticSet<size_t>::Reader reader(&set);
+  for (size_t i = 0; i < 2000; ++i) {
+    size_t k = absl::Uniform<size_t>(bitgen, 0, 500);
+    if (absl::Bernoulli(bitgen, 0.6)) {
+      EXPECT_EQ(set.insert(k), expected.insert(k).second);
+    } else {
+      EXPECT_EQ(set.erase(k), expected.erase(k));
+    }
+    set.Check();
+    ASSERT_EQ(set.size(), expected.size());
+  }
+  auto snapshot = reader.snapshot();
+  size_t rank = 0;
+  for (size_t k : expected) {
+    ASSERT_NE(snapshot.select(rank), nullptr);
+    EXPECT_EQ(*snapshot.select(rank), k);
+    EXPECT_EQ(snapshot.rank(k), rank);
+    ++rank;
+  }
+}
+
+TEST(SingleWriterPrefixSumMapTest, Randomized) {
+  absl::BitGen bitgen;
+  std::map<size_t, size_t> expected;
+  SingleWriterPrefixSumMap<size_t, size_t> map;
+  SingleWriterPrefixSumMap<size_t, size_t>::Reader reader(&map);
+  for (size_t i = 0; i < 2000; ++i) {
+    size_t k = absl::Uniform<size_t>(bitgen, 0, 500);
+    size_t v = absl::Uniform<size_t>(bitgen, 0, 1000);
+    if (absl::Bernoulli(bitgen, 0.6)) {
+      EXPECT_EQ(map.insert_or_assign(k, v),
+                expected.insert_or_assign(k, v).second);
+    } else {
+      EXPECT_EQ(map.erase(k), expected.erase(k));
+    }
+    map.Check();
+  }
+  auto snapshot = reader.snapshot();
+  size_t rank = 0;
+  size_t sum = 0;
+  for (const auto &[k, v] : expected) {
+    EXPECT_EQ(snapshot.SumFirstN(rank), sum);
+    ASSERT_NE(snapshot.find(k), nullptr);
+    EXPECT_THAT(*snapshot.find(k), Pair(k, v));
+    sum += v;
+    ++rank;
+  }
+  EXPECT_EQ(snapshot.SumFirstN(rank), sum);
+}
+
+// One writer slides a window of consecutive keys across the key space while
+// readers check that every version they see is a window: the keys are
+// consecutive, and the sums agree with the sizes.  A torn read would show up
+// as a gap or a wrong sum.
+TEST(SingleWriterPrefixSumMapTest, ConcurrentReaders) {
+  constexpr size_t kWindow = 200;
+  constexpr size_t kSteps = 20000;
+  constexpr size_t kReaders = 4;
+  SingleWriterPrefixSumMap<size_t, size_t> map;
+  for (size_t k = 0; k < kWindow; ++k) map.insert_or_assign(k, 1);
+  std::atomic<bool> done = false;
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < kReaders; ++t) {
+    readers.emplace_back([&map, &done] {
+      SingleWriterPrefixSumMap<size_t, size_t>::Reader reader(&map);
+      absl::BitGen bitgen;
+      while (!done.load()) {
+        auto snapshot = reader.snapshot();
+        size_t size = snapshot.size();
+        ASSERT_TRUE(size == kWindow || size == kWindow - 1) << size;
+        ASSERT_NE(snapshot.select(0), nullptr);
+        size_t first = snapshot.select(0)->first;
+        size_t i = absl::Uniform<size_t>(bitgen, 0, size);
+        ASSERT_NE(snapshot.select(i), nullptr);
+        EXPECT_EQ(snapshot.select(i)->first, first + i);
+        EXPECT_EQ(snapshot.rank(first + i), i);
+        EXPECT_EQ(snapshot.SumFirstN(i), i);
+        EXPECT_TRUE(snapshot.contains(first + size - 1));
+        EXPECT_FALSE(snapshot.contains(first + size));
+      }
+    });
+  }
+  for (size_t step = 0; step < kSteps; ++step) {
+    map.erase(step);
+    map.insert_or_assign(step + kWindow, 1);
+  }
+  done.store(true);
+  for (auto &t : readers) t.join();
+  map.Check();
+  EXPECT_EQ(map.size(), kWindow);
+  EXPECT_EQ(map.CollectForTest(), 0);
+}
+
+}  // namespace cachelib
@@ -0,0 +1,498 @@
+// A TombstoneOrderStatisticSet (or Map) is an order-statistic tree that
+// deletes lazily: `erase()` marks the node dead (a tombstone) instead of
+// unlinking it, so an erase is a single descent that decrements the live
+// counts on the path, with no unlinking, rotations, or deallocation.
+// Erase-heavy bursts, such as invalidation storms, then cost about the same per
+// key as a `find()`.
+//
+// Every node keeps the number of live nodes in its subtree, so `select()` and
+// the ranks count only live elements, in O(log n) time.  The tombstones are
+// reclaimed by rebuilding: when an erase leaves more than half of a subtree
+// (of at least `kMinPurgeSize` nodes) dead, that subtree is rebuilt without its
+// dead nodes, in time linear in its size.  Since at least half of the
+// subtree's nodes had to die since it was built, this is amortized O(1) per
+// erase.  Inserting a key that has a tombstone revives the node in place.
+//
+// Like in an OrderStatisticSet, the nodes have no parent pointers, so moving an
+// iterator does a `select()`, and inserting or erasing invalidates iterators.
+// The iterators refer to const values.
+//
+// Example:
+//
+//   TombstoneOrderStatisticSet<uint64_t> keys;
+//   ...
+//   for (uint64_t k : invalidated) keys.erase(k);  // No rebalancing.
+//   uint64_t median = *keys.select(keys.size() / 2);
+
+#ifndef NET_BANDAID_BDN_CACHELIB_TOMBSTONE_ORDER_STATISTIC_SET_H_
+#define NET_BANDAID_BDN_CACHELIB_TOMBSTONE_ORDER_STATISTIC_SET_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "raw_order_statistic_set.h"
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// A node that may be dead.  `Value` is `Key` for a set and `std::pair<const
+// Key, T>` for a map.
+template <class Key, class Value, class Compare>
+class TombstoneNode
+    : public RawNode<Key, Value, Compare, TombstoneNode<Key, Value, Compare>> {
+  using Base = typename TombstoneNode::RawNode;
+  using key_compare = typename TombstoneNode::key_compare;
+
+ public:
+  using value_type = Value;
+
+  // A subtree is rebuilt once more than half of it is dead, if it has at least
+  // this many nodes.  Smaller subtrees wait for an ancestor to be rebuilt, so
+  // that a rebuild (and the rebalancing above it) pays for several erases.
+  static constexpr size_t kMinPurgeSize = 16;
+
+  explicit TombstoneNode(value_type v) : Base(std::move(v)) {}
+
+  static const Key &key(const value_type &value) {
+    if constexpr (std::is_same_v<Key, value_type>) {
+      return value;
+    } else {
+      return value.first;
+    }
+  }
+
+  void SetMappedValue(const value_type &v) {
+    if constexpr (!std::is_same_v<Key, value_type>) {
+      this->value_.second = v.second;
+    }
+  }
+
+  bool dead() const { return dead_; }
+
+  // Returns the number of live nodes in the subtree.
+  static size_t Live(const std::unique_ptr<TombstoneNode> &n) {
+    return n ? n->live_size_ : 0;
+  }
+
+  void RecomputeSummary() {
+    live_size_ = (dead_ ? 0 : 1) + Live(this->left_) + Live(this->right_);
+    Base::RecomputeSummary();
+  }
+
+  void Check(bool recursive, const key_compare &lessthan) {
+    CHECK_EQ(live_size_,  // Crash OK
+             (dead_ ? 0 : 1) + Live(this->left_) + Live(this->right_));
+    if (recursive) {
+      if (this->left_) this->left_->Check(recursive, lessthan);
+      if (this->right_) this->right_->Check(recursive, lessthan);
+    }
+    Base::Check(false, lessthan);
+  }
+
+  // Returns the live node of live rank `idx` in the subtree, or nullptr if
+  // there is none.
+  static TombstoneNode *SelectLive(const std::unique_ptr<TombstoneNode> &n,
+                                   size_t idx) {
+    TombstoneNode *x = n.get();
+    while (x != nullptr) {
+      size_t left_live = Live(x->left_);
+      if (idx < left_live) {
+        x = x->left_.get();
+        continue;
+      }
+      idx -= left_live;
+      if (!x->dead_) {
+        if (idx == 0) return x;
+        --idx;
+      }
+      x = x->right_.get();
+    }
+    return nullptr;
+  }
+
+  // Returns the number of live keys in the subtree that are less than `k`,
+  // and the first live node whose key is not less than `k` (or nullptr).
+  template <class Karg>
+  static std::pair<size_t, TombstoneNode *> LowerBoundLive(
+      const std::unique_ptr<TombstoneNode> &n, const Karg &k,
+      const key_compare &lessthan) {
+    if (!n) return {0, nullptr};
+    if (lessthan(key(n->value_), k)) {
+      auto [rank, x] = LowerBoundLive(n->right_, k, lessthan);
+      return {Live(n->left_) + (n->dead_ ? 0 : 1) + rank, x};
+    }
+    auto [rank, x] = LowerBoundLive(n->left_, k, lessthan);
+    if (x != nullptr) return {rank, x};
+    // Every live key on the left is less than `k`, and every key on the
+    // right is greater than this one.
+    if (!n->dead_) return {rank, n.get()};
+    return {rank, SelectLive(n->right_, 0)};
+  }
+
+  // Brings the node `x`, whose rank among all the nodes of the tree rooted at
+  // `root` is `idx`, back to life.
+  static void Revive(const std::unique_ptr<TombstoneNode> &root, size_t idx,
+                     TombstoneNode *x) {
+    DCHECK(x->dead_);
+    x->dead_ = false;
+    auto recompute = [](const value_type &) {};
+    Base::ModifyAtRank(root, idx, recompute);
+  }
+
+  // Marks the live node with key `k` in the tree rooted at `*root` dead, and
+  // rebuilds the lowest subtree on its path that is then mostly dead.  Returns
+  // false if there is no such live node.
+  template <class Karg>
+  static bool Erase(std::unique_ptr<TombstoneNode> *root, const Karg &k,
+                    const key_compare &lessthan) {
+    std::unique_ptr<TombstoneNode> *path[Base::kMaxHeight];
+    size_t depth = 0;
+    std::unique_ptr<TombstoneNode> *slot = root;
+    while (true) {
+      TombstoneNode *n = slot->get();
+      if (n == nullptr || n->live_size_ == 0) return false;
+      DCHECK_LT(depth, Base::kMaxHeight);
+      path[depth++] = slot;
+      if (lessthan(key(n->value_), k)) {
+        slot = &n->right_;
+      } else if (lessthan(k, key(n->value_))) {
+        slot = &n->left_;
+      } else if (n->dead_) {
+        return false;
+      } else {
+        n->dead_ = true;
+        break;
+      }
+    }
+    for (size_t i = 0; i < depth; ++i) --(*path[i])->live_size_;
+    bool rebuilt = false;
+    while (depth > 0) {
+      std::unique_ptr<TombstoneNode> &n = *path[--depth];
+      if (rebuilt) {
+        // The subtree below shrank.
+        n->RecomputeSummary();
+        if (!n->IsInBalance()) n = PurgeOrRebalance(std::move(n));
+      } else if (IsMostlyDead(*n)) {
+        n = Purge(std::move(n));
+        rebuilt = true;
+      }
+    }
+    return true;
+  }
+
+  // Returns a perfectly balanced tree of the live nodes of the subtree,
+  // deleting the dead ones.
+  static std::unique_ptr<TombstoneNode> Purge(
+      std::unique_ptr<TombstoneNode> n) {
+    std::vector<std::unique_ptr<TombstoneNode>> nodes;
+    nodes.reserve(Live(n));
+    FlattenLive(std::move(n), &nodes);
+    return Base::Link(nodes.data(), nodes.data() + nodes.size());
+  }
+
+ private:
+  // Like `RawNode::Flatten()`, but keeps only the live nodes, deleting the
+  // dead ones.
+  static void FlattenLive(std::unique_ptr<TombstoneNode> n,
+                      std::vector<std::unique_ptr<TombstoneNode>> *nodes) {
+    if (!n) return;
+    if (n->live_size_ == 0) return;  // Deletes the whole subtree.
+    FlattenLive(std::move(n->left_), nodes);
+    std::unique_ptr<TombstoneNode> right = std::move(n->right_);
+    if (!n->dead_) nodes->push_back(std::move(n));
+    FlattenLive(std::move(right), nodes);
+  }
+
+  static bool IsMostlyDead(const TombstoneNode &n) {
+    size_t size = n.subtree_size_;
+    return size >= kMinPurgeSize && 2 * (size - n.live_size_) > size;
+  }
+
+  // Like `RebalanceOrRebuild()`, but a rebuild also drops the dead nodes.
+  static std::unique_ptr<TombstoneNode> PurgeOrRebalance(
+      std::unique_ptr<TombstoneNode> n) {
+    n = Base::MaybeRebalance(std::move(n));
+    if (n->IsInBalance() && (!n->left_ || n->left_->IsInBalance()) &&
+        (!n->right_ || n->right_->IsInBalance())) {
+      return n;
+    }
+    return Purge(std::move(n));
+  }
+
+  size_t live_size_ = 1;
+  bool dead_ = false;
+};
+
+// The implementation shared by TombstoneOrderStatisticSet and
+// TombstoneOrderStatisticMap.
+template <class Key, class Value, class Compare>
+class RawTombstoneOrderStatisticSet {
+ protected:
+  using Node = TombstoneNode<Key, Value, Compare>;
+
+ public:
+  using key_type = Key;
+  using value_type = Value;
+  using size_type = size_t;
+  using difference_type = ptrdiff_t;
+  using key_compare = Compare;
+
+  // A bidirectional iterator over the live elements.  Moving it does a
+  // `select()`.
+  class const_iterator {
+   public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = const Value;
+    using difference_type = ptrdiff_t;
+    using pointer = const Value *;
+    using reference = const Value &;
+
+    const_iterator(const RawTombstoneOrderStatisticSet *tree, size_t idx,
+                   const Node *node)
+        : tree_(tree), idx_(idx), node_(node) {}
+
+    reference operator*() const { return node_->value_; }
+    pointer operator->() const { return &node_->value_; }
+    // The number of live elements before this one.
+    size_t rank() const { return idx_; }
+
+    const_iterator &operator++() {
+      node_ = Node::SelectLive(tree_->root_, ++idx_);
+      return *this;
+    }
+    const_iterator &operator--() {
+      CHECK_GT(idx_, 0u);  // Crash OK
+      node_ = Node::SelectLive(tree_->root_, --idx_);
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator tmp = *this;
+      ++*this;
+      return tmp;
+    }
+    const_iterator operator--(int) {
+      const_iterator tmp = *this;
+      --*this;
+      return tmp;
+    }
+
+    friend bool operator==(const const_iterator &a, const const_iterator &b) {
+      DCHECK(a.tree_ == b.tree_);
+      return a.idx_ == b.idx_;
+    }
+    friend bool operator!=(const const_iterator &a, const const_iterator &b) {
+      return !(a == b);
+    }
+
+   private:
+    const RawTombstoneOrderStatisticSet *tree_;
+    size_t idx_;
+    const Node *node_;
+  };
+  using iterator = const_iterator;
+
+ protected:
+  RawTombstoneOrderStatisticSet() = default;
+  RawTombstoneOrderStatisticSet(RawTombstoneOrderStatisticSet &&) = default;
+  RawTombstoneOrderStatisticSet &operator=(RawTombstoneOrderStatisticSet &&) =
+      default;
+
+  // The number of live elements.
+  size_t size() const { return Node::Live(root_); }
+  bool empty() const { return size() == 0; }
+  // The number of dead nodes not yet reclaimed.
+  size_t tombstones() const { return Node::Size(root_) - size(); }
+
+  const_iterator begin() const { return select(0); }
+  const_iterator end() const { return const_iterator(this, size(), nullptr); }
+
+  const_iterator select(size_t idx) const {
+    if (idx >= size()) return end();
+    return const_iterator(this, idx, Node::SelectLive(root_, idx));
+  }
+
+  template <class K>
+  const_iterator lower_bound(const K &k) const {
+    auto [rank, n] = Node::LowerBoundLive(root_, k, lessthan_);
+    return const_iterator(this, rank, n);
+  }
+
+  template <class K>
+  const_iterator find(const K &k) const {
+    const_iterator it = lower_bound(k);
+    if (it == end() || lessthan_(k, Node::key(*it))) return end();
+    return it;
+  }
+
+  template <class K>
+  bool contains(const K &k) const {
+    return find(k) != end();
+  }
+
+  // Marks the element with key `k`, if there is a live one, dead.  Returns the
+  // number of elements erased (zero or one).
+  template <class K>
+  size_t erase(const K &k) {
+    return Node::Erase(&root_, k, lessthan_) ? 1 : 0;
+  }
+
+  // Rebuilds the whole tree without its tombstones.  Takes O(n) time.
+  void purge() { root_ = Node::Purge(std::move(root_)); }
+
+  void clear() { root_.reset(); }
+
+  void swap(RawTombstoneOrderStatisticSet &other) {
+    std::swap(root_, other.root_);
+    std::swap(lessthan_, other.lessthan_);
+  }
+
+  key_compare key_comp() const { return lessthan_; }
+
+  // Inserts `value` if its key has no live element, reviving the key's
+  // tombstone if it has one, and otherwise assigns the mapped value (which is
+  // a no-op for a set).  Returns whether the key was inserted.
+  bool InsertInternal(value_type value) {
+    auto [new_root, idx, n, did_insert] = Node::Insert(
+        std::move(root_), std::move(value), 0, /*assign=*/true, lessthan_);
+    root_ = std::move(new_root);
+    if (did_insert) return true;
+    if (!n->dead()) return false;
+    Node::Revive(root_, idx, n);
+    return true;
+  }
+
+ public:
+  //**************** Debugging and test support ****************
+
+  // Checks the tree.  Runs in time O(n).
+  void Check() const {
+    if (root_) root_->Check(true, lessthan_);
+  }
+
+ protected:
+  std::unique_ptr<Node> root_;
+  key_compare lessthan_;
+};
+
+}  // namespace cachelib_internal
+
+template <class Key, class Compare = std::less<>>
+class TombstoneOrderStatisticSet
+    : public cachelib_internal::RawTombstoneOrderStatisticSet<Key, Key,
+                                                              Compare> {
+  using Base = typename TombstoneOrderStatisticSet::
+      RawTombstoneOrderStatisticSet;
+
+ public:
+  using key_type = typename Base::key_type;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using difference_type = typename Base::difference_type;
+  using key_compare = typename Base::key_compare;
+  using iterator = typename Base::iterator;
+  using const_iterator = typename Base::const_iterator;
+
+  // Inserts `k` if it isn't in the set, and returns whether it did.  (It
+  // returns no iterator, since the rank of a revived tombstone would cost
+  // another descent.)
+  bool insert(Key k) { return this->InsertInternal(std::move(k)); }
+
+  // The methods are as for OrderStatisticSet, except as noted above.
+  //
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::tombstones;
+
+  using Base::begin;
+
+  using Base::end;
+
+  using Base::select;
+
+  using Base::lower_bound;
+
+  using Base::find;
+
+  using Base::contains;
+
+  using Base::erase;
+
+  using Base::purge;
+
+  using Base::clear;
+
+  using Base::swap;
+
+  using Base::key_comp;
+};
+
+template <class Key, class T, class Compare = std::less<>>
+class TombstoneOrderStatisticMap
+    : public cachelib_internal::RawTombstoneOrderStatisticSet<
+          Key, std::pair<const Key, T>, Compare> {
+  using Base = typename TombstoneOrderStatisticMap::
+      RawTombstoneOrderStatisticSet;
+
+ public:
+  using key_type = typename Base::key_type;
+  using mapped_type = T;
+  using value_type = typename Base::value_type;
+  using size_type = typename Base::size_type;
+  using difference_type = typename Base::difference_type;
+  using key_compare = typename Base::key_compare;
+  using iterator = typename Base::iterator;
+  using const_iterator = typename Base::const_iterator;
+
+  // Inserts `{k, v}` if `k` isn't in the map, and otherwise assigns `v` to its
+  // mapped value.  Returns whether it inserted.
+  bool insert_or_assign(Key k, T v) {
+    return this->InsertInternal({std::move(k), std::move(v)});
+  }
+
+  // The methods are as for TombstoneOrderStatisticSet.
+  //
+  // Note: the extra blank lines are to prevent `hg fix` from reordering the
+  // lines.
+  using Base::size;
+
+  using Base::empty;
+
+  using Base::tombstones;
+
+  using Base::begin;
+
+  using Base::end;
+
+  using Base::select;
+
+  using Base::lower_bound;
+
+  using Base::find;
+
+  using Base::contains;
+
+  using Base::erase;
+
+  using Base::purge;
+
+  using Base::clear;
+
+  using Base::swap;
+
+  using Base::key_comp;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_TOMBSTONE_ORDER_STATISTIC_SET_H_
@@ -0,0 +1,112 @@
+#include "tombstone_order_statistic_set.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class TombstoneOrderStatisticSet<std::string>;
+template class TombstoneOrderStatisticMap<int, std::string>;
+
+TEST(TombstoneOrderStatisticSetTest, Basic) {
+  TombstoneOrderStatisticSet<int> set;
+  EXPECT_TRUE(set.empty());
+  EXPECT_EQ(set.begin(), set.end());
+  for (int k = 0; k < 10; ++k) EXPECT_TRUE(set.insert(k));
+  EXPECT_FALSE(set.insert(3));
+  EXPECT_EQ(set.erase(3), 1);
+  EXPECT_EQ(set.erase(3), 0);
+  EXPECT_EQ(set.erase(42), 0);
+  EXPECT_EQ(set.size(), 9);
+  EXPECT_EQ(set.tombstones(), 1);
+  EXPECT_FALSE(set.contains(3));
+  EXPECT_EQ(set.find(3), set.end());
+  // The ranks skip the tombstone.
+  EXPECT_EQ(*set.select(3), 4);
+  EXPECT_EQ(set.lower_bound(3).rank(), 3);
+  EXPECT_EQ(*set.lower_bound(3), 4);
+  std::vector<int> all(set.begin(), set.end());
+  EXPECT_THAT(all, ::testing::ElementsAre(0, 1, 2, 4, 5, 6, 7, 8, 9));
+  // Inserting the key again revives its node.
+  EXPECT_TRUE(set.insert(3));
+  EXPECT_EQ(set.tombstones(), 0);
+  EXPECT_EQ(set.find(3).rank(), 3);
+  set.Check();
+}
+
+TEST(TombstoneOrderStatisticSetTest, EraseStorm) {
+  absl::BitGen bitgen;
+  TombstoneOrderStatisticSet<uint64_t> set;
+  std::set<uint64_t> reference;
+  for (size_t round = 0; round < 4; ++round) {
+    while (reference.size() < 5000) {
+      uint64_t k = absl::Uniform<uint64_t>(bitgen, 0, 20000);
+      EXPECT_EQ(set.insert(k), reference.insert(k).second);
+    }
+    // Erase most of the keys, in random order, checking the order statistics
+    // as the tombstones pile up and get reclaimed.
+    std::vector<uint64_t> keys(reference.begin(), reference.end());
+    std::shuffle(keys.begin(), keys.end(), bitgen);
+    keys.resize(keys.size() * 9 / 10);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      EXPECT_EQ(set.erase(keys[i]), 1);
+      reference.erase(keys[i]);
+      ASSERT_EQ(set.size(), reference.size());
+      if (i % 97 == 0) {
+        size_t r = absl::Uniform<size_t>(bitgen, 0, reference.size());
+        auto it = set.select(r);
+        EXPECT_EQ(*it, *std::next(reference.begin(), r));
+        EXPECT_EQ(it.rank(), r);
+        uint64_t k = absl::Uniform<uint64_t>(bitgen, 0, 20000);
+        auto lb = set.lower_bound(k);
+        auto expected = reference.lower_bound(k);
+        EXPECT_EQ(lb.rank(), std::distance(reference.begin(), expected));
+        if (expected != reference.end()) {
+          EXPECT_EQ(*lb, *expected);
+        }
+        EXPECT_EQ(set.contains(k), reference.count(k) == 1);
+      }
+      if (i % 1000 == 0) set.Check();
+    }
+    set.Check();
+    // Subtrees that are mostly dead have been rebuilt, so the tombstones
+    // don't outnumber the live keys by much.
+    EXPECT_LT(set.tombstones(), 2 * reference.size() + 100);
+    std::vector<uint64_t> all(set.begin(), set.end());
+    EXPECT_EQ(all, std::vector<uint64_t>(reference.begin(), reference.end()));
+  }
+  set.purge();
+  EXPECT_EQ(set.tombstones(), 0);
+  EXPECT_EQ(set.size(), reference.size());
+  set.Check();
+}
+
+TEST(TombstoneOrderStatisticMapTest, InsertOrAssign) {
+  TombstoneOrderStatisticMap<int, std::string> map;
+  EXPECT_TRUE(map.insert_or_assign(1, "one"));
+  EXPECT_TRUE(map.insert_or_assign(2, "two"));
+  EXPECT_FALSE(map.insert_or_assign(2, "deux"));
+  EXPECT_THAT(*map.find(2), Pair(2, "deux"));
+  EXPECT_EQ(map.erase(2), 1);
+  EXPECT_EQ(map.find(2), map.end());
+  // Reviving a tombstone takes the new value.
+  EXPECT_TRUE(map.insert_or_assign(2, "zwei"));
+  EXPECT_THAT(*map.select(1), Pair(2, "zwei"));
+  map.Check();
+}
+
+}  // namespace cachelib
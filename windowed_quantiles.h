@@ -0,0 +1,183 @@
+// A WindowedQuantiles tracks the quantiles (p50, p99, p999, ...) of the most
+// recent samples of a stream: the last `max_samples` samples, or the ones less
+// than `max_age` old, or both.
+//
+// The samples in the window are kept twice: in arrival order in a deque, so
+// that the oldest can be expired from its head, and in an
+// OrderStatisticMultiset, so that `quantile(q)` is a `select()` in O(log d)
+// time, for d distinct samples in the window.  The multiset stores each
+// distinct sample once with its multiplicity, so latencies measured in whole
+// microseconds (say) need a tree node per distinct latency rather than per
+// sample, and adding a sample that is already in the window just increments a
+// count.
+//
+// Expiry is batched: the samples that fall out of the window together (after a
+// gap in the stream, or when `advance()` moves the clock) are sorted and
+// removed from the multiset one distinct value at a time.  Each sample is
+// added and expired once, so `add()` takes amortized O(log d) time.
+//
+// Timestamps must not decrease.  `Timestamp` may be any ordered type whose
+// difference is a `Duration` (such as `int64_t` nanoseconds or `absl::Time`,
+// whose difference is an `absl::Duration`).
+//
+// Example:
+//
+//   // p99 latency over the last minute.
+//   WindowedQuantiles<uint32_t, absl::Time> latencies_us(0, absl::Minutes(1));
+//   latencies_us.add(latency_us, absl::Now());
+//   ...
+//   latencies_us.advance(absl::Now());
+//   uint32_t p99 = latencies_us.quantile(0.99);
+
+#ifndef NET_BANDAID_BDN_CACHELIB_WINDOWED_QUANTILES_H_
+#define NET_BANDAID_BDN_CACHELIB_WINDOWED_QUANTILES_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "absl/types/span.h"
+#include "order_statistic_multiset.h"
+
+namespace cachelib {
+
+template <class Sample, class Timestamp = int64_t,
+          class Duration = decltype(std::declval<Timestamp>() -
+                                    std::declval<Timestamp>()),
+          class Compare = std::less<>>
+class WindowedQuantiles {
+ public:
+  // Keeps the last `max_samples` samples (all of them, if `max_samples` is
+  // zero) that are less than `max_age` old (of any age, if `max_age` isn't
+  // given).
+  explicit WindowedQuantiles(size_t max_samples,
+                             std::optional<Duration> max_age = std::nullopt)
+      : max_samples_(max_samples), max_age_(std::move(max_age)) {}
+
+  //**************** Ingest ****************
+
+  // Adds `sample`, taken at time `timestamp` (which must not be earlier than
+  // the previous sample's), and expires the samples that are no longer in the
+  // window.  Takes amortized O(log d) time.
+  void add(Sample sample, Timestamp timestamp) {
+    DCHECK(window_.empty() || !(timestamp < window_.back().second));
+    samples_.insert(sample);
+    window_.emplace_back(std::move(sample), std::move(timestamp));
+    size_t expired = 0;
+    if (max_samples_ != 0 && window_.size() > max_samples_) {
+      expired = window_.size() - max_samples_;
+    }
+    Expire(std::max(expired, TooOld(window_.back().second)));
+  }
+
+  // Expires the samples that are at least `max_age` old at time `now` (which
+  // must not be earlier than the last sample's).
+  void advance(const Timestamp &now) {
+    DCHECK(window_.empty() || !(now < window_.back().second));
+    Expire(TooOld(now));
+  }
+
+  // Removes all the samples.
+  void clear() {
+    window_.clear();
+    samples_.clear();
+  }
+
+  //**************** Quantiles ****************
+
+  // The number of samples in the window.
+  size_t size() const { return window_.size(); }
+  bool empty() const { return window_.empty(); }
+
+  // Returns the `q`-quantile of the samples in the window, for `q` in `[0,
+  // 1]`: the smallest sample that is at least as large as a fraction `q` of the
+  // samples (so `quantile(0)` is the minimum and `quantile(1)` the maximum).
+  // The window must not be empty.  Takes O(log d) time.
+  const Sample &quantile(double q) const {
+    DCHECK(!empty());
+    DCHECK(0 <= q && q <= 1) << q;
+    size_t n = window_.size();
+    // The nearest rank, ceil(q * n), counting from one.
+    size_t rank = static_cast<size_t>(std::ceil(q * n));
+    size_t idx = rank == 0 ? 0 : std::min(rank, n) - 1;
+    return samples_.select(idx)->first;
+  }
+
+  // Returns `quantile(q)` for each of the `qs`.
+  std::vector<Sample> quantiles(absl::Span<const double> qs) const {
+    std::vector<Sample> result;
+    result.reserve(qs.size());
+    for (double q : qs) result.push_back(quantile(q));
+    return result;
+  }
+
+  // Returns the number of samples in the window that are less than `sample`.
+  size_t rank(const Sample &sample) const { return samples_.rank(sample); }
+
+  //**************** Debugging and test support ****************
+
+  // Checks the invariants.  Runs in O(n log d) time.
+  void Check() const {
+    samples_.Check();
+    CHECK_EQ(samples_.size(), window_.size());  // Crash OK
+    if (max_samples_ != 0) {
+      CHECK_LE(window_.size(), max_samples_);  // Crash OK
+    }
+    for (const auto &[sample, timestamp] : window_) {
+      CHECK_GT(samples_.count(sample), 0u);  // Crash OK
+    }
+  }
+
+ private:
+  // Returns the number of samples, from the head of the window, that are at
+  // least `max_age_` old at time `now`.
+  size_t TooOld(const Timestamp &now) const {
+    if (!max_age_.has_value()) return 0;
+    size_t n = 0;
+    while (n < window_.size() && !(now - window_[n].second < *max_age_)) ++n;
+    return n;
+  }
+
+  // Removes the `n` oldest samples.
+  void Expire(size_t n) {
+    if (n == 0) return;
+    if (n == 1) {
+      samples_.erase_one(window_.front().first);
+      window_.pop_front();
+      return;
+    }
+    expired_.clear();
+    for (size_t i = 0; i < n; ++i) {
+      expired_.push_back(std::move(window_.front().first));
+      window_.pop_front();
+    }
+    std::sort(expired_.begin(), expired_.end(), Compare());
+    for (auto it = expired_.begin(); it != expired_.end();) {
+      auto run_end = std::find_if(it, expired_.end(), [&](const Sample &s) {
+        return Compare()(*it, s);
+      });
+      samples_.erase_n(*it, run_end - it);
+      it = run_end;
+    }
+  }
+
+  size_t max_samples_;
+  std::optional<Duration> max_age_;
+  // The samples in the window, oldest first, with their timestamps.
+  std::deque<std::pair<Sample, Timestamp>> window_;
+  // The samples in the window, by value.
+  OrderStatisticMultiset<Sample, Compare> samples_;
+  // Scratch space for `Expire()`.
+  std::vector<Sample> expired_;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_WINDOWED_QUANTILES_H_
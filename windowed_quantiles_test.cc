@@ -0,0 +1,81 @@
+#include "windowed_quantiles.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+
+namespace cachelib {
+
+using ::testing::ElementsAre;
+
+TEST(WindowedQuantilesTest, CountWindow) {
+  WindowedQuantiles<int> window(4);
+  for (int i = 1; i <= 4; ++i) window.add(i * 10, i);
+  EXPECT_EQ(window.size(), 4);
+  EXPECT_EQ(window.quantile(0), 10);
+  EXPECT_EQ(window.quantile(0.25), 10);
+  EXPECT_EQ(window.quantile(0.5), 20);
+  EXPECT_EQ(window.quantile(0.51), 30);
+  EXPECT_EQ(window.quantile(1), 40);
+  window.add(5, 5);
+  EXPECT_EQ(window.size(), 4);
+  EXPECT_THAT(window.quantiles({0, 0.5, 1}), ElementsAre(5, 20, 40));
+  EXPECT_EQ(window.rank(30), 2);
+  window.Check();
+}
+
+TEST(WindowedQuantilesTest, TimeWindow) {
+  WindowedQuantiles<int> window(0, 10);
+  window.add(7, 0);
+  window.add(7, 1);
+  window.add(3, 2);
+  window.add(9, 9);
+  EXPECT_EQ(window.size(), 4);
+  // Expires the samples at times 0 and 1 together.
+  window.add(1, 11);
+  EXPECT_EQ(window.size(), 3);
+  EXPECT_THAT(window.quantiles({0, 0.5, 1}), ElementsAre(1, 3, 9));
+  window.advance(19);
+  EXPECT_EQ(window.size(), 1);
+  EXPECT_EQ(window.quantile(0.5), 1);
+  window.advance(100);
+  EXPECT_TRUE(window.empty());
+  window.Check();
+}
+
+TEST(WindowedQuantilesTest, Randomized) {
+  absl::BitGen bitgen;
+  WindowedQuantiles<int> window(500, 1000);
+  std::deque<std::pair<int, int64_t>> expected;
+  int64_t now = 0;
+  for (size_t i = 0; i < 20000; ++i) {
+    // Occasional long gaps expire many samples at once.
+    now += absl::Bernoulli(bitgen, 0.001) ? 900 : absl::Uniform(bitgen, 0, 4);
+    int sample = absl::Uniform(bitgen, 0, 100);
+    window.add(sample, now);
+    expected.emplace_back(sample, now);
+    while (expected.size() > 500 || now - expected.front().second >= 1000) {
+      expected.pop_front();
+    }
+    ASSERT_EQ(window.size(), expected.size());
+    if (i % 100 == 0) {
+      std::vector<int> sorted;
+      for (const auto &[s, t] : expected) sorted.push_back(s);
+      std::sort(sorted.begin(), sorted.end());
+      for (double q : {0.0, 0.5, 0.9, 0.99, 1.0}) {
+        size_t rank = std::ceil(q * sorted.size());
+        EXPECT_EQ(window.quantile(q), sorted[rank == 0 ? 0 : rank - 1]) << q;
+      }
+      window.Check();
+    }
+  }
+}
+
+}  // namespace cachelib
@@ -0,0 +1,386 @@
+// A WriteBufferedMap puts a small write buffer in front of an order-statistic
+// map (an OrderStatisticMap or a PrefixSumMap) to absorb bursts of writes.
+//
+// Every insert into the tree walks and rebalances a root-to-leaf path, and
+// during a burst of writes those paths are mostly cold in the cache.  Here,
+// instead, each insert, assign, or erase is first recorded in a "delta": a
+// small AugmentedOrderStatisticMap of pending changes.  When the delta fills
+// up, it is merged into the tree in sorted batches (see
+// `insert_or_assign_sorted()`), a few entries per subsequent write, so that no
+// single call pays for the whole merge.
+//
+// The queries (`find`, `contains`, `rank`, `select`, `size`, and, if the tree
+// supports it, `SumFirstN`) see the tree and the delta together, and their
+// answers are exactly the same as if every write had gone straight to the
+// tree.  Each query costs one descent of the delta plus one query on the tree.
+// That works because every delta entry caches its key's rank in the tree, and
+// every subtree of the delta keeps the totals of how much its entries change
+// the number of elements (and their sum).  So a write, or the running totals
+// before an entry, cost O(log d) time in a delta of d entries.  The merge
+// proceeds from the largest key downward, so applying entries to the tree
+// doesn't disturb the cached ranks of the entries that remain.
+//
+// For a PrefixSumMap, `T` must support `-` as well as `+` (to account for the
+// values that a pending assign or erase removes).  For unsigned types the
+// intermediate differences wrap around, which gives the right answer.
+//
+// Like the underlying trees, a WriteBufferedMap is not thread-safe.
+//
+// Example:
+//
+//   WriteBufferedMap<PrefixSumMap<int64_t, int64_t>> map;
+//   for (const Event &e : burst) map.insert_or_assign(e.time, e.bytes);
+//   int64_t bytes_before_median = map.SumFirstN(map.size() / 2);
+
+#ifndef NET_BANDAID_BDN_CACHELIB_WRITE_BUFFERED_MAP_H_
+#define NET_BANDAID_BDN_CACHELIB_WRITE_BUFFERED_MAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "augmented_order_statistic_map.h"
+#include "glog/logging.h"
+
+namespace cachelib {
+namespace cachelib_internal {
+
+// True if `Tree` has a `SumFirstN(size_t)` method.
+template <class Tree, class = void>
+struct HasSumFirstN : std::false_type {};
+template <class Tree>
+struct HasSumFirstN<Tree, std::void_t<decltype(std::declval<const Tree &>()
+                                                   .SumFirstN(size_t{0}))>>
+    : std::true_type {};
+
+}  // namespace cachelib_internal
+
+template <class Tree>
+class WriteBufferedMap {
+  static constexpr bool kHasSums = cachelib_internal::HasSumFirstN<Tree>::value;
+
+ public:
+  using key_type = typename Tree::key_type;
+  using mapped_type = typename Tree::mapped_type;
+  using value_type = typename Tree::value_type;
+  using size_type = std::size_t;
+  using key_compare = typename Tree::key_compare;
+
+  // `capacity` is the number of pending entries at which merging starts, and
+  // `merge_chunk` is the number of entries merged per write while merging.
+  explicit WriteBufferedMap(size_t capacity = 4096, size_t merge_chunk = 256)
+      : capacity_(capacity), merge_chunk_(merge_chunk) {
+    CHECK_GT(merge_chunk_, 1u);  // Crash OK
+  }
+
+  //**************** Observers ****************
+
+  size_t size() const { return tree_.size() + Net(Totals()); }
+  bool empty() const { return size() == 0; }
+
+  // Returns a copy of the element with key equivalent to `k`, if any.
+  std::optional<value_type> find(const key_type &k) const {
+    std::optional<value_type> result;
+    if (auto [it, found] = FindEntry(k); found) {
+      if (it->second.mapped) result.emplace(it->first, *it->second.mapped);
+    } else if (auto tit = tree_.find(k); tit != tree_.end()) {
+      result.emplace(*tit);
+    }
+    return result;
+  }
+
+  bool contains(const key_type &k) const { return find(k).has_value(); }
+
+  // Returns the number of elements with keys less than `k`.
+  size_t rank(const key_type &k) const {
+    auto [it, found] = FindEntry(k);
+    return tree_.lower_bound(k).rank() + Net(Before(it));
+  }
+
+  // Returns a copy of the element of rank `idx`, if there is one.
+  std::optional<value_type> select(size_t idx) const {
+    std::optional<value_type> result;
+    if (idx >= size()) return result;
+    Position p = Locate(idx);
+    if (p.entry) {
+      result.emplace(p.entry->first, *p.entry->second.mapped);
+    } else {
+      result.emplace(*tree_.select(p.tree_idx));
+    }
+    return result;
+  }
+
+  // Returns the sum of the mapped values of the first `n` elements.  Available
+  // only if `Tree` has a `SumFirstN()`.
+  template <bool has_sums = kHasSums,
+            typename = std::enable_if_t<has_sums>>
+  mapped_type SumFirstN(size_t n) const {
+    n = std::min(n, size());
+    if (n == 0) return mapped_type{};
+    Position p = Locate(n - 1);
+    if (p.entry) {
+      const Entry &e = p.entry->second;
+      return tree_.SumFirstN(e.tree_rank) + AdjustIn(p.before) + *e.mapped;
+    }
+    return tree_.SumFirstN(p.tree_idx + 1) + AdjustIn(p.before);
+  }
+
+  // The number of writes waiting in the delta.
+  size_t pending() const { return delta_.size(); }
+
+  // The underlying tree, which doesn't reflect the pending writes.  Call
+  // `Flush()` first to see everything.
+  const Tree &tree() const { return tree_; }
+
+  //**************** Mutators ****************
+
+  // Inserts `{k, v}`, or assigns `v` to the existing element with key `k`.
+  // Returns true iff the insertion happened.
+  bool insert_or_assign(key_type k, mapped_type v) {
+    auto [it, found] = FindEntry(k);
+    bool did_insert;
+    if (found) {
+      Entry e = it->second;
+      did_insert = !e.mapped;
+      e.mapped = std::move(v);
+      delta_.update(it, std::move(e));
+    } else {
+      Entry e = MakeEntry(k);
+      did_insert = !e.in_tree;
+      e.mapped = std::move(v);
+      delta_.insert_or_assign(std::move(k), std::move(e));
+    }
+    MaybeMerge();
+    return did_insert;
+  }
+
+  // Erases the element with key equivalent to `k`, if any.  Returns the number
+  // of elements erased (0 or 1).
+  size_t erase(const key_type &k) {
+    auto [it, found] = FindEntry(k);
+    size_t n_erased = 0;
+    if (found) {
+      n_erased = it->second.mapped ? 1 : 0;
+      if (!it->second.in_tree) {
+        // The key isn't in the tree either, so there's nothing left to do.
+        delta_.erase(it);
+      } else if (n_erased == 1) {
+        Entry e = it->second;
+        e.mapped.reset();
+        delta_.update(it, std::move(e));
+      }
+    } else if (tree_.contains(k)) {
+      n_erased = 1;
+      delta_.insert_or_assign(k, MakeEntry(k));
+    }
+    MaybeMerge();
+    return n_erased;
+  }
+
+  // Merges all the pending writes into the tree.
+  void Flush() {
+    while (!delta_.empty()) MergeSome(merge_chunk_);
+    merging_ = false;
+  }
+
+  //**************** Debugging and test support ****************
+
+  // Checks the tree, the delta's running totals, and the cached information
+  // in the delta.
+  void Check() const {
+    tree_.Check();
+    delta_.Check();
+    for (const auto &[key, e] : delta_) {
+      auto tit = tree_.find(key);
+      CHECK_EQ(e.in_tree, tit != tree_.end());  // Crash OK
+      CHECK(e.in_tree || e.mapped);             // Crash OK
+      CHECK_EQ(e.tree_rank, tree_.lower_bound(key).rank());  // Crash OK
+      if constexpr (kHasSums) {
+        if (e.in_tree) {
+          CHECK(*e.old == tit->second);  // Crash OK
+        }
+      }
+    }
+  }
+
+ private:
+  struct Empty {
+    bool operator==(const Empty &) const { return true; }
+    Empty operator+(const Empty &) const { return {}; }
+    Empty operator-(const Empty &) const { return {}; }
+  };
+  // The type of the running sum adjustments.  Trees without sums don't need
+  // them (and their `T` might not support arithmetic).
+  using Adjust = std::conditional_t<kHasSums, mapped_type, Empty>;
+
+  // A pending write to the key it is stored under.  `mapped` is empty for a
+  // pending erase.
+  struct Entry {
+    std::optional<mapped_type> mapped;
+    // Whether the key is in the tree, and how many keys in the tree are less
+    // than it.
+    bool in_tree;
+    size_t tree_rank;
+    // The value in the tree (if `in_tree`), for computing `AdjustOf()`.
+    std::optional<Adjust> old;
+  };
+
+  // How an entry changes the number of elements.
+  static ptrdiff_t Contribution(const Entry &e) {
+    return (e.mapped ? 1 : 0) - (e.in_tree ? 1 : 0);
+  }
+
+  // How an entry changes the sum of the elements.
+  static Adjust AdjustOf(const Entry &e) {
+    if constexpr (kHasSums) {
+      Adjust result{};
+      if (e.mapped) result = result + *e.mapped;
+      if (e.in_tree) result = result - *e.old;
+      return result;
+    } else {
+      return {};
+    }
+  }
+
+  // The monoids that the delta keeps for each of its subtrees: the total
+  // `Contribution()` and the total `AdjustOf()` of its entries.
+  struct NetMonoid {
+    using type = ptrdiff_t;
+    static ptrdiff_t Identity() { return 0; }
+    static ptrdiff_t Combine(ptrdiff_t a, ptrdiff_t b) { return a + b; }
+    template <class Value>
+    static ptrdiff_t Lift(const Value &value) {
+      return Contribution(value.second);
+    }
+  };
+  struct AdjustMonoid {
+    using type = Adjust;
+    static Adjust Identity() { return Adjust{}; }
+    static Adjust Combine(const Adjust &a, const Adjust &b) { return a + b; }
+    template <class Value>
+    static Adjust Lift(const Value &value) {
+      return AdjustOf(value.second);
+    }
+  };
+
+  using Delta = AugmentedOrderStatisticMap<key_type, Entry, key_compare,
+                                           NetMonoid, AdjustMonoid>;
+  using DeltaIterator = typename Delta::iterator;
+  using DeltaConstIterator = typename Delta::const_iterator;
+  using Summary = typename Delta::summary_type;
+
+  static ptrdiff_t Net(const Summary &s) { return std::get<0>(s); }
+  static const Adjust &AdjustIn(const Summary &s) { return std::get<1>(s); }
+
+  // The totals over the whole delta.
+  Summary Totals() const { return delta_.Aggregate(0, delta_.size()); }
+
+  // The totals over the entries before `it`.
+  Summary Before(DeltaConstIterator it) const {
+    return delta_.Aggregate(0, it.rank());
+  }
+
+  // Returns the first entry with a key not less than `k`, and whether its key
+  // is equivalent to `k`.
+  std::pair<DeltaConstIterator, bool> FindEntry(const key_type &k) const {
+    auto it = delta_.lower_bound(k);
+    return {it, it != delta_.end() && !tree_.key_comp()(k, it->first)};
+  }
+  std::pair<DeltaIterator, bool> FindEntry(const key_type &k) {
+    auto it = delta_.lower_bound(k);
+    return {it, it != delta_.end() && !tree_.key_comp()(k, it->first)};
+  }
+
+  // Where the element of rank `idx` lives: either in a delta entry or in the
+  // tree.  `before` is the totals over the entries with smaller keys.
+  struct Position {
+    const typename Delta::value_type *entry;
+    size_t tree_idx;
+    Summary before;
+  };
+
+  // Finds the element of rank `idx`, which must be less than `size()`.
+  //
+  // The rank that an entry's key has (or would have) in the combined map is
+  // its `tree_rank` plus the total contribution of the entries before it,
+  // which doesn't decrease from one entry to the next.  So one descent of the
+  // delta finds the first entry after `idx`.  If the entry before that one is
+  // at `idx` and isn't an erase, it's the answer.  Otherwise the answer is in
+  // the tree, in the stretch between those two entries, where the combined
+  // rank and the tree rank differ by the total contribution of the entries so
+  // far.
+  Position Locate(size_t idx) const {
+    auto [next, before] = delta_.SelectByPrefixAggregate(
+        [idx](const Summary &prefix, const typename Delta::value_type &v) {
+          return static_cast<ptrdiff_t>(v.second.tree_rank) + Net(prefix) >
+                 static_cast<ptrdiff_t>(idx);
+        });
+    if (next != delta_.begin()) {
+      const auto &prev = *std::prev(next);
+      const Entry &e = prev.second;
+      ptrdiff_t net_before = Net(before) - Contribution(e);
+      if (static_cast<ptrdiff_t>(e.tree_rank) + net_before ==
+              static_cast<ptrdiff_t>(idx) &&
+          e.mapped) {
+        return {&prev, 0,
+                Summary(net_before, AdjustIn(before) - AdjustOf(e))};
+      }
+    }
+    return {nullptr, idx - Net(before), std::move(before)};
+  }
+
+  // Makes an entry for `k`, which isn't in the delta, with no pending write.
+  Entry MakeEntry(const key_type &k) const {
+    Entry e{std::nullopt, false, 0, std::nullopt};
+    if (auto tit = tree_.find(k); tit != tree_.end()) {
+      e.in_tree = true;
+      e.tree_rank = tit.rank();
+      if constexpr (kHasSums) e.old = tit->second;
+    } else {
+      e.tree_rank = tree_.lower_bound(k).rank();
+    }
+    return e;
+  }
+
+  // Starts merging when the delta is full, and then merges another chunk on
+  // each write until the delta is empty.
+  void MaybeMerge() {
+    if (delta_.size() >= capacity_) merging_ = true;
+    if (!merging_) return;
+    MergeSome(merge_chunk_);
+    if (delta_.empty()) merging_ = false;
+  }
+
+  // Applies (up to) the last `n` entries of the delta to the tree.  Since they
+  // have the largest keys, the entries that remain are unaffected.
+  void MergeSome(size_t n) {
+    n = std::min(n, delta_.size());
+    batch_.clear();
+    for (auto it = delta_.select(delta_.size() - n); it != delta_.end();) {
+      if (it->second.mapped) {
+        batch_.emplace_back(it->first, *it->second.mapped);
+      } else {
+        tree_.erase(it->first);
+      }
+      it = delta_.erase(it);
+    }
+    tree_.insert_or_assign_sorted(batch_.begin(), batch_.end());
+  }
+
+  Tree tree_;
+  Delta delta_;
+  size_t capacity_;
+  size_t merge_chunk_;
+  bool merging_ = false;
+  // Scratch space for `MergeSome()`.
+  std::vector<value_type> batch_;
+};
+
+}  // namespace cachelib
+
+#endif  // NET_BANDAID_BDN_CACHELIB_WRITE_BUFFERED_MAP_H_
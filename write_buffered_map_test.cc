@@ -0,0 +1,101 @@
+#include "write_buffered_map.h"
+
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <string>
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "absl/random/random.h"
+#include "order_statistic_map.h"
+#include "prefix_sum_map.h"
+
+namespace cachelib {
+
+using ::testing::Optional;
+using ::testing::Pair;
+
+// Make sure it all compiles.
+template class WriteBufferedMap<OrderStatisticMap<size_t, size_t>>;
+template class WriteBufferedMap<OrderStatisticMap<std::string, std::string>>;
+template class WriteBufferedMap<PrefixSumMap<size_t, size_t>>;
+
+TEST(WriteBufferedMapTest, Basic) {
+  WriteBufferedMap<PrefixSumMap<size_t, size_t>> map(/*capacity=*/4,
+                                                     /*merge_chunk=*/2);
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.insert_or_assign(2, 20));
+  EXPECT_TRUE(map.insert_or_assign(1, 10));
+  EXPECT_FALSE(map.insert_or_assign(2, 21));
+  EXPECT_EQ(map.pending(), 2);
+  EXPECT_EQ(map.size(), 2);
+  EXPECT_THAT(map.find(2), Optional(Pair(2, 21)));
+  EXPECT_THAT(map.select(0), Optional(Pair(1, 10)));
+  EXPECT_EQ(map.select(2), std::nullopt);
+  EXPECT_EQ(map.rank(2), 1);
+  EXPECT_EQ(map.SumFirstN(2), 31);
+  EXPECT_EQ(map.erase(1), 1);
+  EXPECT_EQ(map.erase(1), 0);
+  // The erase of a key that only the delta knows about leaves nothing behind.
+  EXPECT_EQ(map.pending(), 1);
+  map.Flush();
+  EXPECT_EQ(map.pending(), 0);
+  EXPECT_EQ(map.tree().size(), 1);
+  EXPECT_EQ(map.erase(2), 1);
+  EXPECT_EQ(map.pending(), 1);
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(map.SumFirstN(1), 0);
+  map.Check();
+}
+
+// Applies random writes to a WriteBufferedMap and to a std::map, and checks
+// that every query agrees, with a delta small enough that merges happen all
+// the time (and overlap with further writes).
+template <class Tree, bool kCheckSums>
+void RunRandomizedWriteBuffered() {
+  absl::BitGen bitgen;
+  WriteBufferedMap<Tree> map(/*capacity=*/32, /*merge_chunk=*/5);
+  std::map<size_t, size_t> expected;
+  for (size_t i = 0; i < 5000; ++i) {
+    // Mostly appends, like a burst of timestamps, with some random churn.
+    size_t k = absl::Bernoulli(bitgen, 0.5)
+                   ? i + 100
+                   : absl::Uniform<size_t>(bitgen, 0, i + 100);
+    if (absl::Bernoulli(bitgen, 0.7)) {
+      size_t v = absl::Uniform<size_t>(bitgen, 0, 1000);
+      ASSERT_EQ(map.insert_or_assign(k, v),
+                expected.insert_or_assign(k, v).second);
+    } else {
+      ASSERT_EQ(map.erase(k), expected.erase(k));
+    }
+    if (i % 97 == 0) map.Check();
+    ASSERT_EQ(map.size(), expected.size());
+    if (expected.empty()) continue;
+    size_t idx = absl::Uniform<size_t>(bitgen, 0, expected.size());
+    auto it = std::next(expected.begin(), idx);
+    EXPECT_THAT(map.select(idx), Optional(Pair(it->first, it->second)));
+    EXPECT_EQ(map.rank(it->first), idx);
+    EXPECT_EQ(map.rank(k), std::distance(expected.begin(),
+                                         expected.lower_bound(k)));
+    EXPECT_EQ(map.contains(k), expected.count(k) == 1);
+    if constexpr (kCheckSums) {
+      size_t sum = 0;
+      for (auto j = expected.begin(); j != it; ++j) sum += j->second;
+      EXPECT_EQ(map.SumFirstN(idx), sum);
+    }
+  }
+  map.Flush();
+  map.Check();
+  EXPECT_EQ(map.tree().size(), expected.size());
+}
+
+TEST(WriteBufferedMapTest, Randomized) {
+  RunRandomizedWriteBuffered<OrderStatisticMap<size_t, size_t>, false>();
+}
+
+TEST(WriteBufferedMapTest, RandomizedPrefixSum) {
+  RunRandomizedWriteBuffered<PrefixSumMap<size_t, size_t>, true>();
+}
+
+}  // namespace cachelib